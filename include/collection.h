@@ -61,6 +61,42 @@ struct concurrent_pointer_set {
 	struct pointer_set set;
 };
 
+/**
+ * @brief A node of a @ref mpsc_queue. Embed this as the first member into the
+ * struct that should be queued.
+ */
+struct mpsc_queue_node {
+	_Atomic(struct mpsc_queue_node*) next;
+};
+
+/**
+ * @brief An intrusive, lock-free multi-producer single-consumer FIFO queue.
+ * 
+ * Any number of threads can push nodes concurrently, only one thread (the consumer)
+ * may pop them. Pushing never blocks, never allocates and is wait-free.
+ */
+struct mpsc_queue {
+	/**
+	 * @brief The most recently pushed node. Producers atomically exchange this.
+	 */
+	_Atomic(struct mpsc_queue_node*) head;
+
+	/**
+	 * @brief The next node to be popped. Only touched by the consumer.
+	 */
+	struct mpsc_queue_node *tail;
+
+	/**
+	 * @brief Dummy node so the queue never becomes truly empty.
+	 */
+	struct mpsc_queue_node stub;
+
+	/**
+	 * @brief The number of nodes that were pushed but not yet popped.
+	 */
+	atomic_size_t length;
+};
+
 typedef _Atomic(int) refcount_t;
 
 #define QUEUE_DEFAULT_MAX_SIZE 64
@@ -393,6 +429,27 @@ static inline void *__cpset_next_pointer_locked(
 
 #define for_each_pointer_in_cpset(set, pointer) for ((pointer) = __cpset_next_pointer_locked(set, NULL); (pointer) != NULL; (pointer) = __cpset_next_pointer_locked(set, (pointer)))
 
+void mpsc_queue_init(struct mpsc_queue *queue);
+
+/**
+ * @brief Push @ref node onto the queue. Can be called from any thread.
+ * 
+ * @returns true if the queue was empty before, i.e. the consumer should be woken up.
+ */
+bool mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_queue_node *node);
+
+/**
+ * @brief Pop the oldest node from the queue. Must only be called by the consumer thread.
+ * 
+ * May return NULL even though @ref mpsc_queue_get_length is non-zero, when a producer
+ * is in the middle of pushing a node. The consumer should try again later in that case.
+ */
+struct mpsc_queue_node *mpsc_queue_pop(struct mpsc_queue *queue);
+
+static inline size_t mpsc_queue_get_length(struct mpsc_queue *queue) {
+	return atomic_load_explicit(&queue->length, memory_order_acquire);
+}
+
 static inline void *memdup(const void *restrict src, const size_t n) {
 	void *__restrict__ dest;
 
@@ -2,12 +2,15 @@
 #define _COMPOSITOR_H
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include <gbm.h>
 #include <flutter_embedder.h>
 
 #include <collection.h>
 #include <modesetting.h>
+#include <scanout_buffers.h>
+#include <render_scale_controller.h>
 
 struct platform_view_params;
 
@@ -105,6 +108,113 @@ struct platform_view_params {
     double opacity;
 };
 
+#define RENDERTARGET_POOL_MAX_TARGETS 16
+
+/**
+ * @brief How many display-sized no-GBM rendertargets the buffers of the pool may add up to,
+ * unless more are preallocated. The byte limit of the pool is derived from this
+ * in @ref compositor_initialize, so it scales with the display size and the overlay buffer depth.
+ */
+#define RENDERTARGET_POOL_MAX_DISPLAY_SIZED_TARGETS 4
+
+/**
+ * @brief A cache of rendertargets that flutter doesn't use right now.
+ *
+ * A rendertarget is only reused for a backing store with the same kind (GBM or no-GBM),
+ * size, pixel format and modifier. If there are more than @ref RENDERTARGET_POOL_MAX_TARGETS
+ * rendertargets, or their buffers take up more than @ref max_bytes, the least recently
+ * used no-GBM rendertargets are destroyed. The GBM rendertarget is never destroyed,
+ * since there can only be one and it can't be recreated.
+ */
+struct rendertarget_pool {
+    pthread_mutex_t mutex;
+
+    /**
+     * @brief The unused rendertargets, least recently used first.
+     */
+    struct rendertarget *targets[RENDERTARGET_POOL_MAX_TARGETS];
+    int n_targets;
+
+    size_t n_bytes;
+    size_t max_bytes;
+
+    uint64_t n_hits;
+    uint64_t n_misses;
+    uint64_t n_evictions;
+};
+
+/**
+ * @brief Where the contents of a flutter layer end up on screen.
+ */
+struct layer_assignment {
+    /**
+     * @brief The plane the layer is scanned out from, or NULL if it doesn't have one.
+     */
+    struct drm_plane *plane;
+
+    /**
+     * @brief For backing stores that didn't get a plane, the index of the layer
+     * whose buffer they're drawn into using OpenGL. -1 otherwise.
+     */
+    int composited_into;
+
+    /**
+     * @brief True for backing stores that are completely off-screen. They're neither
+     * scanned out nor composited.
+     */
+    bool is_offscreen;
+};
+
+#define COMPOSITOR_PLANE_ASSIGNMENT_CACHE_SIZE 8
+
+/**
+ * @brief The plane assignment of the last frame, and the layer properties it was made for.
+ * If the layers didn't change, the assignment can be reused without validating it again.
+ */
+struct plane_assignment_cache {
+    bool is_valid;
+    size_t n_layers;
+    uint32_t plane_rotation;
+    struct {
+        FlutterLayerContentType type;
+        int x, y, width, height;
+        uint32_t format;
+        uint64_t modifier;
+    } keys[COMPOSITOR_PLANE_ASSIGNMENT_CACHE_SIZE];
+    struct layer_assignment assignments[COMPOSITOR_PLANE_ASSIGNMENT_CACHE_SIZE];
+};
+
+#define COMPOSITOR_MAX_TRACKED_LAYERS 16
+#define COMPOSITOR_MAX_TRACKED_MUTATIONS 16
+
+/**
+ * @brief What the compositor remembers about a layer of the last committed frame,
+ * to detect frames that look exactly like the one before.
+ */
+struct presented_layer {
+    FlutterLayerContentType type;
+    const void *backing_store_user_data;
+    int64_t view_id;
+    FlutterPoint offset;
+    FlutterSize size;
+    size_t n_mutations;
+    FlutterPlatformViewMutation mutations[COMPOSITOR_MAX_TRACKED_MUTATIONS];
+};
+
+/// One for each of 0, 90, 180 and 270 degrees.
+#define COMPOSITOR_N_CURSOR_ROTATIONS 4
+
+/**
+ * @brief A dumb buffer holding a cursor icon, already rotated for the display.
+ */
+struct cursor_buffer {
+    bool is_valid;
+    int hot_x, hot_y;
+    int size;
+    uint32_t gem_bo_handle;
+    uint32_t drm_fb_id;
+};
+
 struct compositor {
     struct drmdev *drmdev;
 
@@ -138,11 +248,8 @@ struct compositor {
     /**
      * @brief A cache of rendertargets that are not currently in use for
      * any flutter layers and can be reused.
-     * 
-     * Make sure to destroy all stale rendertargets before presentation so all the DRM planes
-     * that are reserved by any stale rendertargets get freed.
      */
-    struct concurrent_pointer_set stale_rendertargets;
+    struct rendertarget_pool rendertarget_pool;
 
     /**
      * @brief Whether the mouse cursor is currently enabled and visible.
@@ -150,33 +257,172 @@ struct compositor {
 
     struct {
         bool is_enabled;
-        int cursor_size;
-        const struct cursor_icon *current_cursor;
-        int current_rotation;
+        const struct cursor_buffer *current_buffer;
         int hot_x, hot_y;
         int x, y;
 
-        bool has_buffer;
-        int buffer_depth;
-        int buffer_pitch;
-        int buffer_width;
-        int buffer_height;
-        int buffer_size;
-        uint32_t drm_fb_id;
-        uint32_t gem_bo_handle;
-        uint32_t *buffer;
+        /**
+         * @brief The rotated variants of the cursor icons, indexed by icon, then rotation / 90.
+         * All rotations of an icon are created the first time it's used and are kept around,
+         * so changing the rotation or re-enabling the cursor only switches buffers.
+         */
+        struct cursor_buffer *buffers;
+
+        /**
+         * @brief statistics
+         */
+        uint64_t n_moves;
+        uint64_t n_buffer_switches;
+        int n_buffers;
     } cursor;
 
     /**
      * If true, @ref on_present_layers will commit blockingly.
      * 
      * It will also schedule a simulated page flip event on the main thread
-     * afterwards so the frame queue works.
+     * afterwards so the frame scheduler works.
      * 
      * If false, @ref on_present_layers will commit nonblocking using page flip events,
-     * like usual.
+     * like usual. Only used if the kernel gives us valid vblank timestamps.
      */
     bool do_blocking_atomic_commits;
+
+    /**
+     * @brief Back-pressure for non-blocking commits.
+     *
+     * @ref has_pending_flip is true while a non-blocking commit was made but its
+     * page flip event didn't arrive yet. @ref on_present_layers waits on
+     * @ref flip_completed until that's no longer the case before committing the next frame,
+     * so the kernel never rejects a commit with EBUSY.
+     */
+    pthread_mutex_t flip_mutex;
+    pthread_cond_t flip_completed;
+    bool has_pending_flip;
+
+    /**
+     * @brief How many buffers to use for each no-GBM (overlay plane) rendertarget.
+     */
+    int overlay_buffer_depth;
+
+    /**
+     * @brief How long the raster thread had to wait for page flips, either
+     * to commit a frame or to get a free buffer to render into.
+     */
+    struct {
+        uint64_t n_frames;
+        uint64_t n_stalled_frames;
+        uint64_t total_stall_ns;
+        uint64_t max_stall_ns;
+    } stall_stats;
+
+    /**
+     * @brief Whether plane assignments can be validated using test commits.
+     * Set to false if the kernel rejects even a test commit with just the primary plane.
+     */
+    bool can_test_plane_assignments;
+
+    struct plane_assignment_cache plane_assignment_cache;
+
+    struct {
+        uint64_t n_test_commits;
+        uint64_t n_failed_test_commits;
+        uint64_t n_composited_layers;
+    } plane_stats;
+
+    /**
+     * @brief EGL and GL calls made by the compositor while presenting, to check
+     * the window surface is only swapped when it was actually drawn and
+     * how much GL state compositing layers without a plane touches.
+     * Attaching buffers to FBOs is counted even when creating rendertargets.
+     */
+    struct {
+        uint64_t n_presents;
+        uint64_t n_egl_calls;
+        uint64_t n_gl_calls;
+        uint64_t n_context_switches;
+        uint64_t n_swaps;
+        uint64_t n_fenced_presents;
+    } egl_stats;
+
+    /**
+     * @brief The number of the frame that's being presented, incremented on every present.
+     */
+    uint64_t frame_number;
+
+    /**
+     * @brief How much of the presented backing stores actually changed, according to
+     * the paint regions reported by the engine.
+     */
+    struct {
+        uint64_t n_layers;
+        uint64_t n_partially_damaged_layers;
+        uint64_t n_layer_pixels;
+        uint64_t n_damaged_pixels;
+        uint64_t n_created_blobs;
+    } damage_stats;
+
+    /**
+     * @brief The layers of the last committed frame, or -1 if they're unknown
+     * and the next frame has to be committed in any case.
+     */
+    struct presented_layer last_layers[COMPOSITOR_MAX_TRACKED_LAYERS];
+    int n_last_layers;
+
+    /**
+     * @brief The plane rotation the last frame was committed with. A frame with the same layers
+     * still has to be committed if the display controller rotates the planes differently now.
+     */
+    uint32_t last_plane_rotation;
+
+    /**
+     * @brief How many frames were identical to the one on screen and weren't committed.
+     */
+    uint64_t n_elided_commits;
+
+    /**
+     * @brief Whether GPU rendering is synchronized with scanout using explicit fences,
+     * i.e. the planes get an IN_FENCE_FD and the CRTC an OUT_FENCE_PTR.
+     * Needs EGL_ANDROID_native_fence_sync and atomic modesetting.
+     */
+    bool use_explicit_fencing;
+
+    /**
+     * @brief The OUT_FENCE_PTR of the last commit, or -1. Signals when the frame
+     * is on screen, i.e. when the buffers of the frame before it were released.
+     * Only accessed on the raster thread.
+     */
+    int out_fence_fd;
+
+    /**
+     * @brief The modifier overlay buffers are allocated with, negotiated between EGL
+     * and the planes of the CRTC. DRM_FORMAT_MOD_INVALID if that's not possible,
+     * in which case they're created using eglCreateDRMImageMESA.
+     */
+    uint64_t overlay_modifier;
+
+    /**
+     * @brief The size the engine rendered the frame that's being presented at, in display
+     * orientation, and the render scale that corresponds to. With --dynamic-render-scale,
+     * the frame can be smaller than the window surface. Only the bottom-left part of the
+     * window surface is drawn then (OpenGL renders bottom-up), and the primary plane only
+     * scans out that part. Only accessed on the raster thread.
+     */
+    int frame_width, frame_height;
+    double frame_scale;
+
+    /**
+     * @brief Whether the render scale is picked by @ref render_scale_controller at runtime
+     * (--dynamic-render-scale). Only accessed on the raster thread.
+     */
+    bool has_dynamic_render_scale;
+    struct render_scale_controller render_scale_controller;
+    double requested_render_scale;
+
+    /**
+     * @brief When the engine started rasterizing the frame that's being presented, or 0 if that's not known.
+     * Only accessed on the raster thread.
+     */
+    uint64_t raster_start_ns;
 };
 
 /*
@@ -194,6 +440,10 @@ struct drm_rbo {
     uint32_t gem_handle;
     uint32_t gem_stride;
     uint32_t drm_fb_id;
+
+    /// The GBM BO the EGL image was imported from,
+    /// or NULL if it was created using eglCreateDRMImageMESA.
+    struct gbm_bo *bo;
 };
 
 struct drm_fb {
@@ -231,22 +481,59 @@ struct backing_store_metadata {
 
 struct rendertarget_gbm {
     struct gbm_surface *gbm_surface;
+
+    /**
+     * @brief The buffer that was committed last, i.e. the one that's on screen
+     * or will be once the pending page flip completes.
+     */
     struct gbm_bo *current_front_bo;
+
+    /**
+     * @brief The buffer that was on screen before @ref current_front_bo.
+     * It's released once the page flip to @ref current_front_bo has completed,
+     * since the display could still be scanning it out before that.
+     */
+    struct gbm_bo *previous_front_bo;
+
+    /**
+     * @brief Whether the window surface was swapped for the frame that's being presented.
+     * If it wasn't, @ref current_front_bo is presented again.
+     */
+    bool has_new_front_bo;
 };
 
+/**
+ * @brief How many rects of the engine's paint region are tracked per rendertarget.
+ * Larger paint regions are merged into their bounding box.
+ */
+#define RENDERTARGET_MAX_PAINTED_RECTS 8
+
+#define RENDERTARGET_NOGBM_MIN_BUFFERS 2
+#define RENDERTARGET_NOGBM_MAX_BUFFERS SCANOUT_BUFFERS_MAX
+
 /**
  * @brief No-GBM Rendertarget.
  * A type of rendertarget that is not backed by a GBM-Surface, used for rendering into DRM overlay planes.
+ *
+ * Has between @ref RENDERTARGET_NOGBM_MIN_BUFFERS and @ref RENDERTARGET_NOGBM_MAX_BUFFERS buffers.
+ * With two, OpenGL can only start rendering the next frame once the page flip to the
+ * last one completed. With three or more, it can render into a free buffer right away.
  */
 struct rendertarget_nogbm {
     GLuint gl_fbo_id;
-    struct drm_rbo rbos[2];
-    
+    struct drm_rbo rbos[RENDERTARGET_NOGBM_MAX_BUFFERS];
+    int n_rbos;
+
     /**
-     * @brief The index of the @ref drm_rbo in the @ref rendertarget_nogbm::rbos array that
-     * OpenGL is currently rendering into.
+     * @brief Which of the rbos OpenGL renders into (buffers.front) and which are on screen.
      */
-    int current_front_rbo;
+    struct scanout_buffers buffers;
+
+    /**
+     * @brief Whether the target was presented in the current frame, and needs a new
+     * rbo to render into once the frame was committed.
+     */
+    bool needs_next_rbo;
 };
 
 struct rendertarget {
@@ -261,11 +548,52 @@ struct rendertarget {
 
     GLuint gl_fbo_id;
 
+    /**
+     * @brief The size of the buffers of this rendertarget, in pixels.
+     * GBM rendertargets are always display-sized, no-GBM rendertargets
+     * have the size flutter requested for the backing store.
+     */
+    int width, height;
+
+    /**
+     * @brief The DRM pixel format and modifier of the buffers.
+     * DRM_FORMAT_MOD_INVALID if the modifier is chosen implicitly by the driver.
+     */
+    uint32_t format;
+    uint64_t modifier;
+
+    /**
+     * @brief How much memory the buffers of this rendertarget take up.
+     * 0 for GBM rendertargets, since the GBM surface owns their buffers.
+     */
+    size_t n_bytes;
+
+    /**
+     * @brief Where the engine painted into this rendertarget the last time it was presented,
+     * in framebuffer coordinates, and the plane and position it was presented at.
+     * Used to calculate what changed on the plane in the next frame.
+     * @ref n_painted_rects is -1 if the whole buffer has to be considered painted.
+     */
+    struct drm_mode_rect painted_rects[RENDERTARGET_MAX_PAINTED_RECTS];
+    int n_painted_rects;
+    uint32_t last_plane_id;
+    int last_offset_x, last_offset_y;
+    uint64_t last_presented_frame;
+
+    /**
+     * @brief The FB_DAMAGE_CLIPS property blob of this rendertarget and the rects in it, 0 if there's none.
+     * Kept until the damage changes, so a layer that's repainted in the same place every frame
+     * doesn't need a new blob every frame.
+     */
+    uint32_t damage_blob_id;
+    struct drm_mode_rect damage_blob_rects[2 * RENDERTARGET_MAX_PAINTED_RECTS];
+    int n_damage_blob_rects;
+
     void (*destroy)(struct rendertarget *target);
     int (*present)(
         struct rendertarget *target,
         struct drmdev_atomic_req *atomic_req,
-        uint32_t drm_plane_id,
+        struct drm_plane *plane,
         int offset_x,
         int offset_y,
         int width,
@@ -275,7 +603,7 @@ struct rendertarget {
     int (*present_legacy)(
         struct rendertarget *target,
         struct drmdev *drmdev,
-        uint32_t drm_plane_id,
+        struct drm_plane *plane,
         int offset_x,
         int offset_y,
         int width,
@@ -319,9 +647,32 @@ int compositor_apply_cursor_state(
 
 int compositor_set_cursor_pos(int x, int y);
 
+/**
+ * @brief The engine made the flutter rendering EGL context current on the raster thread.
+ * The first time that happens after a frame was presented is when the engine started
+ * rasterizing the next one, which the raster time for --dynamic-render-scale is measured from.
+ */
+void compositor_on_raster_start(void);
+
+/**
+ * @brief Initialize the compositor.
+ *
+ * @param overlay_buffer_depth How many buffers each no-GBM rendertarget should have.
+ * @param n_preallocated_overlays How many display-sized no-GBM rendertargets to create
+ *   up front, so the first platform view to appear doesn't have to wait for them.
+ *   The flutter rendering EGL context must not be current on any thread if this isn't 0.
+ */
 int compositor_initialize(
-    struct drmdev *drmdev
+    struct drmdev *drmdev,
+    int overlay_buffer_depth,
+    int n_preallocated_overlays
 );
 
+/**
+ * @brief Print how long the raster thread waited for page flips and how well
+ * the rendertarget pool performed. Only prints in debug builds.
+ */
+void compositor_dump_stats(void);
+
 
 #endif
\ No newline at end of file
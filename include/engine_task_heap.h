@@ -0,0 +1,58 @@
+#ifndef _FLUTTERPI_INCLUDE_ENGINE_TASK_HEAP_H
+#define _FLUTTERPI_INCLUDE_ENGINE_TASK_HEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <flutter_embedder.h>
+
+struct engine_task {
+    uint64_t target_time;
+    uint64_t seq;
+    FlutterTask task;
+};
+
+/**
+ * @brief A binary min-heap of engine tasks, ordered by target time and,
+ * for equal target times, by the order they were posted in.
+ *
+ * Zero-initialize it before use. Not thread-safe.
+ */
+struct engine_task_heap {
+    struct engine_task *tasks;
+    size_t n_tasks;
+    size_t size;
+    uint64_t next_seq;
+};
+
+/**
+ * @brief Add a task that should run at @ref target_time.
+ * @returns 0 on success, ENOMEM if the heap couldn't be grown.
+ */
+int engine_task_heap_push(struct engine_task_heap *heap, FlutterTask task, uint64_t target_time);
+
+/**
+ * @brief The task that's due first, or NULL if the heap is empty.
+ */
+static inline const struct engine_task *engine_task_heap_peek(struct engine_task_heap *heap) {
+    return heap->n_tasks > 0 ? heap->tasks : NULL;
+}
+
+/**
+ * @brief Remove the task that's due first. The heap must not be empty.
+ */
+void engine_task_heap_pop(struct engine_task_heap *heap, struct engine_task *task_out);
+
+void engine_task_heap_deinit(struct engine_task_heap *heap);
+
+/**
+ * @brief Arm @ref timerfd for @ref target_time (absolute CLOCK_MONOTONIC, in ns), so it
+ * expires when the first task of the heap is due, or disarm it if @ref target_time is UINT64_MAX.
+ *
+ * @param armed_time The time @ref timerfd is currently armed for. Nothing is done if it's
+ *   already armed for @ref target_time, otherwise it's updated.
+ * @returns 0 on success, the errno of timerfd_settime otherwise.
+ */
+int engine_task_timer_arm(int timerfd, uint64_t target_time, uint64_t *armed_time);
+
+#endif
@@ -28,6 +28,11 @@
 
 #include <modesetting.h>
 #include <collection.h>
+#include <pixel_format.h>
+#include <thread_config.h>
+#include <frame_scheduler.h>
+#include <engine_task_heap.h>
+#include <task_queue.h>
 #include <keyboard.h>
 
 #define LOAD_EGL_PROC(flutterpi_struct, name, full_name) \
@@ -195,22 +200,27 @@ static inline void apply_flutter_transformation(
 #define LIBINPUT_EVENT_IS_KEYBOARD(event_type) (\
 	((event_type) == LIBINPUT_EVENT_KEYBOARD_KEY))
 
-enum frame_state {
-	kFramePending,
-	kFrameRendering,
-	kFrameRendered
+/**
+ * @brief Priority classes for the work done on the platform thread.
+ * 
+ * Lower values are dispatched first. Every class gets its own platform task queue
+ * and main loop event source, so for example a burst of platform messages can never
+ * delay a vblank reply or a touch event.
+ */
+enum platform_task_priority {
+	kPlatformTaskPriorityInput,
+	kPlatformTaskPriorityFrame,
+	kPlatformTaskPriorityEngine,
+	kPlatformTaskPriorityPlatformMessage,
+	kPlatformTaskPriorityBackground,
+	kMax_PlatformTaskPriority = kPlatformTaskPriorityBackground
 };
 
-struct frame {
-	/// The current state of the frame.
-	/// - Pending, when the frame was requested using the FlutterProjectArgs' vsync_callback.
-	/// - Rendering, when the baton was returned to the engine
-	/// - Rendered, when the frame has been / is visible on the display.
-	enum frame_state state;
-
-	/// The baton to be returned to the flutter engine when the frame can be rendered.
-	intptr_t baton;
-};
+/**
+ * @brief If a platform task class has been waiting for longer than this,
+ * it's temporarily dispatched before all other classes.
+ */
+#define PLATFORM_TASK_STARVATION_THRESHOLD_NS 32000000ull
 
 struct compositor;
 
@@ -235,6 +245,14 @@ struct flutterpi {
 		struct gbm_surface *surface;
 		uint32_t 			format;
 		uint64_t			modifier;
+
+		/// The pixel format of the window surface (and the primary plane).
+		/// @ref format is the GBM fourcc of it.
+		enum pixfmt			pixfmt;
+
+		/// True if the pixel format was given on the commandline. Otherwise,
+		/// it's chosen in init_display depending on what the primary plane supports.
+		bool				has_forced_pixfmt;
 	} gbm;
 
 	struct {
@@ -263,6 +281,23 @@ struct flutterpi {
 		PFNEGLCREATEPLATFORMPIXMAPSURFACEEXTPROC createPlatformPixmapSurface;
 		PFNEGLCREATEDRMIMAGEMESAPROC createDRMImageMESA;
 		PFNEGLEXPORTDRMIMAGEMESAPROC exportDRMImageMESA;
+		PFNEGLCREATESYNCKHRPROC createSyncKHR;
+		PFNEGLDESTROYSYNCKHRPROC destroySyncKHR;
+		PFNEGLDUPNATIVEFENCEFDANDROIDPROC dupNativeFenceFDANDROID;
+
+		/// eglSwapBuffersWithDamageKHR or eglSwapBuffersWithDamageEXT, or NULL if neither is supported.
+		PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swapBuffersWithDamage;
+
+		/// True if GPU fences can be exported as sync file fds (EGL_ANDROID_native_fence_sync),
+		/// so they can be passed to the kernel as atomic commit IN_FENCE_FDs.
+		bool supports_native_fence_sync;
+
+		PFNEGLCREATEIMAGEKHRPROC createImageKHR;
+		PFNEGLQUERYDMABUFMODIFIERSEXTPROC queryDmaBufModifiers;
+
+		/// True if dmabufs with explicit modifiers can be imported as EGL images
+		/// (EGL_EXT_image_dma_buf_import_modifiers), so scanout buffers can be tiled or compressed.
+		bool supports_dmabuf_import_modifiers;
 	} egl;
 
 	struct  {
@@ -282,12 +317,27 @@ struct flutterpi {
 		///   to hardcode values for you individual display.
 		int width_mm, height_mm;
 
-		int refresh_rate;
+		/// The exact refresh rate calculated from the mode timings, e.g. 59.94 instead of 60.
+		double refresh_rate;
 
 		/// The pixel ratio used by flutter.
 		/// This is computed inside init_display using width_mm and height_mm.
 		/// flutter only accepts pixel ratios >= 1.0
 		double pixel_ratio;
+
+		/// The factor the engine's rendering resolution is scaled down by (--render-scale).
+		/// The planes upscale the rendered buffers to the display size. Only supported with atomic modesetting.
+		/// With --dynamic-render-scale, this is the largest factor, 1, and the one the buffers are allocated for.
+		double render_scale;
+
+		/// The size of the buffers the engine renders into, in pixels.
+		/// The same as width & height, unless a render scale < 1 is set.
+		int render_width, render_height;
+
+		/// Whether the render scale is lowered at runtime while the engine can't rasterize frames in time
+		/// (--dynamic-render-scale), down to @ref min_render_scale. Otherwise, @ref min_render_scale is @ref render_scale.
+		bool has_dynamic_render_scale;
+		double min_render_scale;
 	} display;
 
 	struct {
@@ -310,8 +360,17 @@ struct flutterpi {
 		/// width & height of the flutter view. These are the dimensions send to flutter using
 		/// [FlutterEngineSendWindowMetricsEvent]. (So, for example, with rotation == 90, these
 		/// dimensions are swapped compared to the display dimensions)
+		/// They're based on the render size, not the display size (see @ref render_scale).
 		int width, height;
 
+		/// The render scale the engine is currently sent window metrics for. The same as display.render_scale,
+		/// unless --dynamic-render-scale lowered it. Only changed on the platform thread.
+		double render_scale;
+
+		/// The device pixel ratio sent to flutter. The display's pixel ratio, scaled by the render scale,
+		/// so the UI has the same logical size no matter the render scale.
+		double pixel_ratio;
+
 		int width_mm, height_mm;
 		
 		/// Used by flutter to transform the flutter view to fill the display.
@@ -321,9 +380,26 @@ struct flutterpi {
 		/// Used by the touch input to transform raw display coordinates into flutter view coordinates.
 		/// Matrix that transforms display coordinates into flutter view coordinates
 		FlutterTransformation display_to_view_transform;
+
+		/// The DRM rotation the compositor applies to the planes it presents on.
+		/// DRM_MODE_ROTATE_0 if the engine renders rotated, otherwise the display
+		/// controller does (part of) the rotation. Chosen once before the engine is started
+		/// and never changed afterwards, since the raster thread reads it.
+		uint32_t plane_rotation;
+
+		/// The rotation the engine renders with, in degrees. The part of @ref rotation the display
+		/// controller doesn't do (see @ref plane_rotation).
+		int engine_rotation;
+
+		/// The transformation the engine renders the view with (its root surface transformation),
+		/// and the inverse of it. The part of the rotation of @ref view_to_display_transform
+		/// the display controller doesn't do (see @ref plane_rotation), for the render size.
+		FlutterTransformation engine_view_to_display_transform;
+		FlutterTransformation engine_display_to_view_transform;
 	} view;
 
-	struct concurrent_queue frame_queue;
+	/// Replies to the engine's vsync requests, paced by the display's page flips.
+	struct frame_scheduler frame_scheduler;
 
 	struct compositor *compositor;
 
@@ -354,18 +430,81 @@ struct flutterpi {
 	
 	/// main event loop
 	pthread_t event_loop_thread;
-	pthread_mutex_t event_loop_mutex;
 	sd_event *event_loop;
-	int wakeup_event_loop_fd;
+
+	/// platform tasks, one lock-free queue and wakeup eventfd per priority class.
+	struct platform_task_queue {
+		enum platform_task_priority priority;
+		struct task_queue tasks;
+		sd_event_source *source;
+
+		/// Whether the event source priority was temporarily raised because the queue starved.
+		bool is_boosted;
+		uint64_t n_boosts;
+	} platform_task_queues[kMax_PlatformTaskPriority + 1];
+	sd_event_source *starvation_check_source;
+
+	/// engine tasks, kept in a binary min-heap ordered by target time
+	/// and dispatched by a single timerfd.
+	struct {
+		pthread_mutex_t mutex;
+		sd_event_source *source;
+		struct engine_task_heap heap;
+		int timerfd;
+
+		/**
+		 * @brief The absolute CLOCK_MONOTONIC time (in ns) the timerfd is currently armed for,
+		 * or UINT64_MAX if it's disarmed.
+		 */
+		uint64_t armed_time;
+
+		/// statistics
+		uint64_t n_posted;
+		uint64_t n_executed;
+		uint64_t n_dispatches;
+		uint64_t n_timer_arms;
+		uint64_t total_lateness_ns;
+		uint64_t max_lateness_ns;
+	} engine_tasks;
+
+	/// The thread flutter-pi provides to the engine as its render task runner.
+	/// Rasterization and all compositor callbacks happen on this thread.
+	struct {
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t task_added;
+		struct engine_task_heap heap;
+
+		/// Set by the platform thread (with mutex locked) to make the render thread exit.
+		bool should_stop;
+	} render_thread;
+
+	/// Scheduling settings for the engine threads, indexed by FlutterThreadPriority.
+	/// The render thread uses the kRaster entry, since it replaces the engine's raster thread.
+	struct thread_config thread_configs[kRaster + 1];
+
+	/// How long a platform thread callback may run before the watchdog reports it. 0 if disabled.
+	unsigned int watchdog_budget_ms;
+
+	/// Whether the watchdog should print a backtrace of the platform thread when it reports a callback.
+	bool watchdog_backtraces;
+
+	/// How many DRM buffers each no-GBM overlay rendertarget uses.
+	int overlay_buffer_depth;
+
+	/// How many overlay rendertargets the compositor should create at startup.
+	int n_preallocated_overlays;
 
 	/// flutter-pi internal stuff
 	struct plugin_registry *plugin_registry;
 	struct texture_registry *texture_registry;
 };
 
+/// A platform task that should run at a specific time.
 struct platform_task {
 	int (*callback)(void *userdata);
 	void *userdata;
+	uint64_t target_time_usec;
 };
 
 struct platform_message {
@@ -390,17 +529,48 @@ int flutterpi_fill_view_properties(
 	int rotation
 );
 
+/**
+ * @brief Make the engine render at @ref render_scale times the display resolution from the next frame on
+ * (see --dynamic-render-scale). Can be called from any thread, the window metrics are sent on the platform thread.
+ *
+ * The render scale is only changed while the engine doesn't render rotated, since its root surface
+ * transformation depends on the render size.
+ *
+ * @returns 0 if the change was queued.
+ */
+int flutterpi_set_render_scale(double render_scale);
+
+/**
+ * @brief Post a task to the platform thread, with priority @ref kPlatformTaskPriorityBackground.
+ *
+ * @returns 0 if the task was queued, in which case @ref callback will be called with @ref userdata.
+ *   An error means the task was not queued and the caller still owns @ref userdata.
+ */
 int flutterpi_post_platform_task(
 	int (*callback)(void *userdata),
 	void *userdata
 );
 
+int flutterpi_post_platform_task_with_priority(
+	enum platform_task_priority priority,
+	int (*callback)(void *userdata),
+	void *userdata
+);
+
 int flutterpi_post_platform_task_with_time(
 	int (*callback)(void *userdata),
 	void *userdata,
 	uint64_t target_time_usec
 );
 
+/**
+ * @brief Add an IO event source to the main loop.
+ *
+ * On the platform thread, the source is added immediately. Other threads can't get
+ * the source back without waiting for the platform thread, so they must pass NULL
+ * for @ref source_out (the source is added in the background and is floating)
+ * or use @ref flutterpi_sd_event_add_io_async.
+ */
 int flutterpi_sd_event_add_io(
 	sd_event_source **source_out,
 	int fd,
@@ -409,6 +579,32 @@ int flutterpi_sd_event_add_io(
 	void *userdata
 );
 
+/**
+ * @brief Called on the platform thread once the event source requested using
+ * @ref flutterpi_sd_event_add_io_async was added.
+ *
+ * @param source The new event source, or NULL if @ref result is non-zero.
+ *   The callback owns a reference to it and must unref it when it's done with it.
+ * @param result 0 on success, an errno otherwise.
+ * @param userdata The userdata of the IO callback.
+ */
+typedef void (*flutterpi_io_source_added_cb)(sd_event_source *source, int result, void *userdata);
+
+/**
+ * @brief Add an IO event source to the main loop, from any thread, without waiting for the platform thread.
+ *
+ * @param on_added Called on the platform thread with the new event source, or NULL
+ *   if the caller doesn't need it, in which case the source is floating.
+ * @returns 0 if the request was queued. Errors while adding the source are reported to @ref on_added.
+ */
+int flutterpi_sd_event_add_io_async(
+	int fd,
+	uint32_t events,
+	sd_event_io_handler_t callback,
+	void *userdata,
+	flutterpi_io_source_added_cb on_added
+);
+
 int flutterpi_send_platform_message(
 	const char *channel,
 	const uint8_t *restrict message,
@@ -436,6 +632,19 @@ int flutterpi_schedule_exit(void);
 
 struct gbm_device *flutterpi_get_gbm_device(struct flutterpi *flutterpi);
 
+/**
+ * @brief Select the modifier scanout buffers with this DRM format should be allocated with.
+ *
+ * The candidates are the modifiers EGL can render into, that are also supported
+ * by the primary plane (if @ref primary_plane_only is true) or by every primary and
+ * overlay plane of the selected CRTC that supports the format at all. Cursor planes
+ * are ignored. GBM picks the best of those.
+ *
+ * @returns 0 on success, ENOTSUP if modifiers can't be negotiated. In that case,
+ *   buffers should be allocated linear or with an implicit modifier.
+ */
+int flutterpi_select_scanout_modifier(uint32_t format, bool primary_plane_only, uint64_t *modifier_out);
+
 EGLDisplay flutterpi_get_egl_display(struct flutterpi *flutterpi);
 
 EGLContext flutterpi_create_egl_context(struct flutterpi *flutterpi);
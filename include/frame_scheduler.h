@@ -0,0 +1,158 @@
+#ifndef _FLUTTERPI_INCLUDE_FRAME_SCHEDULER_H
+#define _FLUTTERPI_INCLUDE_FRAME_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * @brief Paces the frames the flutter engine renders to the display's vblanks.
+ *
+ * The engine requests a frame using the vsync callback, and the frame scheduler
+ * replies with the vblank the frame should start at. If the previous frame is still
+ * waiting to be scanned out, the reply is deferred until its page flip completes,
+ * so the engine never renders more than one frame ahead of the display.
+ *
+ * A vsync reply doesn't mean the engine will actually present a frame; it can
+ * decide there's nothing to draw. That's why the frame scheduler counts the frames
+ * that were actually submitted to the display instead of matching requests to page flips.
+ *
+ * The frame scheduler doesn't know about DRM or the engine. Time and the vsync
+ * reply are provided through callbacks, so it can also be driven by a fake clock.
+ * All functions are thread-safe.
+ */
+
+/// Vblank intervals spanning more periods than this are too ambiguous to use for the period estimate.
+#define FRAME_SCHEDULER_MAX_INTERVAL_PERIODS 16
+
+/// How far the estimate may move away from the mode timings, as a fraction of the nominal period.
+#define FRAME_SCHEDULER_MAX_PERIOD_DEVIATION 0.02
+
+/**
+ * @brief Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+typedef uint64_t (*frame_scheduler_get_time_t)(void *userdata);
+
+/**
+ * @brief Returns the CLOCK_MONOTONIC timestamp of the last vblank in nanoseconds,
+ * or 0 if it's not known.
+ */
+typedef uint64_t (*frame_scheduler_get_last_vblank_t)(void *userdata);
+
+/**
+ * @brief Replies to the frame request identified by @ref baton.
+ * Called without the frame scheduler lock held, on the thread that made the reply possible.
+ */
+typedef void (*frame_scheduler_reply_t)(void *userdata, intptr_t baton, uint64_t frame_start_ns, uint64_t frame_target_ns);
+
+struct frame_scheduler_stats {
+    uint64_t n_requests;
+    uint64_t n_deferred_requests;
+    uint64_t n_submitted_frames;
+    uint64_t n_dropped_frames;
+    uint64_t n_vblanks;
+
+    /**
+     * @brief The refresh period calculated from the mode timings, in nanoseconds.
+     */
+    double nominal_period_ns;
+
+    /**
+     * @brief The current estimate of the refresh period, from the vblank timestamps.
+     */
+    double estimated_period_ns;
+
+    /**
+     * @brief How far off the vblank predictions were from the actual vblank timestamps.
+     * Only vblanks that are used for the period estimate count as samples.
+     */
+    uint64_t n_drift_samples;
+    double total_abs_drift_ns;
+    double max_abs_drift_ns;
+
+    /**
+     * @brief Vblank intervals that didn't fit the expected period at all, and were ignored.
+     */
+    uint64_t n_rejected_intervals;
+};
+
+struct frame_scheduler {
+    pthread_mutex_t mutex;
+
+    /**
+     * @brief The refresh period from the mode timings and our running estimate of
+     * the actual period, in nanoseconds. Kept as double, because the integer
+     * part alone would accumulate errors when predicting several vblanks ahead.
+     */
+    double nominal_period_ns;
+    double period_ns;
+
+    frame_scheduler_get_time_t get_time;
+    frame_scheduler_get_last_vblank_t get_last_vblank;
+    frame_scheduler_reply_t reply;
+    void *userdata;
+
+    /**
+     * @brief The timestamp of the last page flip we were notified of, or 0.
+     */
+    uint64_t last_vblank_ns;
+
+    /**
+     * @brief The number of frames that were submitted to the display, but not yet scanned out.
+     */
+    unsigned int n_frames_in_flight;
+
+    bool has_pending_request;
+    intptr_t pending_baton;
+
+    struct frame_scheduler_stats stats;
+};
+
+/**
+ * @brief Initialize @ref scheduler for a display with the given refresh rate.
+ * The refresh rate should be the exact one from the mode timings (see @ref mode_get_vrefresh),
+ * not the integer vrefresh. The actual period is refined from the vblank timestamps afterwards.
+ *
+ * @param get_last_vblank Optional. If NULL, only the timestamps passed to
+ *   @ref frame_scheduler_on_vblank are used.
+ */
+void frame_scheduler_init(
+    struct frame_scheduler *scheduler,
+    double refresh_rate,
+    frame_scheduler_get_time_t get_time,
+    frame_scheduler_get_last_vblank_t get_last_vblank,
+    frame_scheduler_reply_t reply,
+    void *userdata
+);
+
+void frame_scheduler_deinit(struct frame_scheduler *scheduler);
+
+/**
+ * @brief The engine requested a frame. Replies right away if the display can take
+ * a new frame, otherwise when the frame in flight was scanned out.
+ */
+void frame_scheduler_request_frame(struct frame_scheduler *scheduler, intptr_t baton);
+
+/**
+ * @brief A frame is about to be submitted to the display. Must be followed by either
+ * @ref frame_scheduler_on_vblank once it's scanned out or @ref frame_scheduler_on_frame_dropped
+ * if submitting it failed.
+ *
+ * Call this before the commit, so the page flip can't be reported before the submission.
+ */
+void frame_scheduler_on_frame_submitted(struct frame_scheduler *scheduler);
+
+/**
+ * @brief A frame announced using @ref frame_scheduler_on_frame_submitted won't be scanned out after all.
+ */
+void frame_scheduler_on_frame_dropped(struct frame_scheduler *scheduler);
+
+/**
+ * @brief A submitted frame was scanned out at @ref vblank_ns.
+ * Also updates the estimate of the refresh period.
+ */
+void frame_scheduler_on_vblank(struct frame_scheduler *scheduler, uint64_t vblank_ns);
+
+void frame_scheduler_get_stats(struct frame_scheduler *scheduler, struct frame_scheduler_stats *stats_out);
+
+#endif
@@ -9,10 +9,49 @@
 
 #include <collection.h>
 
+/**
+ * @brief The properties of connectors, CRTCs and planes flutter-pi sets on every frame.
+ * Their IDs are looked up once when the drmdev is created, so they can be set without
+ * comparing property names. See @ref drmdev_atomic_req_put_plane_prop.
+ */
+enum drm_connector_prop {
+    kDrmConnectorPropCrtcId,
+    kMax_DrmConnectorProp
+};
+
+enum drm_crtc_prop {
+    kDrmCrtcPropActive,
+    kDrmCrtcPropModeId,
+    kDrmCrtcPropOutFencePtr,
+    kMax_DrmCrtcProp
+};
+
+enum drm_plane_prop {
+    kDrmPlanePropFbId,
+    kDrmPlanePropCrtcId,
+    kDrmPlanePropSrcX,
+    kDrmPlanePropSrcY,
+    kDrmPlanePropSrcW,
+    kDrmPlanePropSrcH,
+    kDrmPlanePropCrtcX,
+    kDrmPlanePropCrtcY,
+    kDrmPlanePropCrtcW,
+    kDrmPlanePropCrtcH,
+    kDrmPlanePropRotation,
+    kDrmPlanePropZpos,
+    kDrmPlanePropInFenceFd,
+    kDrmPlanePropFbDamageClips,
+    kDrmPlanePropInFormats,
+    kMax_DrmPlaneProp
+};
+
 struct drm_connector {
     drmModeConnector *connector;
 	drmModeObjectProperties *props;
     drmModePropertyRes **props_info;
+
+    /// Index into @ref props_info for each of the known properties, or -1 if the connector doesn't have it.
+    int prop_indices[kMax_DrmConnectorProp];
 };
 
 struct drm_encoder {
@@ -25,6 +64,15 @@ struct drm_crtc {
     drmModePropertyRes **props_info;
     uint32_t bitmask;
     uint8_t index;
+    int prop_indices[kMax_DrmCrtcProp];
+};
+
+/**
+ * @brief A pixel format & modifier combination a plane can scan out.
+ */
+struct drm_plane_modified_format {
+    uint32_t format;
+    uint64_t modifier;
 };
 
 struct drm_plane {
@@ -32,6 +80,13 @@ struct drm_plane {
     drmModePlane *plane;
     drmModeObjectProperties *props;
     drmModePropertyRes **props_info;
+    int prop_indices[kMax_DrmPlaneProp];
+
+    /// The format & modifier combinations from the IN_FORMATS property.
+    /// NULL if the plane doesn't have that property, in which case only
+    /// implicit modifiers can be used for it.
+    struct drm_plane_modified_format *modified_formats;
+    size_t n_modified_formats;
 };
 
 struct drmdev {
@@ -89,6 +144,14 @@ int drmdev_configure(
     const drmModeModeInfo *mode
 );
 
+/**
+ * @brief Find the plane with the given id. Returns NULL if there's none.
+ */
+struct drm_plane *drmdev_get_plane(
+    struct drmdev *drmdev,
+    uint32_t plane_id
+);
+
 int drmdev_plane_get_type(
     struct drmdev *drmdev,
     uint32_t plane_id
@@ -101,6 +164,15 @@ int drmdev_plane_supports_setting_rotation_value(
     bool *result
 );
 
+/**
+ * @brief Same as @ref drmdev_plane_supports_setting_rotation_value, for a plane that was already looked up.
+ * Doesn't search the plane list, so it's cheap enough to call on every frame.
+ */
+bool drm_plane_supports_setting_rotation_value(
+    const struct drm_plane *plane,
+    int drm_rotation
+);
+
 int drmdev_plane_get_min_zpos_value(
     struct drmdev *drmdev,
     uint32_t plane_id,
@@ -113,6 +185,40 @@ int drmdev_plane_get_max_zpos_value(
     int64_t *max_zpos_out
 );
 
+int drmdev_plane_supports_format(
+    struct drmdev *drmdev,
+    uint32_t plane_id,
+    uint32_t format,
+    bool *result
+);
+
+/**
+ * @brief Check whether the plane can scan out buffers with this format and explicit modifier.
+ * If the plane doesn't tell us which modifiers it supports, only DRM_FORMAT_MOD_LINEAR is assumed to work.
+ */
+int drmdev_plane_supports_format_modifier(
+    struct drmdev *drmdev,
+    uint32_t plane_id,
+    uint32_t format,
+    uint64_t modifier,
+    bool *result
+);
+
+/**
+ * @brief Get the modifiers the plane supports for @ref format.
+ *
+ * @returns 0 on success, ENOTSUP if the plane doesn't have an IN_FORMATS property.
+ *   If the plane supports more than @ref max_modifiers modifiers, the rest is silently dropped.
+ */
+int drmdev_plane_get_modifiers(
+    struct drmdev *drmdev,
+    uint32_t plane_id,
+    uint32_t format,
+    uint64_t *modifiers_out,
+    size_t max_modifiers,
+    size_t *n_modifiers_out
+);
+
 int drmdev_plane_supports_setting_zpos(
     struct drmdev *drmdev,
     uint32_t plane_id,
@@ -126,6 +232,14 @@ int drmdev_plane_supports_setting_zpos_value(
     bool *result
 );
 
+/**
+ * @brief Same as @ref drmdev_plane_supports_setting_zpos_value, for a plane that was already looked up.
+ */
+bool drm_plane_supports_setting_zpos_value(
+    const struct drm_plane *plane,
+    int64_t zpos
+);
+
 int drmdev_new_atomic_req(
     struct drmdev *drmdev,
     struct drmdev_atomic_req **req_out
@@ -154,6 +268,45 @@ int drmdev_atomic_req_put_plane_property(
     uint64_t value
 );
 
+/**
+ * @brief Like @ref drmdev_atomic_req_put_plane_property, but without looking up the plane
+ * and the property by name. Meant for the properties that are set on every frame.
+ *
+ * @returns 0 on success, EINVAL if the plane doesn't have the property.
+ */
+int drmdev_atomic_req_put_plane_prop(
+    struct drmdev_atomic_req *req,
+    const struct drm_plane *plane,
+    enum drm_plane_prop prop,
+    uint64_t value
+);
+
+/**
+ * @brief Set a property of the selected CRTC, see @ref drmdev_atomic_req_put_plane_prop.
+ */
+int drmdev_atomic_req_put_crtc_prop(
+    struct drmdev_atomic_req *req,
+    enum drm_crtc_prop prop,
+    uint64_t value
+);
+
+/**
+ * @brief Set a property of the selected connector, see @ref drmdev_atomic_req_put_plane_prop.
+ */
+int drmdev_atomic_req_put_connector_prop(
+    struct drmdev_atomic_req *req,
+    enum drm_connector_prop prop,
+    uint64_t value
+);
+
+inline static bool drm_plane_has_prop(const struct drm_plane *plane, enum drm_plane_prop prop) {
+    return plane->prop_indices[prop] != -1;
+}
+
+inline static bool drm_crtc_has_prop(const struct drm_crtc *crtc, enum drm_crtc_prop prop) {
+    return crtc->prop_indices[prop] != -1;
+}
+
 int drmdev_atomic_req_put_modeset_props(
     struct drmdev_atomic_req *req,
     uint32_t *flags
@@ -172,6 +325,25 @@ int drmdev_atomic_req_commit(
     void *userdata
 );
 
+/**
+ * @brief Check whether the kernel would accept @ref req, without applying it.
+ *
+ * @returns 0 if the request is valid, the error @ref drmdev_atomic_req_commit would fail with otherwise.
+ */
+int drmdev_atomic_req_test(
+    struct drmdev_atomic_req *req,
+    uint32_t flags
+);
+
+/**
+ * @brief Request an event for the next vblank of the selected CRTC, without committing anything.
+ * The event is delivered to the sequence_handler of the drmEventContext, with @ref userdata.
+ */
+int drmdev_queue_vblank_event(
+    struct drmdev *drmdev,
+    uint64_t userdata
+);
+
 int drmdev_legacy_set_mode_and_fb(
     struct drmdev *drmdev,
     uint32_t fb_id
@@ -0,0 +1,103 @@
+#ifndef _FLUTTERPI_INCLUDE_OBJECT_POOL_H
+#define _FLUTTERPI_INCLUDE_OBJECT_POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <collection.h>
+
+/**
+ * @brief The maximum number of object pools that can exist at the same time.
+ * Every pool gets a slot in the per-thread caches.
+ */
+#define OBJECT_POOL_MAX_POOLS 16
+
+/**
+ * @brief How many free objects each thread caches locally, per pool.
+ */
+#define OBJECT_POOL_THREAD_CACHE_SIZE 16
+
+/**
+ * @brief A thread-safe pool of fixed-size objects.
+ *
+ * Freed objects are kept around for re-use, first in a small lock-free
+ * cache local to the freeing thread, then in a mutex-protected free list shared by all threads.
+ * Only when both are empty is a new object allocated using malloc.
+ *
+ * Pools are meant to be statically initialized using @ref OBJECT_POOL_INITIALIZER
+ * and live for the whole lifetime of the process.
+ */
+struct object_pool {
+    const char *name;
+    size_t object_size;
+
+    /**
+     * @brief The maximum number of objects kept in the shared free list.
+     * Objects freed when the free list is full are returned to the system.
+     */
+    size_t max_cached;
+
+    pthread_mutex_t mutex;
+    void *free_list;
+    size_t n_free;
+
+    /**
+     * @brief Index of this pool in the per-thread caches, plus one. Zero if not yet registered.
+     */
+    atomic_int slot;
+
+    /// statistics
+    atomic_size_t n_live;
+    atomic_size_t n_allocs;
+    atomic_size_t n_hits;
+};
+
+struct object_pool_stats {
+    size_t n_live;
+    size_t n_allocs;
+    size_t n_hits;
+    size_t n_free;
+};
+
+#define OBJECT_POOL_INITIALIZER(_name, _object_size, _max_cached) \
+    ((struct object_pool) { \
+        .name = _name, \
+        .object_size = max(_object_size, sizeof(void*)), \
+        .max_cached = _max_cached, \
+        .mutex = PTHREAD_MUTEX_INITIALIZER, \
+        .free_list = NULL, \
+        .n_free = 0, \
+        .slot = 0, \
+        .n_live = 0, \
+        .n_allocs = 0, \
+        .n_hits = 0 \
+    })
+
+/**
+ * @brief Get an object from the pool, allocating a new one if the pool is empty.
+ * The contents of the returned object are undefined.
+ *
+ * @returns The object, or NULL if allocation failed.
+ */
+void *object_pool_alloc(struct object_pool *pool);
+
+/**
+ * @brief Like @ref object_pool_alloc, but zeroes the returned object.
+ */
+void *object_pool_zalloc(struct object_pool *pool);
+
+/**
+ * @brief Return an object to the pool it was allocated from.
+ * Can be called from any thread, not just the allocating one.
+ */
+void object_pool_free(struct object_pool *pool, void *object);
+
+void object_pool_get_stats(struct object_pool *pool, struct object_pool_stats *stats_out);
+
+/**
+ * @brief Print the statistics of all object pools that were used so far. Only prints in debug builds.
+ */
+void object_pool_dump_all_stats(void);
+
+#endif
@@ -44,7 +44,7 @@ COMPILE_ASSERT(kMax_PixFmt == kRGBA8888);
 
 #define PIXFMT_LIST(V) \
     V( "RGB 5:6:5",    "RGB565",  kRGB565,   /*bpp*/ 16, /*opaque*/ true,  /*R*/ 5, 11, /*G*/ 6, 5,  /*B*/ 5, 0,  /*A*/ 0, 0,  /*GBM fourcc*/ GBM_FORMAT_RGB565,   /*DRM fourcc*/ DRM_FORMAT_RGB565) \
-    V("ARGB 8:8:8:8", "ARGB8888", kARGB8888, /*bpp*/ 32, /*opaque*/ false, /*R*/ 8, 16, /*G*/ 8, 8,  /*B*/ 8, 0,  /*A*/ 8, 24, /*GBM fourcc*/ GBM_FORMAT_ARGB8888, /*DRM fourcc*/ DRM_FORMAT_RGB565) \
+    V("ARGB 8:8:8:8", "ARGB8888", kARGB8888, /*bpp*/ 32, /*opaque*/ false, /*R*/ 8, 16, /*G*/ 8, 8,  /*B*/ 8, 0,  /*A*/ 8, 24, /*GBM fourcc*/ GBM_FORMAT_ARGB8888, /*DRM fourcc*/ DRM_FORMAT_ARGB8888) \
     V("XRGB 8:8:8:8", "XRGB8888", kXRGB8888, /*bpp*/ 32, /*opaque*/ true,  /*R*/ 8, 16, /*G*/ 8, 8,  /*B*/ 8, 0,  /*A*/ 0, 24, /*GBM fourcc*/ GBM_FORMAT_XRGB8888, /*DRM fourcc*/ DRM_FORMAT_XRGB8888) \
     V("BGRA 8:8:8:8", "BGRA8888", kBGRA8888, /*bpp*/ 32, /*opaque*/ false, /*R*/ 8,  8, /*G*/ 8, 16, /*B*/ 8, 24, /*A*/ 8, 0,  /*GBM fourcc*/ GBM_FORMAT_BGRA8888, /*DRM fourcc*/ DRM_FORMAT_BGRA8888) \
     V("RGBA 8:8:8:8", "RGBA8888", kRGBA8888, /*bpp*/ 32, /*opaque*/ false, /*R*/ 8, 24, /*G*/ 8, 16, /*B*/ 8, 8,  /*A*/ 8, 0,  /*GBM fourcc*/ GBM_FORMAT_RGBA8888, /*DRM fourcc*/ DRM_FORMAT_RGBA8888)
@@ -121,7 +121,7 @@ extern const size_t n_pixfmt_infos;
  * 
  */
 static inline const struct pixfmt_info *get_pixfmt_info(enum pixfmt format) {
-    DEBUG_ASSERT(format > 0 && format <= kMax_PixFmt);
+    DEBUG_ASSERT(format >= 0 && format <= kMax_PixFmt);
     return pixfmt_infos + format;
 }
 
@@ -0,0 +1,76 @@
+#ifndef _FLUTTERPI_INCLUDE_RENDER_SCALE_CONTROLLER_H
+#define _FLUTTERPI_INCLUDE_RENDER_SCALE_CONTROLLER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Picks the render scale for --dynamic-render-scale from the measured raster times.
+ *
+ * The raster time of a frame is the time from the engine making the GL context current
+ * to the frame being ready to commit, the same span the engine reports as raster time.
+ * While the average raster time doesn't fit into the frame budget, the scale is lowered,
+ * assuming the raster time is proportional to the number of pixels. Once there's
+ * enough headroom for the next larger scale, it's raised again, one step at a time.
+ *
+ * Frames rendered at an older scale, which are still in flight when a new scale is
+ * requested, are ignored. If the new scale doesn't arrive within
+ * @ref RENDER_SCALE_CONTROLLER_HOLD_FRAMES frames, it wasn't applied, and the controller
+ * continues from the scale the frames are rendered at. After each change, the new scale
+ * is held for @ref RENDER_SCALE_CONTROLLER_HOLD_FRAMES frames before it's reconsidered.
+ *
+ * The controller has no lock, it's only used on the raster thread.
+ */
+
+/// The scale is changed in steps of this size, so small variations in the raster time don't change the window metrics.
+#define RENDER_SCALE_CONTROLLER_STEP 0.05
+
+/// The fraction of the refresh period the raster time may take.
+#define RENDER_SCALE_CONTROLLER_TARGET_LOAD 0.8
+
+/// The scale is only raised if the predicted raster time at the next step takes less than this fraction of the budget.
+#define RENDER_SCALE_CONTROLLER_HEADROOM 0.75
+
+/// How many frames are averaged at a scale before the scale is changed again.
+#define RENDER_SCALE_CONTROLLER_HOLD_FRAMES 30
+
+struct render_scale_controller {
+    double min_scale, max_scale;
+    double budget_ns;
+
+    /**
+     * @brief The scale the controller last asked for.
+     */
+    double target_scale;
+
+    /**
+     * @brief Average raster time of the frames rendered at @ref target_scale.
+     */
+    double avg_raster_ns;
+    unsigned int n_frames;
+
+    /**
+     * @brief How many frames in a row were rendered at a different scale than @ref target_scale.
+     */
+    unsigned int n_stale_frames;
+};
+
+/**
+ * @brief Initialize @ref controller to pick scales between @ref min_scale and @ref max_scale,
+ * starting at @ref max_scale.
+ */
+void render_scale_controller_init(
+    struct render_scale_controller *controller,
+    double min_scale,
+    double max_scale,
+    double refresh_rate
+);
+
+/**
+ * @brief Add the raster time of a frame that was rendered at @ref frame_scale.
+ *
+ * @returns The scale the next frames should be rendered at.
+ */
+double render_scale_controller_on_frame(struct render_scale_controller *controller, double frame_scale, uint64_t raster_ns);
+
+#endif
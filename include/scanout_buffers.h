@@ -0,0 +1,62 @@
+#ifndef _FLUTTERPI_INCLUDE_SCANOUT_BUFFERS_H
+#define _FLUTTERPI_INCLUDE_SCANOUT_BUFFERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCANOUT_BUFFERS_MAX 4
+
+/**
+ * @brief Keeps track of which buffers of a multi-buffered plane are free to render into.
+ *
+ * Only the bookkeeping: the buffers themselves (and waiting for page flips)
+ * are up to the user. Not thread-safe.
+ */
+struct scanout_buffers {
+    int n_buffers;
+
+    /**
+     * @brief For each buffer, the number of the commit it was last presented in, or 0 if never.
+     * When picking the next buffer to render into, the free buffer with the lowest
+     * number (the one that went off-screen the longest time ago) is used.
+     */
+    uint64_t presented_at[SCANOUT_BUFFERS_MAX];
+    uint64_t n_presents;
+
+    /**
+     * @brief The buffer that's currently rendered into.
+     */
+    int front;
+
+    /**
+     * @brief The buffer that was committed last (on screen, or will be after the pending page flip),
+     * and the one committed before that (on screen until the pending page flip completes). -1 if none.
+     */
+    int scanout;
+    int previous_scanout;
+};
+
+void scanout_buffers_init(struct scanout_buffers *buffers, int n_buffers);
+
+/**
+ * @brief Mark the front buffer as committed.
+ * @returns The index of the front buffer.
+ */
+int scanout_buffers_present_front(struct scanout_buffers *buffers);
+
+/**
+ * @brief Pick the buffer to render the next frame into and make it the front buffer.
+ * Must be called after the frame presenting the current front buffer was committed.
+ *
+ * The buffer that was just committed and, while its page flip is pending, the one
+ * that's still on screen can't be used. Of the remaining ones, the one that has been
+ * off-screen the longest is picked.
+ *
+ * @param flip_pending Whether the page flip of the last commit is still pending.
+ * @returns The index of the new front buffer, or -1 if there's no free buffer
+ *   (only possible with two buffers while the page flip is pending). In that case,
+ *   wait for the page flip and try again.
+ */
+int scanout_buffers_select_next(struct scanout_buffers *buffers, bool flip_pending);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _FLUTTERPI_INCLUDE_TASK_QUEUE_H
+#define _FLUTTERPI_INCLUDE_TASK_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <collection.h>
+
+/**
+ * @brief A lock-free queue of callbacks that any thread can post to and a single
+ * consumer thread executes, in the order they were posted.
+ *
+ * @ref wakeup_fd is an eventfd that becomes readable whenever there are tasks to run.
+ * Only the post that makes the queue non-empty writes to it, so posting is cheap
+ * no matter how long the consumer takes to run the tasks.
+ */
+struct task_queue {
+    struct mpsc_queue queue;
+    int wakeup_fd;
+
+    /// When the queue last went from empty to non-empty (CLOCK_MONOTONIC, ns), or 0 once it was emptied.
+    /// Only written by the post that makes the queue non-empty and by the consumer, see @ref task_queue_get_pending_since.
+    atomic_uint_fast64_t pending_since;
+};
+
+int task_queue_init(struct task_queue *queue);
+
+/**
+ * @brief Close the wakeup fd. Tasks that are still queued are dropped without being executed.
+ */
+void task_queue_deinit(struct task_queue *queue);
+
+/**
+ * @brief Queue @ref callback to be called with @ref userdata on the consumer thread. Thread-safe.
+ *
+ * @returns 0 if the task was queued, in which case @ref callback will be called with @ref userdata.
+ *   An error means the task was not queued and the caller still owns @ref userdata.
+ */
+int task_queue_post(struct task_queue *queue, int (*callback)(void *userdata), void *userdata);
+
+/**
+ * @brief Run all tasks that were queued before this call. Must only be called by the consumer,
+ * when @ref wakeup_fd is readable.
+ *
+ * Tasks that are posted while the batch is running are left for the next call,
+ * and @ref wakeup_fd is re-armed for them.
+ *
+ * @returns 0 on success, or the errno of reading the wakeup fd.
+ */
+int task_queue_run(struct task_queue *queue);
+
+static inline size_t task_queue_get_length(struct task_queue *queue) {
+    return mpsc_queue_get_length(&queue->queue);
+}
+
+/**
+ * @brief Since when there have been tasks waiting in the queue (CLOCK_MONOTONIC, ns), or 0 if there are none. Thread-safe.
+ *
+ * A producer publishes the time right after its task was queued, so for a task that's being posted
+ * right now, this can be 0, or slightly later than a timestamp the caller took before.
+ */
+static inline uint64_t task_queue_get_pending_since(struct task_queue *queue) {
+    if (mpsc_queue_get_length(&queue->queue) == 0) {
+        return 0;
+    }
+
+    return atomic_load_explicit(&queue->pending_since, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef _FLUTTERPI_INCLUDE_THREAD_CONFIG_H
+#define _FLUTTERPI_INCLUDE_THREAD_CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+
+/**
+ * @brief Scheduling policy, priority and CPU affinity that should be applied to a thread.
+ */
+struct thread_config {
+    bool has_sched_policy;
+
+    /**
+     * @brief One of SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO or SCHED_RR.
+     */
+    int sched_policy;
+
+    /**
+     * @brief For SCHED_FIFO and SCHED_RR, the realtime priority (1-99).
+     * For SCHED_OTHER and SCHED_BATCH, the nice value (-20 - 19).
+     */
+    int sched_priority;
+
+    bool has_affinity;
+
+    /**
+     * @brief Bit i is set if the thread may run on CPU i.
+     * Only the first 64 CPUs can be selected, which is plenty for the boards we run on.
+     */
+    uint64_t affinity;
+
+    /**
+     * @brief If true, failing to apply the scheduling policy is not reported as an error.
+     * Used for the built-in defaults, which need privileges flutter-pi might not have.
+     */
+    bool is_sched_optional;
+};
+
+#define THREAD_CONFIG_INITIALIZER \
+    ((struct thread_config) { \
+        .has_sched_policy = false, \
+        .sched_policy = SCHED_OTHER, \
+        .sched_priority = 0, \
+        .has_affinity = false, \
+        .affinity = 0, \
+        .is_sched_optional = false \
+    })
+
+/**
+ * @brief Parse a scheduling policy of the form "<policy>[:<priority>]" into @ref config.
+ *
+ * <policy> is one of "other", "batch", "idle", "fifo" or "rr".
+ * <priority> is the realtime priority for "fifo" and "rr", or the nice value for "other" and "batch".
+ *
+ * Examples: "fifo:10", "other:-5", "idle"
+ *
+ * @returns 0 on success, EINVAL if @ref str is not a valid scheduling policy.
+ */
+int thread_config_parse_sched(struct thread_config *config, const char *str);
+
+/**
+ * @brief Parse a CPU list of the form "0,2-3" into the affinity mask of @ref config.
+ *
+ * @returns 0 on success, EINVAL if @ref str is not a valid CPU list.
+ */
+int thread_config_parse_cpus(struct thread_config *config, const char *str);
+
+/**
+ * @brief Apply @ref config to the calling thread.
+ *
+ * Elevated priorities usually require CAP_SYS_NICE. Failures are logged
+ * and returned, but the thread keeps running with its old settings.
+ */
+int thread_config_apply(const struct thread_config *config, const char *thread_name);
+
+#endif
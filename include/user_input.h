@@ -126,6 +126,12 @@ void user_input_set_transform(
     unsigned int display_height
 );
 
+/**
+ * @brief Set the factor the flutter view is scaled down by relative to the display.
+ * Device coordinates are multiplied by it after they were transformed using the display_to_view_transform.
+ */
+void user_input_set_render_scale(struct user_input *input, double render_scale);
+
 /**
  * @brief Returns a filedescriptor used for input event notification. The returned
  * filedescriptor should be listened to with EPOLLIN | EPOLLRDHUP | EPOLLPRI or equivalent.
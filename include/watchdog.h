@@ -0,0 +1,102 @@
+#ifndef _FLUTTERPI_INCLUDE_WATCHDOG_H
+#define _FLUTTERPI_INCLUDE_WATCHDOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Detects main loop callbacks that block the platform thread for too long.
+ *
+ * The platform thread marks the start and end of every callback using
+ * @ref watchdog_enter and @ref watchdog_leave. A separate watchdog thread
+ * periodically checks how long the current callback has been running and,
+ * once it exceeds the budget, logs what callback it is and, if enabled,
+ * dumps a backtrace of the platform thread.
+ *
+ * Callbacks can be nested (for example a platform task that synchronously
+ * handles a platform message). Only the outermost callback is timed and reported.
+ *
+ * @ref watchdog_enter and @ref watchdog_leave only have an effect on the
+ * thread that called @ref watchdog_init, so they can safely be called from
+ * code that runs on other threads too.
+ */
+
+enum watchdog_callback_kind {
+    kWatchdogPlatformTask,
+    kWatchdogEngineTask,
+    kWatchdogPlatformMessage,
+    kWatchdogEventSource,
+    kMax_WatchdogCallbackKind
+};
+
+#define WATCHDOG_MAX_NAME_LENGTH 64
+
+struct watchdog_stats {
+    /**
+     * @brief How many (outermost) callbacks were executed while the watchdog was running.
+     */
+    uint64_t n_callbacks;
+
+    /**
+     * @brief How many callbacks exceeded the budget.
+     */
+    uint64_t n_stalls;
+
+    /**
+     * @brief The longest time a single callback was observed running, in nanoseconds.
+     */
+    uint64_t max_duration_ns;
+
+    /**
+     * @brief The callback that exceeded the budget most recently.
+     * Only valid if n_stalls > 0.
+     */
+    enum watchdog_callback_kind last_stall_kind;
+    const void *last_stall_function;
+    char last_stall_name[WATCHDOG_MAX_NAME_LENGTH];
+    uint64_t last_stall_duration_ns;
+};
+
+/**
+ * @brief Start the watchdog thread, watching callbacks executed on the calling thread.
+ *
+ * @param budget_ms How long a callback may run before it's reported. 0 disables the watchdog,
+ *   in which case @ref watchdog_enter and @ref watchdog_leave are no-ops.
+ * @param print_backtraces Whether to also print a backtrace of the watched thread when a callback is reported.
+ *   The backtrace is printed by the watched thread itself, from a SIGRTMIN handler, so this interrupts
+ *   whatever syscall it's blocked in at that time.
+ */
+int watchdog_init(unsigned int budget_ms, bool print_backtraces);
+
+/**
+ * @brief Stop the watchdog thread.
+ */
+void watchdog_deinit(void);
+
+/**
+ * @brief Mark the start of a callback on the watched thread.
+ *
+ * @param kind What kind of callback this is.
+ * @param function The function that's called, or NULL if not known. Only used for printing.
+ * @param name Optional name of the callback, for example the platform channel.
+ *   Copied, so it doesn't need to outlive the callback.
+ */
+void watchdog_enter(enum watchdog_callback_kind kind, const void *function, const char *name);
+
+/**
+ * @brief Mark the end of the callback started by the last @ref watchdog_enter.
+ */
+void watchdog_leave(void);
+
+/**
+ * @brief Get the watchdog statistics. Can be called from any thread.
+ */
+void watchdog_get_stats(struct watchdog_stats *stats_out);
+
+/**
+ * @brief Print the watchdog statistics. Only prints in debug builds.
+ */
+void watchdog_dump_stats(void);
+
+#endif
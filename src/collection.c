@@ -530,4 +530,78 @@ int cpset_init(
 void cpset_deinit(struct concurrent_pointer_set *set) {
 	pthread_mutex_destroy(&set->mutex);
 	pset_deinit(&set->set);
-}
\ No newline at end of file
+}
+
+void mpsc_queue_init(struct mpsc_queue *queue) {
+	atomic_init(&queue->stub.next, NULL);
+	atomic_init(&queue->head, &queue->stub);
+	queue->tail = &queue->stub;
+	atomic_init(&queue->length, 0);
+}
+
+static void mpsc_queue_link(struct mpsc_queue *queue, struct mpsc_queue_node *node) {
+	struct mpsc_queue_node *prev;
+
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+
+	prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+
+	// Between the exchange above and this store, the queue is "broken",
+	// the consumer can't see @ref node yet. mpsc_queue_pop will return NULL in that case.
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+bool mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_queue_node *node) {
+	size_t length;
+
+	// Increment the length before linking, so the consumer
+	// can never observe a length smaller than the number of poppable nodes.
+	length = atomic_fetch_add_explicit(&queue->length, 1, memory_order_acq_rel);
+
+	mpsc_queue_link(queue, node);
+
+	return length == 0;
+}
+
+struct mpsc_queue_node *mpsc_queue_pop(struct mpsc_queue *queue) {
+	struct mpsc_queue_node *tail, *next, *head;
+
+	tail = queue->tail;
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &queue->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+
+		queue->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+
+	if (next != NULL) {
+		queue->tail = next;
+		goto out_return_tail;
+	}
+
+	head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail != head) {
+		// a producer is in the middle of pushing.
+		return NULL;
+	}
+
+	// tail is the last node in the queue. Push the stub node
+	// so we can pop tail without leaving the queue without a node.
+	mpsc_queue_link(queue, &queue->stub);
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next == NULL) {
+		return NULL;
+	}
+
+	queue->tail = next;
+
+	out_return_tail:
+	atomic_fetch_sub_explicit(&queue->length, 1, memory_order_acq_rel);
+	return tail;
+}
@@ -3,6 +3,8 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <math.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -20,9 +22,20 @@
 #include <collection.h>
 #include <compositor.h>
 #include <cursor.h>
+#include <object_pool.h>
+#include <pixel_format.h>
 
 FILE_DESCR("compositor")
 
+/// The pixel format of the No-GBM rendertargets. They're used for overlay planes,
+/// so unlike the window surface they always need an alpha channel.
+#define RENDERTARGET_NOGBM_PIXFMT kARGB8888
+
+/// Make a GL call and count it in the EGL stats of the compositor.
+#define COUNT_GL(call) (compositor.egl_stats.n_gl_calls++, (call))
+
+static struct object_pool backing_store_pool = OBJECT_POOL_INITIALIZER("backing stores", sizeof(struct flutterpi_backing_store), 16);
+
 struct view_cb_data {
 	int64_t view_id;
 	platform_view_mount_cb mount;
@@ -44,8 +57,24 @@ struct compositor compositor = {
 	.cbs = CPSET_INITIALIZER(CPSET_DEFAULT_MAX_SIZE),
 	.has_applied_modeset = false,
 	.should_create_window_surface_backing_store = true,
-	.stale_rendertargets = CPSET_INITIALIZER(CPSET_DEFAULT_MAX_SIZE),
-	.do_blocking_atomic_commits = true
+	.rendertarget_pool = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.n_targets = 0,
+		.n_bytes = 0,
+		.max_bytes = 0
+	},
+	.do_blocking_atomic_commits = true,
+	.flip_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.has_pending_flip = false,
+	.overlay_buffer_depth = RENDERTARGET_NOGBM_MIN_BUFFERS,
+	.can_test_plane_assignments = true,
+	.plane_assignment_cache = {
+		.is_valid = false
+	},
+	.use_explicit_fencing = false,
+	.out_fence_fd = -1,
+	.overlay_modifier = DRM_FORMAT_MOD_INVALID,
+	.n_last_layers = -1
 };
 
 static struct view_cb_data *get_cbs_for_view_id_locked(int64_t view_id) {
@@ -71,21 +100,226 @@ static struct view_cb_data *get_cbs_for_view_id(int64_t view_id) {
 }
 
 /**
- * @brief Destroy all the rendertargets in the stale rendertarget cache.
+ * @brief Take the most recently used rendertarget with the given properties out of the pool.
+ * @returns The rendertarget, or NULL if there's none.
  */
-static int destroy_stale_rendertargets(void) {
+static struct rendertarget *rendertarget_pool_take(
+	struct rendertarget_pool *pool,
+	bool is_gbm,
+	int width,
+	int height,
+	uint32_t format,
+	uint64_t modifier
+) {
 	struct rendertarget *target;
 
-	cpset_lock(&compositor.stale_rendertargets);
+	pthread_mutex_lock(&pool->mutex);
+
+	target = NULL;
+	for (int i = pool->n_targets - 1; i >= 0; i--) {
+		struct rendertarget *candidate = pool->targets[i];
+
+		// With --dynamic-render-scale, the engine renders smaller frames into the same window surface.
+		if ((candidate->is_gbm == is_gbm) &&
+			(((candidate->width == width) && (candidate->height == height)) ||
+			 (candidate->is_gbm && flutterpi.display.has_dynamic_render_scale && (width <= candidate->width) && (height <= candidate->height))) &&
+			(candidate->format == format) && (candidate->modifier == modifier)) {
+			target = candidate;
+			pool->n_bytes -= target->n_bytes;
+			pool->n_targets--;
+			memmove(pool->targets + i, pool->targets + i + 1, (pool->n_targets - i) * sizeof(*pool->targets));
+			break;
+		}
+	}
 
-	for_each_pointer_in_cpset(&compositor.stale_rendertargets, target) {
-		target->destroy(target);
-		target = NULL;
+	if (target != NULL) {
+		pool->n_hits++;
+	} else {
+		pool->n_misses++;
 	}
 
-	cpset_unlock(&compositor.stale_rendertargets);
+	pthread_mutex_unlock(&pool->mutex);
 
-	return 0;
+	return target;
+}
+
+/**
+ * @brief Put a rendertarget flutter doesn't use anymore into the pool, evicting the least
+ * recently used no-GBM rendertargets if the pool is full.
+ *
+ * Evicted rendertargets are destroyed, so this must be called on a thread where
+ * the flutter rendering EGL context is current.
+ */
+static void rendertarget_pool_put(struct rendertarget_pool *pool, struct rendertarget *target) {
+	struct rendertarget *evicted[RENDERTARGET_POOL_MAX_TARGETS + 1];
+	int n_evicted;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (int i = 0; i < pool->n_targets; i++) {
+		if (pool->targets[i] == target) {
+			pthread_mutex_unlock(&pool->mutex);
+			return;
+		}
+	}
+
+	n_evicted = 0;
+	while ((pool->n_targets == RENDERTARGET_POOL_MAX_TARGETS) || (pool->n_targets > 0 && pool->n_bytes + target->n_bytes > pool->max_bytes)) {
+		int i;
+
+		for (i = 0; i < pool->n_targets; i++) {
+			if (!pool->targets[i]->is_gbm) {
+				break;
+			}
+		}
+
+		if (i == pool->n_targets) {
+			break;
+		}
+
+		evicted[n_evicted++] = pool->targets[i];
+		pool->n_bytes -= pool->targets[i]->n_bytes;
+		pool->n_targets--;
+		memmove(pool->targets + i, pool->targets + i + 1, (pool->n_targets - i) * sizeof(*pool->targets));
+		pool->n_evictions++;
+	}
+
+	// Only possible if the pool is full of GBM rendertargets, which can't happen,
+	// or if target alone is larger than max_bytes.
+	if ((pool->n_targets == RENDERTARGET_POOL_MAX_TARGETS) || (!target->is_gbm && pool->n_bytes + target->n_bytes > pool->max_bytes)) {
+		evicted[n_evicted++] = target;
+		pool->n_evictions++;
+	} else {
+		pool->targets[pool->n_targets++] = target;
+		pool->n_bytes += target->n_bytes;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < n_evicted; i++) {
+		evicted[i]->destroy(evicted[i]);
+	}
+}
+
+/**
+ * @brief Wait until the page flip of the last non-blocking commit has completed.
+ * Called on the raster thread.
+ *
+ * @returns How long we had to wait, in nanoseconds.
+ */
+static uint64_t wait_for_pending_flip(struct compositor *compositor) {
+	struct timespec deadline;
+	uint64_t start, deadline_ns;
+	int ok;
+
+	pthread_mutex_lock(&compositor->flip_mutex);
+	if (!compositor->has_pending_flip) {
+		pthread_mutex_unlock(&compositor->flip_mutex);
+		return 0;
+	}
+
+	start = get_monotonic_time();
+
+	// If the page flip event got lost somehow, don't hang forever.
+	deadline_ns = start + 100000000ull;
+	deadline.tv_sec = deadline_ns / 1000000000ull;
+	deadline.tv_nsec = deadline_ns % 1000000000ull;
+
+	while (compositor->has_pending_flip) {
+		ok = pthread_cond_timedwait(&compositor->flip_completed, &compositor->flip_mutex, &deadline);
+		if (ok == ETIMEDOUT) {
+			LOG_ERROR("Timed out waiting for the page flip of the last frame. Committing anyway.\n");
+			compositor->has_pending_flip = false;
+		}
+	}
+	pthread_mutex_unlock(&compositor->flip_mutex);
+
+	return get_monotonic_time() - start;
+}
+
+static bool has_pending_flip(struct compositor *compositor) {
+	bool result;
+
+	pthread_mutex_lock(&compositor->flip_mutex);
+	result = compositor->has_pending_flip;
+	pthread_mutex_unlock(&compositor->flip_mutex);
+
+	return result;
+}
+
+static void set_pending_flip(struct compositor *compositor, bool has_pending_flip) {
+	pthread_mutex_lock(&compositor->flip_mutex);
+	compositor->has_pending_flip = has_pending_flip;
+	if (!has_pending_flip) {
+		pthread_cond_broadcast(&compositor->flip_completed);
+	}
+	pthread_mutex_unlock(&compositor->flip_mutex);
+}
+
+/**
+ * @brief Create a sync file fd that signals once the GPU has finished all
+ * rendering commands issued in the current context so far.
+ * Needs EGL_ANDROID_native_fence_sync.
+ *
+ * @returns The fence fd, or -1 if it couldn't be created.
+ */
+static int create_render_fence(void) {
+	static const EGLint attribs[] = {
+		EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+		EGL_NONE
+	};
+	EGLSyncKHR sync;
+	int fd;
+
+	sync = flutterpi.egl.createSyncKHR(flutterpi.egl.display, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+	if (sync == EGL_NO_SYNC_KHR) {
+		LOG_ERROR("Could not create EGL fence. eglCreateSyncKHR: 0x%08X\n", eglGetError());
+		return -1;
+	}
+
+	// the sync file is only created once the fence was flushed to the GPU.
+	glFlush();
+
+	fd = flutterpi.egl.dupNativeFenceFDANDROID(flutterpi.egl.display, sync);
+	if (fd == EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+		LOG_ERROR("Could not export EGL fence. eglDupNativeFenceFDANDROID: 0x%08X\n", eglGetError());
+	}
+
+	flutterpi.egl.destroySyncKHR(flutterpi.egl.display, sync);
+
+	return fd;
+}
+
+static bool is_fence_signaled(int fence_fd) {
+	struct pollfd fd = {.fd = fence_fd, .events = POLLIN};
+
+	return poll(&fd, 1, 0) == 1;
+}
+
+/**
+ * @brief Wait until the OUT_FENCE_PTR fence of the last commit signaled.
+ * If it doesn't signal in time, it's dropped and we rely on the page flip event again.
+ *
+ * @returns How long we had to wait, in nanoseconds.
+ */
+static uint64_t wait_for_out_fence(struct compositor *compositor) {
+	struct pollfd fd = {.fd = compositor->out_fence_fd, .events = POLLIN};
+	uint64_t start;
+	int ok;
+
+	start = get_monotonic_time();
+
+	do {
+		ok = poll(&fd, 1, 100);
+	} while ((ok < 0) && (errno == EINTR));
+
+	if (ok != 1) {
+		LOG_ERROR("Timed out waiting for the display to release the buffers of the last frame.\n");
+		close(compositor->out_fence_fd);
+		compositor->out_fence_fd = -1;
+	}
+
+	return get_monotonic_time() - start;
 }
 
 static void destroy_gbm_bo(
@@ -102,6 +336,15 @@ static void destroy_gbm_bo(
 	free(fb);
 }
 
+/**
+ * @brief The flags for registering a buffer with this modifier using drmModeAddFB2WithModifiers.
+ * DRM_FORMAT_MOD_LINEAR is an explicit modifier too, only DRM_FORMAT_MOD_INVALID
+ * leaves the layout up to the driver.
+ */
+static uint32_t get_drm_fb_flags(uint64_t modifier) {
+	return modifier != DRM_FORMAT_MOD_INVALID ? DRM_MODE_FB_MODIFIERS : 0;
+}
+
 /**
  * @brief Get a DRM FB id for this GBM BO, so we can display it.
  */
@@ -128,14 +371,12 @@ static uint32_t gbm_bo_get_drm_fb_id(struct gbm_bo *bo) {
 
 	for (int i = 0; i < num_planes; i++) {
 		strides[i] = gbm_bo_get_stride_for_plane(bo, i);
-		handles[i] = gbm_bo_get_handle(bo).u32;
+		handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
 		offsets[i] = gbm_bo_get_offset(bo, i);
 		modifiers[i] = modifiers[0];
 	}
 
-	if (modifiers[0]) {
-		flags = DRM_MODE_FB_MODIFIERS;
-	}
+	flags = get_drm_fb_flags(modifiers[0]);
 
 	ok = drmModeAddFB2WithModifiers(flutterpi.drm.drmdev->fd, width, height, format, handles, strides, offsets, modifiers, &fb->fb_id, flags);
 
@@ -162,40 +403,163 @@ static uint32_t gbm_bo_get_drm_fb_id(struct gbm_bo *bo) {
 }
 
 
+/**
+ * @brief Allocate a GBM BO with an explicit modifier and import it into EGL as a dmabuf.
+ * Also returns the buffer layout, for registering it as a DRM framebuffer.
+ */
+static int create_gbm_egl_image(
+	size_t width,
+	size_t height,
+	enum pixfmt pixfmt,
+	uint64_t modifier,
+	struct drm_rbo *fbo,
+	uint32_t handles[4],
+	uint32_t strides[4],
+	uint32_t offsets[4],
+	uint64_t modifiers[4]
+) {
+	static const EGLint plane_attribs[4][5] = {
+		{EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT},
+		{EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT},
+		{EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT},
+		{EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT, EGL_DMA_BUF_PLANE3_PITCH_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT}
+	};
+	EGLint attribs[6 + 4*10 + 1];
+	struct gbm_bo *bo;
+	EGLImage image;
+	int n_planes, n_attribs, fd;
+
+	bo = gbm_bo_create_with_modifiers(flutterpi.gbm.device, width, height, get_pixfmt_info(pixfmt)->gbm_format, &modifier, 1);
+	if (bo == NULL) {
+		LOG_ERROR("Could not create GBM BO for flutter backing store. gbm_bo_create_with_modifiers: %s\n", strerror(errno));
+		return EIO;
+	}
+
+	n_planes = gbm_bo_get_plane_count(bo);
+	if ((n_planes < 1) || (n_planes > 4)) {
+		LOG_ERROR("GBM BO for flutter backing store has an unsupported number of planes: %d\n", n_planes);
+		gbm_bo_destroy(bo);
+		return EINVAL;
+	}
+
+	// all planes of a GBM BO are in the same dmabuf.
+	fd = gbm_bo_get_fd(bo);
+	if (fd < 0) {
+		LOG_ERROR("Could not export GBM BO as dmabuf. gbm_bo_get_fd: %s\n", strerror(errno));
+		gbm_bo_destroy(bo);
+		return EIO;
+	}
+
+	n_attribs = 0;
+	attribs[n_attribs++] = EGL_WIDTH;
+	attribs[n_attribs++] = width;
+	attribs[n_attribs++] = EGL_HEIGHT;
+	attribs[n_attribs++] = height;
+	attribs[n_attribs++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[n_attribs++] = get_pixfmt_info(pixfmt)->drm_format;
+
+	for (int i = 0; i < n_planes; i++) {
+		handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+		strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+		offsets[i] = gbm_bo_get_offset(bo, i);
+		modifiers[i] = modifier;
+
+		attribs[n_attribs++] = plane_attribs[i][0];
+		attribs[n_attribs++] = fd;
+		attribs[n_attribs++] = plane_attribs[i][1];
+		attribs[n_attribs++] = offsets[i];
+		attribs[n_attribs++] = plane_attribs[i][2];
+		attribs[n_attribs++] = strides[i];
+		attribs[n_attribs++] = plane_attribs[i][3];
+		attribs[n_attribs++] = (EGLint) (modifier & 0xFFFFFFFFull);
+		attribs[n_attribs++] = plane_attribs[i][4];
+		attribs[n_attribs++] = (EGLint) (modifier >> 32);
+	}
+
+	attribs[n_attribs++] = EGL_NONE;
+
+	eglGetError();
+
+	image = flutterpi.egl.createImageKHR(flutterpi.egl.display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+
+	// the EGL image keeps its own reference to the dmabuf.
+	close(fd);
+
+	if (image == EGL_NO_IMAGE_KHR) {
+		LOG_ERROR("Could not import GBM BO as EGL image. eglCreateImageKHR: 0x%08X\n", eglGetError());
+		gbm_bo_destroy(bo);
+		return EIO;
+	}
+
+	fbo->bo = bo;
+	fbo->egl_image = image;
+	fbo->gem_handle = handles[0];
+	fbo->gem_stride = strides[0];
+
+	return 0;
+}
+
 /**
  * @brief Create a GL renderbuffer that is backed by a DRM buffer-object and registered as a DRM framebuffer
+ *
+ * @param modifier The modifier of the buffer. If it's DRM_FORMAT_MOD_INVALID, the buffer is created
+ *   using eglCreateDRMImageMESA, which chooses the layout implicitly.
  */
 static int create_drm_rbo(
 	size_t width,
 	size_t height,
+	enum pixfmt pixfmt,
+	uint64_t modifier,
 	struct drm_rbo *out
 ) {
+	uint32_t handles[4] = {0}, strides[4] = {0}, offsets[4] = {0};
+	uint64_t modifiers[4] = {0};
 	struct drm_rbo fbo;
 	EGLint egl_error;
 	GLenum gl_error;
 	int ok;
 
-	eglGetError();
-	glGetError();
+	fbo.bo = NULL;
 
-	fbo.egl_image = flutterpi.egl.createDRMImageMESA(flutterpi.egl.display, (const EGLint[]) {
-		EGL_WIDTH, width,
-		EGL_HEIGHT, height,
-		EGL_DRM_BUFFER_FORMAT_MESA, EGL_DRM_BUFFER_FORMAT_ARGB32_MESA,
-		EGL_DRM_BUFFER_USE_MESA, EGL_DRM_BUFFER_USE_SCANOUT_MESA,
-		EGL_NONE
-	});
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		LOG_ERROR("error creating DRM EGL Image for flutter backing store, eglCreateDRMImageMESA: %" PRId32 "\n", egl_error);
-		return EINVAL;
-	}
+	if (modifier != DRM_FORMAT_MOD_INVALID) {
+		ok = create_gbm_egl_image(width, height, pixfmt, modifier, &fbo, handles, strides, offsets, modifiers);
+		if (ok != 0) {
+			return ok;
+		}
+	} else {
+		// MESA_drm_image only knows about 32-bit ARGB buffers.
+		// XRGB8888 has the same memory layout, the alpha channel is just ignored on scanout.
+		if ((pixfmt != kARGB8888) && (pixfmt != kXRGB8888)) {
+			LOG_ERROR("Pixel format %s is not supported for DRM EGL Images.\n", get_pixfmt_info(pixfmt)->name);
+			return EINVAL;
+		}
 
-	flutterpi.egl.exportDRMImageMESA(flutterpi.egl.display, fbo.egl_image, NULL, (EGLint*) &fbo.gem_handle, (EGLint*) &fbo.gem_stride);
-	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
-		LOG_ERROR("error getting handle & stride for DRM EGL Image, eglExportDRMImageMESA: %d\n", egl_error);
-		return EINVAL;
+		eglGetError();
+
+		fbo.egl_image = flutterpi.egl.createDRMImageMESA(flutterpi.egl.display, (const EGLint[]) {
+			EGL_WIDTH, width,
+			EGL_HEIGHT, height,
+			EGL_DRM_BUFFER_FORMAT_MESA, EGL_DRM_BUFFER_FORMAT_ARGB32_MESA,
+			EGL_DRM_BUFFER_USE_MESA, EGL_DRM_BUFFER_USE_SCANOUT_MESA,
+			EGL_NONE
+		});
+		if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+			LOG_ERROR("error creating DRM EGL Image for flutter backing store, eglCreateDRMImageMESA: %" PRId32 "\n", egl_error);
+			return EINVAL;
+		}
+
+		flutterpi.egl.exportDRMImageMESA(flutterpi.egl.display, fbo.egl_image, NULL, (EGLint*) &fbo.gem_handle, (EGLint*) &fbo.gem_stride);
+		if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+			LOG_ERROR("error getting handle & stride for DRM EGL Image, eglExportDRMImageMESA: %d\n", egl_error);
+			return EINVAL;
+		}
+
+		handles[0] = fbo.gem_handle;
+		strides[0] = fbo.gem_stride;
 	}
 
+	glGetError();
+
 	glGenRenderbuffers(1, &fbo.gl_rbo_id);
 	if ((gl_error = glGetError())) {
 		LOG_ERROR("error generating renderbuffers for flutter backing store, glGenRenderbuffers: %u\n", gl_error);
@@ -241,28 +605,20 @@ static int create_drm_rbo(
 	
 	// glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-	ok = drmModeAddFB2(
+	ok = drmModeAddFB2WithModifiers(
 		flutterpi.drm.drmdev->fd,
 		width,
 		height,
-		DRM_FORMAT_ARGB8888,
-		(const uint32_t*) &(uint32_t[4]) {
-			fbo.gem_handle,
-			0,
-			0,
-			0
-		},
-		(const uint32_t*) &(uint32_t[4]) {
-			fbo.gem_stride, 0, 0, 0
-		},
-		(const uint32_t*) &(uint32_t[4]) {
-			0, 0, 0, 0
-		},
+		get_pixfmt_info(pixfmt)->drm_format,
+		handles,
+		strides,
+		offsets,
+		modifiers,
 		&fbo.drm_fb_id,
-		0
+		get_drm_fb_flags(modifier)
 	);
 	if (ok == -1) {
-		LOG_ERROR("Could not make DRM fb from EGL Image, drmModeAddFB2: %s", strerror(errno));
+		LOG_ERROR("Could not make DRM fb from EGL Image, drmModeAddFB2WithModifiers: %s", strerror(errno));
 		return errno;
 	}
 
@@ -280,23 +636,24 @@ static int attach_drm_rbo_to_fbo(
 ) {
 	GLenum gl_error;
 
+	compositor.egl_stats.n_egl_calls++;
 	eglGetError();
-	glGetError();
+	COUNT_GL(glGetError());
 
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo_id);
-	if ((gl_error = glGetError())) {
+	COUNT_GL(glBindFramebuffer(GL_FRAMEBUFFER, fbo_id));
+	if ((gl_error = COUNT_GL(glGetError()))) {
 		LOG_ERROR("error binding FBO for attaching the renderbuffer, glBindFramebuffer: %d\n", gl_error);
 		return EINVAL;
 	}
 
-	glBindRenderbuffer(GL_RENDERBUFFER, rbo->gl_rbo_id);
-	if ((gl_error = glGetError())) {
+	COUNT_GL(glBindRenderbuffer(GL_RENDERBUFFER, rbo->gl_rbo_id));
+	if ((gl_error = COUNT_GL(glGetError()))) {
 		LOG_ERROR("error binding renderbuffer, glBindRenderbuffer: %d\n", gl_error);
 		return EINVAL;
 	}
 
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo->gl_rbo_id);
-	if ((gl_error = glGetError())) {
+	COUNT_GL(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo->gl_rbo_id));
+	if ((gl_error = COUNT_GL(glGetError()))) {
 		LOG_ERROR("error attaching renderbuffer to FBO, glFramebufferRenderbuffer: %d\n", gl_error);
 		return EINVAL;
 	}
@@ -331,16 +688,87 @@ static void destroy_drm_rbo(
 	if (egl_error = eglGetError(), egl_error != EGL_SUCCESS) {
 		LOG_ERROR("error destroying EGL image, eglDestroyImage: 0x%08X\n", egl_error);
 	}
+
+	if (rbo->bo != NULL) {
+		gbm_bo_destroy(rbo->bo);
+	}
+}
+
+/**
+ * @brief Make @ref next_front_bo the new front buffer of @ref gbm_target.
+ *
+ * Must only be called once the page flip to the current front buffer has completed
+ * (@ref on_present_layers waits for that). At that point, the buffer before it
+ * is guaranteed to be off-screen and can be given back to the GBM surface.
+ * The current front buffer itself can still be on screen until the flip to @ref next_front_bo
+ * completes, so it's only released on the next call.
+ */
+static void rendertarget_gbm_retire_front_bo(struct rendertarget_gbm *gbm_target, struct gbm_bo *next_front_bo) {
+	if (gbm_target->previous_front_bo != NULL) {
+		gbm_surface_release_buffer(gbm_target->gbm_surface, gbm_target->previous_front_bo);
+	}
+	gbm_target->previous_front_bo = gbm_target->current_front_bo;
+	gbm_target->current_front_bo = next_front_bo;
+}
+
+/**
+ * @brief The DRM rotation for a plane presenting this rendertarget.
+ *
+ * No-GBM rendertargets are rendered upside down, so they're reflected in Y-direction.
+ * If the display controller rotates the view by 180 degrees (see flutterpi.view.plane_rotation),
+ * that's combined into a reflection in X-direction.
+ */
+static uint32_t get_rendertarget_rotation(const struct rendertarget *target) {
+	bool is_rotated = flutterpi.view.plane_rotation == DRM_MODE_ROTATE_180;
+
+	if (target->is_gbm) {
+		return is_rotated ? DRM_MODE_ROTATE_180 : DRM_MODE_ROTATE_0;
+	} else {
+		return is_rotated ? DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_X : DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y;
+	}
+}
+
+/**
+ * @brief Transform the rect of a layer from view coordinates into the CRTC coordinates
+ * of the plane it's presented on, which differ if the display controller rotates the planes
+ * or scales them up to the display size (see --render-scale).
+ */
+static void view_to_crtc_rect(int *x, int *y, int *width, int *height) {
+	double scale = compositor.frame_scale;
+	int right, bottom;
+
+	if (flutterpi.view.plane_rotation == DRM_MODE_ROTATE_180) {
+		*x = compositor.frame_width - *x - *width;
+		*y = compositor.frame_height - *y - *height;
+	}
+
+	if (scale != 1.0) {
+		// scale the edges instead of the size, so adjacent layers stay adjacent.
+		right = min((int) round((*x + *width) / scale), (int) flutterpi.display.width);
+		bottom = min((int) round((*y + *height) / scale), (int) flutterpi.display.height);
+		*x = (int) round(*x / scale);
+		*y = (int) round(*y / scale);
+		*width = max(1, right - *x);
+		*height = max(1, bottom - *y);
+	}
+}
+
+static void rendertarget_destroy_damage_blob(struct rendertarget *target) {
+	if (target->damage_blob_id != 0) {
+		drmModeDestroyPropertyBlob(target->compositor->drmdev->fd, target->damage_blob_id);
+		target->damage_blob_id = 0;
+	}
 }
 
 static void rendertarget_gbm_destroy(struct rendertarget *target) {
+	rendertarget_destroy_damage_blob(target);
 	free(target);
 }
 
 static int rendertarget_gbm_present(
 	struct rendertarget *target,
 	struct drmdev_atomic_req *atomic_req,
-	uint32_t drm_plane_id,
+	struct drm_plane *plane,
 	int offset_x,
 	int offset_y,
 	int width,
@@ -351,7 +779,6 @@ static int rendertarget_gbm_present(
 	struct gbm_bo *next_front_bo;
 	uint32_t next_front_fb_id;
 	bool supported;
-	int ok;
 
 	(void)offset_x;
 	(void)offset_y;
@@ -360,25 +787,30 @@ static int rendertarget_gbm_present(
 
 	gbm_target = &target->gbm;
 
-	next_front_bo = gbm_surface_lock_front_buffer(gbm_target->gbm_surface);
+	// Without a swap, there's no new buffer to lock. What's on screen is still up to date.
+	if (gbm_target->has_new_front_bo) {
+		next_front_bo = gbm_surface_lock_front_buffer(gbm_target->gbm_surface);
+	} else {
+		next_front_bo = gbm_target->current_front_bo;
+	}
 	next_front_fb_id = gbm_bo_get_drm_fb_id(next_front_bo);
 
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "FB_ID", next_front_fb_id);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_ID", target->compositor->drmdev->selected_crtc->crtc->crtc_id);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "SRC_X", 0);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "SRC_Y", 0);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "SRC_W", ((uint16_t) flutterpi.display.width) << 16);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "SRC_H", ((uint16_t) flutterpi.display.height) << 16);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_X", 0);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_Y", 0);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_W", flutterpi.display.width);
-	drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "CRTC_H", flutterpi.display.height);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropFbId, next_front_fb_id);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropCrtcId, target->compositor->drmdev->selected_crtc->crtc->crtc_id);
+	// A frame smaller than the window surface is drawn into its bottom-left corner.
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropSrcX, 0);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropSrcY, ((uint16_t) (target->height - target->compositor->frame_height)) << 16);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropSrcW, ((uint16_t) target->compositor->frame_width) << 16);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropSrcH, ((uint16_t) target->compositor->frame_height) << 16);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropCrtcX, 0);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropCrtcY, 0);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropCrtcW, flutterpi.display.width);
+	drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropCrtcH, flutterpi.display.height);
 
-	ok = drmdev_plane_supports_setting_rotation_value(atomic_req->drmdev, drm_plane_id, DRM_MODE_ROTATE_0, &supported);
-	if (ok != 0) return ok;
+	supported = drm_plane_supports_setting_rotation_value(plane, get_rendertarget_rotation(target));
 
 	if (supported) {
-		drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "rotation", DRM_MODE_ROTATE_0);
+		drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropRotation, get_rendertarget_rotation(target));
 	} else {
 		static bool printed = false;
 
@@ -392,11 +824,10 @@ static int rendertarget_gbm_present(
 		}
 	}
 	
-	ok = drmdev_plane_supports_setting_zpos_value(atomic_req->drmdev, drm_plane_id, zpos, &supported);
-	if (ok != 0) return ok;
+	supported = drm_plane_supports_setting_zpos_value(plane, zpos);
 
 	if (supported) {
-		drmdev_atomic_req_put_plane_property(atomic_req, drm_plane_id, "zpos", zpos);
+		drmdev_atomic_req_put_plane_prop(atomic_req, plane, kDrmPlanePropZpos, zpos);
 	} else {
 		static bool printed = false;
 
@@ -409,13 +840,9 @@ static int rendertarget_gbm_present(
 		}
 	}
 
-	// TODO: move this to the page flip handler.
-	// We can only be sure the buffer can be released when the buffer swap
-	// ocurred.
-	if (gbm_target->current_front_bo != NULL) {
-		gbm_surface_release_buffer(gbm_target->gbm_surface, gbm_target->current_front_bo);
+	if (gbm_target->has_new_front_bo) {
+		rendertarget_gbm_retire_front_bo(gbm_target, next_front_bo);
 	}
-	gbm_target->current_front_bo = (struct gbm_bo *) next_front_bo;
 
 	return 0;
 }
@@ -423,7 +850,7 @@ static int rendertarget_gbm_present(
 static int rendertarget_gbm_present_legacy(
 	struct rendertarget *target,
 	struct drmdev *drmdev,
-	uint32_t drm_plane_id,
+	struct drm_plane *plane,
 	int offset_x,
 	int offset_y,
 	int width,
@@ -444,9 +871,13 @@ static int rendertarget_gbm_present_legacy(
 
 	gbm_target = &target->gbm;
 
-	is_primary = drmdev_plane_get_type(drmdev, drm_plane_id) == DRM_PLANE_TYPE_PRIMARY;
+	is_primary = plane->type == DRM_PLANE_TYPE_PRIMARY;
 
-	next_front_bo = gbm_surface_lock_front_buffer(gbm_target->gbm_surface);
+	if (gbm_target->has_new_front_bo) {
+		next_front_bo = gbm_surface_lock_front_buffer(gbm_target->gbm_surface);
+	} else {
+		next_front_bo = gbm_target->current_front_bo;
+	}
 	next_front_fb_id = gbm_bo_get_drm_fb_id(next_front_bo);
 
 	if (is_primary) {
@@ -464,7 +895,7 @@ static int rendertarget_gbm_present_legacy(
 
 			drmdev_legacy_overlay_plane_pageflip(
 				drmdev,
-				drm_plane_id,
+				plane->plane->plane_id,
 				next_front_fb_id,
 				0,
 				0,
@@ -479,7 +910,7 @@ static int rendertarget_gbm_present_legacy(
 	} else {
 		drmdev_legacy_overlay_plane_pageflip(
 			drmdev,
-			drm_plane_id,
+			plane->plane->plane_id,
 			next_front_fb_id,
 			0,
 			0,
@@ -492,13 +923,9 @@ static int rendertarget_gbm_present_legacy(
 		);
 	}
 	
-	// TODO: move this to the page flip handler.
-	// We can only be sure the buffer can be released when the buffer swap
-	// ocurred.
-	if (gbm_target->current_front_bo != NULL) {
-		gbm_surface_release_buffer(gbm_target->gbm_surface, gbm_target->current_front_bo);
+	if (gbm_target->has_new_front_bo) {
+		rendertarget_gbm_retire_front_bo(gbm_target, next_front_bo);
 	}
-	gbm_target->current_front_bo = (struct gbm_bo *) next_front_bo;
 
 	return 0;
 }
@@ -528,9 +955,17 @@ static int rendertarget_gbm_new(
 		.compositor = compositor,
 		.gbm = {
 			.gbm_surface = flutterpi.gbm.surface,
-			.current_front_bo = NULL
+			.current_front_bo = NULL,
+			.previous_front_bo = NULL,
+			.has_new_front_bo = false
 		},
 		.gl_fbo_id = 0,
+		.width = flutterpi.display.render_width,
+		.height = flutterpi.display.render_height,
+		.format = flutterpi.gbm.format,
+		.modifier = flutterpi.gbm.modifier,
+		.n_bytes = 0,
+		.n_painted_rects = -1,
 		.destroy = rendertarget_gbm_destroy,
 		.present = rendertarget_gbm_present,
 		.present_legacy = rendertarget_gbm_present_legacy
@@ -542,16 +977,116 @@ static int rendertarget_gbm_new(
 }
 
 static void rendertarget_nogbm_destroy(struct rendertarget *target) {
+	rendertarget_destroy_damage_blob(target);
 	glDeleteFramebuffers(1, &target->nogbm.gl_fbo_id);
-	destroy_drm_rbo(target->nogbm.rbos + 1);
-	destroy_drm_rbo(target->nogbm.rbos + 0);
+	for (int i = target->nogbm.n_rbos - 1; i >= 0; i--) {
+		destroy_drm_rbo(target->nogbm.rbos + i);
+	}
 	free(target);
 }
 
+/**
+ * @brief Mark the rbo OpenGL just finished rendering into as presented,
+ * and return the DRM FB id for it.
+ */
+static uint32_t rendertarget_nogbm_present_front_rbo(struct rendertarget_nogbm *nogbm_target) {
+	nogbm_target->needs_next_rbo = true;
+
+	return nogbm_target->rbos[scanout_buffers_present_front(&nogbm_target->buffers)].drm_fb_id;
+}
+
+/**
+ * @brief Pick the rbo OpenGL should render the next frame into (see @ref scanout_buffers_select_next)
+ * and attach it to the FBO. Must be called after the frame presenting the current front rbo was committed.
+ *
+ * Only if every rbo is still queued for scanout (only possible with two buffers), this waits
+ * for the pending page flip, or for the out fence of the commit if there is one.
+ *
+ * @returns How long we had to wait for a free rbo, in nanoseconds.
+ */
+static uint64_t rendertarget_nogbm_select_next_rbo(struct rendertarget *target) {
+	struct rendertarget_nogbm *nogbm_target;
+	uint64_t stall_ns;
+	bool pending;
+	int next;
+
+	nogbm_target = &target->nogbm;
+	nogbm_target->needs_next_rbo = false;
+
+	stall_ns = 0;
+	while (true) {
+		// The out fence signals at the same time the page flip event is sent, but
+		// we don't need to wait for the platform thread to handle the event.
+		pending = has_pending_flip(target->compositor);
+		if (pending && (target->compositor->out_fence_fd >= 0)) {
+			pending = !is_fence_signaled(target->compositor->out_fence_fd);
+		}
+
+		next = scanout_buffers_select_next(&nogbm_target->buffers, pending);
+		if (next != -1) {
+			break;
+		}
+
+		if (target->compositor->out_fence_fd >= 0) {
+			stall_ns += wait_for_out_fence(target->compositor);
+		} else {
+			stall_ns += wait_for_pending_flip(target->compositor);
+		}
+	}
+
+	attach_drm_rbo_to_fbo(nogbm_target->gl_fbo_id, nogbm_target->rbos + next);
+
+	return stall_ns;
+}
+
+/**
+ * @brief The part of a buffer that's scanned out (src, in buffer pixels)
+ * and where it's shown on the CRTC.
+ */
+struct plane_rect {
+	int src_x, src_y, src_width, src_height;
+	int crtc_x, crtc_y, crtc_width, crtc_height;
+};
+
+/**
+ * @brief Get the plane rect for a no-GBM rendertarget positioned at the given offset (in view coordinates).
+ *
+ * Not all drivers accept planes that are partially off-screen, so the plane
+ * is cropped to the part of the rendertarget that's on screen.
+ *
+ * @returns false if no part of the rendertarget is on screen.
+ */
+static bool rendertarget_nogbm_get_plane_rect(const struct rendertarget *target, int offset_x, int offset_y, struct plane_rect *rect_out) {
+	int left, top, right, bottom;
+
+	left = max(offset_x, 0);
+	top = max(offset_y, 0);
+	right = min(offset_x + target->width, compositor.frame_width);
+	bottom = min(offset_y + target->height, compositor.frame_height);
+	if ((right <= left) || (bottom <= top)) {
+		return false;
+	}
+
+	// OpenGL renders bottom-up, so the rows of the buffer are stored upside down
+	// (the plane reflects them back). Cropping the top of the layer crops the bottom of the buffer.
+	rect_out->src_x = left - offset_x;
+	rect_out->src_y = offset_y + target->height - bottom;
+	rect_out->src_width = right - left;
+	rect_out->src_height = bottom - top;
+
+	rect_out->crtc_x = left;
+	rect_out->crtc_y = top;
+	rect_out->crtc_width = right - left;
+	rect_out->crtc_height = bottom - top;
+	view_to_crtc_rect(&rect_out->crtc_x, &rect_out->crtc_y, &rect_out->crtc_width, &rect_out->crtc_height);
+
+	return true;
+}
+
 static int rendertarget_nogbm_present(
 	struct rendertarget *target,
 	struct drmdev_atomic_req *req,
-	uint32_t drm_plane_id,
+	struct drm_plane *plane,
 	int offset_x,
 	int offset_y,
 	int width,
@@ -560,35 +1095,34 @@ static int rendertarget_nogbm_present(
 ) {
 	struct rendertarget_nogbm *nogbm_target;
 	bool supported;
-	int ok;
+	struct plane_rect rect;
 
-	(void)offset_x;
-	(void)offset_y;
 	(void)width;
 	(void)height;
 
 	nogbm_target = &target->nogbm;
 
-	nogbm_target->current_front_rbo ^= 1;
-	ok = attach_drm_rbo_to_fbo(nogbm_target->gl_fbo_id, nogbm_target->rbos + nogbm_target->current_front_rbo);
-	if (ok != 0) return ok;
-
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "FB_ID", nogbm_target->rbos[nogbm_target->current_front_rbo ^ 1].drm_fb_id);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_ID", target->compositor->drmdev->selected_crtc->crtc->crtc_id);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "SRC_X", 0);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "SRC_Y", 0);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "SRC_W", ((uint16_t) flutterpi.display.width) << 16);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "SRC_H", ((uint16_t) flutterpi.display.height) << 16);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_X", 0);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_Y", 0);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_W", flutterpi.display.width);
-	drmdev_atomic_req_put_plane_property(req, drm_plane_id, "CRTC_H", flutterpi.display.height);
+	// assign_planes doesn't give layers that are completely off-screen a plane.
+	if (!rendertarget_nogbm_get_plane_rect(target, offset_x, offset_y, &rect)) {
+		return EINVAL;
+	}
+
+	// the next rbo to render into is selected after the commit, see rendertarget_nogbm_select_next_rbo.
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropFbId, rendertarget_nogbm_present_front_rbo(nogbm_target));
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcId, target->compositor->drmdev->selected_crtc->crtc->crtc_id);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcX, ((uint16_t) rect.src_x) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcY, ((uint16_t) rect.src_y) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcW, ((uint16_t) rect.src_width) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcH, ((uint16_t) rect.src_height) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcX, rect.crtc_x);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcY, rect.crtc_y);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcW, rect.crtc_width);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcH, rect.crtc_height);
 	
-	ok = drmdev_plane_supports_setting_rotation_value(req->drmdev, drm_plane_id, DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y, &supported);
-	if (ok != 0) return ok;
+	supported = drm_plane_supports_setting_rotation_value(plane, get_rendertarget_rotation(target));
 	
 	if (supported) {
-		drmdev_atomic_req_put_plane_property(req, drm_plane_id, "rotation", DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y);
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropRotation, get_rendertarget_rotation(target));
 	} else {
 		static bool printed = false;
 
@@ -602,11 +1136,10 @@ static int rendertarget_nogbm_present(
 		}
 	}
 
-	ok = drmdev_plane_supports_setting_zpos_value(req->drmdev, drm_plane_id, zpos, &supported);
-	if (ok != 0) return ok;
+	supported = drm_plane_supports_setting_zpos_value(plane, zpos);
 	
 	if (supported) {
-		drmdev_atomic_req_put_plane_property(req, drm_plane_id, "zpos", zpos);
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropZpos, zpos);
 	} else {
 		static bool printed = false;
 
@@ -625,7 +1158,7 @@ static int rendertarget_nogbm_present(
 static int rendertarget_nogbm_present_legacy(
 	struct rendertarget *target,
 	struct drmdev *drmdev,
-	uint32_t drm_plane_id,
+	struct drm_plane *plane,
 	int offset_x,
 	int offset_y,
 	int width,
@@ -634,24 +1167,23 @@ static int rendertarget_nogbm_present_legacy(
 	bool set_mode
 ) {
 	struct rendertarget_nogbm *nogbm_target;
+	struct plane_rect rect;
 	uint32_t fb_id;
 	bool supported, is_primary;
-	int ok;
 
-	(void)offset_x;
-	(void)offset_y;
 	(void)width;
 	(void)height;
 
 	nogbm_target = &target->nogbm;
 
-	is_primary = drmdev_plane_get_type(drmdev, drm_plane_id) == DRM_PLANE_TYPE_PRIMARY;
+	// assign_planes doesn't give layers that are completely off-screen a plane.
+	if (!rendertarget_nogbm_get_plane_rect(target, offset_x, offset_y, &rect)) {
+		return EINVAL;
+	}
 
-	nogbm_target->current_front_rbo ^= 1;
-	ok = attach_drm_rbo_to_fbo(nogbm_target->gl_fbo_id, nogbm_target->rbos + nogbm_target->current_front_rbo);
-	if (ok != 0) return ok;
+	is_primary = plane->type == DRM_PLANE_TYPE_PRIMARY;
 
-	fb_id = nogbm_target->rbos[nogbm_target->current_front_rbo ^ 1].drm_fb_id;
+	fb_id = rendertarget_nogbm_present_front_rbo(nogbm_target);
 
 	if (is_primary) {
 		if (set_mode) {
@@ -669,24 +1201,26 @@ static int rendertarget_nogbm_present_legacy(
 	} else {
 		drmdev_legacy_overlay_plane_pageflip(
 			drmdev,
-			drm_plane_id,
+			plane->plane->plane_id,
 			fb_id,
-			0,
-			0,
-			flutterpi.display.width,
-			flutterpi.display.height,
-			0,
-			0,
-			((uint16_t) flutterpi.display.width) << 16,
-			((uint16_t) flutterpi.display.height) << 16
+			rect.crtc_x,
+			rect.crtc_y,
+			rect.crtc_width,
+			rect.crtc_height,
+			((uint16_t) rect.src_x) << 16,
+			((uint16_t) rect.src_y) << 16,
+			((uint16_t) rect.src_width) << 16,
+			((uint16_t) rect.src_height) << 16
 		);
 	}
+
+	// legacy modesetting commits right away, so we can select the next rbo here already.
+	rendertarget_nogbm_select_next_rbo(target);
 	
-	ok = drmdev_plane_supports_setting_rotation_value(drmdev, drm_plane_id, DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y, &supported);
-	if (ok != 0) return ok;
+	supported = drm_plane_supports_setting_rotation_value(plane, DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y);
 	
 	if (supported) {
-		drmdev_legacy_set_plane_property(drmdev, drm_plane_id, "rotation", DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y);
+		drmdev_legacy_set_plane_property(drmdev, plane->plane->plane_id, "rotation", DRM_MODE_ROTATE_0 | DRM_MODE_REFLECT_Y);
 	} else {
 		static bool printed = false;
 
@@ -700,11 +1234,10 @@ static int rendertarget_nogbm_present_legacy(
 		}
 	}
 
-	ok = drmdev_plane_supports_setting_zpos_value(drmdev, drm_plane_id, zpos, &supported);
-	if (ok != 0) return ok;
+	supported = drm_plane_supports_setting_zpos_value(plane, zpos);
 	
 	if (supported) {
-		drmdev_legacy_set_plane_property(drmdev, drm_plane_id, "zpos", zpos);
+		drmdev_legacy_set_plane_property(drmdev, plane->plane->plane_id, "zpos", zpos);
 	} else {
 		static bool printed = false;
 
@@ -725,12 +1258,16 @@ static int rendertarget_nogbm_present_legacy(
  * 
  * @param[out] out A pointer to the pointer of the created rendertarget.
  * @param[in] compositor The compositor which this rendertarget should be associated with.
+ * @param[in] width The width of the buffers, in pixels.
+ * @param[in] height The height of the buffers, in pixels.
  * 
  * @see rendertarget_nogbm
  */
 static int rendertarget_nogbm_new(
 	struct rendertarget **out,
-	struct compositor *compositor
+	struct compositor *compositor,
+	int width,
+	int height
 ) {
 	struct rendertarget *target;
 	GLenum gl_error;
@@ -743,6 +1280,10 @@ static int rendertarget_nogbm_new(
 
 	target->is_gbm = false;
 	target->compositor = compositor;
+	target->width = width;
+	target->height = height;
+	target->format = get_pixfmt_info(RENDERTARGET_NOGBM_PIXFMT)->drm_format;
+	target->modifier = compositor->overlay_modifier;
 	target->destroy = rendertarget_nogbm_destroy;
 	target->present = rendertarget_nogbm_present;
 	target->present_legacy = rendertarget_nogbm_present_legacy;
@@ -757,27 +1298,31 @@ static int rendertarget_nogbm_new(
 		goto fail_free_target;
 	}
 
-	ok = create_drm_rbo(
-		flutterpi.display.width,
-		flutterpi.display.height,
-		target->nogbm.rbos + 0
-	);
-	if (ok != 0) {
-		goto fail_delete_fb;
-	}
+	target->nogbm.n_rbos = 0;
+	for (int i = 0; i < compositor->overlay_buffer_depth; i++) {
+		ok = create_drm_rbo(
+			width,
+			height,
+			RENDERTARGET_NOGBM_PIXFMT,
+			compositor->overlay_modifier,
+			target->nogbm.rbos + i
+		);
+		if (ok != 0) {
+			goto fail_destroy_drm_rbos;
+		}
 
-	ok = create_drm_rbo(
-		flutterpi.display.width,
-		flutterpi.display.height,
-		target->nogbm.rbos + 1
-	);
-	if (ok != 0) {
-		goto fail_destroy_drm_rbo_0;
+		target->nogbm.n_rbos++;
 	}
 
-	ok = attach_drm_rbo_to_fbo(target->nogbm.gl_fbo_id, target->nogbm.rbos + target->nogbm.current_front_rbo);
+	target->n_bytes = (size_t) target->nogbm.n_rbos * target->nogbm.rbos[0].gem_stride * height;
+
+	scanout_buffers_init(&target->nogbm.buffers, target->nogbm.n_rbos);
+	target->nogbm.needs_next_rbo = false;
+	target->n_painted_rects = -1;
+
+	ok = attach_drm_rbo_to_fbo(target->nogbm.gl_fbo_id, target->nogbm.rbos + target->nogbm.buffers.front);
 	if (ok != 0) {
-		goto fail_destroy_drm_rbo_1;
+		goto fail_destroy_drm_rbos;
 	}
 
 	target->gl_fbo_id = target->nogbm.gl_fbo_id;
@@ -786,13 +1331,11 @@ static int rendertarget_nogbm_new(
 	return 0;
 
 
-	fail_destroy_drm_rbo_1:
-	destroy_drm_rbo(target->nogbm.rbos + 1);
-
-	fail_destroy_drm_rbo_0:
-	destroy_drm_rbo(target->nogbm.rbos + 0);
+	fail_destroy_drm_rbos:
+	for (int i = target->nogbm.n_rbos - 1; i >= 0; i--) {
+		destroy_drm_rbo(target->nogbm.rbos + i);
+	}
 
-	fail_delete_fb:
 	glDeleteFramebuffers(1, &target->nogbm.gl_fbo_id);
 
 	fail_free_target:
@@ -815,10 +1358,11 @@ static void on_destroy_backing_store_gl_fb(void *userdata) {
 	store = userdata;
 	compositor = store->target->compositor;
 
-	cpset_put(&compositor->stale_rendertargets, store->target);
-
+	// The rendertarget can only be reused once flutter is done with the backing store
+	// and destroyed the FBO wrapping it, so whichever of the two callbacks comes last puts it into the pool.
 	if (store->should_free_on_next_destroy) {
-		free(store);
+		rendertarget_pool_put(&compositor->rendertarget_pool, store->target);
+		object_pool_free(&backing_store_pool, store);
 	} else {
 		store->should_free_on_next_destroy = true;
 	}
@@ -844,10 +1388,9 @@ static bool on_collect_backing_store(
 	store = backing_store->user_data;
 	compositor = store->target->compositor;
 
-	cpset_put(&compositor->stale_rendertargets, store->target);
-
 	if (store->should_free_on_next_destroy) {
-		free(store);
+		rendertarget_pool_put(&compositor->rendertarget_pool, store->target);
+		object_pool_free(&backing_store_pool, store);
 	} else {
 		store->should_free_on_next_destroy = true;
 	}
@@ -871,27 +1414,43 @@ static bool on_create_backing_store(
 	struct flutterpi_backing_store *store;
 	struct rendertarget *target;
 	struct compositor *compositor;
+	int width, height;
 	int ok;
 
-	(void) config;
 	compositor = userdata;
 
-	store = calloc(1, sizeof *store);
+	// overlay layers are often much smaller than the display, for example when
+	// they only contain a toolbar drawn on top of a platform view.
+	width = max(1, min((int) ceil(config->size.width), flutterpi.display.render_width));
+	height = max(1, min((int) ceil(config->size.height), flutterpi.display.render_height));
+
+	store = object_pool_zalloc(&backing_store_pool);
 	if (store == NULL) {
 		return false;
 	}
 
-	// first, try to find a stale GBM rendertarget.
-	cpset_lock(&compositor->stale_rendertargets);
-	for_each_pointer_in_cpset(&compositor->stale_rendertargets, target) break;
-	if (target != NULL) {
-		cpset_remove_locked(&compositor->stale_rendertargets, target);
+	// first, try to reuse the GBM rendertarget, then a No-GBM rendertarget of the same size.
+	target = rendertarget_pool_take(
+		&compositor->rendertarget_pool,
+		true,
+		width,
+		height,
+		flutterpi.gbm.format,
+		flutterpi.gbm.modifier
+	);
+	if (target == NULL) {
+		target = rendertarget_pool_take(
+			&compositor->rendertarget_pool,
+			false,
+			width,
+			height,
+			get_pixfmt_info(RENDERTARGET_NOGBM_PIXFMT)->drm_format,
+			compositor->overlay_modifier
+		);
 	}
-	cpset_unlock(&compositor->stale_rendertargets);
 
-	// if we didn't find one, check if we should create one. If not,
-	// try to find a stale No-GBM rendertarget. If there is none,
-	// create one.
+	// if we didn't find one, create one. The first one
+	// is the GBM rendertarget, all others are No-GBM.
 	if (target == NULL) {
 		if (compositor->should_create_window_surface_backing_store) {
 			// We create 1 "backing store" that is rendering to the DRM_PLANE_PRIMARY
@@ -904,7 +1463,7 @@ static bool on_create_backing_store(
 			);
 
 			if (ok != 0) {
-				free(store);
+				object_pool_free(&backing_store_pool, store);
 				return false;
 			}
 
@@ -912,11 +1471,13 @@ static bool on_create_backing_store(
 		} else {
 			ok = rendertarget_nogbm_new(
 				&target,
-				compositor
+				compositor,
+				width,
+				height
 			);
 
 			if (ok != 0) {
-				free(store);
+				object_pool_free(&backing_store_pool, store);
 				return false;
 			}
 		}
@@ -961,15 +1522,42 @@ static int execute_simulate_page_flip_event(void *userdata) {
 
 	data = userdata;
 
-	// disabled because vsync is broken
-	// on_pageflip_event(flutterpi.drm.drmdev->fd, 0, data->sec, data->usec, NULL);
+	on_pageflip_event(flutterpi.drm.drmdev->fd, 0, data->sec, data->usec, NULL);
 
 	free(data);
 
 	return 0;
 }
 
-static void fill_platform_view_params(
+/**
+ * @brief Make the platform thread handle a page flip event with the current time as
+ * the timestamp, for frames the kernel won't send a page flip event for.
+ */
+static int post_simulated_page_flip_event(void) {
+	struct simulated_page_flip_event_data *data;
+	uint64_t time;
+	int ok;
+
+	time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+
+	data = malloc(sizeof *data);
+	if (data == NULL) {
+		return ENOMEM;
+	}
+
+	data->sec = time / 1000000000llu;
+	data->usec = (time % 1000000000llu) / 1000;
+
+	ok = flutterpi_post_platform_task_with_priority(kPlatformTaskPriorityFrame, execute_simulate_page_flip_event, data);
+	if (ok != 0) {
+		free(data);
+		return ok;
+	}
+
+	return 0;
+}
+
+static void fill_platform_view_params(
 	struct platform_view_params *params_out,
 	const FlutterPoint *offset,
 	const FlutterSize *size,
@@ -979,7 +1567,7 @@ static void fill_platform_view_params(
 	const FlutterTransformation *view_to_display_transform,
 	double device_pixel_ratio
 ) {
-	(void) view_to_display_transform;
+	FlutterTransformation render_to_view_transform, render_to_display_transform;
 
 	/**
 	 * inversion for
@@ -1045,16 +1633,1171 @@ static void fill_platform_view_params(
 		}
     }
 
+	// The mutations include the root surface transformation of the engine, so the quad is in
+	// render coordinates now. The platform views are positioned in display coordinates though,
+	// which differ if the display controller rotates the planes or scales them up (see --render-scale).
+	render_to_view_transform = FLUTTER_MULTIPLIED_TRANSFORMATIONS(
+		((FlutterTransformation) {
+			.scaleX = 1 / compositor.frame_scale, .skewX = 0, .transX = 0,
+			.skewY = 0, .scaleY = 1 / compositor.frame_scale, .transY = 0,
+			.pers0 = 0, .pers1 = 0, .pers2 = 1
+		}),
+		flutterpi.view.engine_display_to_view_transform
+	);
+	render_to_display_transform = FLUTTER_MULTIPLIED_TRANSFORMATIONS((*view_to_display_transform), render_to_view_transform);
+
+	apply_transform_to_quad(render_to_display_transform, &quad);
+
+	if (flutterpi.view.plane_rotation == DRM_MODE_ROTATE_180) {
+		rotation += 180;
+	}
+
 	rotation = fmod(rotation, 360.0);
 
-	params_out->rect = quad;
-	params_out->opacity = 0;
-	params_out->rotation = rotation;
-	params_out->clip_rects = NULL;
-	params_out->n_clip_rects = 0;
+	params_out->rect = quad;
+	params_out->opacity = 0;
+	params_out->rotation = rotation;
+	params_out->clip_rects = NULL;
+	params_out->n_clip_rects = 0;
+}
+
+/// PLANE ASSIGNMENT
+/**
+ * @brief Get the position of a backing store layer in view coordinates.
+ * Parts of it may be off-screen.
+ */
+static void get_layer_rect(const FlutterLayer *layer, int *x_out, int *y_out, int *width_out, int *height_out) {
+	struct flutterpi_backing_store *store;
+	struct rendertarget *target;
+	int x, y;
+
+	store = layer->backing_store->user_data;
+	target = store->target;
+
+	if (target->is_gbm) {
+		// the engine only draws the current frame size into the window surface.
+		*x_out = 0;
+		*y_out = 0;
+		*width_out = compositor.frame_width;
+		*height_out = compositor.frame_height;
+		return;
+	}
+
+	x = (int) round(layer->offset.x);
+	y = (int) round(layer->offset.y);
+
+	*x_out = x;
+	*y_out = y;
+	*width_out = target->width;
+	*height_out = target->height;
+}
+
+/**
+ * @brief Get the part of a backing store layer that's on screen, in view coordinates.
+ *
+ * @returns false if no part of the layer is on screen.
+ */
+static bool get_visible_layer_rect(const FlutterLayer *layer, int *x_out, int *y_out, int *width_out, int *height_out) {
+	int x, y, width, height, right, bottom;
+
+	get_layer_rect(layer, &x, &y, &width, &height);
+
+	right = min(x + width, compositor.frame_width);
+	bottom = min(y + height, compositor.frame_height);
+	x = max(x, 0);
+	y = max(y, 0);
+	if ((right <= x) || (bottom <= y)) {
+		return false;
+	}
+
+	*x_out = x;
+	*y_out = y;
+	*width_out = right - x;
+	*height_out = bottom - y;
+	return true;
+}
+
+/**
+ * @brief Get the plane rect of a backing store layer, the same way it's presented.
+ *
+ * @returns false if no part of the layer is on screen.
+ */
+static bool get_layer_plane_rect(const FlutterLayer *layer, struct plane_rect *rect_out) {
+	struct flutterpi_backing_store *store;
+	struct rendertarget *target;
+
+	store = layer->backing_store->user_data;
+	target = store->target;
+
+	if (!target->is_gbm) {
+		return rendertarget_nogbm_get_plane_rect(target, (int) round(layer->offset.x), (int) round(layer->offset.y), rect_out);
+	}
+
+	// see rendertarget_gbm_present.
+	rect_out->src_x = 0;
+	rect_out->src_y = target->height - compositor.frame_height;
+	rect_out->src_width = compositor.frame_width;
+	rect_out->src_height = compositor.frame_height;
+	rect_out->crtc_x = 0;
+	rect_out->crtc_y = 0;
+	rect_out->crtc_width = compositor.frame_width;
+	rect_out->crtc_height = compositor.frame_height;
+	view_to_crtc_rect(&rect_out->crtc_x, &rect_out->crtc_y, &rect_out->crtc_width, &rect_out->crtc_height);
+	return true;
+}
+
+static void put_plane_test_props(
+	struct drmdev_atomic_req *req,
+	const struct drm_plane *plane,
+	uint32_t fb_id,
+	const struct plane_rect *rect,
+	int rotation,
+	int64_t zpos
+) {
+
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropFbId, fb_id);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcId, req->drmdev->selected_crtc->crtc->crtc_id);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcX, ((uint16_t) rect->src_x) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcY, ((uint16_t) rect->src_y) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcW, ((uint16_t) rect->src_width) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcH, ((uint16_t) rect->src_height) << 16);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcX, rect->crtc_x);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcY, rect->crtc_y);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcW, rect->crtc_width);
+	drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcH, rect->crtc_height);
+
+	if (drm_plane_supports_setting_rotation_value(plane, rotation)) {
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropRotation, rotation);
+	}
+
+	if (drm_plane_supports_setting_zpos_value(plane, zpos)) {
+		drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropZpos, zpos);
+	}
+}
+
+/**
+ * @brief Check whether the kernel accepts the planes assigned to the first @ref n_layers layers,
+ * using a test-only commit. The primary plane is tested with the buffer that's currently
+ * on screen, since the new one is only available after eglSwapBuffers.
+ */
+static bool test_plane_assignment(
+	struct compositor *compositor,
+	const FlutterLayer **layers,
+	const struct layer_assignment *assignments,
+	size_t n_layers,
+	uint32_t primary_fb_id,
+	int64_t min_zpos
+) {
+	struct drmdev_atomic_req *req;
+	struct drm_plane *plane;
+	bool is_used;
+	int ok;
+
+	ok = drmdev_new_atomic_req(compositor->drmdev, &req);
+	if (ok != 0) {
+		return false;
+	}
+
+	for (int i = 0; i < n_layers; i++) {
+		struct flutterpi_backing_store *store;
+		struct rendertarget *target;
+		struct plane_rect rect;
+		uint32_t fb_id;
+
+		if ((assignments[i].plane == NULL) || !get_layer_plane_rect(layers[i], &rect)) {
+			continue;
+		}
+
+		store = layers[i]->backing_store->user_data;
+		target = store->target;
+
+		if (target->is_gbm) {
+			fb_id = primary_fb_id;
+		} else {
+			fb_id = target->nogbm.rbos[target->nogbm.buffers.front].drm_fb_id;
+		}
+
+		put_plane_test_props(
+			req,
+			assignments[i].plane,
+			fb_id,
+			&rect,
+			get_rendertarget_rotation(target),
+			i + min_zpos
+		);
+	}
+
+	// disable all the other planes, like the actual commit will.
+	for_each_unreserved_plane_in_atomic_req(req, plane) {
+		if ((plane->type != DRM_PLANE_TYPE_PRIMARY) && (plane->type != DRM_PLANE_TYPE_OVERLAY)) {
+			continue;
+		}
+
+		is_used = false;
+		for (int i = 0; i < n_layers; i++) {
+			if (assignments[i].plane == plane) {
+				is_used = true;
+				break;
+			}
+		}
+
+		if (!is_used) {
+			drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropFbId, 0);
+			drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcId, 0);
+		}
+	}
+
+	ok = drmdev_atomic_req_test(req, 0);
+
+	compositor->plane_stats.n_test_commits++;
+	if (ok != 0) {
+		compositor->plane_stats.n_failed_test_commits++;
+	}
+
+	drmdev_destroy_atomic_req(req);
+
+	return ok == 0;
+}
+
+/**
+ * @brief Check whether @ref plane could show a layer with the given pixel format at the given zpos.
+ *
+ * With a render scale other than 1, every plane is scaled up to the display size.
+ * KMS doesn't tell whether a plane can scale, so that's only checked by the
+ * test commits in @ref assign_planes (with legacy modesetting, not at all).
+ */
+static bool plane_fits_layer(struct drmdev *drmdev, struct drm_plane *plane, const struct rendertarget *target, int64_t zpos) {
+	bool supported;
+	int ok;
+
+	if (target->modifier != DRM_FORMAT_MOD_INVALID) {
+		ok = drmdev_plane_supports_format_modifier(drmdev, plane->plane->plane_id, target->format, target->modifier, &supported);
+	} else {
+		ok = drmdev_plane_supports_format(drmdev, plane->plane->plane_id, target->format, &supported);
+	}
+	if ((ok != 0) || !supported) {
+		return false;
+	}
+
+	// if the display controller rotates the view, a plane that can't rotate would show the layer upside down.
+	if (flutterpi.view.plane_rotation != DRM_MODE_ROTATE_0) {
+		if (!drm_plane_supports_setting_rotation_value(plane, get_rendertarget_rotation(target))) {
+			return false;
+		}
+	}
+
+	// planes with a fixed zpos can still be used, they're just stacked in their intrinsic order.
+	ok = drmdev_plane_supports_setting_zpos(drmdev, plane->plane->plane_id, &supported);
+	if ((ok == 0) && supported) {
+		if (!drm_plane_supports_setting_zpos_value(plane, zpos)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool rect_contains(int x, int y, int width, int height, int inner_x, int inner_y, int inner_width, int inner_height) {
+	return (x <= inner_x) && (y <= inner_y) && (inner_x + inner_width <= x + width) && (inner_y + inner_height <= y + height);
+}
+
+/**
+ * @brief Check if the plane assignment of the last frame was made for the same layers.
+ * If so, copy it into @ref assignments.
+ */
+static bool get_cached_plane_assignment(
+	struct plane_assignment_cache *cache,
+	const FlutterLayer **layers,
+	size_t layers_count,
+	struct layer_assignment *assignments,
+	bool update
+) {
+	int x, y, width, height;
+	uint64_t modifier;
+	uint32_t format;
+
+	if (layers_count > COMPOSITOR_PLANE_ASSIGNMENT_CACHE_SIZE) {
+		cache->is_valid = false;
+		return false;
+	}
+
+	if (update) {
+		cache->n_layers = layers_count;
+		cache->plane_rotation = flutterpi.view.plane_rotation;
+	} else if (!cache->is_valid || (cache->n_layers != layers_count) || (cache->plane_rotation != flutterpi.view.plane_rotation)) {
+		return false;
+	}
+
+	for (int i = 0; i < layers_count; i++) {
+		x = y = width = height = 0;
+		format = 0;
+		modifier = DRM_FORMAT_MOD_INVALID;
+		if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			struct flutterpi_backing_store *store = layers[i]->backing_store->user_data;
+
+			get_layer_rect(layers[i], &x, &y, &width, &height);
+			format = store->target->format;
+			modifier = store->target->modifier;
+		}
+
+		if (update) {
+			cache->keys[i].type = layers[i]->type;
+			cache->keys[i].x = x;
+			cache->keys[i].y = y;
+			cache->keys[i].width = width;
+			cache->keys[i].height = height;
+			cache->keys[i].format = format;
+			cache->keys[i].modifier = modifier;
+			cache->assignments[i] = assignments[i];
+		} else if ((cache->keys[i].type != layers[i]->type) ||
+			(cache->keys[i].x != x) || (cache->keys[i].y != y) ||
+			(cache->keys[i].width != width) || (cache->keys[i].height != height) ||
+			(cache->keys[i].format != format) || (cache->keys[i].modifier != modifier)) {
+			return false;
+		}
+	}
+
+	if (update) {
+		cache->is_valid = true;
+	} else {
+		memcpy(assignments, cache->assignments, layers_count * sizeof(*assignments));
+	}
+
+	return true;
+}
+
+/**
+ * @brief Check whether there's a platform view between layer @ref index and the nearest
+ * backing store below it. Such a layer can't be drawn into any layer below it without
+ * ending up beneath the platform view.
+ */
+static bool is_directly_above_platform_view(const FlutterLayer **layers, int index) {
+	for (int i = index - 1; i >= 0; i--) {
+		if (layers[i]->type == kFlutterLayerContentTypePlatformView) {
+			return true;
+		} else if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * @brief Decide which backing store layers get a DRM plane.
+ *
+ * The first layer always goes into the primary plane. All other backing stores get the first
+ * free overlay plane that supports their pixel format and zpos and, with atomic modesetting,
+ * passes a test commit together with the planes assigned so far. Backing stores that
+ * don't get a plane are drawn into the nearest layer below them that has one and fully
+ * contains them, but never into one beneath a platform view, since the platform view
+ * would cover them then. That's why the first backing store above a platform view gets
+ * its plane before all others.
+ *
+ * @param available_planes The planes that can be used for the selected CRTC.
+ * @returns false if a backing store neither got a plane nor a layer to be drawn into.
+ */
+static bool assign_planes(
+	struct compositor *compositor,
+	struct pointer_set *available_planes,
+	bool use_atomic_modesetting,
+	const FlutterLayer **layers,
+	size_t layers_count,
+	int64_t min_zpos,
+	struct layer_assignment *assignments
+) {
+	struct flutterpi_backing_store *store;
+	struct drm_plane *primary_plane, *plane;
+	uint32_t primary_fb_id;
+	bool can_test, is_used, all_assigned;
+	int x, y, width, height;
+
+	if (get_cached_plane_assignment(&compositor->plane_assignment_cache, layers, layers_count, assignments, false)) {
+		return true;
+	}
+
+	primary_plane = NULL;
+	for_each_pointer_in_pset(available_planes, plane) {
+		if (plane->type == DRM_PLANE_TYPE_PRIMARY) {
+			primary_plane = plane;
+			break;
+		}
+	}
+
+	for (int i = 0; i < layers_count; i++) {
+		assignments[i].plane = NULL;
+		assignments[i].composited_into = -1;
+		assignments[i].is_offscreen = false;
+	}
+
+	// We can only test the assignment once the CRTC is active and we know a buffer
+	// for the primary plane, which is after the first frame.
+	primary_fb_id = 0;
+	if ((layers_count > 0) && (layers[0]->type == kFlutterLayerContentTypeBackingStore)) {
+		store = layers[0]->backing_store->user_data;
+		if (store->target->is_gbm && (store->target->gbm.current_front_bo != NULL)) {
+			primary_fb_id = gbm_bo_get_drm_fb_id(store->target->gbm.current_front_bo);
+		}
+
+		assignments[0].plane = primary_plane;
+	}
+
+	can_test = use_atomic_modesetting && compositor->has_applied_modeset && compositor->can_test_plane_assignments && (primary_plane != NULL) && (primary_fb_id != 0);
+	if (can_test && !test_plane_assignment(compositor, layers, assignments, 1, primary_fb_id, min_zpos)) {
+		LOG_ERROR("Kernel rejected a test commit with just the primary plane. Not validating overlay plane assignments anymore.\n");
+		compositor->can_test_plane_assignments = false;
+		can_test = false;
+	}
+
+	// first the backing stores directly above platform views, then all others.
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 1; i < layers_count; i++) {
+			if (layers[i]->type != kFlutterLayerContentTypeBackingStore) {
+				continue;
+			}
+
+			if (is_directly_above_platform_view(layers, i) != (pass == 0)) {
+				continue;
+			}
+
+			store = layers[i]->backing_store->user_data;
+
+			// Nothing to show, and some drivers reject planes that are completely off-screen.
+			if (!get_visible_layer_rect(layers[i], &x, &y, &width, &height)) {
+				assignments[i].is_offscreen = true;
+				continue;
+			}
+
+			for_each_pointer_in_pset(available_planes, plane) {
+				if (plane->type != DRM_PLANE_TYPE_OVERLAY) {
+					continue;
+				}
+
+				is_used = false;
+				for (int j = 0; j < layers_count; j++) {
+					if (assignments[j].plane == plane) {
+						is_used = true;
+						break;
+					}
+				}
+
+				if (is_used || !plane_fits_layer(compositor->drmdev, plane, store->target, i + min_zpos)) {
+					continue;
+				}
+
+				// planes assigned in the first pass may be above this one, so test all of them.
+				assignments[i].plane = plane;
+				if (can_test && !test_plane_assignment(compositor, layers, assignments, layers_count, primary_fb_id, min_zpos)) {
+					assignments[i].plane = NULL;
+					continue;
+				}
+
+				break;
+			}
+		}
+	}
+
+	all_assigned = true;
+	for (int i = 0; i < layers_count; i++) {
+		if ((layers[i]->type != kFlutterLayerContentTypeBackingStore) || (assignments[i].plane != NULL) || assignments[i].is_offscreen) {
+			continue;
+		}
+
+		get_visible_layer_rect(layers[i], &x, &y, &width, &height);
+
+		// only the parts that are on screen need to fit into the layer below.
+		for (int j = i - 1; j >= 0; j--) {
+			int dst_x, dst_y, dst_width, dst_height;
+
+			if (layers[j]->type == kFlutterLayerContentTypePlatformView) {
+				break;
+			}
+
+			if (assignments[j].plane == NULL) {
+				continue;
+			}
+
+			if (get_visible_layer_rect(layers[j], &dst_x, &dst_y, &dst_width, &dst_height) && rect_contains(dst_x, dst_y, dst_width, dst_height, x, y, width, height)) {
+				assignments[i].composited_into = j;
+				break;
+			}
+		}
+
+		if (assignments[i].composited_into < 0) {
+			all_assigned = false;
+		}
+	}
+
+	// Only reuse assignments that were validated. Without test commits, assigning is cheap anyway.
+	if (all_assigned && (can_test || !use_atomic_modesetting)) {
+		get_cached_plane_assignment(&compositor->plane_assignment_cache, layers, layers_count, assignments, true);
+	}
+
+	return all_assigned;
+}
+
+/// GL COMPOSITING OF LAYERS WITHOUT A PLANE
+static const char *layer_blit_vertex_shader_source =
+	"attribute vec2 position;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"    gl_Position = vec4(position, 0.0, 1.0);\n"
+	"    texcoord = position * 0.5 + 0.5;\n"
+	"}\n";
+
+static const char *layer_blit_fragment_shader_source =
+	"precision mediump float;\n"
+	"uniform sampler2D tex;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"    gl_FragColor = texture2D(tex, texcoord);\n"
+	"}\n";
+
+static struct {
+	bool is_initialized;
+	GLuint program;
+	GLint position_location;
+	GLint texture_location;
+} layer_blit = {
+	.is_initialized = false
+};
+
+static GLuint compile_shader(GLenum type, const char *source) {
+	GLuint shader;
+	GLint status;
+	char log[512];
+
+	shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE) {
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		LOG_ERROR("Could not compile layer compositing shader. glCompileShader: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+/**
+ * @brief Compile the program used to draw layers into each other.
+ * Must be called with the compositor EGL context current, the program only exists in that context.
+ */
+static int init_layer_blit(void) {
+	GLuint vertex_shader, fragment_shader, program;
+	GLint status;
+	char log[512];
+
+	if (layer_blit.is_initialized) {
+		return 0;
+	}
+
+	vertex_shader = compile_shader(GL_VERTEX_SHADER, layer_blit_vertex_shader_source);
+	if (vertex_shader == 0) {
+		return EINVAL;
+	}
+
+	fragment_shader = compile_shader(GL_FRAGMENT_SHADER, layer_blit_fragment_shader_source);
+	if (fragment_shader == 0) {
+		glDeleteShader(vertex_shader);
+		return EINVAL;
+	}
+
+	program = glCreateProgram();
+	glAttachShader(program, vertex_shader);
+	glAttachShader(program, fragment_shader);
+	glLinkProgram(program);
+
+	glDeleteShader(vertex_shader);
+	glDeleteShader(fragment_shader);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		LOG_ERROR("Could not link layer compositing program. glLinkProgram: %s\n", log);
+		glDeleteProgram(program);
+		return EINVAL;
+	}
+
+	layer_blit.program = program;
+	layer_blit.position_location = glGetAttribLocation(program, "position");
+	layer_blit.texture_location = glGetUniformLocation(program, "tex");
+	layer_blit.is_initialized = true;
+
+	return 0;
+}
+
+/**
+ * @brief Draw the no-GBM backing store of @ref src_layer on top of the contents
+ * of @ref dst_layer, using OpenGL. Must be called with the compositor EGL context
+ * and the window surface current, before the window surface is swapped.
+ *
+ * Counts the GL calls it makes in the EGL stats of the compositor, see @ref COUNT_GL.
+ */
+static int composite_layer(const FlutterLayer *dst_layer, const FlutterLayer *src_layer) {
+	static const GLfloat vertices[] = {
+		-1, -1,
+		 1, -1,
+		-1,  1,
+		 1,  1
+	};
+	struct flutterpi_backing_store *src_store, *dst_store;
+	struct rendertarget *src, *dst;
+	GLuint texture, fbo;
+	GLenum gl_error;
+	int src_x, src_y, src_width, src_height;
+	int dst_x, dst_y, dst_width, dst_height;
+	int ok;
+
+	src_store = src_layer->backing_store->user_data;
+	dst_store = dst_layer->backing_store->user_data;
+	src = src_store->target;
+	dst = dst_store->target;
+
+	// the GBM rendertarget always has a plane, since it's always the first layer.
+	if (src->is_gbm) {
+		return EINVAL;
+	}
+
+	ok = init_layer_blit();
+	if (ok != 0) {
+		return ok;
+	}
+
+	get_layer_rect(src_layer, &src_x, &src_y, &src_width, &src_height);
+	get_layer_rect(dst_layer, &dst_x, &dst_y, &dst_width, &dst_height);
+
+	COUNT_GL(glGetError());
+
+	fbo = 0;
+	if (!dst->is_gbm) {
+		// FBOs aren't shared between contexts, so we need our own one for the destination buffer.
+		COUNT_GL(glGenFramebuffers(1, &fbo));
+		ok = attach_drm_rbo_to_fbo(fbo, dst->nogbm.rbos + dst->nogbm.buffers.front);
+		if (ok != 0) {
+			COUNT_GL(glDeleteFramebuffers(1, &fbo));
+			return ok;
+		}
+	}
+
+	COUNT_GL(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+
+	COUNT_GL(glGenTextures(1, &texture));
+	COUNT_GL(glBindTexture(GL_TEXTURE_2D, texture));
+	COUNT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+	COUNT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+	COUNT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+	COUNT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+	COUNT_GL(flutterpi.gl.EGLImageTargetTexture2DOES(GL_TEXTURE_2D, src->nogbm.rbos[src->nogbm.buffers.front].egl_image));
+
+	// Both buffers were rendered by OpenGL, so their rows are stored bottom-up.
+	COUNT_GL(glViewport(src_x - dst_x, dst_height - (src_y - dst_y) - src_height, src_width, src_height));
+
+	COUNT_GL(glUseProgram(layer_blit.program));
+	COUNT_GL(glActiveTexture(GL_TEXTURE0));
+	COUNT_GL(glUniform1i(layer_blit.texture_location, 0));
+
+	// flutter renders with premultiplied alpha.
+	COUNT_GL(glEnable(GL_BLEND));
+	COUNT_GL(glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA));
+
+	COUNT_GL(glVertexAttribPointer(layer_blit.position_location, 2, GL_FLOAT, GL_FALSE, 0, vertices));
+	COUNT_GL(glEnableVertexAttribArray(layer_blit.position_location));
+	COUNT_GL(glDrawArrays(GL_TRIANGLE_STRIP, 0, 4));
+	COUNT_GL(glDisableVertexAttribArray(layer_blit.position_location));
+
+	COUNT_GL(glDisable(GL_BLEND));
+	COUNT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+	COUNT_GL(glDeleteTextures(1, &texture));
+
+	if (fbo != 0) {
+		// the window surface is synchronized by eglSwapBuffers, our own buffers are not.
+		COUNT_GL(glFinish());
+		COUNT_GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+		COUNT_GL(glDeleteFramebuffers(1, &fbo));
+	}
+
+	if ((gl_error = COUNT_GL(glGetError()))) {
+		LOG_ERROR("Could not draw layer into the layer below it. glGetError: %u\n", gl_error);
+		return EIO;
+	}
+
+	return 0;
+}
+
+/// DAMAGE TRACKING
+/**
+ * @brief Get the area the engine painted into the backing store of @ref layer
+ * in this frame, in framebuffer coordinates of @ref target.
+ *
+ * The engine doesn't report damage for backing stores, only where it painted.
+ * Everything outside of that is transparent, so what changed on a plane
+ * is contained in the painted areas of the last and the current frame.
+ *
+ * That's not what actually changed though: the engine repaints a layer completely
+ * whenever anything in it changes. So this only helps layers that are mostly transparent,
+ * i.e. the overlays of multi-layer scenes (platform views). The primary layer of
+ * a scene without platform views is always painted completely.
+ *
+ * @returns The number of rects, or -1 if the engine didn't report a paint region
+ *   and the whole buffer has to be considered painted.
+ */
+static int get_painted_rects(const FlutterLayer *layer, const struct rendertarget *target, struct drm_mode_rect *rects_out) {
+	const FlutterRegion *region;
+	struct drm_mode_rect rect;
+	int n_rects;
+
+	// older engines don't have the paint region at all.
+	if (layer->struct_size < offsetof(FlutterLayer, backing_store_present_info) + sizeof(layer->backing_store_present_info)) {
+		return -1;
+	}
+
+	if ((layer->backing_store_present_info == NULL) || (layer->backing_store_present_info->paint_region == NULL)) {
+		return -1;
+	}
+
+	region = layer->backing_store_present_info->paint_region;
+
+	n_rects = 0;
+	for (size_t i = 0; i < region->rects_count; i++) {
+		rect.x1 = max(0, (int32_t) floor(region->rects[i].left));
+		rect.y1 = max(0, (int32_t) floor(region->rects[i].top));
+		rect.x2 = min(target->width, (int32_t) ceil(region->rects[i].right));
+		rect.y2 = min(target->height, (int32_t) ceil(region->rects[i].bottom));
+
+		if ((rect.x1 >= rect.x2) || (rect.y1 >= rect.y2)) {
+			continue;
+		}
+
+		if (!target->is_gbm) {
+			// OpenGL renders the no-GBM buffers bottom-up, the plane reflects them.
+			int32_t y1 = rect.y1;
+			rect.y1 = target->height - rect.y2;
+			rect.y2 = target->height - y1;
+		}
+
+		if (n_rects < RENDERTARGET_MAX_PAINTED_RECTS) {
+			rects_out[n_rects++] = rect;
+		} else {
+			// too many rects, just use the bounding box.
+			for (int j = 1; j < n_rects; j++) {
+				rects_out[0].x1 = min(rects_out[0].x1, rects_out[j].x1);
+				rects_out[0].y1 = min(rects_out[0].y1, rects_out[j].y1);
+				rects_out[0].x2 = max(rects_out[0].x2, rects_out[j].x2);
+				rects_out[0].y2 = max(rects_out[0].y2, rects_out[j].y2);
+			}
+			rects_out[0].x1 = min(rects_out[0].x1, rect.x1);
+			rects_out[0].y1 = min(rects_out[0].y1, rect.y1);
+			rects_out[0].x2 = max(rects_out[0].x2, rect.x2);
+			rects_out[0].y2 = max(rects_out[0].y2, rect.y2);
+			n_rects = 1;
+		}
+	}
+
+	return n_rects;
+}
+
+/**
+ * @brief Calculate what changes on the plane with id @ref plane_id when @ref target is
+ * presented on it at the given offset, and remember the painted rects for the next frame.
+ *
+ * The damage is only known if the same rendertarget was presented on the same plane
+ * at the same position in the last frame.
+ *
+ * @param n_painted_rects The number of @ref painted_rects, or -1 if the whole buffer was painted.
+ * @param damage_out Must have room for 2 * @ref RENDERTARGET_MAX_PAINTED_RECTS rects.
+ * @returns The number of damage rects, or -1 if the whole plane has to be considered damaged.
+ */
+static int update_layer_damage(
+	struct compositor *compositor,
+	struct rendertarget *target,
+	uint32_t plane_id,
+	int offset_x,
+	int offset_y,
+	const struct drm_mode_rect *painted_rects,
+	int n_painted_rects,
+	struct drm_mode_rect *damage_out
+) {
+	uint64_t n_damaged_pixels;
+	int n_damage;
+
+	n_damage = -1;
+	if ((n_painted_rects >= 0) &&
+		(target->n_painted_rects >= 0) &&
+		(target->last_presented_frame != 0) &&
+		(target->last_presented_frame + 1 == compositor->frame_number) &&
+		(target->last_plane_id == plane_id) &&
+		(target->last_offset_x == offset_x) &&
+		(target->last_offset_y == offset_y)
+	) {
+		memcpy(damage_out, target->painted_rects, target->n_painted_rects * sizeof(*damage_out));
+		memcpy(damage_out + target->n_painted_rects, painted_rects, n_painted_rects * sizeof(*damage_out));
+		n_damage = target->n_painted_rects + n_painted_rects;
+	}
+
+	if (n_painted_rects >= 0) {
+		memcpy(target->painted_rects, painted_rects, n_painted_rects * sizeof(*painted_rects));
+	}
+	target->n_painted_rects = n_painted_rects;
+	target->last_plane_id = plane_id;
+	target->last_offset_x = offset_x;
+	target->last_offset_y = offset_y;
+	target->last_presented_frame = compositor->frame_number;
+
+	// overlapping rects are counted twice here, it's just an estimate.
+	n_damaged_pixels = 0;
+	for (int i = 0; i < n_damage; i++) {
+		n_damaged_pixels += (uint64_t) (damage_out[i].x2 - damage_out[i].x1) * (damage_out[i].y2 - damage_out[i].y1);
+	}
+
+	compositor->damage_stats.n_layers++;
+	compositor->damage_stats.n_layer_pixels += (uint64_t) target->width * target->height;
+	if (n_damage >= 0) {
+		compositor->damage_stats.n_partially_damaged_layers++;
+		compositor->damage_stats.n_damaged_pixels += min(n_damaged_pixels, (uint64_t) target->width * target->height);
+	} else {
+		compositor->damage_stats.n_damaged_pixels += (uint64_t) target->width * target->height;
+	}
+
+	return n_damage;
+}
+
+/**
+ * @brief Get the FB_DAMAGE_CLIPS property blob for presenting @ref target with the given damage.
+ *
+ * The blob of the last frame is reused if the damage didn't change. Otherwise, it's
+ * replaced by a new one. The kernel keeps a reference to blobs that are part of the
+ * committed state, so the old one can be destroyed right away.
+ *
+ * @returns 0 on success, or the errno of creating the blob.
+ */
+static int rendertarget_get_damage_blob(
+	struct compositor *compositor,
+	struct rendertarget *target,
+	const struct drm_mode_rect *damage,
+	int n_damage,
+	uint32_t *blob_id_out
+) {
+	int ok;
+
+	if ((target->damage_blob_id != 0) &&
+		(target->n_damage_blob_rects == n_damage) &&
+		(memcmp(target->damage_blob_rects, damage, n_damage * sizeof(*damage)) == 0)
+	) {
+		*blob_id_out = target->damage_blob_id;
+		return 0;
+	}
+
+	rendertarget_destroy_damage_blob(target);
+
+	ok = drmModeCreatePropertyBlob(compositor->drmdev->fd, damage, n_damage * sizeof(*damage), &target->damage_blob_id);
+	if (ok != 0) {
+		target->damage_blob_id = 0;
+		return -ok;
+	}
+
+	memcpy(target->damage_blob_rects, damage, n_damage * sizeof(*damage));
+	target->n_damage_blob_rects = n_damage;
+	compositor->damage_stats.n_created_blobs++;
+
+	*blob_id_out = target->damage_blob_id;
+	return 0;
+}
+
+/**
+ * @brief Swap the window surface, telling EGL which part of it changed if possible.
+ */
+static void swap_window_surface(const struct rendertarget *target, const struct drm_mode_rect *damage, int n_damage) {
+	EGLint rects[4 * n_damage > 0 ? 4 * n_damage : 1];
+
+	// EGL can't express "nothing changed", 0 rects means everything did.
+	if ((flutterpi.egl.swapBuffersWithDamage == NULL) || (n_damage <= 0)) {
+		eglSwapBuffers(flutterpi.egl.display, flutterpi.egl.surface);
+		return;
+	}
+
+	// EGL damage rects are x, y, width, height, with y measured from the bottom of the surface.
+	for (int i = 0; i < n_damage; i++) {
+		rects[4*i + 0] = damage[i].x1;
+		rects[4*i + 1] = target->height - damage[i].y2;
+		rects[4*i + 2] = damage[i].x2 - damage[i].x1;
+		rects[4*i + 3] = damage[i].y2 - damage[i].y1;
+	}
+
+	flutterpi.egl.swapBuffersWithDamage(flutterpi.egl.display, flutterpi.egl.surface, rects, n_damage);
+}
+
+/// PRESENT FUNCS
+static void update_stall_stats(struct compositor *compositor, uint64_t stall_ns) {
+	compositor->stall_stats.n_frames++;
+	if (stall_ns > 0) {
+		compositor->stall_stats.n_stalled_frames++;
+		compositor->stall_stats.total_stall_ns += stall_ns;
+		compositor->stall_stats.max_stall_ns = max(compositor->stall_stats.max_stall_ns, stall_ns);
+	}
+
+	if (compositor->stall_stats.n_frames % 1000 == 0) {
+		compositor_dump_stats();
+	}
+}
+
+void compositor_dump_stats(void) {
+	struct rendertarget_pool *pool;
+
+	pool = &compositor.rendertarget_pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	LOG_DEBUG(
+		"rendertarget pool: %llu hits, %llu misses, %llu evictions, %d unused rendertargets using %zu of %zu bytes\n",
+		(unsigned long long) pool->n_hits,
+		(unsigned long long) pool->n_misses,
+		(unsigned long long) pool->n_evictions,
+		pool->n_targets,
+		pool->n_bytes,
+		pool->max_bytes
+	);
+	pthread_mutex_unlock(&pool->mutex);
+
+	LOG_DEBUG(
+		"plane assignment: %llu test commits, %llu rejected, %llu layers drawn into the layer below using OpenGL\n",
+		(unsigned long long) compositor.plane_stats.n_test_commits,
+		(unsigned long long) compositor.plane_stats.n_failed_test_commits,
+		(unsigned long long) compositor.plane_stats.n_composited_layers
+	);
+
+	LOG_DEBUG(
+		"EGL: %llu presents, %.2f EGL calls and %.2f GL calls per present, %llu context switches, %llu window surface swaps, %llu presents with an IN_FENCE_FD\n",
+		(unsigned long long) compositor.egl_stats.n_presents,
+		compositor.egl_stats.n_presents ? (double) compositor.egl_stats.n_egl_calls / compositor.egl_stats.n_presents : 0.0,
+		compositor.egl_stats.n_presents ? (double) compositor.egl_stats.n_gl_calls / compositor.egl_stats.n_presents : 0.0,
+		(unsigned long long) compositor.egl_stats.n_context_switches,
+		(unsigned long long) compositor.egl_stats.n_swaps,
+		(unsigned long long) compositor.egl_stats.n_fenced_presents
+	);
+
+	LOG_DEBUG(
+		"%llu frames were identical to the one on screen and weren't committed\n",
+		(unsigned long long) compositor.n_elided_commits
+	);
+
+	LOG_DEBUG(
+		"damage: %llu of %llu presented layers had a known damage region, %.1f%% of the layer pixels changed, %llu damage blobs created\n",
+		(unsigned long long) compositor.damage_stats.n_partially_damaged_layers,
+		(unsigned long long) compositor.damage_stats.n_layers,
+		compositor.damage_stats.n_layer_pixels ? 100.0 * compositor.damage_stats.n_damaged_pixels / compositor.damage_stats.n_layer_pixels : 0.0,
+		(unsigned long long) compositor.damage_stats.n_created_blobs
+	);
+
+	LOG_DEBUG(
+		"overlay buffer depth %d: %llu frames, %llu stalled waiting for page flips, avg stall %.2fms per frame, max %.2fms\n",
+		compositor.overlay_buffer_depth,
+		(unsigned long long) compositor.stall_stats.n_frames,
+		(unsigned long long) compositor.stall_stats.n_stalled_frames,
+		compositor.stall_stats.n_frames ? compositor.stall_stats.total_stall_ns / 1000000.0 / compositor.stall_stats.n_frames : 0.0,
+		compositor.stall_stats.max_stall_ns / 1000000.0
+	);
+
+	LOG_DEBUG(
+		"cursor: %llu moves, %llu buffer switches, %d cached cursor buffers\n",
+		(unsigned long long) compositor.cursor.n_moves,
+		(unsigned long long) compositor.cursor.n_buffer_switches,
+		compositor.cursor.n_buffers
+	);
+}
+
+/**
+ * @brief Whether the engine rendered into the backing store of @ref layer for this frame.
+ */
+static bool backing_store_did_update(const FlutterLayer *layer) {
+	const FlutterBackingStore *store = layer->backing_store;
+
+	// if the engine can't tell us whether it rendered into the backing store again, assume it did.
+	if (store->struct_size < offsetof(FlutterBackingStore, did_update) + sizeof(store->did_update)) {
+		return true;
+	}
+
+	return store->did_update;
+}
+
+/**
+ * @brief Check whether the engine presents exactly what's already on screen: the same
+ * backing stores at the same positions, none of them rendered into again, and the same
+ * platform views with the same geometry and mutations.
+ * compositor->cbs must be locked.
+ */
+static bool is_same_as_last_frame_locked(struct compositor *compositor, const FlutterLayer **layers, size_t layers_count) {
+	const struct presented_layer *last;
+	struct view_cb_data *cb_data;
+
+	if ((compositor->n_last_layers < 0) || (layers_count != (size_t) compositor->n_last_layers)) {
+		return false;
+	}
+
+	if (compositor->last_plane_rotation != flutterpi.view.plane_rotation) {
+		return false;
+	}
+
+	for (size_t i = 0; i < layers_count; i++) {
+		last = compositor->last_layers + i;
+
+		if ((layers[i]->type != last->type) ||
+			memcmp(&layers[i]->offset, &last->offset, sizeof(FlutterPoint)) ||
+			memcmp(&layers[i]->size, &last->size, sizeof(FlutterSize))) {
+			return false;
+		}
+
+		if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			if (backing_store_did_update(layers[i]) || (layers[i]->backing_store->user_data != last->backing_store_user_data)) {
+				return false;
+			}
+		} else {
+			const FlutterPlatformView *view = layers[i]->platform_view;
+
+			if ((view->identifier != last->view_id) || (view->mutations_count != last->n_mutations)) {
+				return false;
+			}
+
+			for (size_t j = 0; j < view->mutations_count; j++) {
+				if (memcmp(view->mutations[j], last->mutations + j, sizeof(FlutterPlatformViewMutation))) {
+					return false;
+				}
+			}
+
+			// a view that got callbacks since the last frame still needs to be mounted.
+			cb_data = get_cbs_for_view_id_locked(view->identifier);
+			if ((cb_data != NULL) && !cb_data->was_present_last_frame) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief Remember the layers of the frame that was just committed, for @ref is_same_as_last_frame_locked.
+ */
+static void remember_layers(struct compositor *compositor, const FlutterLayer **layers, size_t layers_count) {
+	struct presented_layer *last;
+
+	compositor->n_last_layers = -1;
+	compositor->last_plane_rotation = flutterpi.view.plane_rotation;
+	if (layers_count > COMPOSITOR_MAX_TRACKED_LAYERS) {
+		return;
+	}
+
+	for (size_t i = 0; i < layers_count; i++) {
+		last = compositor->last_layers + i;
+
+		last->type = layers[i]->type;
+		last->offset = layers[i]->offset;
+		last->size = layers[i]->size;
+
+		if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			last->backing_store_user_data = layers[i]->backing_store->user_data;
+		} else {
+			const FlutterPlatformView *view = layers[i]->platform_view;
+
+			if (view->mutations_count > COMPOSITOR_MAX_TRACKED_MUTATIONS) {
+				return;
+			}
+
+			last->view_id = view->identifier;
+			last->n_mutations = view->mutations_count;
+			for (size_t j = 0; j < view->mutations_count; j++) {
+				last->mutations[j] = *view->mutations[j];
+			}
+		}
+	}
+
+	compositor->n_last_layers = layers_count;
+}
+
+/**
+ * @brief Don't commit a frame that's identical to the one on screen.
+ *
+ * The frame still counts as submitted to the frame scheduler and completes at the
+ * next vblank, so the engine stays paced to the display like with a real commit.
+ */
+static bool elide_commit(struct compositor *compositor) {
+	int ok;
+
+	compositor->n_elided_commits++;
+
+	frame_scheduler_on_frame_submitted(&flutterpi.frame_scheduler);
+
+	ok = drmdev_queue_vblank_event(compositor->drmdev, 0);
+	if (ok != 0) {
+		ok = post_simulated_page_flip_event();
+		if (ok != 0) {
+			frame_scheduler_on_frame_dropped(&flutterpi.frame_scheduler);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief Get the size the engine rendered this frame at from the window surface layer.
+ * Without --dynamic-render-scale, that's always the render size.
+ */
+static void update_frame_size(struct compositor *compositor, const FlutterLayer **layers, size_t layers_count) {
+	struct flutterpi_backing_store *store;
+
+	compositor->frame_width = flutterpi.display.render_width;
+	compositor->frame_height = flutterpi.display.render_height;
+	compositor->frame_scale = flutterpi.display.render_scale;
+
+	if (!compositor->has_dynamic_render_scale) {
+		return;
+	}
+
+	for (int i = 0; i < layers_count; i++) {
+		if (layers[i]->type != kFlutterLayerContentTypeBackingStore) {
+			continue;
+		}
+
+		store = layers[i]->backing_store->user_data;
+		if (store->target->is_gbm) {
+			compositor->frame_width = max(1, min((int) round(layers[i]->size.width), store->target->width));
+			compositor->frame_height = max(1, min((int) round(layers[i]->size.height), store->target->height));
+			compositor->frame_scale = flutterpi.display.render_scale * compositor->frame_width / store->target->width;
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Tell the render scale controller how long rasterizing this frame took,
+ * and change the render scale if it picked a new one.
+ */
+static void update_render_scale(struct compositor *compositor, uint64_t raster_ns) {
+	double render_scale;
+	int ok;
+
+	// The render scale can't be changed while the engine renders rotated, see flutterpi_set_render_scale.
+	if (flutterpi.view.engine_rotation != 0) {
+		return;
+	}
+
+	render_scale = render_scale_controller_on_frame(&compositor->render_scale_controller, compositor->frame_scale, raster_ns);
+	if (render_scale == compositor->requested_render_scale) {
+		return;
+	}
+
+	ok = flutterpi_set_render_scale(render_scale);
+	if (ok != 0) {
+		LOG_ERROR("Could not change the render scale. flutterpi_set_render_scale: %s\n", strerror(ok));
+		return;
+	}
+
+	compositor->requested_render_scale = render_scale;
 }
 
-/// PRESENT FUNCS
 static bool on_present_layers(
 	const FlutterLayer **layers,
 	size_t layers_count,
@@ -1062,24 +2805,41 @@ static bool on_present_layers(
 ) {
 	struct drmdev_atomic_req *req;
 	struct view_cb_data *cb_data;
-	struct pointer_set planes;
+	struct pointer_set planes, *available_planes;
+	struct layer_assignment assignments[layers_count];
 	struct compositor *compositor;
 	struct drm_plane *plane;
 	struct drmdev *drmdev;
+	int64_t min_zpos;
 	uint32_t req_flags;
 	void *planes_storage[32] = {0};
 	bool legacy_rendertarget_set_mode = false;
 	bool schedule_fake_page_flip_event;
 	bool use_atomic_modesetting;
+	bool needs_swap, needs_context, needs_fence, did_make_current;
+	int in_fence_fd;
+	struct drm_mode_rect damage[layers_count][2 * RENDERTARGET_MAX_PAINTED_RECTS];
+	int n_damage[layers_count];
+	bool needs_compositing[layers_count];
+	int window_surface_layer;
+	EGLContext stored_context;
+	EGLSurface stored_draw_surface, stored_read_surface;
+	uint64_t stall_ns, raster_start_ns;
 	int ok;
 
 	// TODO: proper error handling
 
 	compositor = userdata;
 	drmdev = compositor->drmdev;
-	schedule_fake_page_flip_event = compositor->do_blocking_atomic_commits;
 	use_atomic_modesetting = drmdev->supports_atomic_modesetting;
 
+	// The next time the engine makes its context current, it starts rasterizing the next frame.
+	raster_start_ns = compositor->raster_start_ns;
+	compositor->raster_start_ns = 0;
+
+	// legacy modesetting doesn't give us page flip events for all planes, so always simulate them.
+	schedule_fake_page_flip_event = compositor->do_blocking_atomic_commits || !use_atomic_modesetting;
+
 #ifdef DUMP_ENGINE_LAYERS
 	LOG_DEBUG("layers:\n");
 	for (int i = 0; i < layers_count; i++) {
@@ -1131,12 +2891,40 @@ static bool on_present_layers(
 	}
 #endif
 
+	cpset_lock(&compositor->cbs);
+	if (compositor->has_applied_modeset && is_same_as_last_frame_locked(compositor, layers, layers_count)) {
+		cpset_unlock(&compositor->cbs);
+		return elide_commit(compositor);
+	}
+	cpset_unlock(&compositor->cbs);
+
+	update_frame_size(compositor, layers, layers_count);
+
+	// Building the frame doesn't need the page flip of the last one to be completed:
+	// no-GBM rendertargets only ever render into rbos that are off-screen (see rendertarget_nogbm_select_next_rbo),
+	// and the GBM front buffer released while presenting isn't rendered into before this returns.
+	// Only the commit itself has to wait for it, see below. Legacy page flips fail with EBUSY while
+	// the last one is pending too, but legacy rendertargets are presented (and flipped) one by one.
+	stall_ns = 0;
+	if (!use_atomic_modesetting) {
+		stall_ns = wait_for_pending_flip(compositor);
+	}
+
+	if (compositor->out_fence_fd >= 0) {
+		close(compositor->out_fence_fd);
+		compositor->out_fence_fd = -1;
+	}
+
+	compositor->frame_number++;
+
 	req = NULL;
 	if (use_atomic_modesetting) {
 		ok = drmdev_new_atomic_req(compositor->drmdev, &req);
 		if (ok != 0) {
 			return false;
 		}
+
+		available_planes = &req->available_planes;
 	} else {
 		planes = PSET_INITIALIZER_STATIC(planes_storage, 32);
 		for_each_plane_in_drmdev(drmdev, plane) {
@@ -1147,23 +2935,185 @@ static bool on_present_layers(
 				}
 			}
 		}
+
+		available_planes = &planes;
 	}
 
 	cpset_lock(&compositor->cbs);
 
-	EGLDisplay stored_display = eglGetCurrentDisplay();
-	EGLSurface stored_read_surface = eglGetCurrentSurface(EGL_READ);
-	EGLSurface stored_write_surface = eglGetCurrentSurface(EGL_DRAW);
-	EGLContext stored_context = eglGetCurrentContext();
+	min_zpos = 0;
+	for_each_pointer_in_pset(available_planes, plane) {
+		if (plane->type == DRM_PLANE_TYPE_PRIMARY) {
+			ok = drmdev_plane_get_min_zpos_value(drmdev, plane->plane->plane_id, &min_zpos);
+			if (ok != 0) {
+				min_zpos = 0;
+			}
+			break;
+		}
+	}
+
+	compositor->egl_stats.n_presents++;
+
+	// Layers that don't get a plane need to be drawn into a layer below them before it's presented.
+	if (!assign_planes(compositor, available_planes, use_atomic_modesetting, layers, layers_count, min_zpos, assignments)) {
+		// Presenting the frame without that layer would silently drop part of the UI.
+		LOG_ERROR("Could not find a free primary/overlay DRM plane or a layer below for presenting a backing store. Dropping the frame.\n");
+		if (req != NULL) {
+			drmdev_destroy_atomic_req(req);
+		}
+		cpset_unlock(&compositor->cbs);
+		return false;
+	}
+
+	needs_swap = false;
+	needs_context = false;
+	needs_fence = false;
+	window_surface_layer = -1;
+	for (int i = 0; i < layers_count; i++) {
+		n_damage[i] = -1;
+		needs_compositing[i] = false;
+		if (assignments[i].composited_into < 0) {
+			continue;
+		}
+
+		// The buffer of a layer that wasn't rendered again still contains what was drawn into it
+		// for the last frame. There's no way to draw into it again without the old contents.
+		if (!backing_store_did_update(layers[assignments[i].composited_into])) {
+			if (backing_store_did_update(layers[i])) {
+				LOG_ERROR("Could not draw a backing store into the layer below it, since that one wasn't rendered again. Dropping the frame.\n");
+				if (req != NULL) {
+					drmdev_destroy_atomic_req(req);
+				}
+				cpset_unlock(&compositor->cbs);
+				return false;
+			}
+
+			continue;
+		}
+
+		needs_compositing[i] = true;
+		needs_context = true;
+	}
+
+	for (int i = 0; i < layers_count; i++) {
+		if ((layers[i]->type == kFlutterLayerContentTypeBackingStore) && (assignments[i].composited_into < 0) && (assignments[i].plane != NULL)) {
+			struct flutterpi_backing_store *store = layers[i]->backing_store->user_data;
+			struct drm_mode_rect painted_rects[RENDERTARGET_MAX_PAINTED_RECTS];
+			int n_painted_rects;
+
+			// Only the GBM rendertarget renders into the window surface.
+			// Swapping it when it's not presented would only waste a buffer that's never scanned out.
+			if (store->target->is_gbm) {
+				window_surface_layer = i;
+			}
+			needs_fence = compositor->use_explicit_fencing;
+
+			// layers drawn into this one aren't part of its paint region.
+			n_painted_rects = get_painted_rects(layers[i], store->target, painted_rects);
+			for (int j = i + 1; j < layers_count; j++) {
+				if (assignments[j].composited_into == i) {
+					n_painted_rects = -1;
+				}
+			}
+
+			// The paint region is relative to the frame, which doesn't start at the top of
+			// the window surface if it's smaller (see rendertarget_gbm_present).
+			if (store->target->is_gbm && ((compositor->frame_width != store->target->width) || (compositor->frame_height != store->target->height))) {
+				n_painted_rects = -1;
+			}
+
+			n_damage[i] = update_layer_damage(
+				compositor,
+				store->target,
+				assignments[i].plane->plane->plane_id,
+				(int) round(layers[i]->offset.x),
+				(int) round(layers[i]->offset.y),
+				painted_rects,
+				n_painted_rects,
+				damage[i]
+			);
+		}
+	}
+
+	// If neither the engine nor we drew into the window surface, its back buffer has undefined contents.
+	// The buffer that's on screen is presented again instead.
+	if (window_surface_layer >= 0) {
+		struct flutterpi_backing_store *store = layers[window_surface_layer]->backing_store->user_data;
+
+		needs_swap = backing_store_did_update(layers[window_surface_layer]) || (store->target->gbm.current_front_bo == NULL);
+		store->target->gbm.has_new_front_bo = needs_swap;
+	}
+
+	// A fence created in the flutter rendering context doesn't cover what we draw in the
+	// compositor context. Frames that need compositing are synchronized implicitly instead.
+	if (needs_context) {
+		needs_fence = false;
+	}
+
+	stored_context = EGL_NO_CONTEXT;
+	stored_draw_surface = EGL_NO_SURFACE;
+	stored_read_surface = EGL_NO_SURFACE;
+	did_make_current = false;
+	in_fence_fd = -1;
+	if (needs_swap || needs_context || needs_fence) {
+		// The engine makes the flutter rendering context current on the raster thread
+		// before presenting, so for the swap there's usually nothing to switch.
+		// Compositing uses its own context though, so we don't mess with the GL state
+		// the engine caches for its context.
+		compositor->egl_stats.n_egl_calls++;
+		stored_context = eglGetCurrentContext();
 
-	eglMakeCurrent(flutterpi.egl.display, flutterpi.egl.surface, flutterpi.egl.surface, flutterpi.egl.root_context);
-	eglSwapBuffers(flutterpi.egl.display, flutterpi.egl.surface);
+		// All backing stores were rendered by the engine in its context,
+		// so a single fence covers all of them.
+		if (needs_fence && (stored_context == flutterpi.egl.flutter_render_context)) {
+			compositor->egl_stats.n_egl_calls += 3;
+			in_fence_fd = create_render_fence();
+		}
+
+		if (needs_context || (stored_context != flutterpi.egl.flutter_render_context)) {
+			// Whatever was current before is restored afterwards, including its surfaces.
+			compositor->egl_stats.n_egl_calls += 2;
+			stored_draw_surface = eglGetCurrentSurface(EGL_DRAW);
+			stored_read_surface = eglGetCurrentSurface(EGL_READ);
+
+			compositor->egl_stats.n_egl_calls++;
+			compositor->egl_stats.n_context_switches++;
+			eglMakeCurrent(flutterpi.egl.display, flutterpi.egl.surface, flutterpi.egl.surface, flutterpi.egl.compositor_context);
+			did_make_current = true;
+		}
+	}
+
+	for (int i = 0; i < layers_count; i++) {
+		if (needs_compositing[i]) {
+			ok = composite_layer(layers[assignments[i].composited_into], layers[i]);
+			if (ok != 0) {
+				LOG_ERROR("Could not draw backing store into the layer below it. composite_layer: %s\n", strerror(ok));
+			}
+			compositor->plane_stats.n_composited_layers++;
+		}
+	}
+
+	if (needs_swap) {
+		struct flutterpi_backing_store *store = layers[window_surface_layer]->backing_store->user_data;
+
+		compositor->egl_stats.n_egl_calls++;
+		compositor->egl_stats.n_swaps++;
+		swap_window_surface(store->target, damage[window_surface_layer], n_damage[window_surface_layer]);
+	}
+
+	// Only the time until the frame is ready to commit counts, waiting for the display to take it doesn't.
+	if (compositor->has_dynamic_render_scale && (raster_start_ns != 0)) {
+		update_render_scale(compositor, get_monotonic_time() - raster_start_ns);
+	}
 
 	req_flags =  0 /* DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK*/;
 	if (compositor->has_applied_modeset == false) {
 		if (use_atomic_modesetting) {
 			ok = drmdev_atomic_req_put_modeset_props(req, &req_flags);
 			if (ok != 0) {
+				if (in_fence_fd >= 0) {
+					close(in_fence_fd);
+				}
 				return false;
 			}
 		} else {
@@ -1191,7 +3141,7 @@ static bool on_present_layers(
 					}
 
 					if (supported) {
-						drmdev_atomic_req_put_plane_property(req, plane->plane->plane_id, "zpos", max_zpos);
+						drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropZpos, max_zpos);
 					} else {
 						LOG_ERROR("Could not move cursor to front. Mouse cursor may be invisible. drmdev_plane_supports_setting_zpos_value: %s\n", strerror(ok));
 						continue;
@@ -1326,7 +3276,7 @@ static bool on_present_layers(
 				layer->platform_view->mutations_count,
 				&flutterpi.view.display_to_view_transform,
 				&flutterpi.view.view_to_display_transform,
-				flutterpi.display.pixel_ratio
+				flutterpi.display.pixel_ratio * compositor->frame_scale
 			);
 
 			ok = cb_data->update_view(
@@ -1373,7 +3323,7 @@ static bool on_present_layers(
 				layer->platform_view->mutations_count,
 				&flutterpi.view.display_to_view_transform,
 				&flutterpi.view.view_to_display_transform,
-				flutterpi.display.pixel_ratio
+				flutterpi.display.pixel_ratio * compositor->frame_scale
 			);
 
 			if (cb_data->mount != NULL) {
@@ -1400,62 +3350,23 @@ static bool on_present_layers(
 		}
 	}
 	
-	int64_t min_zpos;
-	if (use_atomic_modesetting) {
-		for_each_unreserved_plane_in_atomic_req(req, plane) {
-			if (plane->type == DRM_PLANE_TYPE_PRIMARY) {
-				ok = drmdev_plane_get_min_zpos_value(req->drmdev, plane->plane->plane_id, &min_zpos);
-				if (ok != 0) {
-					min_zpos = 0;
-				}
-				break;
-			}
-		}
-	} else {
-		for_each_pointer_in_pset(&planes, plane) {
-			if (plane->type == DRM_PLANE_TYPE_PRIMARY) {
-				ok = drmdev_plane_get_min_zpos_value(drmdev, plane->plane->plane_id, &min_zpos);
-				if (ok != 0) {
-					min_zpos = 0;
-				}
-				break;
-			}
-		}
-	}
-
 	for (int i = 0; i < layers_count; i++) {
 		if (layers[i]->type == kFlutterLayerContentTypeBackingStore) {
+			if (assignments[i].composited_into >= 0) {
+				// already drawn into the buffer of a layer below.
+				continue;
+			} else if (assignments[i].is_offscreen) {
+				continue;
+			}
+
+			// assign_planes made sure every other backing store has a plane.
+			plane = assignments[i].plane;
+			DEBUG_ASSERT_NOT_NULL(plane);
+
 			if (use_atomic_modesetting) {
-				for_each_unreserved_plane_in_atomic_req(req, plane) {
-					// choose a plane which has an "intrinsic" zpos that matches
-					// the zpos we want the plane to have.
-					// (Since planes are buggy and we can't rely on the zpos we explicitly
-					// configure the plane to have to be actually applied to the hardware.
-					// In short, assigning a different value to the zpos property won't always
-					// take effect.)
-					if ((i == 0) && (plane->type == DRM_PLANE_TYPE_PRIMARY)) {
-						ok = drmdev_atomic_req_reserve_plane(req, plane);
-						break;
-					} else if ((i != 0) && (plane->type == DRM_PLANE_TYPE_OVERLAY)) {
-						ok = drmdev_atomic_req_reserve_plane(req, plane);
-						break;
-					}
-				}
+				drmdev_atomic_req_reserve_plane(req, plane);
 			} else {
-				for_each_pointer_in_pset(&planes, plane) {
-					if ((i == 0) && (plane->type == DRM_PLANE_TYPE_PRIMARY)) {
-						break;
-					} else if ((i != 0) && (plane->type == DRM_PLANE_TYPE_OVERLAY)) {
-						break;
-					}
-				}
-				if (plane != NULL) {
-					pset_remove(&planes, plane);
-				}
-			}
-			if (plane == NULL) {
-				LOG_ERROR("Could not find a free primary/overlay DRM plane for presenting the backing store. drmdev_atomic_req_reserve_plane: %s\n", strerror(ok));
-				continue;
+				pset_remove(&planes, plane);
 			}
 
 			struct flutterpi_backing_store *store = layers[i]->backing_store->user_data;
@@ -1465,25 +3376,39 @@ static bool on_present_layers(
 				ok = target->present(
 					target,
 					req,
-					plane->plane->plane_id,
-					0,
-					0,
-					compositor->drmdev->selected_mode->hdisplay,
-					compositor->drmdev->selected_mode->vdisplay,
+					plane,
+					(int) round(layers[i]->offset.x),
+					(int) round(layers[i]->offset.y),
+					target->width,
+					target->height,
 					i + min_zpos
 				);
 				if (ok != 0) {
 					LOG_ERROR("Could not present backing store. rendertarget->present: %s\n", strerror(ok));
+				} else {
+					if ((in_fence_fd >= 0) && drm_plane_has_prop(plane, kDrmPlanePropInFenceFd)) {
+						drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropInFenceFd, in_fence_fd);
+					}
+
+					// Without FB_DAMAGE_CLIPS, the driver assumes the whole plane changed.
+					if ((n_damage[i] > 0) && drm_plane_has_prop(plane, kDrmPlanePropFbDamageClips)) {
+						uint32_t damage_blob_id;
+
+						ok = rendertarget_get_damage_blob(compositor, target, damage[i], n_damage[i], &damage_blob_id);
+						if (ok == 0) {
+							drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropFbDamageClips, damage_blob_id);
+						}
+					}
 				}
 			} else {
 				ok = target->present_legacy(
 					target,
 					drmdev,
-					plane->plane->plane_id,
-					0,
-					0,
-					compositor->drmdev->selected_mode->hdisplay,
-					compositor->drmdev->selected_mode->vdisplay,
+					plane,
+					(int) round(layers[i]->offset.x),
+					(int) round(layers[i]->offset.y),
+					target->width,
+					target->height,
 					i + min_zpos,
 					legacy_rendertarget_set_mode && (plane->type == DRM_PLANE_TYPE_PRIMARY)
 				);
@@ -1502,7 +3427,7 @@ static bool on_present_layers(
 					layers[i]->platform_view->mutations_count,
 					&flutterpi.view.display_to_view_transform,
 					&flutterpi.view.view_to_display_transform,
-					flutterpi.display.pixel_ratio
+					flutterpi.display.pixel_ratio * compositor->frame_scale
 				);
 
 				ok = cb_data->present(
@@ -1522,35 +3447,65 @@ static bool on_present_layers(
 	if (use_atomic_modesetting) {
 		for_each_unreserved_plane_in_atomic_req(req, plane) {
 			if ((plane->type == DRM_PLANE_TYPE_PRIMARY) || (plane->type == DRM_PLANE_TYPE_OVERLAY)) {
-				drmdev_atomic_req_put_plane_property(req, plane->plane->plane_id, "FB_ID", 0);
-				drmdev_atomic_req_put_plane_property(req, plane->plane->plane_id, "CRTC_ID", 0);
+				drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropFbId, 0);
+				drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcId, 0);
 			}
 		}
 	}
 
-	eglMakeCurrent(stored_display, stored_read_surface, stored_write_surface, stored_context);
+	if (did_make_current) {
+		compositor->egl_stats.n_egl_calls++;
+		eglMakeCurrent(flutterpi.egl.display, stored_draw_surface, stored_read_surface, stored_context);
+	}
+
+	// Needs to happen before the commit, since the page flip event
+	// could otherwise arrive on the platform thread before this.
+	frame_scheduler_on_frame_submitted(&flutterpi.frame_scheduler);
 	
 	if (use_atomic_modesetting) {
-		do_commit:
+		if (compositor->use_explicit_fencing) {
+			// the kernel writes the fence fd in here when committing.
+			drmdev_atomic_req_put_crtc_prop(req, kDrmCrtcPropOutFencePtr, (uint64_t) (uintptr_t) &compositor->out_fence_fd);
+		}
+
 		if (compositor->do_blocking_atomic_commits) {
 			req_flags &= ~(DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT);
 		} else {
 			req_flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+
+			// The kernel only takes one non-blocking commit per CRTC at a time.
+			// Usually the frame scheduler already made sure the last one has completed.
+			stall_ns += wait_for_pending_flip(compositor);
+
+			// set this before committing, the page flip event could arrive before drmModeAtomicCommit returns.
+			set_pending_flip(compositor, true);
 		}
 		
 		ok = drmdev_atomic_req_commit(req, req_flags, NULL);
 		if ((compositor->do_blocking_atomic_commits == false) && (ok == EBUSY)) {
-			LOG_ERROR(
-				"Non-blocking drmModeAtomicCommit failed with EBUSY.\n"
-				"  Future drmModeAtomicCommits will be executed blockingly.\n"
-				"  This may have have an impact on performance.\n"
-			);
+			// We waited for the last page flip, so this shouldn't happen. But some drivers
+			// are busy for a bit longer than that, so just commit this frame blockingly.
+			LOG_DEBUG("Non-blocking drmModeAtomicCommit failed with EBUSY. Committing blockingly.\n");
 
-			compositor->do_blocking_atomic_commits = true;
+			set_pending_flip(compositor, false);
 			schedule_fake_page_flip_event = true;
-			goto do_commit;
-		} else if (ok != 0) {
+
+			req_flags &= ~(DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT);
+			ok = drmdev_atomic_req_commit(req, req_flags, NULL);
+		}
+
+		// the kernel holds its own reference to the in fence now.
+		if (in_fence_fd >= 0) {
+			close(in_fence_fd);
+			compositor->egl_stats.n_fenced_presents++;
+		}
+
+		if (ok != 0) {
 			LOG_ERROR("Could not present frame. drmModeAtomicCommit: %s\n", strerror(ok));
+			compositor->out_fence_fd = -1;
+			compositor->n_last_layers = -1;
+			set_pending_flip(compositor, false);
+			frame_scheduler_on_frame_dropped(&flutterpi.frame_scheduler);
 			drmdev_destroy_atomic_req(req);
 			cpset_unlock(&compositor->cbs);
 			return false;
@@ -1561,18 +3516,29 @@ static bool on_present_layers(
 
 	cpset_unlock(&compositor->cbs);
 
-	if (schedule_fake_page_flip_event) {
-		uint64_t time = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
+	if (use_atomic_modesetting) {
+		for (int i = 0; i < layers_count; i++) {
+			if (layers[i]->type != kFlutterLayerContentTypeBackingStore) {
+				continue;
+			}
 
-		struct simulated_page_flip_event_data *data = malloc(sizeof(struct simulated_page_flip_event_data));
-		if (data == NULL) {
-			return false;
+			struct flutterpi_backing_store *store = layers[i]->backing_store->user_data;
+			if (!store->target->is_gbm && store->target->nogbm.needs_next_rbo) {
+				stall_ns += rendertarget_nogbm_select_next_rbo(store->target);
+			}
 		}
+	}
 
-		data->sec = time / 1000000000llu;
-		data->usec = (time % 1000000000llu) / 1000;
+	remember_layers(compositor, layers, layers_count);
 
-		flutterpi_post_platform_task(execute_simulate_page_flip_event, data);
+	update_stall_stats(compositor, stall_ns);
+
+	if (schedule_fake_page_flip_event) {
+		ok = post_simulated_page_flip_event();
+		if (ok != 0) {
+			frame_scheduler_on_frame_dropped(&flutterpi.frame_scheduler);
+			return false;
+		}
 	}
 
 	return true;
@@ -1584,6 +3550,10 @@ int compositor_on_page_flip(
 ) {
 	(void) sec;
 	(void) usec;
+
+	// Let the raster thread commit the next frame.
+	set_pending_flip(&compositor, false);
+
 	return 0;
 }
 
@@ -1640,41 +3610,140 @@ int compositor_remove_view_callbacks(int64_t view_id) {
 }
 
 /// COMPOSITOR INITIALIZATION
-int compositor_initialize(struct drmdev *drmdev) {
+/**
+ * @brief Create display-sized no-GBM rendertargets and put them into the pool,
+ * so they don't have to be created on the raster thread once a platform view appears.
+ */
+static int preallocate_overlays(int n_overlays) {
+	struct rendertarget *target;
+	EGLint egl_error;
+	int ok;
+
+	// FBOs aren't shared between contexts, so the rendertargets need to be created
+	// in the context flutter renders with.
+	eglMakeCurrent(flutterpi.egl.display, flutterpi.egl.surface, flutterpi.egl.surface, flutterpi.egl.flutter_render_context);
+	if ((egl_error = eglGetError()) != EGL_SUCCESS) {
+		LOG_ERROR("Could not make the flutter rendering EGL context current to preallocate overlays. eglMakeCurrent: 0x%08X\n", egl_error);
+		return EINVAL;
+	}
+
+	ok = 0;
+	for (int i = 0; i < n_overlays; i++) {
+		ok = rendertarget_nogbm_new(&target, &compositor, flutterpi.display.render_width, flutterpi.display.render_height);
+		if (ok != 0) {
+			break;
+		}
+
+		if (compositor.rendertarget_pool.n_bytes + target->n_bytes > compositor.rendertarget_pool.max_bytes) {
+			LOG_ERROR("Can only preallocate %d overlays, more wouldn't fit into the rendertarget pool.\n", i);
+			target->destroy(target);
+			break;
+		}
+
+		rendertarget_pool_put(&compositor.rendertarget_pool, target);
+	}
+
+	eglMakeCurrent(flutterpi.egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+	return ok;
+}
+
+void compositor_on_raster_start(void) {
+	if (compositor.raster_start_ns == 0) {
+		compositor.raster_start_ns = get_monotonic_time();
+	}
+}
+
+int compositor_initialize(struct drmdev *drmdev, int overlay_buffer_depth, int n_preallocated_overlays) {
+	pthread_condattr_t attr;
+	int ok;
+
+	DEBUG_ASSERT(overlay_buffer_depth >= RENDERTARGET_NOGBM_MIN_BUFFERS && overlay_buffer_depth <= RENDERTARGET_NOGBM_MAX_BUFFERS);
+
 	compositor.drmdev = drmdev;
+	compositor.overlay_buffer_depth = overlay_buffer_depth;
+
+	// no-GBM rendertargets use 4 bytes per pixel for each of their buffers.
+	compositor.rendertarget_pool.max_bytes =
+		(size_t) max(n_preallocated_overlays, RENDERTARGET_POOL_MAX_DISPLAY_SIZED_TARGETS) *
+		flutterpi.display.render_width * flutterpi.display.render_height * 4 * overlay_buffer_depth;
+
+	// Without valid vblank timestamps, vsync is disabled and nothing paces
+	// the engine to the page flips, so commit blockingly in that case.
+	compositor.do_blocking_atomic_commits = !flutterpi.drm.platform_supports_get_sequence_ioctl;
+
+	compositor.use_explicit_fencing =
+		drmdev->supports_atomic_modesetting &&
+		flutterpi.egl.supports_native_fence_sync &&
+		drm_crtc_has_prop(drmdev->selected_crtc, kDrmCrtcPropOutFencePtr);
+	compositor.out_fence_fd = -1;
+
+	if (!compositor.use_explicit_fencing) {
+		LOG_DEBUG("Explicit fencing is not supported. Relying on implicit synchronization between rendering and scanout.\n");
+	}
+
+	ok = flutterpi_select_scanout_modifier(get_pixfmt_info(RENDERTARGET_NOGBM_PIXFMT)->drm_format, false, &compositor.overlay_modifier);
+	if (ok != 0) {
+		LOG_DEBUG("Could not negotiate a modifier for overlay buffers. Using implicit modifiers.\n");
+		compositor.overlay_modifier = DRM_FORMAT_MOD_INVALID;
+	}
+
+	compositor.frame_width = flutterpi.display.render_width;
+	compositor.frame_height = flutterpi.display.render_height;
+	compositor.frame_scale = flutterpi.display.render_scale;
+
+	compositor.has_dynamic_render_scale = flutterpi.display.has_dynamic_render_scale;
+	if (compositor.has_dynamic_render_scale) {
+		render_scale_controller_init(
+			&compositor.render_scale_controller,
+			flutterpi.display.min_render_scale,
+			flutterpi.display.render_scale,
+			flutterpi.display.refresh_rate
+		);
+	}
+	compositor.requested_render_scale = flutterpi.display.render_scale;
+	compositor.raster_start_ns = 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&compositor.flip_completed, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (n_preallocated_overlays > 0) {
+		ok = preallocate_overlays(n_preallocated_overlays);
+		if (ok != 0) {
+			LOG_ERROR("Could not preallocate overlays. Overlays will be created on demand.\n");
+		}
+	}
+
 	return 0;
 }
 
-static void destroy_cursor_buffer(void) {
+static void destroy_cursor_buffer(struct cursor_buffer *buffer) {
 	struct drm_mode_destroy_dumb destroy_req;
 
-	munmap(compositor.cursor.buffer, compositor.cursor.buffer_size);
-
-	drmModeRmFB(compositor.drmdev->fd, compositor.cursor.drm_fb_id);
+	drmModeRmFB(compositor.drmdev->fd, buffer->drm_fb_id);
 
 	memset(&destroy_req, 0, sizeof destroy_req);
-	destroy_req.handle = compositor.cursor.gem_bo_handle;
+	destroy_req.handle = buffer->gem_bo_handle;
 
 	ioctl(compositor.drmdev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_req);
 
-	compositor.cursor.has_buffer = false;
-	compositor.cursor.buffer_depth = 0;
-	compositor.cursor.gem_bo_handle = 0;
-	compositor.cursor.buffer_pitch = 0;
-	compositor.cursor.buffer_width = 0;
-	compositor.cursor.buffer_height = 0;
-	compositor.cursor.buffer_size = 0;
-	compositor.cursor.drm_fb_id = 0;
-	compositor.cursor.buffer = NULL;
+	memset(buffer, 0, sizeof *buffer);
+	compositor.cursor.n_buffers--;
 }
 
-static int create_cursor_buffer(int width, int height, int bpp) {
+/**
+ * @brief Create a dumb buffer containing @ref icon rotated by @ref rotation degrees.
+ */
+static int create_cursor_buffer(const struct cursor_icon *icon, int rotation, struct cursor_buffer *buffer_out) {
 	struct drm_mode_create_dumb create_req;
 	struct drm_mode_map_dumb map_req;
 	uint32_t drm_fb_id;
 	uint32_t *buffer;
 	uint64_t cap;
 	uint8_t depth;
+	int size;
 	int ok;
 
 	ok = drmGetCap(compositor.drmdev->fd, DRM_CAP_DUMB_BUFFER, &cap);
@@ -1703,10 +3772,12 @@ static int create_cursor_buffer(int width, int height, int bpp) {
 		LOG_ERROR("Preferred framebuffer depth for hardware cursor is not supported by flutter-pi.\n");
 	}
 
+	size = icon->width;
+
 	memset(&create_req, 0, sizeof create_req);
-	create_req.width = width;
-	create_req.height = height;
-	create_req.bpp = bpp;
+	create_req.width = size;
+	create_req.height = size;
+	create_req.bpp = 32;
 	create_req.flags = 0;
 
 	ok = ioctl(compositor.drmdev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_req);
@@ -1740,16 +3811,54 @@ static int create_cursor_buffer(int width, int height, int bpp) {
 		goto fail_rm_drm_fb;
 	}
 
-	compositor.cursor.has_buffer = true;
-	compositor.cursor.buffer_depth = depth;
-	compositor.cursor.gem_bo_handle = create_req.handle;
-	compositor.cursor.buffer_pitch = create_req.pitch;
-	compositor.cursor.buffer_width = width;
-	compositor.cursor.buffer_height = height;
-	compositor.cursor.buffer_size = create_req.size;
-	compositor.cursor.drm_fb_id = drm_fb_id;
-	compositor.cursor.buffer = buffer;
-	
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			int buffer_x, buffer_y;
+			if (rotation == 0) {
+				buffer_x = x;
+				buffer_y = y;
+			} else if (rotation == 90) {
+				buffer_x = size - y - 1;
+				buffer_y = x;
+			} else if (rotation == 180) {
+				buffer_x = size - x - 1;
+				buffer_y = size - y - 1;
+			} else {
+				DEBUG_ASSERT(rotation == 270);
+				buffer_x = y;
+				buffer_y = size - x - 1;
+			}
+
+			int buffer_offset = create_req.pitch * buffer_y + (depth / 8) * buffer_x;
+			int cursor_offset = size * y + x;
+
+			buffer[buffer_offset / 4] = icon->data[cursor_offset];
+		}
+	}
+
+	// the icon won't change anymore, so we don't need the mapping.
+	munmap(buffer, create_req.size);
+
+	if (rotation == 0) {
+		buffer_out->hot_x = icon->hot_x;
+		buffer_out->hot_y = icon->hot_y;
+	} else if (rotation == 90) {
+		buffer_out->hot_x = size - icon->hot_y - 1;
+		buffer_out->hot_y = icon->hot_x;
+	} else if (rotation == 180) {
+		buffer_out->hot_x = size - icon->hot_x - 1;
+		buffer_out->hot_y = size - icon->hot_y - 1;
+	} else {
+		buffer_out->hot_x = icon->hot_y;
+		buffer_out->hot_y = size - icon->hot_x - 1;
+	}
+
+	buffer_out->is_valid = true;
+	buffer_out->size = size;
+	buffer_out->gem_bo_handle = create_req.handle;
+	buffer_out->drm_fb_id = drm_fb_id;
+	compositor.cursor.n_buffers++;
+
 	return 0;
 
 
@@ -1766,104 +3875,96 @@ static int create_cursor_buffer(int width, int height, int bpp) {
 	return ok;
 }
 
+/**
+ * @brief Get the buffer containing @ref icon rotated by @ref rotation degrees.
+ * If this is the first time the icon is used, create the buffers for all the rotations,
+ * so rotating the display later on doesn't have to touch any pixels.
+ */
+static int get_cursor_buffer(const struct cursor_icon *icon, int rotation, const struct cursor_buffer **buffer_out) {
+	struct cursor_buffer *buffers;
+	int ok;
+
+	if (compositor.cursor.buffers == NULL) {
+		compositor.cursor.buffers = calloc(n_cursors * COMPOSITOR_N_CURSOR_ROTATIONS, sizeof *compositor.cursor.buffers);
+		if (compositor.cursor.buffers == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	buffers = compositor.cursor.buffers + (icon - cursors) * COMPOSITOR_N_CURSOR_ROTATIONS;
+
+	if (buffers[0].is_valid == false) {
+		for (int i = 0; i < COMPOSITOR_N_CURSOR_ROTATIONS; i++) {
+			ok = create_cursor_buffer(icon, i * 90, buffers + i);
+			if (ok != 0) {
+				for (int j = 0; j < i; j++) {
+					destroy_cursor_buffer(buffers + j);
+				}
+				return ok;
+			}
+		}
+	}
+
+	*buffer_out = buffers + rotation / 90;
+	return 0;
+}
+
 int compositor_apply_cursor_state(
 	bool is_enabled,
 	int rotation,
 	double device_pixel_ratio
 ) {
+	const struct cursor_buffer *buffer;
 	const struct cursor_icon *cursor;
 	int ok;
 
 	if (is_enabled == true) {
+		if ((rotation != 0) && (rotation != 90) && (rotation != 180) && (rotation != 270)) {
+			return EINVAL;
+		}
+
 		// find the best fitting cursor icon.
+		// if the display has a smaller pixel ratio than all of them, use the smallest one.
 		{
 			double last_diff = INFINITY;
 
-			cursor = NULL;
+			cursor = cursors;
 			for (int i = 0; i < n_cursors; i++) {
 				double cursor_dpr = (cursors[i].width * 3 * 10.0) / (25.4 * 38);
 				double cursor_screen_dpr_diff = device_pixel_ratio - cursor_dpr;
 				if ((cursor_screen_dpr_diff >= 0) && (cursor_screen_dpr_diff < last_diff)) {
 					cursor = cursors + i;
+					last_diff = cursor_screen_dpr_diff;
 				}
 			}
 		}
 
-		// destroy the old cursor buffer, if necessary
-		if (compositor.cursor.has_buffer && (compositor.cursor.buffer_width != cursor->width)) {
-			destroy_cursor_buffer();
-		}
-
-		// create a new cursor buffer, if necessary
-		if (compositor.cursor.has_buffer == false) {
-			create_cursor_buffer(cursor->width, cursor->width, 32);
+		ok = get_cursor_buffer(cursor, rotation, &buffer);
+		if (ok != 0) {
+			return ok;
 		}
 
-		if ((compositor.cursor.is_enabled == false) || (compositor.cursor.current_rotation != rotation) || (compositor.cursor.current_cursor != cursor)) {
-			int rotated_hot_x, rotated_hot_y;
-			
-			if (rotation == 0) {
-				memcpy(compositor.cursor.buffer, cursor->data, compositor.cursor.buffer_size);
-				rotated_hot_x = cursor->hot_x;
-				rotated_hot_y = cursor->hot_y;
-			} else if ((rotation == 90) || (rotation == 180) || (rotation == 270)) {
-				for (int y = 0; y < cursor->width; y++) {
-					for (int x = 0; x < cursor->width; x++) {
-						int buffer_x, buffer_y;
-						if (rotation == 90) {
-							buffer_x = cursor->width - y - 1;
-							buffer_y = x;
-						} else if (rotation == 180) {
-							buffer_x = cursor->width - y - 1;
-							buffer_y = cursor->width - x - 1;
-						} else {
-							buffer_x = y;
-							buffer_y = cursor->width - x - 1;
-						}
-						
-						int buffer_offset = compositor.cursor.buffer_pitch * buffer_y + (compositor.cursor.buffer_depth / 8) * buffer_x;
-						int cursor_offset = cursor->width * y + x;
-						
-						compositor.cursor.buffer[buffer_offset / 4] = cursor->data[cursor_offset];
-					}
-				}
-
-				if (rotation == 90) {
-					rotated_hot_x = cursor->width - cursor->hot_y - 1;
-					rotated_hot_y = cursor->hot_x;
-				} else if (rotation == 180) {
-					rotated_hot_x = cursor->width - cursor->hot_x - 1;
-					rotated_hot_y = cursor->width - cursor->hot_y - 1;
-				} else {
-					DEBUG_ASSERT(rotation == 270);
-					rotated_hot_x = cursor->hot_y;
-					rotated_hot_y = cursor->width - cursor->hot_x - 1;
-				}
-			} else {
-				return EINVAL;
-			}
-
-			compositor.cursor.current_rotation = rotation;
-			compositor.cursor.current_cursor = cursor;
-			compositor.cursor.cursor_size = cursor->width;
-			compositor.cursor.hot_x = rotated_hot_x;
-			compositor.cursor.hot_y = rotated_hot_y;
-			compositor.cursor.is_enabled = true;
-
+		if ((compositor.cursor.is_enabled == false) || (compositor.cursor.current_buffer != buffer)) {
 			ok = drmModeSetCursor2(
 				compositor.drmdev->fd,
 				compositor.drmdev->selected_crtc->crtc->crtc_id,
-				compositor.cursor.gem_bo_handle,
-				compositor.cursor.cursor_size,
-				compositor.cursor.cursor_size,
-				rotated_hot_x,
-				rotated_hot_y
+				buffer->gem_bo_handle,
+				buffer->size,
+				buffer->size,
+				buffer->hot_x,
+				buffer->hot_y
 			);
 			if (ok < 0) {
 				LOG_ERROR("Could not set the mouse cursor buffer. drmModeSetCursor: %s", strerror(errno));
 				return errno;
 			}
 
+			compositor.cursor.current_buffer = buffer;
+			compositor.cursor.hot_x = buffer->hot_x;
+			compositor.cursor.hot_y = buffer->hot_y;
+			compositor.cursor.is_enabled = true;
+			compositor.cursor.n_buffer_switches++;
+
 			ok = drmModeMoveCursor(
 				compositor.drmdev->fd,
 				compositor.drmdev->selected_crtc->crtc->crtc_id,
@@ -1884,11 +3985,8 @@ int compositor_apply_cursor_state(
 			0, 0, 0
 		);
 
-		destroy_cursor_buffer();
-
-		compositor.cursor.cursor_size = 0;
-		compositor.cursor.current_cursor = NULL;
-		compositor.cursor.current_rotation = 0;
+		// the buffers stay cached, so enabling the cursor again is cheap.
+		compositor.cursor.current_buffer = NULL;
 		compositor.cursor.hot_x = 0;
 		compositor.cursor.hot_y = 0;
 		compositor.cursor.x = 0;
@@ -1901,6 +3999,14 @@ int compositor_apply_cursor_state(
 	return 0;
 }
 
+/**
+ * @brief Move the cursor to @ref x, @ref y (in display coordinates).
+ *
+ * This is called right from the input event handler and doesn't wait for the next frame.
+ * The legacy cursor ioctl takes the kernel's asynchronous cursor update path, so unlike
+ * an atomic commit touching the cursor plane, it doesn't fail with EBUSY (or block)
+ * while a page flip of the flutter layers is pending.
+ */
 int compositor_set_cursor_pos(int x, int y) {
 	int ok;
 
@@ -1908,6 +4014,10 @@ int compositor_set_cursor_pos(int x, int y) {
 		return EINVAL;
 	}
 
+	if ((compositor.cursor.x == x) && (compositor.cursor.y == y)) {
+		return 0;
+	}
+
 	ok = drmModeMoveCursor(compositor.drmdev->fd, compositor.drmdev->selected_crtc->crtc->crtc_id, x - compositor.cursor.hot_x, y - compositor.cursor.hot_y);
 	if (ok < 0) {
 		LOG_ERROR("Could not move cursor. drmModeMoveCursor: %s", strerror(errno));
@@ -1915,7 +4025,8 @@ int compositor_set_cursor_pos(int x, int y) {
 	}
 
 	compositor.cursor.x = x;
-	compositor.cursor.y = y;    
+	compositor.cursor.y = y;
+	compositor.cursor.n_moves++;
 
 	return 0;
 }
@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+#include <collection.h>
+#include <engine_task_heap.h>
+
+static inline bool is_before(const struct engine_task *a, const struct engine_task *b) {
+    return (a->target_time < b->target_time) || ((a->target_time == b->target_time) && (a->seq < b->seq));
+}
+
+static void sift_up(struct engine_task_heap *heap, size_t index) {
+    struct engine_task *tasks = heap->tasks;
+    struct engine_task tmp;
+    size_t parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (!is_before(tasks + index, tasks + parent)) {
+            break;
+        }
+
+        tmp = tasks[parent];
+        tasks[parent] = tasks[index];
+        tasks[index] = tmp;
+        index = parent;
+    }
+}
+
+static void sift_down(struct engine_task_heap *heap, size_t index) {
+    struct engine_task *tasks = heap->tasks;
+    struct engine_task tmp;
+    size_t n = heap->n_tasks, smallest, child;
+
+    while (true) {
+        smallest = index;
+
+        child = 2*index + 1;
+        if ((child < n) && is_before(tasks + child, tasks + smallest)) {
+            smallest = child;
+        }
+
+        child++;
+        if ((child < n) && is_before(tasks + child, tasks + smallest)) {
+            smallest = child;
+        }
+
+        if (smallest == index) {
+            break;
+        }
+
+        tmp = tasks[smallest];
+        tasks[smallest] = tasks[index];
+        tasks[index] = tmp;
+        index = smallest;
+    }
+}
+
+int engine_task_heap_push(struct engine_task_heap *heap, FlutterTask task, uint64_t target_time) {
+    struct engine_task *tasks;
+    size_t new_size;
+
+    if (heap->n_tasks == heap->size) {
+        new_size = heap->size ? heap->size * 2 : 64;
+
+        tasks = realloc(heap->tasks, new_size * sizeof *tasks);
+        if (tasks == NULL) {
+            return ENOMEM;
+        }
+
+        heap->tasks = tasks;
+        heap->size = new_size;
+    }
+
+    heap->tasks[heap->n_tasks] = (struct engine_task) {
+        .target_time = target_time,
+        .seq = heap->next_seq++,
+        .task = task
+    };
+    sift_up(heap, heap->n_tasks);
+    heap->n_tasks++;
+
+    return 0;
+}
+
+void engine_task_heap_pop(struct engine_task_heap *heap, struct engine_task *task_out) {
+    DEBUG_ASSERT(heap->n_tasks > 0);
+
+    *task_out = heap->tasks[0];
+
+    heap->n_tasks--;
+    if (heap->n_tasks > 0) {
+        heap->tasks[0] = heap->tasks[heap->n_tasks];
+        sift_down(heap, 0);
+    }
+}
+
+void engine_task_heap_deinit(struct engine_task_heap *heap) {
+    free(heap->tasks);
+    *heap = (struct engine_task_heap) {0};
+}
+
+int engine_task_timer_arm(int timerfd, uint64_t target_time, uint64_t *armed_time) {
+    struct itimerspec spec = {0};
+    int ok;
+
+    if (target_time == *armed_time) {
+        return 0;
+    }
+
+    if (target_time != UINT64_MAX) {
+        // an all-zero it_value would disarm the timer.
+        target_time = max(target_time, 1);
+        spec.it_value.tv_sec = target_time / 1000000000ull;
+        spec.it_value.tv_nsec = target_time % 1000000000ull;
+    }
+
+    ok = timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, NULL);
+    if (ok < 0) {
+        return errno;
+    }
+
+    *armed_time = target_time;
+    return 0;
+}
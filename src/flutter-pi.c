@@ -23,6 +23,7 @@
 #include <elf.h>
 #include <langinfo.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -46,6 +47,8 @@
 
 #include <flutter-pi.h>
 #include <pixel_format.h>
+#include <object_pool.h>
+#include <watchdog.h>
 #include <compositor.h>
 #include <keyboard.h>
 #include <user_input.h>
@@ -95,6 +98,8 @@ OPTIONS:\n\
                              startup orientation. The angle is in degrees and\n\
                              clock-wise.\n\
                              Valid values are 0, 90, 180 and 270.\n\
+                             If the display controller can rotate by 180\n\
+                             degrees, it does so instead of the GPU.\n\
 \n\
   -d, --dimensions \"width_mm,height_mm\" The width & height of your display in\n\
                              millimeters. Useful if your GPU doesn't provide\n\
@@ -106,6 +111,12 @@ OPTIONS:\n\
   --pixelformat <format>     Selects the pixel format to use for the framebuffers.\n\
                              Available pixel formats:\n\
                                RGB565, ARGB8888, XRGB8888, BGRA8888, RGBA8888\n\
+                             By default, ARGB8888 is used if the display\n\
+                             supports it, so video players can show their\n\
+                             video beneath the UI. XRGB8888 is used if\n\
+                             nothing can be shown beneath the UI.\n\
+                             RGB565 needs half the memory bandwidth, but\n\
+                             has less color depth.\n\
 \n\
   -i, --input <glob pattern> Appends all files matching this glob pattern to the\n\
                              list of input (touchscreen, mouse, touchpad, \n\
@@ -124,6 +135,71 @@ OPTIONS:\n\
                              Note that you need to properly escape each glob \n\
                              pattern you use as a parameter so it isn't \n\
                              implicitly expanded by your shell.\n\
+\n\
+  --render-thread-sched <policy[:priority]>  Scheduling policy of the thread\n\
+                             the flutter engine renders on. <policy> is one of\n\
+                             other, batch, idle, fifo, rr. <priority> is the\n\
+                             realtime priority (1-99) for fifo and rr, or the\n\
+                             nice value (-20 - 19) for other and batch.\n\
+                             Elevated priorities need CAP_SYS_NICE.\n\
+                             Defaults to nice value -10 if possible.\n\
+                             Example: --render-thread-sched fifo:10\n\
+\n\
+  --render-thread-cpus <cpu list>  Only run the render thread on these CPUs.\n\
+                             Example: --render-thread-cpus 2-3\n\
+\n\
+  --ui-thread-sched <policy[:priority]>  Like --render-thread-sched, but for\n\
+                             the thread running the dart code. Defaults to\n\
+                             nice value -10 if possible.\n\
+\n\
+  --ui-thread-cpus <cpu list>  Like --render-thread-cpus, but for the thread\n\
+                             running the dart code.\n\
+\n\
+  --io-thread-sched <policy[:priority]>  Like --render-thread-sched, but for\n\
+                             the engine IO threads (image decoding etc).\n\
+                             Defaults to idle.\n\
+\n\
+  --io-thread-cpus <cpu list>  Like --render-thread-cpus, but for the engine\n\
+                             IO threads.\n\
+\n\
+  --watchdog-budget <ms>     Report platform thread callbacks (platform tasks,\n\
+                             engine tasks, platform messages, IO callbacks)\n\
+                             that run longer than this many milliseconds.\n\
+                             0 disables the check. Default: 100\n\
+\n\
+  --watchdog-backtraces      When the watchdog reports a callback, also print\n\
+                             a backtrace of the platform thread. The backtrace\n\
+                             is taken by interrupting the platform thread with\n\
+                             a signal, so sleeps running at that time end early.\n\
+\n\
+  --overlay-buffers <2-4>    How many buffers to use for each overlay layer\n\
+                             when rendering without GBM. With 3 or 4 buffers,\n\
+                             the next frame can be rendered while the last one\n\
+                             is still waiting for its page flip. Default: 2\n\
+\n\
+  --preallocate-overlays <count>  Create this many display-sized overlay\n\
+                             buffers at startup, so the first platform view\n\
+                             to appear doesn't stutter. Default: 0\n\
+\n\
+  --render-scale <factor>    Render the UI at this fraction of the display\n\
+                             resolution and let the display controller\n\
+                             upscale it. Helps GPUs that can't render at the\n\
+                             native resolution fast enough, e.g. on 4K\n\
+                             displays. Needs atomic modesetting and planes\n\
+                             that support scaling, otherwise the UI is\n\
+                             rendered at the native resolution.\n\
+                             With --dynamic-render-scale, this is the lowest\n\
+                             factor the UI is rendered at.\n\
+                             Valid values are 0.25 to 1. Default: 1, or 0.5\n\
+                             with --dynamic-render-scale\n\
+\n\
+  --dynamic-render-scale     Start at the native resolution and lower the\n\
+                             render scale while rasterizing a frame takes\n\
+                             longer than the display's refresh period allows.\n\
+                             Raised again step by step once frames are fast\n\
+                             enough. Only while the UI isn't rotated by the\n\
+                             engine, i.e. with a rotation of 0 degrees or one\n\
+                             the display controller can do.\n\
 \n\
   -h, --help                 Show this help and exit.\n\
 \n\
@@ -177,6 +253,8 @@ static bool on_make_current(void* userdata) {
         return false;
     }
 
+    compositor_on_raster_start();
+
     return true;
 }
 
@@ -392,60 +470,47 @@ static void on_platform_message(
     }
 }
 
-/// Called on the main thread when a new frame request may have arrived.
-/// Uses [drmCrtcGetSequence] or [FlutterEngineGetCurrentTime] to complete
-/// the frame request.
-static int on_execute_frame_request(
-    void *userdata
-) {
-    FlutterEngineResult result;
-    struct frame *peek;
+/// Called by the frame scheduler to get the timestamp of the last vblank.
+static uint64_t on_scheduler_get_last_vblank(void *userdata) {
+    uint64_t ns;
     int ok;
 
     (void) userdata;
-    cqueue_lock(&flutterpi.frame_queue);
-
-    ok = cqueue_peek_locked(&flutterpi.frame_queue, (void**) &peek);
-    if (ok == 0) {
-        if (peek->state == kFramePending) {
-            uint64_t ns;
-            if (flutterpi.drm.platform_supports_get_sequence_ioctl) {
-                ns = 0;
-                ok = drmCrtcGetSequence(flutterpi.drm.drmdev->fd, flutterpi.drm.drmdev->selected_crtc->crtc->crtc_id, NULL, &ns);
-                if (ok < 0) {
-                    perror("[flutter-pi] Couldn't get last vblank timestamp. drmCrtcGetSequence");
-                    cqueue_unlock(&flutterpi.frame_queue);
-                    return errno;
-                }
-            } else {
-                ns = flutterpi.flutter.libflutter_engine.FlutterEngineGetCurrentTime();
-            }
 
-            result = flutterpi.flutter.libflutter_engine.FlutterEngineOnVsync(
-                flutterpi.flutter.engine,
-                peek->baton,
-                ns,
-                ns + (1000000000 / flutterpi.display.refresh_rate)
-            );
-            if (result != kSuccess) {
-                LOG_ERROR("Could not reply to frame request. FlutterEngineOnVsync: %s\n", FLUTTER_RESULT_TO_STRING(result));
-                cqueue_unlock(&flutterpi.frame_queue);
-                return EIO;
-            }
+    if (!flutterpi.drm.platform_supports_get_sequence_ioctl) {
+        return 0;
+    }
 
-            peek->state = kFrameRendering;
-        }
-    } else if (ok == EAGAIN) {
-        // do nothing
-    } else if (ok != 0) {
-        LOG_ERROR("Could not get peek of frame queue. cqueue_peek_locked: %s\n", strerror(ok));
-        cqueue_unlock(&flutterpi.frame_queue);
-        return ok;
+    ns = 0;
+    ok = drmCrtcGetSequence(flutterpi.drm.drmdev->fd, flutterpi.drm.drmdev->selected_crtc->crtc->crtc_id, NULL, &ns);
+    if (ok < 0) {
+        perror("[flutter-pi] Couldn't get last vblank timestamp. drmCrtcGetSequence");
+        return 0;
     }
 
-    cqueue_unlock(&flutterpi.frame_queue);
+    return ns;
+}
 
-    return 0;
+static uint64_t on_scheduler_get_time(void *userdata) {
+    (void) userdata;
+    return get_monotonic_time();
+}
+
+/// Called by the frame scheduler when the engine can start rendering the requested frame.
+static void on_scheduler_reply(void *userdata, intptr_t baton, uint64_t frame_start_ns, uint64_t frame_target_ns) {
+    FlutterEngineResult result;
+
+    (void) userdata;
+
+    result = flutterpi.flutter.libflutter_engine.FlutterEngineOnVsync(
+        flutterpi.flutter.engine,
+        baton,
+        frame_start_ns,
+        frame_target_ns
+    );
+    if (result != kSuccess) {
+        LOG_ERROR("Could not reply to frame request. FlutterEngineOnVsync: %s\n", FLUTTER_RESULT_TO_STRING(result));
+    }
 }
 
 /// Called on some flutter internal thread to request a frame,
@@ -454,125 +519,193 @@ static void on_frame_request(
     void* userdata,
     intptr_t baton
 ) {
-    struct frame *peek;
-    int ok;
-
     (void) userdata;
-    cqueue_lock(&flutterpi.frame_queue);
+    frame_scheduler_request_frame(&flutterpi.frame_scheduler, baton);
+}
 
-    ok = cqueue_peek_locked(&flutterpi.frame_queue, (void**) &peek);
-    if ((ok == 0) || (ok == EAGAIN)) {
-        bool reply_instantly = ok == EAGAIN;
+static void dump_frame_scheduler_stats(void) {
+    struct frame_scheduler_stats stats;
 
-        ok = cqueue_try_enqueue_locked(&flutterpi.frame_queue, &(struct frame) {
-            .state = kFramePending,
-            .baton = baton
-        });
-        if (ok != 0) {
-            LOG_ERROR("Could not enqueue frame request. cqueue_try_enqueue_locked: %s\n", strerror(ok));
-            cqueue_unlock(&flutterpi.frame_queue);
-            return;
-        }
+    frame_scheduler_get_stats(&flutterpi.frame_scheduler, &stats);
 
-        if (reply_instantly) {
-            flutterpi_post_platform_task(
-                on_execute_frame_request,
-                NULL
-            );
-        }
-    } else if (ok != 0) {
-        LOG_ERROR("Could not get peek of frame queue. cqueue_peek_locked: %s\n", strerror(ok));
-    }
+    LOG_DEBUG(
+        "frame scheduler: %llu frame requests (%llu deferred until page flip), %llu frames submitted, %llu dropped, %llu vblanks\n",
+        (unsigned long long) stats.n_requests,
+        (unsigned long long) stats.n_deferred_requests,
+        (unsigned long long) stats.n_submitted_frames,
+        (unsigned long long) stats.n_dropped_frames,
+        (unsigned long long) stats.n_vblanks
+    );
 
-    cqueue_unlock(&flutterpi.frame_queue);
+    LOG_DEBUG(
+        "frame scheduler: refresh period %.0fns (mode timings: %.0fns), vblank prediction error avg %.0fns, max %.0fns over %llu samples, %llu intervals rejected\n",
+        stats.estimated_period_ns,
+        stats.nominal_period_ns,
+        stats.n_drift_samples ? stats.total_abs_drift_ns / stats.n_drift_samples : 0.0,
+        stats.max_abs_drift_ns,
+        (unsigned long long) stats.n_drift_samples,
+        (unsigned long long) stats.n_rejected_intervals
+    );
 }
 
 static FlutterTransformation on_get_transformation(void *userdata) {
     (void) userdata;
-    return flutterpi.view.view_to_display_transform;
+    return flutterpi.view.engine_view_to_display_transform;
 }
 
-atomic_int_least64_t platform_task_counter = 0;
+/// pools for the objects that are allocated for every timed platform task / platform message.
+static struct object_pool platform_task_pool = OBJECT_POOL_INITIALIZER("timed platform tasks", sizeof(struct platform_task), 16);
+static struct object_pool platform_message_pool = OBJECT_POOL_INITIALIZER("platform messages", sizeof(struct platform_message), 64);
+
+/// Platform message channel names and payloads that fit into this
+/// are copied into pooled buffers instead of heap allocated ones.
+#define PLATFORM_MESSAGE_BUFFER_SIZE 256
+static struct object_pool platform_message_buffer_pool = OBJECT_POOL_INITIALIZER("platform message buffers", PLATFORM_MESSAGE_BUFFER_SIZE, 128);
+
+static void dump_platform_task_stats(void) {
+#ifdef DEBUG
+    for (int i = 0; i <= kMax_PlatformTaskPriority; i++) {
+        LOG_DEBUG("platform task priority %d: starved %" PRIu64 " times\n", i, flutterpi.platform_task_queues[i].n_boosts);
+    }
+#endif
+}
 
 /// platform tasks
-static int on_execute_platform_task(
-    sd_event_source *s,
-    void *userdata
-) {
-    struct platform_task *task;
+static int64_t get_sd_event_priority(enum platform_task_priority priority) {
+    // kPlatformTaskPriorityBackground maps to SD_EVENT_PRIORITY_NORMAL, the priority
+    // of event sources added by plugins. Everything else is more important.
+    return SD_EVENT_PRIORITY_NORMAL - 10 * (int64_t) (kMax_PlatformTaskPriority - priority);
+}
+
+/**
+ * @brief Run all platform tasks of this priority class that were queued before this batch started.
+ * 
+ * Called by the wakeup eventfd handler of the queue on the platform thread.
+ * Tasks that are posted while the batch is running are executed in the next
+ * main loop iteration, so higher priority event sources get a chance to run in between.
+ */
+static int on_execute_platform_tasks(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    struct platform_task_queue *queue;
     int ok;
 
-    task = userdata;
-    ok = task->callback(task->userdata);
-    if (ok != 0) {
-        LOG_ERROR("Error executing platform task: %s\n", strerror(ok));
+    (void) s;
+    (void) fd;
+    (void) revents;
+
+    queue = userdata;
+
+    ok = task_queue_run(&queue->tasks);
+
+    if (queue->is_boosted) {
+        sd_event_source_set_priority(queue->source, get_sd_event_priority(queue->priority));
+        queue->is_boosted = false;
     }
 
-    free(task);
+    return ok;
+}
+
+/**
+ * @brief Called after every main loop dispatch. Checks whether any platform task class
+ * was starved by higher priority work and, if so, dispatches it first the next time.
+ */
+static int on_check_platform_task_starvation(sd_event_source *s, void *userdata) {
+    struct platform_task_queue *queue;
+    uint64_t now, pending_since;
 
-    sd_event_source_set_enabled(s, SD_EVENT_OFF);
-    sd_event_source_unrefp(&s);
+    (void) s;
+    (void) userdata;
+
+    now = get_monotonic_time();
+
+    for (int i = kPlatformTaskPriorityInput + 1; i <= kMax_PlatformTaskPriority; i++) {
+        queue = flutterpi.platform_task_queues + i;
+
+        if (queue->is_boosted) {
+            continue;
+        }
+
+        // Tasks are posted from other threads, so they may have been posted after `now`.
+        pending_since = task_queue_get_pending_since(&queue->tasks);
+        if ((pending_since == 0) || (pending_since >= now)) {
+            continue;
+        }
+
+        if (now - pending_since > PLATFORM_TASK_STARVATION_THRESHOLD_NS) {
+            sd_event_source_set_priority(queue->source, get_sd_event_priority(kPlatformTaskPriorityInput) - 10);
+            queue->is_boosted = true;
+            queue->n_boosts++;
+        }
+    }
 
     return 0;
 }
 
+int flutterpi_post_platform_task_with_priority(
+    enum platform_task_priority priority,
+    int (*callback)(void *userdata),
+    void *userdata
+) {
+    DEBUG_ASSERT(priority <= kMax_PlatformTaskPriority);
+
+    // Tasks of the same priority are executed in the order they were posted.
+    return task_queue_post(&flutterpi.platform_task_queues[priority].tasks, callback, userdata);
+}
+
 int flutterpi_post_platform_task(
     int (*callback)(void *userdata),
     void *userdata
 ) {
-    struct platform_task *task;
-    sd_event_source *src;
+    return flutterpi_post_platform_task_with_priority(kPlatformTaskPriorityBackground, callback, userdata);
+}
+
+static int init_platform_task_queues(void) {
+    struct platform_task_queue *queue;
     int ok;
 
-    task = malloc(sizeof *task);
-    if (task == NULL) {
-        return ENOMEM;
-    }
+    for (int i = 0; i <= kMax_PlatformTaskPriority; i++) {
+        queue = flutterpi.platform_task_queues + i;
 
-    task->callback = callback;
-    task->userdata = userdata;
+        ok = task_queue_init(&queue->tasks);
+        if (ok != 0) {
+            return ok;
+        }
 
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_lock(&flutterpi.event_loop_mutex);
+        queue->priority = i;
+        queue->is_boosted = false;
+        queue->n_boosts = 0;
+
+        ok = sd_event_add_io(
+            flutterpi.event_loop,
+            &queue->source,
+            queue->tasks.wakeup_fd,
+            EPOLLIN,
+            on_execute_platform_tasks,
+            queue
+        );
+        if (ok < 0) {
+            LOG_ERROR("Error adding platform task queue to main loop. sd_event_add_io: %s\n", strerror(-ok));
+            task_queue_deinit(&queue->tasks);
+            return -ok;
+        }
+
+        sd_event_source_set_priority(queue->source, get_sd_event_priority(i));
     }
 
-    ok = sd_event_add_defer(
+    ok = sd_event_add_post(
         flutterpi.event_loop,
-        &src,
-        on_execute_platform_task,
-        task
+        &flutterpi.starvation_check_source,
+        on_check_platform_task_starvation,
+        NULL
     );
     if (ok < 0) {
-        LOG_ERROR("Error posting platform task to main loop. sd_event_add_defer: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_unlock_event_loop;
-    }
-
-    // Higher values mean lower priority. So later platform tasks are handled later too.
-    sd_event_source_set_priority(src, atomic_fetch_add(&platform_task_counter, 1));
-
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        ok = write(flutterpi.wakeup_event_loop_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
-        if (ok < 0) {
-            perror("[flutter-pi] Error arming main loop for platform task. write");
-            ok = errno;
-            goto fail_unlock_event_loop;
-        }
+        LOG_ERROR("Error adding platform task starvation check to main loop. sd_event_add_post: %s\n", strerror(-ok));
+        return -ok;
     }
 
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-    }
+    // The check itself must never be starved.
+    sd_event_source_set_priority(flutterpi.starvation_check_source, get_sd_event_priority(kPlatformTaskPriorityInput) - 20);
 
     return 0;
-
-
-    fail_unlock_event_loop:
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-    }
-
-    return ok;
 }
 
 /// timed platform tasks
@@ -592,7 +725,7 @@ static int on_execute_platform_task_with_time(
         LOG_ERROR("Error executing timed platform task: %s\n", strerror(ok));
     }
 
-    free(task);
+    object_pool_free(&platform_task_pool, task);
 
     sd_event_source_set_enabled(s, SD_EVENT_OFF);
     sd_event_source_unrefp(&s);
@@ -600,77 +733,107 @@ static int on_execute_platform_task_with_time(
     return 0;
 }
 
-int flutterpi_post_platform_task_with_time(
-    int (*callback)(void *userdata),
-    void *userdata,
-    uint64_t target_time_usec
-) {
+static int on_add_timed_platform_task(void *userdata) {
     struct platform_task *task;
-    //sd_event_source *source;
     int ok;
 
-    task = malloc(sizeof *task);
-    if (task == NULL) {
-        return ENOMEM;
-    }
-
-    task->callback = callback;
-    task->userdata = userdata;
-
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_lock(&flutterpi.event_loop_mutex);
-    }
+    task = userdata;
 
     ok = sd_event_add_time(
         flutterpi.event_loop,
         NULL,
         CLOCK_MONOTONIC,
-        target_time_usec,
+        task->target_time_usec,
         1,
         on_execute_platform_task_with_time,
         task
     );
     if (ok < 0) {
         LOG_ERROR("Error posting platform task to main loop. sd_event_add_time: %s\n", strerror(-ok));
-        ok = -ok;
-        goto fail_unlock_event_loop;
+        object_pool_free(&platform_task_pool, task);
+        return -ok;
     }
 
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        ok = write(flutterpi.wakeup_event_loop_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
-        if (ok < 0) {
-            perror("[flutter-pi] Error arming main loop for platform task. write");
-            ok = errno;
-            goto fail_unlock_event_loop;
-        }
+    return 0;
+}
+
+int flutterpi_post_platform_task_with_time(
+    int (*callback)(void *userdata),
+    void *userdata,
+    uint64_t target_time_usec
+) {
+    struct platform_task *task;
+    int ok;
+
+    task = object_pool_alloc(&platform_task_pool);
+    if (task == NULL) {
+        return ENOMEM;
     }
 
+    task->callback = callback;
+    task->userdata = userdata;
+    task->target_time_usec = target_time_usec;
+
+    // sd_event is not thread-safe. If we're not on the platform thread,
+    // let the platform thread add the timer source for us.
     if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+        ok = flutterpi_post_platform_task(on_add_timed_platform_task, task);
+    } else {
+        ok = on_add_timed_platform_task(task);
+        return ok;
+    }
+
+    if (ok != 0) {
+        object_pool_free(&platform_task_pool, task);
+        return ok;
     }
 
     return 0;
+}
 
+/// Wraps IO callbacks added by plugins, so the watchdog knows which one is running.
+struct io_callback_wrapper {
+    sd_event_io_handler_t callback;
+    void *userdata;
+};
+
+static int on_io_callback_wrapper(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    struct io_callback_wrapper *wrapper;
+    int ok;
+
+    wrapper = userdata;
+
+    watchdog_enter(kWatchdogEventSource, (const void*) wrapper->callback, NULL);
+    ok = wrapper->callback(s, fd, revents, wrapper->userdata);
+    watchdog_leave();
 
-    fail_unlock_event_loop:
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-    }
-    free(task);
     return ok;
 }
 
-int flutterpi_sd_event_add_io(
+/**
+ * @brief Add an IO event source to the main loop. Must be called on the platform thread.
+ */
+static int add_io(
     sd_event_source **source_out,
     int fd,
     uint32_t events,
     sd_event_io_handler_t callback,
     void *userdata
 ) {
+    struct io_callback_wrapper *wrapper;
     int ok;
 
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_lock(&flutterpi.event_loop_mutex);
+    // floating sources (source_out == NULL) can't be given a destroy callback,
+    // so they're not wrapped and only show up as "sd_event_dispatch" in the watchdog.
+    wrapper = NULL;
+    if (source_out != NULL) {
+        wrapper = malloc(sizeof *wrapper);
+        if (wrapper == NULL) {
+            return ENOMEM;
+        }
+
+        wrapper->callback = callback;
+        wrapper->userdata = userdata;
     }
 
     ok = sd_event_add_io(
@@ -678,124 +841,496 @@ int flutterpi_sd_event_add_io(
         source_out,
         fd,
         events,
-        callback,
-        userdata
+        wrapper ? on_io_callback_wrapper : callback,
+        wrapper ? wrapper : userdata
     );
     if (ok < 0) {
         LOG_ERROR("Could not add IO callback to event loop. sd_event_add_io: %s\n", strerror(-ok));
+        free(wrapper);
         return -ok;
     }
 
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        ok = write(flutterpi.wakeup_event_loop_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
-        if (ok < 0) {
-            perror("[flutter-pi] Error arming main loop for io callback. write");
-            ok = errno;
-            goto fail_unlock_event_loop;
-        }
-    }
-
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+    if (wrapper != NULL) {
+        sd_event_source_set_destroy_callback(*source_out, free);
     }
 
     return 0;
+}
 
+struct add_io_request {
+    int fd;
+    uint32_t events;
+    sd_event_io_handler_t callback;
+    void *userdata;
+    flutterpi_io_source_added_cb on_added;
+};
 
-    fail_unlock_event_loop:
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-    }
-    return ok;
-}
+static int on_add_io(void *userdata) {
+    struct add_io_request *req;
+    sd_event_source *source;
+    int ok;
 
-/// flutter tasks
-static int on_execute_flutter_task(
-    void *userdata
-) {
-    FlutterEngineResult result;
-    FlutterTask *task;
+    req = userdata;
 
-    task = userdata;
+    source = NULL;
+    ok = add_io(req->on_added != NULL ? &source : NULL, req->fd, req->events, req->callback, req->userdata);
 
-    result = flutterpi.flutter.libflutter_engine.FlutterEngineRunTask(flutterpi.flutter.engine, task);
-    if (result != kSuccess) {
-        LOG_ERROR("Error running platform task. FlutterEngineRunTask: %d\n", result);
-        free(task);
-        return EINVAL;
+    if (req->on_added != NULL) {
+        req->on_added(source, ok, req->userdata);
     }
 
-    free(task);
-
+    free(req);
     return 0;
 }
 
-static void on_post_flutter_task(
-    FlutterTask task,
-    uint64_t target_time,
-    void *userdata
+int flutterpi_sd_event_add_io_async(
+    int fd,
+    uint32_t events,
+    sd_event_io_handler_t callback,
+    void *userdata,
+    flutterpi_io_source_added_cb on_added
 ) {
-    FlutterTask *dup_task;
+    struct add_io_request *req;
     int ok;
 
-    (void) userdata;
-
-    dup_task = malloc(sizeof *dup_task);
-    if (dup_task == NULL) {
-        return;
+    req = malloc(sizeof *req);
+    if (req == NULL) {
+        return ENOMEM;
     }
 
-    *dup_task = task;
+    req->fd = fd;
+    req->events = events;
+    req->callback = callback;
+    req->userdata = userdata;
+    req->on_added = on_added;
 
-    ok = flutterpi_post_platform_task_with_time(
-        on_execute_flutter_task,
-        dup_task,
-        target_time / 1000
-    );
+    if (pthread_self() == flutterpi.event_loop_thread) {
+        return on_add_io(req);
+    }
+
+    // sd_event is not thread-safe, so add the source on the platform thread.
+    ok = flutterpi_post_platform_task_with_priority(kPlatformTaskPriorityInput, on_add_io, req);
     if (ok != 0) {
-        free(dup_task);
+        free(req);
+        return ok;
     }
+
+    return 0;
 }
 
-/// platform messages
-static int on_send_platform_message(
+int flutterpi_sd_event_add_io(
+    sd_event_source **source_out,
+    int fd,
+    uint32_t events,
+    sd_event_io_handler_t callback,
     void *userdata
 ) {
-    struct platform_message *msg;
-    FlutterEngineResult result;
-
-    msg = userdata;
-
-    if (msg->is_response) {
-        result = flutterpi.flutter.libflutter_engine.FlutterEngineSendPlatformMessageResponse(flutterpi.flutter.engine, msg->target_handle, msg->message, msg->message_size);
-    } else {
-        result = flutterpi.flutter.libflutter_engine.FlutterEngineSendPlatformMessage(
-            flutterpi.flutter.engine,
-            &(FlutterPlatformMessage) {
-                .struct_size = sizeof(FlutterPlatformMessage),
-                .channel = msg->target_channel,
-                .message = msg->message,
-                .message_size = msg->message_size,
-                .response_handle = msg->response_handle
-            }
-        );
+    if (pthread_self() == flutterpi.event_loop_thread) {
+        return add_io(source_out, fd, events, callback, userdata);
     }
 
-    if (msg->message) {
-        free(msg->message);
+    // Waiting for the platform thread to hand us the source would block this thread
+    // for as long as the platform thread is busy.
+    if (source_out != NULL) {
+        LOG_ERROR("flutterpi_sd_event_add_io can only return the event source on the platform thread. Use flutterpi_sd_event_add_io_async instead.\n");
+        return EINVAL;
     }
 
-    if (msg->is_response == false) {
-        free(msg->target_channel);
-    }
+    return flutterpi_sd_event_add_io_async(fd, events, callback, userdata, NULL);
+}
 
-    free(msg);
+/// flutter tasks
+/**
+ * @brief Arm the engine task timerfd for @ref target_time (absolute CLOCK_MONOTONIC, in ns),
+ * or disarm it if @ref target_time is UINT64_MAX. engine_tasks.mutex must be locked.
+ */
+static int arm_engine_task_timer_locked(uint64_t target_time) {
+    uint64_t armed_time;
+    int ok;
 
-    if (result != kSuccess) {
-        LOG_ERROR("Error sending platform message. FlutterEngineSendPlatformMessage: %s\n", FLUTTER_RESULT_TO_STRING(result));
-    }
+    armed_time = flutterpi.engine_tasks.armed_time;
 
-    return 0;
+    ok = engine_task_timer_arm(flutterpi.engine_tasks.timerfd, target_time, &flutterpi.engine_tasks.armed_time);
+    if (ok != 0) {
+        LOG_ERROR("Could not arm engine task timer. timerfd_settime: %s\n", strerror(ok));
+        return ok;
+    }
+
+    if (flutterpi.engine_tasks.armed_time != armed_time) {
+        flutterpi.engine_tasks.n_timer_arms++;
+    }
+
+    return 0;
+}
+
+static int on_engine_task_timer_expired(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    const struct engine_task *next;
+    FlutterEngineResult result;
+    struct engine_task task;
+    uint64_t expirations, now, seq_limit;
+    int ok;
+
+    (void) s;
+    (void) revents;
+    (void) userdata;
+
+    ok = read(fd, &expirations, sizeof expirations);
+    if ((ok < 0) && (errno != EAGAIN)) {
+        perror("[flutter-pi] Could not read engine task timer. read");
+        return errno;
+    }
+
+    now = get_monotonic_time();
+
+    pthread_mutex_lock(&flutterpi.engine_tasks.mutex);
+
+    flutterpi.engine_tasks.n_dispatches++;
+
+    // Don't run tasks that are posted while we're dispatching. Otherwise a task
+    // that re-posts itself with target time "now" would keep us here forever.
+    seq_limit = flutterpi.engine_tasks.heap.next_seq;
+
+    while ((next = engine_task_heap_peek(&flutterpi.engine_tasks.heap)) && (next->target_time <= now) && (next->seq < seq_limit)) {
+        engine_task_heap_pop(&flutterpi.engine_tasks.heap, &task);
+
+        flutterpi.engine_tasks.n_executed++;
+        flutterpi.engine_tasks.total_lateness_ns += now - task.target_time;
+        flutterpi.engine_tasks.max_lateness_ns = max(flutterpi.engine_tasks.max_lateness_ns, now - task.target_time);
+
+        // The engine may post new tasks from inside FlutterEngineRunTask,
+        // so we can't hold the mutex while running the task.
+        pthread_mutex_unlock(&flutterpi.engine_tasks.mutex);
+
+        watchdog_enter(kWatchdogEngineTask, NULL, NULL);
+        result = flutterpi.flutter.libflutter_engine.FlutterEngineRunTask(flutterpi.flutter.engine, &task.task);
+        watchdog_leave();
+        if (result != kSuccess) {
+            LOG_ERROR("Error running platform task. FlutterEngineRunTask: %d\n", result);
+        }
+
+        pthread_mutex_lock(&flutterpi.engine_tasks.mutex);
+    }
+
+    // The timerfd fired, so it's disarmed now (unless someone re-armed it while we were running tasks).
+    if (flutterpi.engine_tasks.armed_time <= now) {
+        flutterpi.engine_tasks.armed_time = UINT64_MAX;
+    }
+
+    next = engine_task_heap_peek(&flutterpi.engine_tasks.heap);
+    ok = arm_engine_task_timer_locked(next != NULL ? next->target_time : UINT64_MAX);
+
+    pthread_mutex_unlock(&flutterpi.engine_tasks.mutex);
+
+    return ok;
+}
+
+static void on_post_flutter_task(
+    FlutterTask task,
+    uint64_t target_time,
+    void *userdata
+) {
+    int ok;
+
+    (void) userdata;
+
+    pthread_mutex_lock(&flutterpi.engine_tasks.mutex);
+
+    ok = engine_task_heap_push(&flutterpi.engine_tasks.heap, task, target_time);
+    if (ok != 0) {
+        LOG_ERROR("Could not grow engine task heap.\n");
+        pthread_mutex_unlock(&flutterpi.engine_tasks.mutex);
+        return;
+    }
+
+    flutterpi.engine_tasks.n_posted++;
+
+    // Only touch the timerfd if this task is due before the one the timer is armed for.
+    // Tasks with the same (or a later) deadline are picked up by the same dispatch.
+    if (target_time < flutterpi.engine_tasks.armed_time) {
+        ok = arm_engine_task_timer_locked(target_time);
+        if (ok != 0) {
+            LOG_ERROR("Could not schedule engine task.\n");
+        }
+    }
+
+    pthread_mutex_unlock(&flutterpi.engine_tasks.mutex);
+}
+
+static int init_engine_task_timer(void) {
+    int ok, fd;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0) {
+        perror("[flutter-pi] Could not create engine task timer. timerfd_create");
+        return errno;
+    }
+
+    ok = sd_event_add_io(
+        flutterpi.event_loop,
+        &flutterpi.engine_tasks.source,
+        fd,
+        EPOLLIN,
+        on_engine_task_timer_expired,
+        NULL
+    );
+    if (ok < 0) {
+        LOG_ERROR("Could not add engine task timer to main loop. sd_event_add_io: %s\n", strerror(-ok));
+        close(fd);
+        return -ok;
+    }
+
+    sd_event_source_set_priority(flutterpi.engine_tasks.source, get_sd_event_priority(kPlatformTaskPriorityEngine));
+
+    pthread_mutex_init(&flutterpi.engine_tasks.mutex, NULL);
+    flutterpi.engine_tasks.heap = (struct engine_task_heap) {0};
+    flutterpi.engine_tasks.timerfd = fd;
+    flutterpi.engine_tasks.armed_time = UINT64_MAX;
+
+    return 0;
+}
+
+static void dump_engine_task_stats(void) {
+    LOG_DEBUG(
+        "engine tasks: %" PRIu64 " posted, %" PRIu64 " executed in %" PRIu64 " dispatches, "
+        "%" PRIu64 " timer re-arms, lateness avg %" PRIu64 "us, max %" PRIu64 "us\n",
+        flutterpi.engine_tasks.n_posted,
+        flutterpi.engine_tasks.n_executed,
+        flutterpi.engine_tasks.n_dispatches,
+        flutterpi.engine_tasks.n_timer_arms,
+        flutterpi.engine_tasks.n_executed ? flutterpi.engine_tasks.total_lateness_ns / flutterpi.engine_tasks.n_executed / 1000 : 0,
+        flutterpi.engine_tasks.max_lateness_ns / 1000
+    );
+}
+
+/// render tasks
+static void *render_thread_entry(void *userdata) {
+    const struct engine_task *next;
+    FlutterEngineResult result;
+    struct engine_task task;
+    struct timespec deadline;
+
+    (void) userdata;
+
+    thread_config_apply(&flutterpi.thread_configs[kRaster], "render");
+
+    pthread_mutex_lock(&flutterpi.render_thread.mutex);
+    while (!flutterpi.render_thread.should_stop) {
+        next = engine_task_heap_peek(&flutterpi.render_thread.heap);
+        if (next == NULL) {
+            pthread_cond_wait(&flutterpi.render_thread.task_added, &flutterpi.render_thread.mutex);
+            continue;
+        }
+
+        if (next->target_time > get_monotonic_time()) {
+            deadline.tv_sec = next->target_time / 1000000000ull;
+            deadline.tv_nsec = next->target_time % 1000000000ull;
+            pthread_cond_timedwait(&flutterpi.render_thread.task_added, &flutterpi.render_thread.mutex, &deadline);
+            continue;
+        }
+
+        engine_task_heap_pop(&flutterpi.render_thread.heap, &task);
+
+        pthread_mutex_unlock(&flutterpi.render_thread.mutex);
+
+        result = flutterpi.flutter.libflutter_engine.FlutterEngineRunTask(flutterpi.flutter.engine, &task.task);
+        if (result != kSuccess) {
+            LOG_ERROR("Error running render task. FlutterEngineRunTask: %d\n", result);
+        }
+
+        pthread_mutex_lock(&flutterpi.render_thread.mutex);
+    }
+    pthread_mutex_unlock(&flutterpi.render_thread.mutex);
+
+    return NULL;
+}
+
+static bool runs_render_tasks_on_current_thread(void *userdata) {
+    (void) userdata;
+    return pthread_equal(pthread_self(), flutterpi.render_thread.thread) != 0;
+}
+
+static void on_post_render_task(
+    FlutterTask task,
+    uint64_t target_time,
+    void *userdata
+) {
+    int ok;
+
+    (void) userdata;
+
+    pthread_mutex_lock(&flutterpi.render_thread.mutex);
+
+    ok = engine_task_heap_push(&flutterpi.render_thread.heap, task, target_time);
+    if (ok != 0) {
+        LOG_ERROR("Could not grow render task heap.\n");
+        pthread_mutex_unlock(&flutterpi.render_thread.mutex);
+        return;
+    }
+
+    // Only wake the render thread if it's now waiting for the wrong (later) task.
+    if (engine_task_heap_peek(&flutterpi.render_thread.heap)->seq == flutterpi.render_thread.heap.next_seq - 1) {
+        pthread_cond_signal(&flutterpi.render_thread.task_added);
+    }
+
+    pthread_mutex_unlock(&flutterpi.render_thread.mutex);
+}
+
+static int init_render_thread(void) {
+    pthread_condattr_t attr;
+    int ok;
+
+    pthread_mutex_init(&flutterpi.render_thread.mutex, NULL);
+
+    // engine task target times are CLOCK_MONOTONIC based.
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flutterpi.render_thread.task_added, &attr);
+    pthread_condattr_destroy(&attr);
+
+    flutterpi.render_thread.heap = (struct engine_task_heap) {0};
+    flutterpi.render_thread.should_stop = false;
+
+    ok = pthread_create(&flutterpi.render_thread.thread, NULL, render_thread_entry, NULL);
+    if (ok != 0) {
+        LOG_ERROR("Could not create render thread. pthread_create: %s\n", strerror(ok));
+        pthread_cond_destroy(&flutterpi.render_thread.task_added);
+        pthread_mutex_destroy(&flutterpi.render_thread.mutex);
+        return ok;
+    }
+
+    pthread_setname_np(flutterpi.render_thread.thread, "flutter-pi.rstr");
+
+    return 0;
+}
+
+/**
+ * @brief Stop the render thread and wait for it to exit. Render tasks that haven't run yet are dropped.
+ */
+static void deinit_render_thread(void) {
+    pthread_mutex_lock(&flutterpi.render_thread.mutex);
+    flutterpi.render_thread.should_stop = true;
+    pthread_cond_signal(&flutterpi.render_thread.task_added);
+    pthread_mutex_unlock(&flutterpi.render_thread.mutex);
+
+    pthread_join(flutterpi.render_thread.thread, NULL);
+
+    engine_task_heap_deinit(&flutterpi.render_thread.heap);
+    pthread_cond_destroy(&flutterpi.render_thread.task_added);
+    pthread_mutex_destroy(&flutterpi.render_thread.mutex);
+}
+
+/// thread priorities
+static const char *thread_priority_names[kRaster + 1] = {
+    [kBackground] = "background",
+    [kNormal] = "normal",
+    [kDisplay] = "display",
+    [kRaster] = "raster"
+};
+
+/**
+ * @brief Called by the engine on every thread it creates, with the role of that thread.
+ */
+static void on_set_thread_priority(FlutterThreadPriority priority) {
+    if ((priority < kBackground) || (priority > kRaster)) {
+        LOG_ERROR("Engine requested unknown thread priority: %d\n", priority);
+        return;
+    }
+
+    thread_config_apply(&flutterpi.thread_configs[priority], thread_priority_names[priority]);
+}
+
+/**
+ * @brief Set up the built-in scheduling defaults for the engine threads.
+ * Command line options override these.
+ */
+static void init_default_thread_configs(void) {
+    for (int i = 0; i <= kRaster; i++) {
+        flutterpi.thread_configs[i] = THREAD_CONFIG_INITIALIZER;
+    }
+
+    // The UI and raster threads produce the frames, so they shouldn't get
+    // preempted by background work like gstreamer or other processes.
+    // Raising the nice value needs CAP_SYS_NICE, so these are best-effort.
+    flutterpi.thread_configs[kDisplay].has_sched_policy = true;
+    flutterpi.thread_configs[kDisplay].sched_policy = SCHED_OTHER;
+    flutterpi.thread_configs[kDisplay].sched_priority = -10;
+    flutterpi.thread_configs[kDisplay].is_sched_optional = true;
+
+    flutterpi.thread_configs[kRaster] = flutterpi.thread_configs[kDisplay];
+
+    // IO threads only decode images and the like and can wait until everything else is done.
+    flutterpi.thread_configs[kBackground].has_sched_policy = true;
+    flutterpi.thread_configs[kBackground].sched_policy = SCHED_IDLE;
+    flutterpi.thread_configs[kBackground].sched_priority = 0;
+    flutterpi.thread_configs[kBackground].is_sched_optional = true;
+}
+
+/// platform messages
+static void *platform_message_buffer_dup(const void *buffer, size_t size) {
+    void *dup;
+
+    if (size > PLATFORM_MESSAGE_BUFFER_SIZE) {
+        return memdup(buffer, size);
+    }
+
+    dup = object_pool_alloc(&platform_message_buffer_pool);
+    if (dup == NULL) {
+        return NULL;
+    }
+
+    return memcpy(dup, buffer, size);
+}
+
+static void platform_message_buffer_free(void *buffer, size_t size) {
+    if (size > PLATFORM_MESSAGE_BUFFER_SIZE) {
+        free(buffer);
+    } else {
+        object_pool_free(&platform_message_buffer_pool, buffer);
+    }
+}
+
+static void platform_message_destroy(struct platform_message *msg) {
+    if (msg->message) {
+        platform_message_buffer_free(msg->message, msg->message_size);
+    }
+
+    if (msg->is_response == false) {
+        platform_message_buffer_free(msg->target_channel, strlen(msg->target_channel) + 1);
+    }
+
+    object_pool_free(&platform_message_pool, msg);
+}
+
+static int on_send_platform_message(
+    void *userdata
+) {
+    struct platform_message *msg;
+    FlutterEngineResult result;
+
+    msg = userdata;
+
+    if (msg->is_response) {
+        result = flutterpi.flutter.libflutter_engine.FlutterEngineSendPlatformMessageResponse(flutterpi.flutter.engine, msg->target_handle, msg->message, msg->message_size);
+    } else {
+        result = flutterpi.flutter.libflutter_engine.FlutterEngineSendPlatformMessage(
+            flutterpi.flutter.engine,
+            &(FlutterPlatformMessage) {
+                .struct_size = sizeof(FlutterPlatformMessage),
+                .channel = msg->target_channel,
+                .message = msg->message,
+                .message_size = msg->message_size,
+                .response_handle = msg->response_handle
+            }
+        );
+    }
+
+    platform_message_destroy(msg);
+
+    if (result != kSuccess) {
+        LOG_ERROR("Error sending platform message. FlutterEngineSendPlatformMessage: %s\n", FLUTTER_RESULT_TO_STRING(result));
+    }
+
+    return 0;
 }
 
 int flutterpi_send_platform_message(
@@ -824,15 +1359,15 @@ int flutterpi_send_platform_message(
             return EIO;
         }
     } else {
-        msg = calloc(1, sizeof *msg);
+        msg = object_pool_zalloc(&platform_message_pool);
         if (msg == NULL) {
             return ENOMEM;
         }
 
         msg->is_response = false;
-        msg->target_channel = strdup(channel);
+        msg->target_channel = platform_message_buffer_dup(channel, strlen(channel) + 1);
         if (msg->target_channel == NULL) {
-            free(msg);
+            object_pool_free(&platform_message_pool, msg);
             return ENOMEM;
         }
 
@@ -840,10 +1375,10 @@ int flutterpi_send_platform_message(
 
         if (message && message_size) {
             msg->message_size = message_size;
-            msg->message = memdup(message, message_size);
+            msg->message = platform_message_buffer_dup(message, message_size);
             if (msg->message == NULL) {
-                free(msg->target_channel);
-                free(msg);
+                platform_message_buffer_free(msg->target_channel, strlen(channel) + 1);
+                object_pool_free(&platform_message_pool, msg);
                 return ENOMEM;
             }
         } else {
@@ -851,16 +1386,13 @@ int flutterpi_send_platform_message(
             msg->message_size = 0;
         }
 
-        ok = flutterpi_post_platform_task(
+        ok = flutterpi_post_platform_task_with_priority(
+            kPlatformTaskPriorityPlatformMessage,
             on_send_platform_message,
             msg
         );
         if (ok != 0) {
-            if (message && message_size) {
-                free(msg->message);
-            }
-            free(msg->target_channel);
-            free(msg);
+            platform_message_destroy(msg);
             return ok;
         }
     }
@@ -889,7 +1421,7 @@ int flutterpi_respond_to_platform_message(
             return EIO;
         }
     } else {
-        msg = malloc(sizeof *msg);
+        msg = object_pool_alloc(&platform_message_pool);
         if (msg == NULL) {
             return ENOMEM;
         }
@@ -898,9 +1430,9 @@ int flutterpi_respond_to_platform_message(
         msg->target_handle = handle;
         if (message && message_size) {
             msg->message_size = message_size;
-            msg->message = memdup(message, message_size);
+            msg->message = platform_message_buffer_dup(message, message_size);
             if (!msg->message) {
-                free(msg);
+                object_pool_free(&platform_message_pool, msg);
                 return ENOMEM;
             }
         } else {
@@ -908,15 +1440,13 @@ int flutterpi_respond_to_platform_message(
             msg->message = 0;
         }
 
-        ok = flutterpi_post_platform_task(
+        ok = flutterpi_post_platform_task_with_priority(
+            kPlatformTaskPriorityPlatformMessage,
             on_send_platform_message,
             msg
         );
         if (ok != 0) {
-            if (msg->message) {
-                free(msg->message);
-            }
-            free(msg);
+            platform_message_destroy(msg);
         }
     }
 
@@ -993,143 +1523,96 @@ static bool runs_platform_tasks_on_current_thread(void* userdata) {
     return pthread_equal(pthread_self(), flutterpi.event_loop_thread) != 0;
 }
 
+/**
+ * @brief Run the main loop until @ref flutterpi_schedule_exit is called.
+ * 
+ * Other threads never touch the sd_event loop directly, they only post tasks
+ * to the lock-free platform task queue and wake the loop up using the wakeup eventfd.
+ * So there's no lock held while waiting for or dispatching events.
+ */
 static int run_main_loop(void) {
-    int ok, evloop_fd;
+    int ok, state;
 
-    pthread_mutex_lock(&flutterpi.event_loop_mutex);
-    ok = sd_event_get_fd(flutterpi.event_loop);
-    if (ok < 0) {
-        LOG_ERROR("Could not get fd for main event loop. sd_event_get_fd: %s\n", strerror(-ok));
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-        return -ok;
-    }
-    pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-
-    evloop_fd = ok;
-
-    {
-        fd_set rfds, wfds, xfds;
-        int state;
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&xfds);
-        FD_SET(evloop_fd, &rfds);
-        FD_SET(evloop_fd, &wfds);
-        FD_SET(evloop_fd, &xfds);
-
-        const fd_set const_fds = rfds;
-
-        pthread_mutex_lock(&flutterpi.event_loop_mutex);
-
-        do {
-            state = sd_event_get_state(flutterpi.event_loop);
-            switch (state) {
-                case SD_EVENT_INITIAL:
-                    ok = sd_event_prepare(flutterpi.event_loop);
-                    if (ok < 0) {
-                        LOG_ERROR("Could not prepare event loop. sd_event_prepare: %s\n", strerror(-ok));
-                        return -ok;
-                    }
+    do {
+        state = sd_event_get_state(flutterpi.event_loop);
+        switch (state) {
+            case SD_EVENT_INITIAL:
+                ok = sd_event_prepare(flutterpi.event_loop);
+                if (ok < 0) {
+                    LOG_ERROR("Could not prepare event loop. sd_event_prepare: %s\n", strerror(-ok));
+                    return -ok;
+                }
 
-                    break;
-                case SD_EVENT_ARMED:
-                    pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-
-                    do {
-                        rfds = const_fds;
-                        wfds = const_fds;
-                        xfds = const_fds;
-                        ok = select(evloop_fd + 1, &rfds, &wfds, &xfds, NULL);
-                        if ((ok < 0) && (errno != EINTR)) {
-                            perror("[flutter-pi] Could not wait for event loop events. select");
-                            return errno;
-                        }
-                    } while ((ok < 0) && (errno == EINTR));
-
-                    pthread_mutex_lock(&flutterpi.event_loop_mutex);
-
-                    ok = sd_event_wait(flutterpi.event_loop, 0);
-                    if (ok < 0) {
-                        LOG_ERROR("Could not check for event loop events. sd_event_wait: %s\n", strerror(-ok));
-                        return -ok;
-                    }
+                break;
+            case SD_EVENT_ARMED:
+                // blocks in epoll_wait on the event loop fd until any event source is ready.
+                ok = sd_event_wait(flutterpi.event_loop, (uint64_t) -1);
+                if ((ok < 0) && (ok != -EINTR)) {
+                    LOG_ERROR("Could not wait for event loop events. sd_event_wait: %s\n", strerror(-ok));
+                    return -ok;
+                }
 
-                    break;
-                case SD_EVENT_PENDING:
-                    ok = sd_event_dispatch(flutterpi.event_loop);
-                    if (ok < 0) {
-                        LOG_ERROR("Could not dispatch event loop events. sd_event_dispatch: %s\n", strerror(-ok));
-                        return -ok;
-                    }
+                break;
+            case SD_EVENT_PENDING:
+                // most callbacks we dispatch here mark themselves more specifically.
+                // This is just the fallback for event sources that don't.
+                watchdog_enter(kWatchdogEventSource, NULL, "sd_event_dispatch");
+                ok = sd_event_dispatch(flutterpi.event_loop);
+                watchdog_leave();
+                if (ok < 0) {
+                    LOG_ERROR("Could not dispatch event loop events. sd_event_dispatch: %s\n", strerror(-ok));
+                    return -ok;
+                }
 
-                    break;
-                case SD_EVENT_FINISHED:
-                    break;
-                default:
-                    LOG_ERROR("Unhandled event loop state: %d. Aborting\n", state);
-                    abort();
-            }
-        } while (state != SD_EVENT_FINISHED);
+                break;
+            case SD_EVENT_FINISHED:
+                break;
+            default:
+                LOG_ERROR("Unhandled event loop state: %d. Aborting\n", state);
+                abort();
+        }
+    } while (state != SD_EVENT_FINISHED);
 
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-    }
+    dump_engine_task_stats();
+    dump_platform_task_stats();
+    object_pool_dump_all_stats();
+    dump_frame_scheduler_stats();
+    compositor_dump_stats();
+    watchdog_dump_stats();
+    watchdog_deinit();
 
-    pthread_mutex_destroy(&flutterpi.event_loop_mutex);
     sd_event_unrefp(&flutterpi.event_loop);
 
     return 0;
 }
 
-static int on_wakeup_main_loop(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
-    uint8_t buffer[8];
-    int ok;
-
-    (void) s;
-    (void) revents;
-    (void) userdata;
-
-    ok = read(fd, buffer, 8);
-    if (ok < 0) {
-        perror("[flutter-pi] Could not read mainloop wakeup userdata. read");
-        return errno;
-    }
-
-    return 0;
-}
-
 static int init_main_loop(void) {
-    int ok, wakeup_fd;
+    int ok;
 
     flutterpi.event_loop_thread = pthread_self();
 
-    wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (wakeup_fd < 0) {
-        perror("[flutter-pi] Could not create fd for waking up the main loop. eventfd");
-        return errno;
-    }
-
     ok = sd_event_new(&flutterpi.event_loop);
     if (ok < 0) {
         LOG_ERROR("Could not create main event loop. sd_event_new: %s\n", strerror(-ok));
         return -ok;
     }
 
-    ok = sd_event_add_io(
-        flutterpi.event_loop,
-        NULL,
-        wakeup_fd,
-        EPOLLIN,
-        on_wakeup_main_loop,
-        NULL
-    );
-    if (ok < 0) {
-        LOG_ERROR("Error adding wakeup callback to main loop. sd_event_add_io: %s\n", strerror(-ok));
+    ok = init_platform_task_queues();
+    if (ok != 0) {
         sd_event_unrefp(&flutterpi.event_loop);
-        close(wakeup_fd);
-        return -ok;
+        return ok;
     }
 
-    flutterpi.wakeup_event_loop_fd = wakeup_fd;
+    ok = init_engine_task_timer();
+    if (ok != 0) {
+        sd_event_unrefp(&flutterpi.event_loop);
+        return ok;
+    }
+
+    ok = watchdog_init(flutterpi.watchdog_budget_ms, flutterpi.watchdog_backtraces);
+    if (ok != 0) {
+        LOG_ERROR("Could not start main loop watchdog. Continuing without it.\n");
+    }
 
     return 0;
 }
@@ -1145,8 +1628,6 @@ void on_pageflip_event(
     unsigned int usec,
     void *userdata
 ) {
-    FlutterEngineResult result;
-    struct frame presented_frame, *peek;
     int ok;
 
     (void) fd;
@@ -1155,55 +1636,30 @@ void on_pageflip_event(
 
     flutterpi.flutter.libflutter_engine.FlutterEngineTraceEventInstant("pageflip");
 
-    cqueue_lock(&flutterpi.frame_queue);
-
-    ok = cqueue_try_dequeue_locked(&flutterpi.frame_queue, &presented_frame);
-    if (ok != 0) {
-        LOG_ERROR("Could not dequeue completed frame from frame queue: %s\n", strerror(ok));
-        goto fail_unlock_frame_queue;
-    }
-
-    ok = cqueue_peek_locked(&flutterpi.frame_queue, (void**) &peek);
-    if (ok == EAGAIN) {
-        // no frame queued after the one that was completed right now.
-        // do nothing here.
-    } else if (ok != 0) {
-        LOG_ERROR("Could not get frame queue peek. cqueue_peek_locked: %s\n", strerror(ok));
-        goto fail_unlock_frame_queue;
-    } else {
-        if (peek->state == kFramePending) {
-            uint64_t ns = (sec * 1000000000ll) + (usec * 1000ll);
-
-            result = flutterpi.flutter.libflutter_engine.FlutterEngineOnVsync(
-                flutterpi.flutter.engine,
-                peek->baton,
-                ns,
-                ns + (1000000000ll / flutterpi.display.refresh_rate)
-            );
-            if (result != kSuccess) {
-                LOG_ERROR("Could not reply to frame request. FlutterEngineOnVsync: %s\n", FLUTTER_RESULT_TO_STRING(result));
-                goto fail_unlock_frame_queue;
-            }
-
-            peek->state = kFrameRendering;
-        } else {
-            LOG_ERROR("frame queue in inconsistent state. aborting\n");
-            abort();
-        }
-    }
-
-    cqueue_unlock(&flutterpi.frame_queue);
+    frame_scheduler_on_vblank(&flutterpi.frame_scheduler, sec * 1000000000ull + usec * 1000ull);
 
     ok = compositor_on_page_flip(sec, usec);
     if (ok != 0) {
         LOG_ERROR("Error notifying compositor about page flip. compositor_on_page_flip: %s\n", strerror(ok));
     }
+}
 
-    return;
+/// Called on the platform thread for vblank events requested by the compositor
+/// for frames that didn't need a commit (see @ref drmdev_queue_vblank_event).
+static void on_vblank_sequence_event(
+    int fd,
+    uint64_t sequence,
+    uint64_t ns,
+    uint64_t userdata
+) {
+    (void) fd;
+    (void) sequence;
+    (void) userdata;
 
+    flutterpi.flutter.libflutter_engine.FlutterEngineTraceEventInstant("vblank");
 
-    fail_unlock_frame_queue:
-    cqueue_unlock(&flutterpi.frame_queue);
+    // There was no commit, so the compositor isn't waiting for a page flip.
+    frame_scheduler_on_vblank(&flutterpi.frame_scheduler, ns);
 }
 
 static int on_drm_fd_ready(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
@@ -1222,6 +1678,88 @@ static int on_drm_fd_ready(sd_event_source *s, int fd, uint32_t revents, void *u
     return 0;
 }
 
+/// Get the primary plane that can be used with the selected CRTC, or NULL if there's none.
+static struct drm_plane *get_primary_plane(void) {
+    struct drm_plane *plane;
+
+    for_each_plane_in_drmdev(flutterpi.drm.drmdev, plane) {
+        if ((plane->type == DRM_PLANE_TYPE_PRIMARY) && (plane->plane->possible_crtcs & flutterpi.drm.drmdev->selected_crtc->bitmask)) {
+            return plane;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get the DRM rotation the planes should be presented with, so the display controller
+ * rotates the view by @ref rotation degrees instead of the engine rendering it rotated.
+ *
+ * Only 180 degrees are rotated by the display controller. For 90 and 270 degrees the buffers
+ * would need swapped dimensions, and few display controllers can rotate by those anyway.
+ *
+ * @returns DRM_MODE_ROTATE_0 if the engine needs to render rotated.
+ */
+static uint32_t get_plane_rotation(int rotation) {
+    struct drm_plane *plane;
+    bool supported;
+    int ok;
+
+    if ((rotation != 180) || (flutterpi.drm.drmdev == NULL) || !flutterpi.drm.drmdev->supports_atomic_modesetting) {
+        return DRM_MODE_ROTATE_0;
+    }
+
+    plane = get_primary_plane();
+    if (plane == NULL) {
+        return DRM_MODE_ROTATE_0;
+    }
+
+    ok = drmdev_plane_supports_setting_rotation_value(flutterpi.drm.drmdev, plane->plane->plane_id, DRM_MODE_ROTATE_180, &supported);
+    if ((ok != 0) || !supported) {
+        return DRM_MODE_ROTATE_0;
+    }
+
+    return DRM_MODE_ROTATE_180;
+}
+
+/**
+ * @brief Get the transforms between the view and display coordinates of a display
+ * that's @ref width x @ref height pixels and rotated by @ref rotation degrees.
+ */
+static void get_rotation_transforms(
+    int rotation,
+    int width,
+    int height,
+    FlutterTransformation *view_to_display_out,
+    FlutterTransformation *display_to_view_out
+) {
+    if (rotation == 0) {
+        *view_to_display_out = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
+
+        *display_to_view_out = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
+    } else if (rotation == 90) {
+        *view_to_display_out = FLUTTER_ROTZ_TRANSFORMATION(90);
+        view_to_display_out->transX = width;
+
+        *display_to_view_out = FLUTTER_ROTZ_TRANSFORMATION(-90);
+        display_to_view_out->transY = width;
+    } else if (rotation == 180) {
+        *view_to_display_out = FLUTTER_ROTZ_TRANSFORMATION(180);
+        view_to_display_out->transX = width;
+        view_to_display_out->transY = height;
+
+        *display_to_view_out = FLUTTER_ROTZ_TRANSFORMATION(-180);
+        display_to_view_out->transX = width;
+        display_to_view_out->transY = height;
+    } else if (rotation == 270) {
+        *view_to_display_out = FLUTTER_ROTZ_TRANSFORMATION(270);
+        view_to_display_out->transY = height;
+
+        *display_to_view_out = FLUTTER_ROTZ_TRANSFORMATION(-270);
+        display_to_view_out->transX = height;
+    }
+}
+
 int flutterpi_fill_view_properties(
     bool has_orientation,
     enum device_orientation orientation,
@@ -1229,6 +1767,7 @@ int flutterpi_fill_view_properties(
     int rotation
 ) {
     enum device_orientation default_orientation = flutterpi.display.width >= flutterpi.display.height ? kLandscapeLeft : kPortraitUp;
+    int engine_rotation, render_width, render_height;
 
     if (flutterpi.view.has_orientation) {
         if (flutterpi.view.has_rotation == false) {
@@ -1250,99 +1789,390 @@ int flutterpi_fill_view_properties(
         flutterpi.view.has_rotation = true;
     }
 
-    if (has_orientation) {
-        flutterpi.view.rotation += ANGLE_BETWEEN_ORIENTATIONS(flutterpi.view.orientation, orientation);
-        if (flutterpi.view.rotation >= 360) {
-            flutterpi.view.rotation -= 360;
-        }
+    if (has_orientation) {
+        flutterpi.view.rotation += ANGLE_BETWEEN_ORIENTATIONS(flutterpi.view.orientation, orientation);
+        if (flutterpi.view.rotation >= 360) {
+            flutterpi.view.rotation -= 360;
+        }
+
+        flutterpi.view.orientation = orientation;
+    } else if (has_rotation) {
+        for (int i = kPortraitUp; i <= kLandscapeRight; i++) {
+            if (ANGLE_BETWEEN_ORIENTATIONS(default_orientation, i) == rotation) {
+                flutterpi.view.orientation = i;
+                flutterpi.view.rotation = rotation;
+                break;
+            }
+        }
+    }
+
+    // The compositor reads the plane rotation on the raster thread without any locking,
+    // so it's only chosen once, for the rotation flutter-pi starts with, before the engine runs.
+    if (flutterpi.flutter.engine == NULL) {
+        flutterpi.view.plane_rotation = get_plane_rotation(flutterpi.view.rotation);
+    }
+
+    // The engine renders whatever rotation the display controller doesn't do.
+    // Touch input still needs the actual rotation, since the touchscreen isn't rotated by the display controller.
+    engine_rotation = flutterpi.view.rotation;
+    if (flutterpi.view.plane_rotation == DRM_MODE_ROTATE_180) {
+        engine_rotation = (engine_rotation + 180) % 360;
+    }
+    flutterpi.view.engine_rotation = engine_rotation;
+
+    // The root surface transformation of the engine depends on the render size, and frames
+    // that are still rendered for the old size would get the new one. So the render size
+    // only changes at runtime (see --dynamic-render-scale) while there's nothing to transform.
+    if (engine_rotation != 0) {
+        flutterpi.view.render_scale = flutterpi.display.render_scale;
+    }
+
+    render_width = max(1, (int) round(flutterpi.display.width * flutterpi.view.render_scale));
+    render_height = max(1, (int) round(flutterpi.display.height * flutterpi.view.render_scale));
+
+    if ((flutterpi.view.rotation <= 45) || ((flutterpi.view.rotation >= 135) && (flutterpi.view.rotation <= 225)) || (flutterpi.view.rotation >= 315)) {
+        flutterpi.view.width = render_width;
+        flutterpi.view.height = render_height;
+        flutterpi.view.width_mm = flutterpi.display.width_mm;
+        flutterpi.view.height_mm = flutterpi.display.height_mm;
+    } else {
+        flutterpi.view.width = render_height;
+        flutterpi.view.height = render_width;
+        flutterpi.view.width_mm = flutterpi.display.height_mm;
+        flutterpi.view.height_mm = flutterpi.display.width_mm;
+    }
+
+    flutterpi.view.pixel_ratio = flutterpi.display.pixel_ratio * flutterpi.view.render_scale;
+
+    // Input events arrive in display coordinates, the engine renders in render coordinates.
+    get_rotation_transforms(
+        flutterpi.view.rotation,
+        flutterpi.display.width,
+        flutterpi.display.height,
+        &flutterpi.view.view_to_display_transform,
+        &flutterpi.view.display_to_view_transform
+    );
+
+    get_rotation_transforms(
+        engine_rotation,
+        render_width,
+        render_height,
+        &flutterpi.view.engine_view_to_display_transform,
+        &flutterpi.view.engine_display_to_view_transform
+    );
+
+    if (flutterpi.user_input != NULL) {
+        // update the user input with the new transforms
+        user_input_set_transform(
+            flutterpi.user_input,
+            &flutterpi.view.display_to_view_transform,
+            &flutterpi.view.view_to_display_transform,
+            flutterpi.display.width,
+            flutterpi.display.height
+        );
+        user_input_set_render_scale(flutterpi.user_input, flutterpi.view.render_scale);
+    }
+
+    return 0;
+}
+
+static int on_set_render_scale(void *userdata) {
+    FlutterEngineResult engine_result;
+    double *render_scale;
+
+    render_scale = userdata;
+
+    // see flutterpi_fill_view_properties.
+    if ((flutterpi.view.engine_rotation != 0) || (*render_scale == flutterpi.view.render_scale)) {
+        free(render_scale);
+        return 0;
+    }
+
+    flutterpi.view.render_scale = *render_scale;
+    free(render_scale);
+
+    flutterpi_fill_view_properties(false, 0, false, 0);
+
+    engine_result = flutterpi.flutter.libflutter_engine.FlutterEngineSendWindowMetricsEvent(
+        flutterpi.flutter.engine,
+        &(FlutterWindowMetricsEvent) {
+            .struct_size = sizeof(FlutterWindowMetricsEvent),
+            .width = flutterpi.view.width,
+            .height = flutterpi.view.height,
+            .pixel_ratio = flutterpi.view.pixel_ratio
+        }
+    );
+    if (engine_result != kSuccess) {
+        LOG_ERROR("Could not send window metrics for the new render scale to flutter. FlutterEngineSendWindowMetricsEvent: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+int flutterpi_set_render_scale(double render_scale) {
+    double *data;
+    int ok;
+
+    DEBUG_ASSERT(render_scale > 0.0 && render_scale <= flutterpi.display.render_scale);
+
+    data = malloc(sizeof *data);
+    if (data == NULL) {
+        return ENOMEM;
+    }
+
+    *data = render_scale;
+
+    ok = flutterpi_post_platform_task(on_set_render_scale, data);
+    if (ok != 0) {
+        free(data);
+        return ok;
+    }
+
+    return 0;
+}
+
+static const FlutterLocale* on_compute_platform_resolved_locales(const FlutterLocale **locales, size_t n_locales) {
+    return locales_on_compute_platform_resolved_locale(flutterpi.locales, locales, n_locales);
+}
+
+static bool on_gl_external_texture_frame_callback(
+    void* userdata,
+    int64_t texture_id,
+    size_t width,
+    size_t height,
+    FlutterOpenGLTexture *texture_out
+) {
+    struct flutterpi *flutterpi;
+
+    DEBUG_ASSERT_NOT_NULL(userdata);
+
+    flutterpi = userdata;
+
+    return texture_registry_gl_external_texture_frame_callback(
+        flutterpi->texture_registry,
+        texture_id,
+        width,
+        height,
+        texture_out
+    );
+}
+
+/// Check whether the space-separated extension string contains the given extension.
+static bool has_extension(const char *extensions, const char *name) {
+    size_t name_length = strlen(name);
+    const char *cursor = extensions;
+
+    while ((cursor != NULL) && (cursor = strstr(cursor, name), cursor != NULL)) {
+        if (((cursor == extensions) || (cursor[-1] == ' ')) && ((cursor[name_length] == ' ') || (cursor[name_length] == '\0'))) {
+            return true;
+        }
+        cursor += name_length;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Check whether anything can be shown beneath the primary plane, in which case
+ * the primary plane needs an alpha channel so it stays visible through the UI.
+ */
+static bool can_show_content_below_primary_plane(const struct drm_plane *primary_plane) {
+#ifdef BUILD_OMXPLAYER_VIDEO_PLAYER_PLUGIN
+    // omxplayer shows its video beneath the primary plane, on a layer we can't see from here.
+    (void) primary_plane;
+    return true;
+#else
+    struct drm_plane *plane;
+    int64_t primary_max_zpos, min_zpos;
+    int ok;
+
+    ok = drmdev_plane_get_max_zpos_value(flutterpi.drm.drmdev, primary_plane->plane->plane_id, &primary_max_zpos);
+    if (ok != 0) {
+        // no zpos, so the primary plane is always the bottom-most one.
+        return false;
+    }
+
+    for_each_plane_in_drmdev(flutterpi.drm.drmdev, plane) {
+        if ((plane == primary_plane) || !(plane->plane->possible_crtcs & flutterpi.drm.drmdev->selected_crtc->bitmask)) {
+            continue;
+        }
+
+        if (plane->type != DRM_PLANE_TYPE_OVERLAY) {
+            continue;
+        }
+
+        ok = drmdev_plane_get_min_zpos_value(flutterpi.drm.drmdev, plane->plane->plane_id, &min_zpos);
+        if ((ok == 0) && (min_zpos < primary_max_zpos)) {
+            return true;
+        }
+    }
+
+    return false;
+#endif
+}
+
+/**
+ * @brief Select the pixel format of the window surface, depending on what the primary plane
+ * of the selected CRTC supports. If a pixel format was given on the commandline, only check
+ * that the primary plane supports it.
+ *
+ * We prefer ARGB8888, since video players can show their video beneath the primary plane
+ * (omxplayer always does), which is only visible through the alpha channel of the UI.
+ * XRGB8888 is only preferred if nothing can be shown beneath the primary plane.
+ * RGB565 halves the memory bandwidth needed for scanout, but it has visible banding,
+ * so it's only used if the user asks for it or the display can't do anything else.
+ */
+static int select_scanout_pixfmt(void) {
+    static const enum pixfmt translucent_pixfmts[] = {
+        kARGB8888,
+        kXRGB8888,
+        kRGB565
+    };
+    static const enum pixfmt opaque_pixfmts[] = {
+        kXRGB8888,
+        kARGB8888,
+        kRGB565
+    };
+    const enum pixfmt *preferred_pixfmts;
+    struct drm_plane *plane;
+    bool supported;
+    int ok;
+
+    plane = get_primary_plane();
+    if (plane == NULL) {
+        LOG_ERROR("Could not find a primary plane for the selected CRTC.\n");
+        return EINVAL;
+    }
+
+    if (flutterpi.gbm.has_forced_pixfmt) {
+        ok = drmdev_plane_supports_format(flutterpi.drm.drmdev, plane->plane->plane_id, get_pixfmt_info(flutterpi.gbm.pixfmt)->drm_format, &supported);
+        if (ok != 0) return ok;
+
+        if (!supported) {
+            LOG_ERROR("The primary plane doesn't support the pixel format %s given using --pixelformat.\n", get_pixfmt_info(flutterpi.gbm.pixfmt)->arg_name);
+            return EINVAL;
+        }
+
+        return 0;
+    }
+
+    preferred_pixfmts = can_show_content_below_primary_plane(plane) ? translucent_pixfmts : opaque_pixfmts;
 
-        flutterpi.view.orientation = orientation;
-    } else if (has_rotation) {
-        for (int i = kPortraitUp; i <= kLandscapeRight; i++) {
-            if (ANGLE_BETWEEN_ORIENTATIONS(default_orientation, i) == rotation) {
-                flutterpi.view.orientation = i;
-                flutterpi.view.rotation = rotation;
-                break;
-            }
+    for (size_t i = 0; i < sizeof(translucent_pixfmts) / sizeof(*translucent_pixfmts); i++) {
+        ok = drmdev_plane_supports_format(flutterpi.drm.drmdev, plane->plane->plane_id, get_pixfmt_info(preferred_pixfmts[i])->drm_format, &supported);
+        if (ok != 0) return ok;
+
+        if (supported) {
+            flutterpi.gbm.pixfmt = preferred_pixfmts[i];
+            return 0;
         }
     }
 
-    if ((flutterpi.view.rotation <= 45) || ((flutterpi.view.rotation >= 135) && (flutterpi.view.rotation <= 225)) || (flutterpi.view.rotation >= 315)) {
-        flutterpi.view.width = flutterpi.display.width;
-        flutterpi.view.height = flutterpi.display.height;
-        flutterpi.view.width_mm = flutterpi.display.width_mm;
-        flutterpi.view.height_mm = flutterpi.display.height_mm;
-    } else {
-        flutterpi.view.width = flutterpi.display.height;
-        flutterpi.view.height = flutterpi.display.width;
-        flutterpi.view.width_mm = flutterpi.display.height_mm;
-        flutterpi.view.height_mm = flutterpi.display.width_mm;
+    LOG_ERROR("The primary plane doesn't support any of the pixel formats ARGB8888, XRGB8888 or RGB565.\n");
+    return EINVAL;
+}
+
+int flutterpi_select_scanout_modifier(uint32_t format, bool primary_plane_only, uint64_t *modifier_out) {
+    struct drm_plane *plane;
+    struct gbm_bo *bo;
+    EGLBoolean *external_only;
+    EGLint n_egl_modifiers;
+    uint64_t *modifiers;
+    size_t n_modifiers;
+    bool supported;
+    int ok;
+
+    if (!flutterpi.egl.supports_dmabuf_import_modifiers) {
+        return ENOTSUP;
+    }
+
+    n_egl_modifiers = 0;
+    if (!flutterpi.egl.queryDmaBufModifiers(flutterpi.egl.display, format, 0, NULL, NULL, &n_egl_modifiers) || (n_egl_modifiers == 0)) {
+        return ENOTSUP;
+    }
+
+    modifiers = malloc(n_egl_modifiers * sizeof *modifiers);
+    external_only = malloc(n_egl_modifiers * sizeof *external_only);
+    if ((modifiers == NULL) || (external_only == NULL)) {
+        ok = ENOMEM;
+        goto fail_free_modifiers;
+    }
+
+    if (!flutterpi.egl.queryDmaBufModifiers(flutterpi.egl.display, format, n_egl_modifiers, (EGLuint64KHR*) modifiers, external_only, &n_egl_modifiers)) {
+        ok = ENOTSUP;
+        goto fail_free_modifiers;
+    }
+
+    // we render into the buffers, so modifiers that can only be sampled from are no use.
+    n_modifiers = 0;
+    for (int i = 0; i < n_egl_modifiers; i++) {
+        if (!external_only[i]) {
+            modifiers[n_modifiers++] = modifiers[i];
+        }
     }
 
-    if (flutterpi.view.rotation == 0) {
-        flutterpi.view.view_to_display_transform = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
+    for_each_plane_in_drmdev(flutterpi.drm.drmdev, plane) {
+        if (!(plane->plane->possible_crtcs & flutterpi.drm.drmdev->selected_crtc->bitmask)) {
+            continue;
+        }
 
-        flutterpi.view.display_to_view_transform = FLUTTER_TRANSLATION_TRANSFORMATION(0, 0);
-    } else if (flutterpi.view.rotation == 90) {
-        flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(90);
-        flutterpi.view.view_to_display_transform.transX = flutterpi.display.width;
+        // cursor planes never show the buffers this modifier is for.
+        if (primary_plane_only && (plane->type != DRM_PLANE_TYPE_PRIMARY)) {
+            continue;
+        } else if ((plane->type != DRM_PLANE_TYPE_PRIMARY) && (plane->type != DRM_PLANE_TYPE_OVERLAY)) {
+            continue;
+        }
 
-        flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-90);
-        flutterpi.view.display_to_view_transform.transY = flutterpi.display.width;
-    } else if (flutterpi.view.rotation == 180) {
-        flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(180);
-        flutterpi.view.view_to_display_transform.transX = flutterpi.display.width;
-        flutterpi.view.view_to_display_transform.transY = flutterpi.display.height;
+        ok = drmdev_plane_supports_format(flutterpi.drm.drmdev, plane->plane->plane_id, format, &supported);
+        if ((ok != 0) || !supported) {
+            continue;
+        }
 
-        flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-180);
-        flutterpi.view.display_to_view_transform.transX = flutterpi.display.width;
-        flutterpi.view.display_to_view_transform.transY = flutterpi.display.height;
-    } else if (flutterpi.view.rotation == 270) {
-        flutterpi.view.view_to_display_transform = FLUTTER_ROTZ_TRANSFORMATION(270);
-        flutterpi.view.view_to_display_transform.transY = flutterpi.display.height;
+        if (plane->modified_formats == NULL) {
+            // this plane doesn't tell us which modifiers it supports.
+            ok = ENOTSUP;
+            goto fail_free_modifiers;
+        }
 
-        flutterpi.view.display_to_view_transform = FLUTTER_ROTZ_TRANSFORMATION(-270);
-        flutterpi.view.display_to_view_transform.transX = flutterpi.display.height;
+        for (size_t i = 0; i < n_modifiers;) {
+            ok = drmdev_plane_supports_format_modifier(flutterpi.drm.drmdev, plane->plane->plane_id, format, modifiers[i], &supported);
+            if ((ok == 0) && supported) {
+                i++;
+            } else {
+                modifiers[i] = modifiers[--n_modifiers];
+            }
+        }
     }
 
-    if (flutterpi.user_input != NULL) {
-        // update the user input with the new transforms
-        user_input_set_transform(
-            flutterpi.user_input,
-            &flutterpi.view.display_to_view_transform,
-            &flutterpi.view.view_to_display_transform,
-            flutterpi.display.width,
-            flutterpi.display.height
-        );
+    if (n_modifiers == 0) {
+        ok = ENOTSUP;
+        goto fail_free_modifiers;
     }
 
-    return 0;
-}
+    // Let the driver decide which of the modifiers is best, using a display-sized buffer.
+    bo = gbm_bo_create_with_modifiers(flutterpi.gbm.device, flutterpi.display.render_width, flutterpi.display.render_height, format, modifiers, n_modifiers);
+    if (bo == NULL) {
+        ok = errno;
+        perror("[flutter-pi] Could not create GBM BO for selecting a scanout modifier. gbm_bo_create_with_modifiers");
+        goto fail_free_modifiers;
+    }
 
-static const FlutterLocale* on_compute_platform_resolved_locales(const FlutterLocale **locales, size_t n_locales) {
-    return locales_on_compute_platform_resolved_locale(flutterpi.locales, locales, n_locales);
-}
+    *modifier_out = gbm_bo_get_modifier(bo);
 
-static bool on_gl_external_texture_frame_callback(
-    void* userdata,
-    int64_t texture_id,
-    size_t width,
-    size_t height,
-    FlutterOpenGLTexture *texture_out
-) {
-    struct flutterpi *flutterpi;
+    gbm_bo_destroy(bo);
+    free(external_only);
+    free(modifiers);
 
-    DEBUG_ASSERT_NOT_NULL(userdata);
+    LOG_DEBUG("Selected modifier 0x%016" PRIx64 " out of %zu candidates for scanout format 0x%08" PRIx32 ".\n", *modifier_out, n_modifiers, format);
 
-    flutterpi = userdata;
+    return 0;
 
-    return texture_registry_gl_external_texture_frame_callback(
-        flutterpi->texture_registry,
-        texture_id,
-        width,
-        height,
-        texture_out
-    );
+
+    fail_free_modifiers:
+    free(external_only);
+    free(modifiers);
+    return ok;
 }
 
 static int load_egl_gl_procs(void) {
@@ -1351,11 +2181,96 @@ static int load_egl_gl_procs(void) {
 	LOAD_EGL_PROC(flutterpi, createPlatformPixmapSurface, eglCreatePlatformPixmapSurface);
 	flutterpi.egl.createDRMImageMESA = (PFNEGLCREATEDRMIMAGEMESAPROC) eglGetProcAddress("eglCreateDRMImageMESA");
 	flutterpi.egl.exportDRMImageMESA = (PFNEGLEXPORTDRMIMAGEMESAPROC) eglGetProcAddress("eglExportDRMImageMESA");
+	flutterpi.egl.createSyncKHR = (PFNEGLCREATESYNCKHRPROC) eglGetProcAddress("eglCreateSyncKHR");
+	flutterpi.egl.destroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC) eglGetProcAddress("eglDestroySyncKHR");
+	flutterpi.egl.dupNativeFenceFDANDROID = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC) eglGetProcAddress("eglDupNativeFenceFDANDROID");
+	flutterpi.egl.createImageKHR = (PFNEGLCREATEIMAGEKHRPROC) eglGetProcAddress("eglCreateImageKHR");
+	flutterpi.egl.queryDmaBufModifiers = (PFNEGLQUERYDMABUFMODIFIERSEXTPROC) eglGetProcAddress("eglQueryDmaBufModifiersEXT");
 	flutterpi.gl.EGLImageTargetTexture2DOES = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC) eglGetProcAddress("glEGLImageTargetTexture2DOES");
 	flutterpi.gl.EGLImageTargetRenderbufferStorageOES = (PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC) eglGetProcAddress("glEGLImageTargetRenderbufferStorageOES");
 	return 0;
 }
 
+/**
+ * @brief Check whether the display controller can scale a @ref width x @ref height buffer on the primary plane
+ * up to the display size (see --render-scale), using a test-only commit with a throwaway buffer.
+ *
+ * @returns 0 if it can, otherwise the error the kernel rejected the commit with.
+ */
+static int test_primary_plane_scaling(int width, int height) {
+    struct drmdev_atomic_req *req;
+    struct drm_plane *plane;
+    struct gbm_bo *bo;
+    uint32_t fb_id, flags;
+    int ok;
+
+    plane = get_primary_plane();
+    if (plane == NULL) {
+        return EINVAL;
+    }
+
+    bo = gbm_bo_create(flutterpi.gbm.device, width, height, flutterpi.gbm.format, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+    if (bo == NULL) {
+        ok = errno;
+        LOG_ERROR("Could not create buffer for testing the render scale. gbm_bo_create: %s\n", strerror(ok));
+        return ok;
+    }
+
+    ok = drmModeAddFB2(
+        flutterpi.drm.drmdev->fd,
+        width,
+        height,
+        flutterpi.gbm.format,
+        (uint32_t[4]) {gbm_bo_get_handle(bo).u32, 0, 0, 0},
+        (uint32_t[4]) {gbm_bo_get_stride(bo), 0, 0, 0},
+        (uint32_t[4]) {0, 0, 0, 0},
+        &fb_id,
+        0
+    );
+    if (ok < 0) {
+        ok = errno;
+        LOG_ERROR("Could not add framebuffer for testing the render scale. drmModeAddFB2: %s\n", strerror(ok));
+        goto fail_destroy_bo;
+    }
+
+    ok = drmdev_new_atomic_req(flutterpi.drm.drmdev, &req);
+    if (ok != 0) {
+        goto fail_remove_fb;
+    }
+
+    // The mode isn't applied yet, so test it together with the plane.
+    flags = 0;
+    ok = drmdev_atomic_req_put_modeset_props(req, &flags);
+    if (ok != 0) {
+        goto fail_destroy_req;
+    }
+
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropFbId, fb_id);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcId, flutterpi.drm.drmdev->selected_crtc->crtc->crtc_id);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcX, 0);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcY, 0);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcW, ((uint64_t) width) << 16);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropSrcH, ((uint64_t) height) << 16);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcX, 0);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcY, 0);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcW, flutterpi.display.width);
+    drmdev_atomic_req_put_plane_prop(req, plane, kDrmPlanePropCrtcH, flutterpi.display.height);
+
+    ok = drmdev_atomic_req_test(req, flags);
+
+
+    fail_destroy_req:
+    drmdev_destroy_atomic_req(req);
+
+    fail_remove_fb:
+    drmModeRmFB(flutterpi.drm.drmdev->fd, fb_id);
+
+    fail_destroy_bo:
+    gbm_bo_destroy(bo);
+
+    return ok;
+}
+
 static int init_display(void) {
     /**********************
      * DRM INITIALIZATION *
@@ -1467,7 +2382,7 @@ static int init_display(void) {
 
     flutterpi.display.width = mode->hdisplay;
     flutterpi.display.height = mode->vdisplay;
-    flutterpi.display.refresh_rate = mode->vrefresh;
+    flutterpi.display.refresh_rate = mode_get_vrefresh(mode);
 
     if ((flutterpi.display.width_mm == 0) || (flutterpi.display.height_mm == 0)) {
         LOG_ERROR("WARNING: display didn't provide valid physical dimensions. The device-pixel ratio will default to 1.0, which may not be the fitting device-pixel ratio for your display.\n");
@@ -1484,6 +2399,17 @@ static int init_display(void) {
         }
     }
 
+    // Without atomic modesetting, we can't set the source & destination rectangles of the planes.
+    if ((flutterpi.display.min_render_scale != 1.0) && !flutterpi.drm.drmdev->supports_atomic_modesetting) {
+        LOG_ERROR("WARNING: --render-scale and --dynamic-render-scale need atomic modesetting, which is not supported by the display driver. Will render at the display resolution.\n");
+        flutterpi.display.render_scale = 1.0;
+        flutterpi.display.min_render_scale = 1.0;
+        flutterpi.display.has_dynamic_render_scale = false;
+    }
+
+    flutterpi.display.render_width = max(1, (int) round(flutterpi.display.width * flutterpi.display.render_scale));
+    flutterpi.display.render_height = max(1, (int) round(flutterpi.display.height * flutterpi.display.render_scale));
+
     for_each_encoder_in_drmdev(flutterpi.drm.drmdev, encoder) {
         if (encoder->encoder->encoder_id == connector->connector->encoder_id) {
             break;
@@ -1555,6 +2481,7 @@ static int init_display(void) {
     memset(&flutterpi.drm.evctx, 0, sizeof(drmEventContext));
     flutterpi.drm.evctx.version = 4;
     flutterpi.drm.evctx.page_flip_handler = on_pageflip_event;
+    flutterpi.drm.evctx.sequence_handler = on_vblank_sequence_event;
 
     ok = sd_event_add_io(
         flutterpi.event_loop,
@@ -1569,41 +2496,54 @@ static int init_display(void) {
         return -ok;
     }
 
+    sd_event_source_set_priority(flutterpi.drm.drm_pageflip_event_source, get_sd_event_priority(kPlatformTaskPriorityFrame));
+
+    ok = select_scanout_pixfmt();
+    if (ok != 0) return ok;
+
+    /**********************
+     * GBM INITIALIZATION *
+     **********************/
+    flutterpi.gbm.device = gbm_create_device(flutterpi.drm.drmdev->fd);
+    flutterpi.gbm.format = get_pixfmt_info(flutterpi.gbm.pixfmt)->gbm_format;
+    flutterpi.gbm.surface = NULL;
+    flutterpi.gbm.modifier = DRM_FORMAT_MOD_LINEAR;
+
+    // With --dynamic-render-scale, the primary plane scales anything between the minimum render size and the display size.
+    if (flutterpi.display.min_render_scale != 1.0) {
+        int min_render_width = max(1, (int) round(flutterpi.display.width * flutterpi.display.min_render_scale));
+        int min_render_height = max(1, (int) round(flutterpi.display.height * flutterpi.display.min_render_scale));
+
+        ok = test_primary_plane_scaling(min_render_width, min_render_height);
+        if (ok != 0) {
+            LOG_ERROR("WARNING: The display controller can't scale the primary plane from %d x %d to the display size (%s). Will render at the display resolution.\n", min_render_width, min_render_height, strerror(ok));
+            flutterpi.display.render_scale = 1.0;
+            flutterpi.display.min_render_scale = 1.0;
+            flutterpi.display.has_dynamic_render_scale = false;
+            flutterpi.display.render_width = flutterpi.display.width;
+            flutterpi.display.render_height = flutterpi.display.height;
+        }
+    }
+
     locales_print(flutterpi.locales);
     printf(
         "===================================\n"
         "display mode:\n"
         "  resolution: %u x %u\n"
-        "  refresh rate: %uHz\n"
+        "  refresh rate: %.3fHz\n"
         "  physical size: %umm x %umm\n"
         "  flutter device pixel ratio: %f\n"
+        "  render resolution: %u x %u\n"
+        "  pixel format: %s\n"
         "===================================\n",
         flutterpi.display.width, flutterpi.display.height,
         flutterpi.display.refresh_rate,
         flutterpi.display.width_mm, flutterpi.display.height_mm,
-        flutterpi.display.pixel_ratio
+        flutterpi.display.pixel_ratio * flutterpi.display.render_scale,
+        flutterpi.display.render_width, flutterpi.display.render_height,
+        get_pixfmt_info(flutterpi.gbm.pixfmt)->arg_name
     );
 
-    /**********************
-     * GBM INITIALIZATION *
-     **********************/
-    flutterpi.gbm.device = gbm_create_device(flutterpi.drm.drmdev->fd);
-    flutterpi.gbm.format = DRM_FORMAT_ARGB8888;
-    flutterpi.gbm.surface = NULL;
-    flutterpi.gbm.modifier = DRM_FORMAT_MOD_LINEAR;
-
-    flutterpi.gbm.surface = gbm_surface_create_with_modifiers(flutterpi.gbm.device, flutterpi.display.width, flutterpi.display.height, flutterpi.gbm.format, &flutterpi.gbm.modifier, 1);
-    if (flutterpi.gbm.surface == NULL) {
-        perror("[flutter-pi] Could not create GBM Surface. gbm_surface_create_with_modifiers. Will attempt with gbm_surface_create");
-		
-		flutterpi.gbm.surface = gbm_surface_create(flutterpi.gbm.device, flutterpi.display.width, flutterpi.display.height, flutterpi.gbm.format, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
-		
-		if (flutterpi.gbm.surface == NULL) {
-			perror("[flutter-pi] Could not create GBM Surface even with gbm_surface_create");
-			return errno;
-		}
-    }
-
     /**********************
      * EGL INITIALIZATION *
      **********************/
@@ -1662,6 +2602,23 @@ static int init_display(void) {
     printf("  display extensions: \"%s\"\n", egl_exts_dpy);
     printf("===================================\n");
 
+    flutterpi.egl.supports_native_fence_sync =
+        has_extension(egl_exts_dpy, "EGL_KHR_fence_sync") &&
+        has_extension(egl_exts_dpy, "EGL_ANDROID_native_fence_sync") &&
+        flutterpi.egl.createSyncKHR && flutterpi.egl.destroySyncKHR && flutterpi.egl.dupNativeFenceFDANDROID;
+
+    flutterpi.egl.supports_dmabuf_import_modifiers =
+        has_extension(egl_exts_dpy, "EGL_EXT_image_dma_buf_import") &&
+        has_extension(egl_exts_dpy, "EGL_EXT_image_dma_buf_import_modifiers") &&
+        flutterpi.egl.createImageKHR && flutterpi.egl.queryDmaBufModifiers;
+
+    flutterpi.egl.swapBuffersWithDamage = NULL;
+    if (has_extension(egl_exts_dpy, "EGL_KHR_swap_buffers_with_damage")) {
+        flutterpi.egl.swapBuffersWithDamage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC) eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+    } else if (has_extension(egl_exts_dpy, "EGL_EXT_swap_buffers_with_damage")) {
+        flutterpi.egl.swapBuffersWithDamage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC) eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+    }
+
     eglBindAPI(EGL_OPENGL_ES_API);
     if ((egl_error = eglGetError()) != EGL_SUCCESS) {
         LOG_ERROR("Failed to bind OpenGL ES API! eglBindAPI: 0x%08X\n", egl_error);
@@ -1710,7 +2667,10 @@ static int init_display(void) {
     free(configs);
 
     if (_found_matching_config == false) {
-        LOG_ERROR("Could not find EGL framebuffer configuration with appropriate attributes & native visual ID.\n");
+        LOG_ERROR(
+            "Could not find EGL framebuffer configuration with appropriate attributes & native visual ID. (pixel format: %s)\n",
+            get_pixfmt_info(flutterpi.gbm.pixfmt)->arg_name
+        );
         return EIO;
     }
 
@@ -1749,6 +2709,25 @@ static int init_display(void) {
         return EIO;
     }
 
+    // The GBM surface is only created now, since choosing a modifier for it needs EGL.
+    ok = flutterpi_select_scanout_modifier(flutterpi.gbm.format, true, &flutterpi.gbm.modifier);
+    if (ok != 0) {
+        flutterpi.gbm.modifier = DRM_FORMAT_MOD_LINEAR;
+    }
+
+    flutterpi.gbm.surface = gbm_surface_create_with_modifiers(flutterpi.gbm.device, flutterpi.display.render_width, flutterpi.display.render_height, flutterpi.gbm.format, &flutterpi.gbm.modifier, 1);
+    if (flutterpi.gbm.surface == NULL) {
+        perror("[flutter-pi] Could not create GBM Surface. gbm_surface_create_with_modifiers. Will attempt with gbm_surface_create");
+		
+		flutterpi.gbm.modifier = DRM_FORMAT_MOD_LINEAR;
+		flutterpi.gbm.surface = gbm_surface_create(flutterpi.gbm.device, flutterpi.display.render_width, flutterpi.display.render_height, flutterpi.gbm.format, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
+		
+		if (flutterpi.gbm.surface == NULL) {
+			perror("[flutter-pi] Could not create GBM Surface even with gbm_surface_create");
+			return errno;
+		}
+    }
+
     flutterpi.egl.surface = eglCreateWindowSurface(flutterpi.egl.display, flutterpi.egl.config, (EGLNativeWindowType) flutterpi.gbm.surface, NULL);
     if ((egl_error = eglGetError()) != EGL_SUCCESS) {
         LOG_ERROR("Could not create EGL window surface. eglCreateWindowSurface: 0x%08X\n", egl_error);
@@ -1792,18 +2771,23 @@ static int init_display(void) {
 
     /// miscellaneous initialization
     /// initialize the compositor
-    ok = compositor_initialize(flutterpi.drm.drmdev);
+    ok = compositor_initialize(flutterpi.drm.drmdev, flutterpi.overlay_buffer_depth, flutterpi.n_preallocated_overlays);
     if (ok != 0) {
         return ok;
     }
 
-    /// initialize the frame queue
-    ok = cqueue_init(&flutterpi.frame_queue, sizeof(struct frame), QUEUE_DEFAULT_MAX_SIZE);
-    if (ok != 0) {
-        return ok;
-    }
+    /// initialize the frame scheduler
+    frame_scheduler_init(
+        &flutterpi.frame_scheduler,
+        flutterpi.display.refresh_rate,
+        on_scheduler_get_time,
+        on_scheduler_get_last_vblank,
+        on_scheduler_reply,
+        NULL
+    );
 
-    /// We're starting without any rotation by default.
+    /// We're starting without any rotation by default, at the largest render scale.
+    flutterpi.view.render_scale = flutterpi.display.render_scale;
     flutterpi_fill_view_properties(false, 0, false, 0);
 
     return 0;
@@ -1976,7 +2960,7 @@ static int init_application(void) {
         .update_semantics_custom_action_callback = NULL,
         .persistent_cache_path = NULL,
         .is_persistent_cache_read_only = false,
-        .vsync_callback = NULL /* on_frame_request - broken since 2.2 */,
+        .vsync_callback = flutterpi.drm.platform_supports_get_sequence_ioctl ? on_frame_request : NULL,
         .custom_dart_entrypoint = NULL,
         .custom_task_runners = &(FlutterCustomTaskRunners) {
             .struct_size = sizeof(FlutterCustomTaskRunners),
@@ -1986,8 +2970,13 @@ static int init_application(void) {
                 .runs_task_on_current_thread_callback = runs_platform_tasks_on_current_thread,
                 .post_task_callback = on_post_flutter_task
             },
-            .render_task_runner = NULL,
-            .thread_priority_setter = NULL
+            .render_task_runner = &(FlutterTaskRunnerDescription) {
+                .struct_size = sizeof(FlutterTaskRunnerDescription),
+                .user_data = NULL,
+                .runs_task_on_current_thread_callback = runs_render_tasks_on_current_thread,
+                .post_task_callback = on_post_render_task
+            },
+            .thread_priority_setter = on_set_thread_priority
         },
         .shutdown_dart_vm_when_done = true,
         .compositor = &flutter_compositor,
@@ -2031,6 +3020,12 @@ static int init_application(void) {
         project_args.aot_data = aot_data;
     }
 
+    // the render task runner needs to be up before the engine starts posting raster tasks to it.
+    ok = init_render_thread();
+    if (ok != 0) {
+        return ok;
+    }
+
     // spin up the engine
     engine_result = libflutter_engine->FlutterEngineInitialize(FLUTTER_ENGINE_VERSION, &renderer_config, &project_args, &flutterpi, &flutterpi.flutter.engine);
     if (engine_result != kSuccess) {
@@ -2082,7 +3077,7 @@ static int init_application(void) {
             .struct_size = sizeof(FlutterWindowMetricsEvent),
             .width = flutterpi.view.width,
             .height = flutterpi.view.height,
-            .pixel_ratio = flutterpi.display.pixel_ratio,
+            .pixel_ratio = flutterpi.view.pixel_ratio,
             .left = 0,
             .top = 0,
             .physical_view_inset_top = 0,
@@ -2099,27 +3094,26 @@ static int init_application(void) {
     return 0;
 }
 
-int flutterpi_schedule_exit(void) {
+static int on_schedule_exit(void *userdata) {
     int ok;
 
-    if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_lock(&flutterpi.event_loop_mutex);
-    }
+    (void) userdata;
 
     ok = sd_event_exit(flutterpi.event_loop, 0);
     if (ok < 0) {
         LOG_ERROR("Could not schedule application exit. sd_event_exit: %s\n", strerror(-ok));
-        if (pthread_self() != flutterpi.event_loop_thread) {
-            pthread_mutex_unlock(&flutterpi.event_loop_mutex);
-        }
         return -ok;
     }
 
+    return 0;
+}
+
+int flutterpi_schedule_exit(void) {
     if (pthread_self() != flutterpi.event_loop_thread) {
-        pthread_mutex_unlock(&flutterpi.event_loop_mutex);
+        return flutterpi_post_platform_task(on_schedule_exit, NULL);
     }
 
-    return 0;
+    return on_schedule_exit(NULL);
 }
 
 /**************
@@ -2285,6 +3279,8 @@ static int init_user_input(void) {
             LOG_ERROR("Couldn't listen for user input. flutter-pi will run without user input. sd_event_add_io: %s\n", strerror(-ok));
             user_input_destroy(input);
             input = NULL;
+        } else {
+            sd_event_source_set_priority(event_source, get_sd_event_priority(kPlatformTaskPriorityInput));
         }
     }
 
@@ -2337,6 +3333,9 @@ static bool setup_paths(void) {
 static bool parse_cmd_args(int argc, char **argv) {
     bool finished_parsing_options;
     int runtime_mode_int = kDebug;
+    int watchdog_backtraces_int = false;
+    int dynamic_render_scale_int = false;
+    bool has_render_scale = false;
     int longopt_index = 0;
     int opt, ok;
 
@@ -2349,9 +3348,27 @@ static bool parse_cmd_args(int argc, char **argv) {
         {"dimensions", required_argument, NULL, 'd'},
         {"help", no_argument, 0, 'h'},
         {"pixelformat", required_argument, NULL, 'p'},
+        {"render-thread-sched", required_argument, NULL, 'S'},
+        {"render-thread-cpus", required_argument, NULL, 'C'},
+        {"ui-thread-sched", required_argument, NULL, 'U'},
+        {"ui-thread-cpus", required_argument, NULL, 'u'},
+        {"io-thread-sched", required_argument, NULL, 'B'},
+        {"io-thread-cpus", required_argument, NULL, 'b'},
+        {"watchdog-budget", required_argument, NULL, 'W'},
+        {"watchdog-backtraces", no_argument, &watchdog_backtraces_int, true},
+        {"overlay-buffers", required_argument, NULL, 'O'},
+        {"preallocate-overlays", required_argument, NULL, 'P'},
+        {"render-scale", required_argument, NULL, 'R'},
+        {"dynamic-render-scale", no_argument, &dynamic_render_scale_int, true},
         {0, 0, 0, 0}
     };
 
+    init_default_thread_configs();
+    flutterpi.watchdog_budget_ms = 100;
+    flutterpi.overlay_buffer_depth = RENDERTARGET_NOGBM_MIN_BUFFERS;
+    flutterpi.n_preallocated_overlays = 0;
+    flutterpi.display.render_scale = 1.0;
+
     finished_parsing_options = false;
     while (!finished_parsing_options) {
         longopt_index = 0;
@@ -2420,7 +3437,8 @@ static bool parse_cmd_args(int argc, char **argv) {
             case 'p':
                 for (int i = 0; i < n_pixfmt_infos; i++) {
                     if (strcmp(optarg, pixfmt_infos[i].arg_name) == 0) {
-                        flutterpi.gbm.format = pixfmt_infos[i].gbm_format;
+                        flutterpi.gbm.pixfmt = pixfmt_infos[i].format;
+                        flutterpi.gbm.has_forced_pixfmt = true;
                         goto valid_format;
                     }
                 }
@@ -2436,9 +3454,122 @@ static bool parse_cmd_args(int argc, char **argv) {
                 // but don't update the valid values above.
                 COMPILE_ASSERT(kCount_PixFmt == 5);
 
+                return false;
+
                 valid_format:
                 break;
 
+            case 'S':
+                ok = thread_config_parse_sched(&flutterpi.thread_configs[kRaster], optarg);
+                if (ok != 0) {
+                    LOG_ERROR("ERROR: Invalid argument for --render-thread-sched passed.\n%s", usage);
+                    return false;
+                }
+
+                break;
+
+            case 'C':
+                ok = thread_config_parse_cpus(&flutterpi.thread_configs[kRaster], optarg);
+                if (ok != 0) {
+                    LOG_ERROR("ERROR: Invalid argument for --render-thread-cpus passed.\n%s", usage);
+                    return false;
+                }
+
+                break;
+
+            case 'U':
+                ok = thread_config_parse_sched(&flutterpi.thread_configs[kDisplay], optarg);
+                if (ok != 0) {
+                    LOG_ERROR("ERROR: Invalid argument for --ui-thread-sched passed.\n%s", usage);
+                    return false;
+                }
+
+                break;
+
+            case 'u':
+                ok = thread_config_parse_cpus(&flutterpi.thread_configs[kDisplay], optarg);
+                if (ok != 0) {
+                    LOG_ERROR("ERROR: Invalid argument for --ui-thread-cpus passed.\n%s", usage);
+                    return false;
+                }
+
+                break;
+
+            case 'B':
+                ok = thread_config_parse_sched(&flutterpi.thread_configs[kBackground], optarg);
+                if (ok != 0) {
+                    LOG_ERROR("ERROR: Invalid argument for --io-thread-sched passed.\n%s", usage);
+                    return false;
+                }
+
+                break;
+
+            case 'b':
+                ok = thread_config_parse_cpus(&flutterpi.thread_configs[kBackground], optarg);
+                if (ok != 0) {
+                    LOG_ERROR("ERROR: Invalid argument for --io-thread-cpus passed.\n%s", usage);
+                    return false;
+                }
+
+                break;
+
+            case 'W': ;
+                char *endptr;
+                long budget_ms;
+
+                errno = 0;
+                budget_ms = strtol(optarg, &endptr, 10);
+                if ((errno != 0) || (endptr == optarg) || (*endptr != '\0') || (budget_ms < 0) || (budget_ms > UINT_MAX)) {
+                    LOG_ERROR("ERROR: Invalid argument for --watchdog-budget passed.\n%s", usage);
+                    return false;
+                }
+
+                flutterpi.watchdog_budget_ms = budget_ms;
+                break;
+
+            case 'O': ;
+                char *depth_end;
+                long depth;
+
+                errno = 0;
+                depth = strtol(optarg, &depth_end, 10);
+                if ((errno != 0) || (depth_end == optarg) || (*depth_end != '\0') || (depth < RENDERTARGET_NOGBM_MIN_BUFFERS) || (depth > RENDERTARGET_NOGBM_MAX_BUFFERS)) {
+                    LOG_ERROR("ERROR: Invalid argument for --overlay-buffers passed. Valid values are 2, 3 and 4.\n%s", usage);
+                    return false;
+                }
+
+                flutterpi.overlay_buffer_depth = depth;
+                break;
+
+            case 'P': ;
+                char *n_overlays_end;
+                long n_overlays;
+
+                errno = 0;
+                n_overlays = strtol(optarg, &n_overlays_end, 10);
+                if ((errno != 0) || (n_overlays_end == optarg) || (*n_overlays_end != '\0') || (n_overlays < 0) || (n_overlays > RENDERTARGET_POOL_MAX_TARGETS)) {
+                    LOG_ERROR("ERROR: Invalid argument for --preallocate-overlays passed.\n%s", usage);
+                    return false;
+                }
+
+                flutterpi.n_preallocated_overlays = n_overlays;
+                break;
+
+            case 'R': ;
+                char *render_scale_end;
+                double render_scale;
+
+                errno = 0;
+                render_scale = strtod(optarg, &render_scale_end);
+                if ((errno != 0) || (render_scale_end == optarg) || (*render_scale_end != '\0') || !(render_scale >= 0.25) || !(render_scale <= 1.0)) {
+                    LOG_ERROR("ERROR: Invalid argument for --render-scale passed.\n%s", usage);
+                    return false;
+                }
+
+                flutterpi.display.render_scale = render_scale;
+                has_render_scale = true;
+                break;
+
             case 'h':
                 printf("%s", usage);
                 return false;
@@ -2466,6 +3597,16 @@ static bool parse_cmd_args(int argc, char **argv) {
 
     flutterpi.flutter.asset_bundle_path = realpath(argv[optind], NULL);
     flutterpi.flutter.runtime_mode = runtime_mode_int;
+    flutterpi.watchdog_backtraces = watchdog_backtraces_int;
+
+    // With --dynamic-render-scale, --render-scale is the lowest scale. The engine starts at the display resolution.
+    flutterpi.display.has_dynamic_render_scale = dynamic_render_scale_int;
+    if (flutterpi.display.has_dynamic_render_scale) {
+        flutterpi.display.min_render_scale = has_render_scale ? flutterpi.display.render_scale : 0.5;
+        flutterpi.display.render_scale = 1.0;
+    } else {
+        flutterpi.display.min_render_scale = flutterpi.display.render_scale;
+    }
 
     argv[optind] = argv[0];
     flutterpi.flutter.engine_argc = argc - optind;
@@ -2525,7 +3666,16 @@ int run() {
 }
 
 void deinit() {
-    return;
+    FlutterEngineResult engine_result;
+
+    // The engine waits for the raster task runner while shutting down,
+    // so the render thread has to keep running until it's done.
+    engine_result = flutterpi.flutter.libflutter_engine.FlutterEngineShutdown(flutterpi.flutter.engine);
+    if (engine_result != kSuccess) {
+        LOG_ERROR("Could not shut down the flutter engine. FlutterEngineShutdown: %s\n", FLUTTER_RESULT_TO_STRING(engine_result));
+    }
+
+    deinit_render_thread();
 }
 
 
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <collection.h>
+#include <frame_scheduler.h>
+
+FILE_DESCR("frame scheduler")
+
+/// Weight of a new sample in the running estimate of the refresh period is 1 / FRAME_SCHEDULER_PERIOD_FILTER.
+#define FRAME_SCHEDULER_PERIOD_FILTER 16
+
+/// How often the drift statistics are logged in debug builds, in vblanks.
+#define FRAME_SCHEDULER_LOG_INTERVAL 3600
+
+void frame_scheduler_init(
+    struct frame_scheduler *scheduler,
+    double refresh_rate,
+    frame_scheduler_get_time_t get_time,
+    frame_scheduler_get_last_vblank_t get_last_vblank,
+    frame_scheduler_reply_t reply,
+    void *userdata
+) {
+    if (refresh_rate <= 0) {
+        LOG_ERROR("Display reported an invalid refresh rate. Assuming 60Hz.\n");
+        refresh_rate = 60;
+    }
+
+    pthread_mutex_init(&scheduler->mutex, NULL);
+    scheduler->nominal_period_ns = 1000000000.0 / refresh_rate;
+    scheduler->period_ns = scheduler->nominal_period_ns;
+    scheduler->get_time = get_time;
+    scheduler->get_last_vblank = get_last_vblank;
+    scheduler->reply = reply;
+    scheduler->userdata = userdata;
+    scheduler->last_vblank_ns = 0;
+    scheduler->n_frames_in_flight = 0;
+    scheduler->has_pending_request = false;
+    scheduler->pending_baton = 0;
+    memset(&scheduler->stats, 0, sizeof(scheduler->stats));
+}
+
+void frame_scheduler_deinit(struct frame_scheduler *scheduler) {
+    pthread_mutex_destroy(&scheduler->mutex);
+}
+
+/**
+ * @brief Calculate the start and target time for a frame that begins now,
+ * aligned to the vblanks predicted from @ref vblank_ns.
+ */
+static void get_frame_times(struct frame_scheduler *scheduler, uint64_t now, uint64_t vblank_ns, uint64_t *start_out, uint64_t *target_out) {
+    double period;
+    uint64_t start;
+
+    pthread_mutex_lock(&scheduler->mutex);
+    period = scheduler->period_ns;
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    if ((vblank_ns == 0) || (vblank_ns > now)) {
+        // we don't know when the last vblank was (or the clocks disagree).
+        start = now;
+    } else {
+        // the most recent vblank, predicted from the last one we know of.
+        start = vblank_ns + (uint64_t) (floor((now - vblank_ns) / period) * period);
+    }
+
+    *start_out = start;
+    *target_out = start + (uint64_t) period;
+}
+
+/**
+ * @brief Refine the refresh period estimate using the interval between two vblanks
+ * and record how far off the prediction was. scheduler->mutex must be locked.
+ */
+static void update_period_estimate_locked(struct frame_scheduler *scheduler, uint64_t last_vblank_ns, uint64_t vblank_ns) {
+    double interval, n_periods, drift, sample, min_period, max_period;
+
+    if ((last_vblank_ns == 0) || (vblank_ns <= last_vblank_ns)) {
+        return;
+    }
+
+    // There's not a page flip event for every vblank, only for the ones where a new frame was shown.
+    interval = vblank_ns - last_vblank_ns;
+    n_periods = round(interval / scheduler->period_ns);
+
+    drift = interval - n_periods * scheduler->period_ns;
+    if ((n_periods < 1) || (n_periods > FRAME_SCHEDULER_MAX_INTERVAL_PERIODS) || (fabs(drift) > scheduler->period_ns / 4)) {
+        scheduler->stats.n_rejected_intervals++;
+        return;
+    }
+
+    scheduler->stats.n_drift_samples++;
+    scheduler->stats.total_abs_drift_ns += fabs(drift);
+    scheduler->stats.max_abs_drift_ns = fmax(scheduler->stats.max_abs_drift_ns, fabs(drift));
+
+    sample = interval / n_periods;
+    scheduler->period_ns += (sample - scheduler->period_ns) / FRAME_SCHEDULER_PERIOD_FILTER;
+
+    min_period = scheduler->nominal_period_ns * (1 - FRAME_SCHEDULER_MAX_PERIOD_DEVIATION);
+    max_period = scheduler->nominal_period_ns * (1 + FRAME_SCHEDULER_MAX_PERIOD_DEVIATION);
+    scheduler->period_ns = fmin(fmax(scheduler->period_ns, min_period), max_period);
+
+    if (scheduler->stats.n_drift_samples % FRAME_SCHEDULER_LOG_INTERVAL == 0) {
+        LOG_DEBUG(
+            "refresh period: %.0fns (mode timings: %.0fns), vblank prediction error: avg %.0fns, max %.0fns\n",
+            scheduler->period_ns,
+            scheduler->nominal_period_ns,
+            scheduler->stats.total_abs_drift_ns / scheduler->stats.n_drift_samples,
+            scheduler->stats.max_abs_drift_ns
+        );
+    }
+}
+
+/**
+ * @brief If there's a pending request and the display can take a new frame,
+ * take the request out so it can be replied to. scheduler->mutex must be locked.
+ */
+static bool take_pending_request_locked(struct frame_scheduler *scheduler, intptr_t *baton_out) {
+    if (!scheduler->has_pending_request || (scheduler->n_frames_in_flight > 0)) {
+        return false;
+    }
+
+    *baton_out = scheduler->pending_baton;
+    scheduler->has_pending_request = false;
+    return true;
+}
+
+static void reply(struct frame_scheduler *scheduler, intptr_t baton, uint64_t vblank_ns) {
+    uint64_t start, target;
+
+    get_frame_times(scheduler, scheduler->get_time(scheduler->userdata), vblank_ns, &start, &target);
+    scheduler->reply(scheduler->userdata, baton, start, target);
+}
+
+void frame_scheduler_request_frame(struct frame_scheduler *scheduler, intptr_t baton) {
+    uint64_t vblank_ns;
+    bool reply_now;
+
+    vblank_ns = scheduler->get_last_vblank ? scheduler->get_last_vblank(scheduler->userdata) : 0;
+
+    pthread_mutex_lock(&scheduler->mutex);
+
+    scheduler->stats.n_requests++;
+
+    if (scheduler->has_pending_request) {
+        // The engine only ever has one outstanding request, so this shouldn't happen.
+        // If it does, the old baton is stale and the engine is waiting for the new one.
+        LOG_ERROR("Engine requested a frame while another request was still pending.\n");
+    }
+
+    scheduler->has_pending_request = true;
+    scheduler->pending_baton = baton;
+
+    reply_now = take_pending_request_locked(scheduler, &baton);
+    if (!reply_now) {
+        scheduler->stats.n_deferred_requests++;
+    }
+
+    if (vblank_ns == 0) {
+        vblank_ns = scheduler->last_vblank_ns;
+    }
+
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    if (reply_now) {
+        reply(scheduler, baton, vblank_ns);
+    }
+}
+
+void frame_scheduler_on_frame_submitted(struct frame_scheduler *scheduler) {
+    pthread_mutex_lock(&scheduler->mutex);
+    scheduler->n_frames_in_flight++;
+    scheduler->stats.n_submitted_frames++;
+    pthread_mutex_unlock(&scheduler->mutex);
+}
+
+void frame_scheduler_on_frame_dropped(struct frame_scheduler *scheduler) {
+    uint64_t vblank_ns;
+    intptr_t baton;
+    bool reply_now;
+
+    pthread_mutex_lock(&scheduler->mutex);
+
+    DEBUG_ASSERT(scheduler->n_frames_in_flight > 0);
+    if (scheduler->n_frames_in_flight > 0) {
+        scheduler->n_frames_in_flight--;
+    }
+    scheduler->stats.n_dropped_frames++;
+
+    reply_now = take_pending_request_locked(scheduler, &baton);
+    vblank_ns = scheduler->last_vblank_ns;
+
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    if (reply_now) {
+        reply(scheduler, baton, vblank_ns);
+    }
+}
+
+void frame_scheduler_on_vblank(struct frame_scheduler *scheduler, uint64_t vblank_ns) {
+    intptr_t baton;
+    bool reply_now;
+
+    pthread_mutex_lock(&scheduler->mutex);
+
+    // The initial modeset also produces a page flip event, without a frame being in flight.
+    if (scheduler->n_frames_in_flight > 0) {
+        scheduler->n_frames_in_flight--;
+    }
+    update_period_estimate_locked(scheduler, scheduler->last_vblank_ns, vblank_ns);
+    scheduler->last_vblank_ns = vblank_ns;
+    scheduler->stats.n_vblanks++;
+
+    reply_now = take_pending_request_locked(scheduler, &baton);
+
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    if (reply_now) {
+        reply(scheduler, baton, vblank_ns);
+    }
+}
+
+void frame_scheduler_get_stats(struct frame_scheduler *scheduler, struct frame_scheduler_stats *stats_out) {
+    pthread_mutex_lock(&scheduler->mutex);
+    *stats_out = scheduler->stats;
+    stats_out->nominal_period_ns = scheduler->nominal_period_ns;
+    stats_out->estimated_period_ns = scheduler->period_ns;
+    pthread_mutex_unlock(&scheduler->mutex);
+}
@@ -8,9 +8,60 @@
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
 #include <modesetting.h>
 
+static const char *connector_prop_names[kMax_DrmConnectorProp] = {
+    [kDrmConnectorPropCrtcId] = "CRTC_ID"
+};
+
+static const char *crtc_prop_names[kMax_DrmCrtcProp] = {
+    [kDrmCrtcPropActive] = "ACTIVE",
+    [kDrmCrtcPropModeId] = "MODE_ID",
+    [kDrmCrtcPropOutFencePtr] = "OUT_FENCE_PTR"
+};
+
+static const char *plane_prop_names[kMax_DrmPlaneProp] = {
+    [kDrmPlanePropFbId] = "FB_ID",
+    [kDrmPlanePropCrtcId] = "CRTC_ID",
+    [kDrmPlanePropSrcX] = "SRC_X",
+    [kDrmPlanePropSrcY] = "SRC_Y",
+    [kDrmPlanePropSrcW] = "SRC_W",
+    [kDrmPlanePropSrcH] = "SRC_H",
+    [kDrmPlanePropCrtcX] = "CRTC_X",
+    [kDrmPlanePropCrtcY] = "CRTC_Y",
+    [kDrmPlanePropCrtcW] = "CRTC_W",
+    [kDrmPlanePropCrtcH] = "CRTC_H",
+    [kDrmPlanePropRotation] = "rotation",
+    [kDrmPlanePropZpos] = "zpos",
+    [kDrmPlanePropInFenceFd] = "IN_FENCE_FD",
+    [kDrmPlanePropFbDamageClips] = "FB_DAMAGE_CLIPS",
+    [kDrmPlanePropInFormats] = "IN_FORMATS"
+};
+
+/**
+ * @brief For each of the @ref n_names property names, find the index of the property
+ * with that name in @ref props_info, or -1 if there's none.
+ */
+static void find_prop_indices(
+    drmModePropertyRes **props_info,
+    int n_props,
+    const char **names,
+    int n_names,
+    int *indices_out
+) {
+    for (int i = 0; i < n_names; i++) {
+        indices_out[i] = -1;
+        for (int j = 0; j < n_props; j++) {
+            if (strcmp(props_info[j]->name, names[i]) == 0) {
+                indices_out[i] = j;
+                break;
+            }
+        }
+    }
+}
+
 static int drmdev_lock(struct drmdev *drmdev) {
     return pthread_mutex_lock(&drmdev->mutex);
 }
@@ -76,6 +127,7 @@ static int fetch_connectors(struct drmdev *drmdev, struct drm_connector **connec
         connectors[i].connector = connector;
         connectors[i].props = props;
         connectors[i].props_info = props_info;
+        find_prop_indices(props_info, props->count_props, connector_prop_names, kMax_DrmConnectorProp, connectors[i].prop_indices);
     }
 
     *connectors_out = connectors;
@@ -223,6 +275,7 @@ static int fetch_crtcs(struct drmdev *drmdev, struct drm_crtc **crtcs_out, size_
         crtcs[i].crtc = crtc;
         crtcs[i].props = props;
         crtcs[i].props_info = props_info;
+        find_prop_indices(props_info, props->count_props, crtc_prop_names, kMax_DrmCrtcProp, crtcs[i].prop_indices);
         
         crtcs[i].index = i;
         crtcs[i].bitmask = 1 << i;
@@ -264,6 +317,70 @@ static int free_crtcs(struct drm_crtc *crtcs, size_t n_crtcs) {
     return 0;
 }
 
+/**
+ * @brief Parse the IN_FORMATS blob of a plane into a list of format & modifier combinations.
+ */
+static int parse_in_formats_blob(
+    int fd,
+    uint32_t blob_id,
+    struct drm_plane_modified_format **formats_out,
+    size_t *n_formats_out
+) {
+    struct drm_plane_modified_format *formats;
+    const struct drm_format_modifier_blob *header;
+    const struct drm_format_modifier *modifiers;
+    drmModePropertyBlobRes *blob;
+    const uint32_t *blob_formats;
+    size_t n_formats;
+    int ok;
+
+    blob = drmModeGetPropertyBlob(fd, blob_id);
+    if (blob == NULL) {
+        ok = errno;
+        perror("[modesetting] Could not get IN_FORMATS blob of plane. drmModeGetPropertyBlob");
+        return ok;
+    }
+
+    header = blob->data;
+    if ((blob->length < sizeof *header) || (header->version != FORMAT_BLOB_CURRENT)) {
+        printf("[modesetting] Unsupported IN_FORMATS blob of plane.\n");
+        drmModeFreePropertyBlob(blob);
+        return EINVAL;
+    }
+
+    blob_formats = (const uint32_t *) ((const uint8_t *) blob->data + header->formats_offset);
+    modifiers = (const struct drm_format_modifier *) ((const uint8_t *) blob->data + header->modifiers_offset);
+
+    // every modifier can be used with up to 64 formats.
+    n_formats = 0;
+    for (uint32_t i = 0; i < header->count_modifiers; i++) {
+        n_formats += __builtin_popcountll(modifiers[i].formats);
+    }
+
+    formats = calloc(n_formats ? n_formats : 1, sizeof *formats);
+    if (formats == NULL) {
+        drmModeFreePropertyBlob(blob);
+        return ENOMEM;
+    }
+
+    n_formats = 0;
+    for (uint32_t i = 0; i < header->count_modifiers; i++) {
+        for (int j = 0; j < 64; j++) {
+            if ((modifiers[i].formats & (1ull << j)) && (modifiers[i].offset + j < header->count_formats)) {
+                formats[n_formats].format = blob_formats[modifiers[i].offset + j];
+                formats[n_formats].modifier = modifiers[i].modifier;
+                n_formats++;
+            }
+        }
+    }
+
+    drmModeFreePropertyBlob(blob);
+
+    *formats_out = formats;
+    *n_formats_out = n_formats;
+    return 0;
+}
+
 static int fetch_planes(struct drmdev *drmdev, struct drm_plane **planes_out, size_t *n_planes_out) {
     struct drm_plane *planes;
     int n_allocated_planes;
@@ -331,6 +448,23 @@ static int fetch_planes(struct drmdev *drmdev, struct drm_plane **planes_out, si
         planes[i].plane = plane;
         planes[i].props = props;
         planes[i].props_info = props_info;
+        find_prop_indices(props_info, props->count_props, plane_prop_names, kMax_DrmPlaneProp, planes[i].prop_indices);
+
+        planes[i].modified_formats = NULL;
+        planes[i].n_modified_formats = 0;
+        if (planes[i].prop_indices[kDrmPlanePropInFormats] != -1) {
+            ok = parse_in_formats_blob(
+                drmdev->fd,
+                props->prop_values[planes[i].prop_indices[kDrmPlanePropInFormats]],
+                &planes[i].modified_formats,
+                &planes[i].n_modified_formats
+            );
+            if (ok != 0) {
+                // not fatal, we just can't use explicit modifiers for this plane.
+                planes[i].modified_formats = NULL;
+                planes[i].n_modified_formats = 0;
+            }
+        }
     }
 
     *planes_out = planes;
@@ -344,6 +478,7 @@ static int fetch_planes(struct drmdev *drmdev, struct drm_plane **planes_out, si
         for (int j = 0; j < planes[i].props->count_props; j++)
             drmModeFreeProperty(planes[i].props_info[j]);
         free(planes[i].props_info);
+        free(planes[i].modified_formats);
         drmModeFreeObjectProperties(planes[i].props);
         drmModeFreePlane(planes[i].plane);
     }
@@ -360,6 +495,7 @@ static int free_planes(struct drm_plane *planes, size_t n_planes) {
         for (int j = 0; j < planes[i].props->count_props; j++)
             drmModeFreeProperty(planes[i].props_info[j]);
         free(planes[i].props_info);
+        free(planes[i].modified_formats);
         drmModeFreeObjectProperties(planes[i].props);
         drmModeFreePlane(planes[i].plane);
     }
@@ -371,7 +507,28 @@ static int free_planes(struct drm_plane *planes, size_t n_planes) {
 
 
 float mode_get_vrefresh(const drmModeModeInfo *mode) {
-    return mode->clock * 1000.0 / (mode->htotal * mode->vtotal);
+    double refresh;
+
+    if ((mode->htotal == 0) || (mode->vtotal == 0)) {
+        return mode->vrefresh;
+    }
+
+    // same calculation as the kernels drm_mode_vrefresh, but without rounding to an integer.
+    refresh = mode->clock * 1000.0 / (mode->htotal * mode->vtotal);
+
+    if (mode->flags & DRM_MODE_FLAG_INTERLACE) {
+        refresh *= 2;
+    }
+
+    if (mode->flags & DRM_MODE_FLAG_DBLSCAN) {
+        refresh /= 2;
+    }
+
+    if (mode->vscan > 1) {
+        refresh /= mode->vscan;
+    }
+
+    return refresh;
 }
 
 int drmdev_new_from_fd(
@@ -586,23 +743,11 @@ static struct drm_plane *get_plane_by_id(
     return plane;
 }
 
-static int get_plane_property_index_by_name(
-    struct drm_plane *plane,
-    const char *property_name
+struct drm_plane *drmdev_get_plane(
+    struct drmdev *drmdev,
+    uint32_t plane_id
 ) {
-    if (plane == NULL) {
-        return -1;
-    }
-
-    int prop_index = -1; 
-    for (int i = 0; i < plane->props->count_props; i++) {
-        if (strcmp(plane->props_info[i]->name, property_name) == 0) {
-            prop_index = i;
-            break;
-        }
-    }
-
-    return prop_index;
+    return get_plane_by_id(drmdev, plane_id);
 }
 
 int drmdev_plane_get_type(
@@ -617,31 +762,21 @@ int drmdev_plane_get_type(
     return plane->type;
 }
 
-int drmdev_plane_supports_setting_rotation_value(
-    struct drmdev *drmdev,
-    uint32_t plane_id,
-    int drm_rotation,
-    bool *result
+bool drm_plane_supports_setting_rotation_value(
+    const struct drm_plane *plane,
+    int drm_rotation
 ) {
-    struct drm_plane *plane = get_plane_by_id(drmdev, plane_id);
-    if (plane == NULL) {
-        return EINVAL;
-    }
-    
-    int prop_index = get_plane_property_index_by_name(plane, "rotation");
+    int prop_index = plane->prop_indices[kDrmPlanePropRotation];
     if (prop_index == -1) {
-        *result = false;
-        return 0;
+        return false;
     }
 
     if (plane->props_info[prop_index]->flags & DRM_MODE_PROP_IMMUTABLE) {
-        *result = false;
-        return 0;
+        return false;
     }
 
     if (!(plane->props_info[prop_index]->flags & DRM_MODE_PROP_BITMASK)) {
-        *result = false;
-        return 0;
+        return false;
     }
 
     uint64_t value = drm_rotation;
@@ -650,64 +785,68 @@ int drmdev_plane_supports_setting_rotation_value(
         value &= ~(1 << plane->props_info[prop_index]->enums[i].value);
     }
 
-    *result = !value;
-    return 0;
+    return !value;
 }
 
-int drmdev_plane_supports_setting_zpos_value(
+int drmdev_plane_supports_setting_rotation_value(
     struct drmdev *drmdev,
     uint32_t plane_id,
-    int64_t zpos,
+    int drm_rotation,
     bool *result
 ) {
     struct drm_plane *plane = get_plane_by_id(drmdev, plane_id);
     if (plane == NULL) {
         return EINVAL;
     }
-    
-    int prop_index = get_plane_property_index_by_name(plane, "zpos");
+
+    *result = drm_plane_supports_setting_rotation_value(plane, drm_rotation);
+    return 0;
+}
+
+bool drm_plane_supports_setting_zpos_value(
+    const struct drm_plane *plane,
+    int64_t zpos
+) {
+    int prop_index = plane->prop_indices[kDrmPlanePropZpos];
     if (prop_index == -1) {
-        *result = false;
-        return 0;
+        return false;
     }
 
     if (plane->props_info[prop_index]->flags & DRM_MODE_PROP_IMMUTABLE) {
-        *result = false;
-        return 0;
+        return false;
     }
 
     if (plane->props_info[prop_index]->count_values != 2) {
-        *result = false;
-        return 0;
+        return false;
     }
 
     if (plane->props_info[prop_index]->flags & DRM_MODE_PROP_SIGNED_RANGE) {
         int64_t min = *((int64_t*) (plane->props_info[prop_index]->values + 0));
         int64_t max = *((int64_t*) (plane->props_info[prop_index]->values + 1));
 
-        if ((min <= zpos) && (max >= zpos)) {
-            *result = true;
-            return 0;
-        } else {
-            *result = false;
-            return 0;
-        }
+        return (min <= zpos) && (max >= zpos);
     } else if (plane->props_info[prop_index]->flags & DRM_MODE_PROP_RANGE) {
         uint64_t min = plane->props_info[prop_index]->values[0];
         uint64_t max = plane->props_info[prop_index]->values[1];
 
-        if ((min <= zpos) && (max >= zpos)) {
-            *result = true;
-            return 0;
-        } else {
-            *result = false;
-            return 0;
-        }
+        return (min <= zpos) && (max >= zpos);
     } else {
-        *result = false;
-        return 0;
+        return false;
     }
-    
+}
+
+int drmdev_plane_supports_setting_zpos_value(
+    struct drmdev *drmdev,
+    uint32_t plane_id,
+    int64_t zpos,
+    bool *result
+) {
+    struct drm_plane *plane = get_plane_by_id(drmdev, plane_id);
+    if (plane == NULL) {
+        return EINVAL;
+    }
+
+    *result = drm_plane_supports_setting_zpos_value(plane, zpos);
     return 0;
 }
 
@@ -721,7 +860,7 @@ int drmdev_plane_get_min_zpos_value(
         return EINVAL;
     }
     
-    int prop_index = get_plane_property_index_by_name(plane, "zpos");
+    int prop_index = plane->prop_indices[kDrmPlanePropZpos];
     if (prop_index == -1) {
         return EINVAL;
     }
@@ -757,7 +896,7 @@ int drmdev_plane_get_max_zpos_value(
         return EINVAL;
     }
     
-    int prop_index = get_plane_property_index_by_name(plane, "zpos");
+    int prop_index = plane->prop_indices[kDrmPlanePropZpos];
     if (prop_index == -1) {
         return EINVAL;
     }
@@ -783,6 +922,90 @@ int drmdev_plane_get_max_zpos_value(
     return EINVAL;
 }
 
+int drmdev_plane_supports_format(
+    struct drmdev *drmdev,
+    uint32_t plane_id,
+    uint32_t format,
+    bool *result
+) {
+    struct drm_plane *plane = get_plane_by_id(drmdev, plane_id);
+    if (plane == NULL) {
+        return EINVAL;
+    }
+
+    for (uint32_t i = 0; i < plane->plane->count_formats; i++) {
+        if (plane->plane->formats[i] == format) {
+            *result = true;
+            return 0;
+        }
+    }
+
+    *result = false;
+    return 0;
+}
+
+int drmdev_plane_supports_format_modifier(
+    struct drmdev *drmdev,
+    uint32_t plane_id,
+    uint32_t format,
+    uint64_t modifier,
+    bool *result
+) {
+    struct drm_plane *plane = get_plane_by_id(drmdev, plane_id);
+    if (plane == NULL) {
+        return EINVAL;
+    }
+
+    if (plane->modified_formats == NULL) {
+        if (modifier == DRM_FORMAT_MOD_LINEAR) {
+            return drmdev_plane_supports_format(drmdev, plane_id, format, result);
+        }
+
+        *result = false;
+        return 0;
+    }
+
+    for (size_t i = 0; i < plane->n_modified_formats; i++) {
+        if ((plane->modified_formats[i].format == format) && (plane->modified_formats[i].modifier == modifier)) {
+            *result = true;
+            return 0;
+        }
+    }
+
+    *result = false;
+    return 0;
+}
+
+int drmdev_plane_get_modifiers(
+    struct drmdev *drmdev,
+    uint32_t plane_id,
+    uint32_t format,
+    uint64_t *modifiers_out,
+    size_t max_modifiers,
+    size_t *n_modifiers_out
+) {
+    struct drm_plane *plane = get_plane_by_id(drmdev, plane_id);
+    size_t n_modifiers;
+
+    if (plane == NULL) {
+        return EINVAL;
+    }
+
+    if (plane->modified_formats == NULL) {
+        return ENOTSUP;
+    }
+
+    n_modifiers = 0;
+    for (size_t i = 0; (i < plane->n_modified_formats) && (n_modifiers < max_modifiers); i++) {
+        if (plane->modified_formats[i].format == format) {
+            modifiers_out[n_modifiers++] = plane->modified_formats[i].modifier;
+        }
+    }
+
+    *n_modifiers_out = n_modifiers;
+    return 0;
+}
+
 int drmdev_plane_supports_setting_zpos(
     struct drmdev *drmdev,
     uint32_t plane_id,
@@ -793,7 +1016,7 @@ int drmdev_plane_supports_setting_zpos(
         return EINVAL;
     }
     
-    int prop_index = get_plane_property_index_by_name(plane, "zpos");
+    int prop_index = plane->prop_indices[kDrmPlanePropZpos];
     if (prop_index == -1) {
         *result = false;
         return 0;
@@ -981,6 +1204,75 @@ int drmdev_atomic_req_put_plane_property(
     return EINVAL;
 }
 
+int drmdev_atomic_req_put_plane_prop(
+    struct drmdev_atomic_req *req,
+    const struct drm_plane *plane,
+    enum drm_plane_prop prop,
+    uint64_t value
+) {
+    int ok;
+
+    // The property tables never change after the drmdev was created, so no need to lock.
+    if (plane->prop_indices[prop] == -1) {
+        return EINVAL;
+    }
+
+    ok = drmModeAtomicAddProperty(req->atomic_req, plane->plane->plane_id, plane->props_info[plane->prop_indices[prop]]->prop_id, value);
+    if (ok < 0) {
+        ok = errno;
+        perror("[modesetting] Could not add plane property to atomic request. drmModeAtomicAddProperty");
+        return ok;
+    }
+
+    return 0;
+}
+
+int drmdev_atomic_req_put_crtc_prop(
+    struct drmdev_atomic_req *req,
+    enum drm_crtc_prop prop,
+    uint64_t value
+) {
+    const struct drm_crtc *crtc;
+    int ok;
+
+    crtc = req->drmdev->selected_crtc;
+    if (crtc->prop_indices[prop] == -1) {
+        return EINVAL;
+    }
+
+    ok = drmModeAtomicAddProperty(req->atomic_req, crtc->crtc->crtc_id, crtc->props_info[crtc->prop_indices[prop]]->prop_id, value);
+    if (ok < 0) {
+        ok = errno;
+        perror("[modesetting] Could not add crtc property to atomic request. drmModeAtomicAddProperty");
+        return ok;
+    }
+
+    return 0;
+}
+
+int drmdev_atomic_req_put_connector_prop(
+    struct drmdev_atomic_req *req,
+    enum drm_connector_prop prop,
+    uint64_t value
+) {
+    const struct drm_connector *connector;
+    int ok;
+
+    connector = req->drmdev->selected_connector;
+    if (connector->prop_indices[prop] == -1) {
+        return EINVAL;
+    }
+
+    ok = drmModeAtomicAddProperty(req->atomic_req, connector->connector->connector_id, connector->props_info[connector->prop_indices[prop]]->prop_id, value);
+    if (ok < 0) {
+        ok = errno;
+        perror("[modesetting] Could not add connector property to atomic request. drmModeAtomicAddProperty");
+        return ok;
+    }
+
+    return 0;
+}
+
 int drmdev_atomic_req_put_modeset_props(
     struct drmdev_atomic_req *req,
     uint32_t *flags
@@ -993,19 +1285,19 @@ int drmdev_atomic_req_put_modeset_props(
         return ok;
     }
 
-    ok = drmdev_atomic_req_put_connector_property(req, "CRTC_ID", req->drmdev->selected_crtc->crtc->crtc_id);
+    ok = drmdev_atomic_req_put_connector_prop(req, kDrmConnectorPropCrtcId, req->drmdev->selected_crtc->crtc->crtc_id);
     if (ok != 0) {
         drmdev_destroy_atomic_req(augment);
         return ok;
     }
 
-    ok = drmdev_atomic_req_put_crtc_property(req, "MODE_ID", req->drmdev->selected_mode_blob_id);
+    ok = drmdev_atomic_req_put_crtc_prop(req, kDrmCrtcPropModeId, req->drmdev->selected_mode_blob_id);
     if (ok != 0) {
         drmdev_destroy_atomic_req(augment);
         return ok;
     }
 
-    ok = drmdev_atomic_req_put_crtc_property(req, "ACTIVE", 1);
+    ok = drmdev_atomic_req_put_crtc_prop(req, kDrmCrtcPropActive, 1);
     if (ok != 0) {
         drmdev_destroy_atomic_req(augment);
         return ok;
@@ -1049,6 +1341,50 @@ int drmdev_atomic_req_commit(
     return 0;
 }
 
+int drmdev_atomic_req_test(
+    struct drmdev_atomic_req *req,
+    uint32_t flags
+) {
+    int ok;
+
+    // page flip events and non-blocking commits don't make sense for test commits,
+    // the kernel rejects them.
+    flags &= ~(DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK);
+
+    drmdev_lock(req->drmdev);
+
+    // failing is a valid result here, so don't print an error.
+    ok = drmModeAtomicCommit(req->drmdev->fd, req->atomic_req, flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+    if (ok < 0) {
+        ok = errno;
+        drmdev_unlock(req->drmdev);
+        return ok;
+    }
+
+    drmdev_unlock(req->drmdev);
+    return 0;
+}
+
+int drmdev_queue_vblank_event(
+    struct drmdev *drmdev,
+    uint64_t userdata
+) {
+    int ok;
+
+    drmdev_lock(drmdev);
+
+    ok = drmCrtcQueueSequence(drmdev->fd, drmdev->selected_crtc->crtc->crtc_id, DRM_CRTC_SEQUENCE_RELATIVE, 1, NULL, userdata);
+    if (ok < 0) {
+        ok = errno;
+        perror("[modesetting] Could not request vblank event. drmCrtcQueueSequence");
+        drmdev_unlock(drmdev);
+        return ok;
+    }
+
+    drmdev_unlock(drmdev);
+    return 0;
+}
+
 int drmdev_legacy_set_mode_and_fb(
     struct drmdev *drmdev,
     uint32_t fb_id
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <collection.h>
+#include <object_pool.h>
+
+FILE_DESCR("object pool")
+
+struct object_pool_thread_cache {
+    size_t n_objects;
+    void *objects[OBJECT_POOL_THREAD_CACHE_SIZE];
+};
+
+static struct object_pool *pools[OBJECT_POOL_MAX_POOLS];
+static atomic_int n_pools = 0;
+
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_cache_key;
+
+static __thread struct object_pool_thread_cache thread_caches[OBJECT_POOL_MAX_POOLS];
+static __thread bool thread_caches_registered = false;
+
+/**
+ * @brief Push @ref object onto the shared free list of @ref pool, or free it
+ * if the free list is full. pool->mutex must be locked.
+ */
+static void object_pool_put_locked(struct object_pool *pool, void *object) {
+    if (pool->n_free >= pool->max_cached) {
+        free(object);
+        return;
+    }
+
+    *(void**) object = pool->free_list;
+    pool->free_list = object;
+    pool->n_free++;
+}
+
+static void *object_pool_take_locked(struct object_pool *pool) {
+    void *object;
+
+    object = pool->free_list;
+    if (object != NULL) {
+        pool->free_list = *(void**) object;
+        pool->n_free--;
+    }
+
+    return object;
+}
+
+/**
+ * @brief Called when a thread that used any pool exits.
+ * Moves all objects cached by that thread back to the shared free lists.
+ */
+static void on_thread_exit(void *userdata) {
+    struct object_pool_thread_cache *caches, *cache;
+    struct object_pool *pool;
+    int i;
+
+    caches = userdata;
+
+    for (i = 0; i < min(atomic_load(&n_pools), OBJECT_POOL_MAX_POOLS); i++) {
+        pool = pools[i];
+        cache = caches + i;
+
+        if ((pool == NULL) || (cache->n_objects == 0)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        while (cache->n_objects > 0) {
+            object_pool_put_locked(pool, cache->objects[--cache->n_objects]);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+static void create_thread_cache_key(void) {
+    int ok;
+
+    ok = pthread_key_create(&thread_cache_key, on_thread_exit);
+    if (ok != 0) {
+        LOG_ERROR("Could not create thread-local key for object pool caches. pthread_key_create: %s\n", strerror(ok));
+    }
+}
+
+/**
+ * @brief Get the cache of the calling thread for @ref pool.
+ * Registers @ref pool on first use.
+ *
+ * @returns The cache, or NULL if there are already too many pools.
+ */
+static struct object_pool_thread_cache *get_thread_cache(struct object_pool *pool) {
+    int slot, expected;
+
+    slot = atomic_load_explicit(&pool->slot, memory_order_acquire);
+    if (slot == 0) {
+        // not yet registered. reserve a new slot and try to publish it.
+        slot = atomic_fetch_add(&n_pools, 1) + 1;
+        if (slot > OBJECT_POOL_MAX_POOLS) {
+            LOG_ERROR("Too many object pools. Pool \"%s\" won't use thread-local caching.\n", pool->name);
+            atomic_fetch_sub(&n_pools, 1);
+            return NULL;
+        }
+
+        pools[slot - 1] = pool;
+
+        expected = 0;
+        if (!atomic_compare_exchange_strong(&pool->slot, &expected, slot)) {
+            // someone else registered the pool concurrently.
+            // Our slot stays reserved but unused, which is harmless.
+            pools[slot - 1] = NULL;
+            slot = expected;
+        }
+    }
+
+    if (thread_caches_registered == false) {
+        pthread_once(&thread_cache_key_once, create_thread_cache_key);
+        pthread_setspecific(thread_cache_key, thread_caches);
+        thread_caches_registered = true;
+    }
+
+    return thread_caches + slot - 1;
+}
+
+void *object_pool_alloc(struct object_pool *pool) {
+    struct object_pool_thread_cache *cache;
+    void *object;
+
+    cache = get_thread_cache(pool);
+
+    if ((cache != NULL) && (cache->n_objects > 0)) {
+        object = cache->objects[--cache->n_objects];
+    } else {
+        pthread_mutex_lock(&pool->mutex);
+        object = object_pool_take_locked(pool);
+
+        // refill the thread cache by half, so the next few allocations don't need to lock.
+        if ((object != NULL) && (cache != NULL)) {
+            while ((cache->n_objects < OBJECT_POOL_THREAD_CACHE_SIZE / 2) && (pool->n_free > 0)) {
+                cache->objects[cache->n_objects++] = object_pool_take_locked(pool);
+            }
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    atomic_fetch_add_explicit(&pool->n_allocs, 1, memory_order_relaxed);
+
+    if (object != NULL) {
+        atomic_fetch_add_explicit(&pool->n_hits, 1, memory_order_relaxed);
+    } else {
+        object = malloc(pool->object_size);
+        if (object == NULL) {
+            return NULL;
+        }
+    }
+
+    atomic_fetch_add_explicit(&pool->n_live, 1, memory_order_relaxed);
+
+    return object;
+}
+
+void *object_pool_zalloc(struct object_pool *pool) {
+    void *object;
+
+    object = object_pool_alloc(pool);
+    if (object == NULL) {
+        return NULL;
+    }
+
+    return memset(object, 0, pool->object_size);
+}
+
+void object_pool_free(struct object_pool *pool, void *object) {
+    struct object_pool_thread_cache *cache;
+
+    if (object == NULL) {
+        return;
+    }
+
+    atomic_fetch_sub_explicit(&pool->n_live, 1, memory_order_relaxed);
+
+    cache = get_thread_cache(pool);
+
+    if ((cache != NULL) && (cache->n_objects < OBJECT_POOL_THREAD_CACHE_SIZE)) {
+        cache->objects[cache->n_objects++] = object;
+        return;
+    }
+
+    // The thread cache is full (typical for a thread that only ever frees objects allocated
+    // on another thread). Move half of it to the shared free list.
+    pthread_mutex_lock(&pool->mutex);
+    object_pool_put_locked(pool, object);
+    if (cache != NULL) {
+        while (cache->n_objects > OBJECT_POOL_THREAD_CACHE_SIZE / 2) {
+            object_pool_put_locked(pool, cache->objects[--cache->n_objects]);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void object_pool_get_stats(struct object_pool *pool, struct object_pool_stats *stats_out) {
+    stats_out->n_live = atomic_load_explicit(&pool->n_live, memory_order_relaxed);
+    stats_out->n_allocs = atomic_load_explicit(&pool->n_allocs, memory_order_relaxed);
+    stats_out->n_hits = atomic_load_explicit(&pool->n_hits, memory_order_relaxed);
+
+    pthread_mutex_lock(&pool->mutex);
+    stats_out->n_free = pool->n_free;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void object_pool_dump_all_stats(void) {
+    struct object_pool_stats stats;
+    int i;
+
+    for (i = 0; i < min(atomic_load(&n_pools), OBJECT_POOL_MAX_POOLS); i++) {
+        if (pools[i] == NULL) {
+            continue;
+        }
+
+        object_pool_get_stats(pools[i], &stats);
+
+        LOG_DEBUG(
+            "pool \"%s\": %zu live, %zu allocations, hit rate %.1f%%, %zu in shared free list\n",
+            pools[i]->name,
+            stats.n_live,
+            stats.n_allocs,
+            stats.n_allocs ? 100.0 * stats.n_hits / stats.n_allocs : 0.0,
+            stats.n_free
+        );
+    }
+}
@@ -14,6 +14,7 @@
 #include <pluginregistry.h>
 #include <collection.h>
 #include <flutter-pi.h>
+#include <watchdog.h>
 
 FILE_DESCR("plugin registry")
 
@@ -171,7 +172,9 @@ int plugin_registry_on_platform_message(FlutterPlatformMessage *message) {
 		return ok;
 	}
 
+	watchdog_enter(kWatchdogPlatformMessage, (const void*) data_copy.callback, message->channel);
 	ok = data_copy.callback((char*) message->channel, &object, (FlutterPlatformMessageResponseHandle*) message->response_handle); //, data->userdata);
+	watchdog_leave();
 	if (ok != 0) {
 		platch_free_obj(&object);
 		return ok;
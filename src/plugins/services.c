@@ -125,7 +125,7 @@ static int on_receive_platform(char *channel, struct platch_obj *object, Flutter
                     .struct_size = sizeof(FlutterWindowMetricsEvent),
                     .width = flutterpi.view.width, 
                     .height = flutterpi.view.height,
-                    .pixel_ratio = flutterpi.display.pixel_ratio
+                    .pixel_ratio = flutterpi.view.pixel_ratio
                 });
                 if (result != kSuccess) {
                     fprintf(stderr, "[services] Could not send updated window metrics to flutter. FlutterEngineSendWindowMetricsEvent: %s\n", FLUTTER_RESULT_TO_STRING(result));
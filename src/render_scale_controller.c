@@ -0,0 +1,81 @@
+#include <math.h>
+
+#include <collection.h>
+#include <render_scale_controller.h>
+
+FILE_DESCR("render scale controller")
+
+void render_scale_controller_init(
+    struct render_scale_controller *controller,
+    double min_scale,
+    double max_scale,
+    double refresh_rate
+) {
+    DEBUG_ASSERT(min_scale > 0);
+    DEBUG_ASSERT(min_scale <= max_scale);
+
+    if (refresh_rate <= 0) {
+        LOG_ERROR("Display reported an invalid refresh rate. Assuming 60Hz.\n");
+        refresh_rate = 60;
+    }
+
+    controller->min_scale = min_scale;
+    controller->max_scale = max_scale;
+    controller->budget_ns = 1000000000.0 / refresh_rate * RENDER_SCALE_CONTROLLER_TARGET_LOAD;
+    controller->target_scale = max_scale;
+    controller->avg_raster_ns = 0;
+    controller->n_frames = 0;
+    controller->n_stale_frames = 0;
+}
+
+double render_scale_controller_on_frame(struct render_scale_controller *controller, double frame_scale, uint64_t raster_ns) {
+    double scale, new_scale;
+
+    // The frame scale is calculated from the buffer size, so it's not exactly the scale we asked for.
+    if (fabs(frame_scale - controller->target_scale) >= RENDER_SCALE_CONTROLLER_STEP / 2) {
+        controller->n_stale_frames++;
+        if (controller->n_stale_frames < RENDER_SCALE_CONTROLLER_HOLD_FRAMES) {
+            // frame was started before the engine got the new window metrics.
+            return controller->target_scale;
+        }
+
+        // the new scale was never applied.
+        controller->target_scale = frame_scale;
+        controller->avg_raster_ns = 0;
+        controller->n_frames = 0;
+    }
+    controller->n_stale_frames = 0;
+
+    // Mean of all frames until there are enough of them, a moving average afterwards.
+    controller->n_frames++;
+    controller->avg_raster_ns += (raster_ns - controller->avg_raster_ns) / min(controller->n_frames, RENDER_SCALE_CONTROLLER_HOLD_FRAMES);
+
+    if (controller->n_frames < RENDER_SCALE_CONTROLLER_HOLD_FRAMES) {
+        return controller->target_scale;
+    }
+
+    scale = controller->target_scale;
+    if ((controller->avg_raster_ns > controller->budget_ns) && (scale > controller->min_scale)) {
+        // The raster time grows with the number of pixels, so with the square of the scale.
+        new_scale = scale * sqrt(controller->budget_ns / controller->avg_raster_ns);
+        new_scale = floor(new_scale / RENDER_SCALE_CONTROLLER_STEP + 1e-9) * RENDER_SCALE_CONTROLLER_STEP;
+        new_scale = max(controller->min_scale, min(new_scale, scale - RENDER_SCALE_CONTROLLER_STEP));
+    } else if (scale < controller->max_scale) {
+        // stay on the grid of steps, so adding them up doesn't accumulate rounding errors.
+        new_scale = min(floor(scale / RENDER_SCALE_CONTROLLER_STEP + 1 + 1e-9) * RENDER_SCALE_CONTROLLER_STEP, controller->max_scale);
+
+        if (controller->avg_raster_ns * (new_scale * new_scale) / (scale * scale) >= controller->budget_ns * RENDER_SCALE_CONTROLLER_HEADROOM) {
+            return scale;
+        }
+    } else {
+        return scale;
+    }
+
+    LOG_DEBUG("Average raster time at render scale %.2f is %.2fms. Changing render scale to %.2f.\n", scale, controller->avg_raster_ns / 1000000.0, new_scale);
+
+    controller->target_scale = new_scale;
+    controller->avg_raster_ns = 0;
+    controller->n_frames = 0;
+    controller->n_stale_frames = 0;
+    return new_scale;
+}
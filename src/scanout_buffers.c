@@ -0,0 +1,44 @@
+#include <collection.h>
+#include <scanout_buffers.h>
+
+void scanout_buffers_init(struct scanout_buffers *buffers, int n_buffers) {
+    DEBUG_ASSERT(n_buffers >= 2 && n_buffers <= SCANOUT_BUFFERS_MAX);
+
+    buffers->n_buffers = n_buffers;
+    for (int i = 0; i < SCANOUT_BUFFERS_MAX; i++) {
+        buffers->presented_at[i] = 0;
+    }
+    buffers->n_presents = 0;
+    buffers->front = 0;
+    buffers->scanout = -1;
+    buffers->previous_scanout = -1;
+}
+
+int scanout_buffers_present_front(struct scanout_buffers *buffers) {
+    buffers->previous_scanout = buffers->scanout;
+    buffers->scanout = buffers->front;
+    buffers->presented_at[buffers->front] = ++buffers->n_presents;
+
+    return buffers->front;
+}
+
+int scanout_buffers_select_next(struct scanout_buffers *buffers, bool flip_pending) {
+    int next;
+
+    next = -1;
+    for (int i = 0; i < buffers->n_buffers; i++) {
+        if ((i == buffers->scanout) || (flip_pending && (i == buffers->previous_scanout))) {
+            continue;
+        }
+
+        if ((next == -1) || (buffers->presented_at[i] < buffers->presented_at[next])) {
+            next = i;
+        }
+    }
+
+    if (next != -1) {
+        buffers->front = next;
+    }
+
+    return next;
+}
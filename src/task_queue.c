@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <collection.h>
+#include <object_pool.h>
+#include <watchdog.h>
+#include <task_queue.h>
+
+FILE_DESCR("task queue")
+
+struct task_queue_task {
+    struct mpsc_queue_node node;
+    int (*callback)(void *userdata);
+    void *userdata;
+};
+
+static struct object_pool task_pool = OBJECT_POOL_INITIALIZER("platform tasks", sizeof(struct task_queue_task), 256);
+
+static int wakeup(struct task_queue *queue) {
+    int ok;
+
+    ok = write(queue->wakeup_fd, (uint8_t[8]) {0, 0, 0, 0, 0, 0, 0, 1}, 8);
+    if (ok < 0) {
+        return errno;
+    }
+
+    return 0;
+}
+
+int task_queue_init(struct task_queue *queue) {
+    int fd;
+
+    fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        LOG_ERROR("Could not create task queue wakeup fd. eventfd: %s\n", strerror(errno));
+        return errno;
+    }
+
+    mpsc_queue_init(&queue->queue);
+    queue->wakeup_fd = fd;
+    atomic_init(&queue->pending_since, 0);
+
+    return 0;
+}
+
+void task_queue_deinit(struct task_queue *queue) {
+    struct task_queue_task *task;
+
+    while ((task = (struct task_queue_task *) mpsc_queue_pop(&queue->queue)) != NULL) {
+        object_pool_free(&task_pool, task);
+    }
+
+    close(queue->wakeup_fd);
+}
+
+int task_queue_post(struct task_queue *queue, int (*callback)(void *userdata), void *userdata) {
+    struct task_queue_task *task;
+    int ok;
+
+    task = object_pool_alloc(&task_pool);
+    if (task == NULL) {
+        return ENOMEM;
+    }
+
+    task->callback = callback;
+    task->userdata = userdata;
+
+    // Only the post that makes the queue non-empty needs to wake up the consumer.
+    if (mpsc_queue_push(&queue->queue, &task->node)) {
+        atomic_store_explicit(&queue->pending_since, get_monotonic_time(), memory_order_relaxed);
+
+        ok = wakeup(queue);
+        if (ok != 0) {
+            // We can't take the task back out of the queue at this point, so this is not an error
+            // for the caller: the task still owns userdata and will be executed on the next wakeup.
+            LOG_ERROR("Error waking up task queue consumer. write: %s\n", strerror(ok));
+        }
+    }
+
+    return 0;
+}
+
+int task_queue_run(struct task_queue *queue) {
+    struct task_queue_task *task;
+    uint64_t batch_start, pending_since;
+    uint8_t buffer[8];
+    size_t n_tasks;
+    int ok;
+
+    ok = read(queue->wakeup_fd, buffer, 8);
+    if ((ok < 0) && (errno != EAGAIN)) {
+        ok = errno;
+        LOG_ERROR("Could not read task queue wakeup fd. read: %s\n", strerror(ok));
+        return ok;
+    }
+
+    batch_start = get_monotonic_time();
+    n_tasks = mpsc_queue_get_length(&queue->queue);
+
+    for (; n_tasks > 0; n_tasks--) {
+        task = (struct task_queue_task *) mpsc_queue_pop(&queue->queue);
+        if (task == NULL) {
+            break;
+        }
+
+        watchdog_enter(kWatchdogPlatformTask, (const void*) task->callback, NULL);
+        ok = task->callback(task->userdata);
+        watchdog_leave();
+        if (ok != 0) {
+            LOG_ERROR("Error executing platform task: %s\n", strerror(ok));
+        }
+
+        object_pool_free(&task_pool, task);
+    }
+
+    // Read before looking at the queue, so a time published by a producer afterwards isn't cleared below.
+    pending_since = atomic_load_explicit(&queue->pending_since, memory_order_relaxed);
+
+    // Producers only wake us up when the queue transitions from empty to non-empty.
+    // So if there's anything left (either because it was posted while executing this batch or
+    // because a producer was in the middle of pushing) we need to re-arm ourselves.
+    if (mpsc_queue_get_length(&queue->queue) != 0) {
+        // everything that's left was posted after this batch started.
+        atomic_store_explicit(&queue->pending_since, batch_start, memory_order_relaxed);
+
+        ok = wakeup(queue);
+        if (ok != 0) {
+            LOG_ERROR("Error re-arming task queue. write: %s\n", strerror(ok));
+        }
+    } else {
+        // A producer that made the queue non-empty since then has published its own time, keep that one.
+        atomic_compare_exchange_strong_explicit(&queue->pending_since, &pending_since, 0, memory_order_relaxed, memory_order_relaxed);
+    }
+
+    return 0;
+}
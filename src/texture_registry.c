@@ -9,6 +9,7 @@
 
 #include <texture_registry.h>
 #include <flutter-pi.h>
+#include <object_pool.h>
 
 FILE_DESCR("texture registry")
 
@@ -24,12 +25,14 @@ struct counted_texture_frame {
     struct texture_frame frame;
 };
 
+static struct object_pool counted_texture_frame_pool = OBJECT_POOL_INITIALIZER("texture frames", sizeof(struct counted_texture_frame), 64);
+
 void counted_texture_frame_destroy(struct counted_texture_frame *frame) {
     frame->frame.destroy(
         &frame->frame,
         frame->frame.userdata
     );
-    free(frame);
+    object_pool_free(&counted_texture_frame_pool, frame);
 }
 
 DEFINE_REF_OPS(counted_texture_frame, n_refs)
@@ -236,7 +239,7 @@ int texture_push_frame(struct texture *texture, const struct texture_frame *fram
     struct counted_texture_frame *counted_frame;
     int ok;
 
-    counted_frame = malloc(sizeof *counted_frame);
+    counted_frame = object_pool_alloc(&counted_texture_frame_pool);
     if (counted_frame == NULL) {
         return ENOMEM;
     }
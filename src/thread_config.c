@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <collection.h>
+#include <thread_config.h>
+
+FILE_DESCR("thread config")
+
+#define LOG_SCHED_ERROR(config, fmtstring, ...) \
+    do { \
+        if ((config)->is_sched_optional) { \
+            LOG_DEBUG(fmtstring, __VA_ARGS__); \
+        } else { \
+            LOG_ERROR(fmtstring, __VA_ARGS__); \
+        } \
+    } while (false)
+
+static const struct {
+    const char *name;
+    int policy;
+} sched_policies[] = {
+    {"other", SCHED_OTHER},
+    {"batch", SCHED_BATCH},
+    {"idle", SCHED_IDLE},
+    {"fifo", SCHED_FIFO},
+    {"rr", SCHED_RR}
+};
+
+int thread_config_parse_sched(struct thread_config *config, const char *str) {
+    const char *colon;
+    size_t name_len;
+    long priority;
+    char *endptr;
+    int policy;
+
+    colon = strchr(str, ':');
+    name_len = colon ? (size_t) (colon - str) : strlen(str);
+
+    policy = -1;
+    for (int i = 0; i < sizeof(sched_policies) / sizeof(*sched_policies); i++) {
+        if ((strlen(sched_policies[i].name) == name_len) && (strncmp(str, sched_policies[i].name, name_len) == 0)) {
+            policy = sched_policies[i].policy;
+            break;
+        }
+    }
+
+    if (policy == -1) {
+        return EINVAL;
+    }
+
+    priority = 0;
+    if (colon != NULL) {
+        errno = 0;
+        priority = strtol(colon + 1, &endptr, 10);
+        if ((errno != 0) || (endptr == colon + 1) || (*endptr != '\0')) {
+            return EINVAL;
+        }
+    }
+
+    if ((policy == SCHED_FIFO) || (policy == SCHED_RR)) {
+        if (colon == NULL) {
+            priority = 1;
+        }
+
+        if ((priority < sched_get_priority_min(policy)) || (priority > sched_get_priority_max(policy))) {
+            return EINVAL;
+        }
+    } else if ((policy == SCHED_OTHER) || (policy == SCHED_BATCH)) {
+        if ((priority < -20) || (priority > 19)) {
+            return EINVAL;
+        }
+    } else if (priority != 0) {
+        return EINVAL;
+    }
+
+    config->has_sched_policy = true;
+    config->sched_policy = policy;
+    config->sched_priority = priority;
+    config->is_sched_optional = false;
+
+    return 0;
+}
+
+int thread_config_parse_cpus(struct thread_config *config, const char *str) {
+    const char *cursor;
+    long first, last;
+    uint64_t mask;
+    char *endptr;
+
+    mask = 0;
+
+    cursor = str;
+    do {
+        errno = 0;
+        first = strtol(cursor, &endptr, 10);
+        if ((errno != 0) || (endptr == cursor) || (first < 0) || (first >= 64)) {
+            return EINVAL;
+        }
+
+        last = first;
+        if (*endptr == '-') {
+            cursor = endptr + 1;
+            last = strtol(cursor, &endptr, 10);
+            if ((errno != 0) || (endptr == cursor) || (last < first) || (last >= 64)) {
+                return EINVAL;
+            }
+        }
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            mask |= 1ull << cpu;
+        }
+
+        if (*endptr == ',') {
+            cursor = endptr + 1;
+        } else if (*endptr != '\0') {
+            return EINVAL;
+        }
+    } while (*endptr != '\0');
+
+    config->has_affinity = true;
+    config->affinity = mask;
+
+    return 0;
+}
+
+int thread_config_apply(const struct thread_config *config, const char *thread_name) {
+    struct sched_param param;
+    cpu_set_t set;
+    int ok, result;
+
+    result = 0;
+
+    if (config->has_sched_policy) {
+        if ((config->sched_policy == SCHED_FIFO) || (config->sched_policy == SCHED_RR)) {
+            param.sched_priority = config->sched_priority;
+        } else {
+            param.sched_priority = 0;
+        }
+
+        ok = pthread_setschedparam(pthread_self(), config->sched_policy, &param);
+        if (ok != 0) {
+            LOG_SCHED_ERROR(config, "Could not set scheduling policy of %s thread. pthread_setschedparam: %s\n", thread_name, strerror(ok));
+            result = ok;
+        } else if ((config->sched_policy == SCHED_OTHER) || (config->sched_policy == SCHED_BATCH)) {
+            // On linux, the nice value is per-thread.
+            ok = setpriority(PRIO_PROCESS, syscall(SYS_gettid), config->sched_priority);
+            if (ok < 0) {
+                ok = errno;
+                LOG_SCHED_ERROR(config, "Could not set nice value of %s thread. setpriority: %s\n", thread_name, strerror(ok));
+                result = ok;
+            }
+        }
+    }
+
+    if (config->has_affinity) {
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if (config->affinity & (1ull << cpu)) {
+                CPU_SET(cpu, &set);
+            }
+        }
+
+        ok = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+        if (ok != 0) {
+            LOG_ERROR("Could not set CPU affinity of %s thread. pthread_setaffinity_np: %s\n", thread_name, strerror(ok));
+            result = ok;
+        }
+    }
+
+    return result;
+}
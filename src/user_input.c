@@ -52,6 +52,12 @@ struct user_input {
     FlutterTransformation view_to_display_transform_nontranslating;
 	unsigned int display_width;
 	unsigned int display_height;
+
+    /**
+     * @brief The factor the view is scaled down by relative to the display (see --render-scale).
+     * Applied after @ref display_to_view_transform.
+     */
+    double render_scale;
     
     /**
      * @brief The number of devices connected that want a mouse cursor.
@@ -160,6 +166,7 @@ struct user_input *user_input_new(
         display_height
     );
 
+    input->render_scale = 1.0;
     input->n_cursor_devices = 0;
     input->cursor_flutter_device_id = -1;
     input->cursor_x = 0.0;
@@ -217,12 +224,28 @@ void user_input_set_transform(
     input->display_height = display_height;
 }
 
+void user_input_set_render_scale(struct user_input *input, double render_scale) {
+    DEBUG_ASSERT(input != NULL);
+    DEBUG_ASSERT(render_scale > 0.0);
+
+    input->render_scale = render_scale;
+}
+
 int user_input_get_fd(struct user_input *input) {
     DEBUG_ASSERT(input != NULL);
     return libinput_get_fd(input->libinput);
 }
 
 
+/**
+ * @brief Transform display coordinates into the coordinates of the flutter view.
+ */
+static void transform_display_to_view(struct user_input *input, double *x, double *y) {
+    apply_flutter_transformation(input->display_to_view_transform, x, y);
+    *x *= input->render_scale;
+    *y *= input->render_scale;
+}
+
 static void flush_pointer_events(struct user_input *input) {
     DEBUG_ASSERT(input != NULL);
 
@@ -581,7 +604,7 @@ static int on_mouse_motion_event(struct user_input *input, struct libinput_event
     input->cursor_y = new_cursor_y;
 
     // transform the cursor pos to view (flutter) coordinates.
-    apply_flutter_transformation(input->display_to_view_transform, &new_cursor_x, &new_cursor_y);
+    transform_display_to_view(input, &new_cursor_x, &new_cursor_y);
 
     if (data->has_emitted_pointer_events == false) {
         data->has_emitted_pointer_events = true;
@@ -640,7 +663,7 @@ static int on_mouse_motion_absolute_event(struct user_input *input, struct libin
     input->cursor_y = y;
 
     // transform x & y to view (flutter) coordinates
-    apply_flutter_transformation(input->display_to_view_transform, &x, &y);
+    transform_display_to_view(input, &x, &y);
 
     if (data->has_emitted_pointer_events == false) {
         data->has_emitted_pointer_events = true;
@@ -737,7 +760,7 @@ static int on_mouse_button_event(struct user_input *input, struct libinput_event
         
         // since the stored coords are in display, not view coordinates,
         // we need to transform them again
-        apply_flutter_transformation(input->display_to_view_transform, &x, &y);
+        transform_display_to_view(input, &x, &y);
 
         emit_pointer_events(
             input,
@@ -777,7 +800,7 @@ static int on_mouse_axis_event(struct user_input *input, struct libinput_event *
     
     // since the stored coords are in display, not view coordinates,
     // we need to transform them again
-    apply_flutter_transformation(input->display_to_view_transform, &x, &y);
+    transform_display_to_view(input, &x, &y);
 
     double scroll_x = libinput_event_pointer_has_axis(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL)
         ? libinput_event_pointer_get_axis_value(pointer_event, LIBINPUT_POINTER_AXIS_SCROLL_HORIZONTAL)
@@ -832,7 +855,7 @@ static int on_touch_down(struct user_input *input, struct libinput_event *event)
     y = libinput_event_touch_get_y_transformed(touch_event, input->display_height - 1);
 
     // transform the display coordinates to view (flutter) coordinates
-    apply_flutter_transformation(input->display_to_view_transform, &x, &y);
+    transform_display_to_view(input, &x, &y);
 
     // emit the flutter pointer event
     emit_pointer_events(input, &FLUTTER_POINTER_TOUCH_DOWN_EVENT(timestamp, x, y, device_id), 1);
@@ -901,7 +924,7 @@ static int on_touch_motion(struct user_input *input, struct libinput_event *even
     y = libinput_event_touch_get_y_transformed(touch_event, input->display_height - 1);
 
     // transform the display coordinates to view (flutter) coordinates
-    apply_flutter_transformation(input->display_to_view_transform, &x, &y);
+    transform_display_to_view(input, &x, &y);
 
     // emit the flutter pointer event
     emit_pointer_events(input, &FLUTTER_POINTER_TOUCH_MOVE_EVENT(timestamp, x, y, device_id), 1);
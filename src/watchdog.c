@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+#include <collection.h>
+#include <watchdog.h>
+
+FILE_DESCR("watchdog")
+
+/// Sent to the watched thread to make it print its own backtrace.
+#define WATCHDOG_BACKTRACE_SIGNAL (SIGRTMIN)
+
+struct watchdog_frame {
+    bool is_active;
+    enum watchdog_callback_kind kind;
+    const void *function;
+    char name[WATCHDOG_MAX_NAME_LENGTH];
+    uint64_t start;
+};
+
+static struct {
+    /**
+     * @brief Read by every thread that runs callbacks, to find out whether it's the watched thread.
+     * Set with release semantics after the rest of the configuration, so a thread that
+     * sees it set also sees @ref watched_thread.
+     */
+    atomic_bool enabled;
+    bool print_backtraces;
+    uint64_t budget_ns;
+    pthread_t watched_thread;
+    pthread_t thread;
+    atomic_bool should_stop;
+
+    /**
+     * @brief The callback currently running on the watched thread, as seen by the watchdog thread.
+     *
+     * Written only by the watched thread and read by the watchdog thread.
+     * Protected by a seqlock: @ref seq is odd while @ref current is being written.
+     */
+    atomic_uint seq;
+    struct watchdog_frame current;
+
+    /// Only touched by the watched thread. The outermost running callback
+    /// and how many callbacks are currently nested, including the outermost one.
+    struct watchdog_frame outermost;
+    int depth;
+
+    /// statistics
+    atomic_uint_fast64_t n_callbacks;
+    atomic_uint_fast64_t max_duration_ns;
+    pthread_mutex_t stats_mutex;
+    uint64_t n_stalls;
+    enum watchdog_callback_kind last_stall_kind;
+    const void *last_stall_function;
+    char last_stall_name[WATCHDOG_MAX_NAME_LENGTH];
+    uint64_t last_stall_duration_ns;
+} watchdog = {
+    .enabled = false,
+    .stats_mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static const char *callback_kind_names[kMax_WatchdogCallbackKind] = {
+    [kWatchdogPlatformTask] = "platform task",
+    [kWatchdogEngineTask] = "engine task",
+    [kWatchdogPlatformMessage] = "platform message",
+    [kWatchdogEventSource] = "event source"
+};
+
+static void publish_frame(const struct watchdog_frame *frame) {
+    unsigned int seq;
+
+    seq = atomic_load_explicit(&watchdog.seq, memory_order_relaxed);
+
+    atomic_store_explicit(&watchdog.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    watchdog.current = *frame;
+
+    atomic_store_explicit(&watchdog.seq, seq + 2, memory_order_release);
+}
+
+/**
+ * @brief Read the frame published by the watched thread.
+ * @returns The seqlock sequence number the frame belongs to.
+ */
+static unsigned int read_frame(struct watchdog_frame *frame_out) {
+    unsigned int seq_before, seq_after;
+
+    do {
+        seq_before = atomic_load_explicit(&watchdog.seq, memory_order_acquire);
+        if (seq_before & 1) {
+            continue;
+        }
+
+        *frame_out = watchdog.current;
+
+        atomic_thread_fence(memory_order_acquire);
+        seq_after = atomic_load_explicit(&watchdog.seq, memory_order_relaxed);
+    } while ((seq_before & 1) || (seq_before != seq_after));
+
+    return seq_before;
+}
+
+static void on_backtrace_signal(int signal) {
+    void *addresses[64];
+    int n_addresses;
+
+    (void) signal;
+
+    n_addresses = backtrace(addresses, sizeof(addresses) / sizeof(*addresses));
+    backtrace_symbols_fd(addresses, n_addresses, STDERR_FILENO);
+}
+
+static void report_stall(const struct watchdog_frame *frame, uint64_t duration) {
+    const char *symbol;
+    Dl_info info;
+
+    symbol = NULL;
+    if ((frame->function != NULL) && dladdr(frame->function, &info) && (info.dli_sname != NULL)) {
+        symbol = info.dli_sname;
+    }
+
+    LOG_ERROR(
+        "Main loop stalled: %s %s%s%s%s(%p) has been running for %llu ms (budget: %llu ms).%s\n",
+        callback_kind_names[frame->kind],
+        frame->name[0] ? "\"" : "",
+        frame->name,
+        frame->name[0] ? "\" " : "",
+        symbol ? symbol : "",
+        frame->function,
+        (unsigned long long) (duration / 1000000),
+        (unsigned long long) (watchdog.budget_ns / 1000000),
+        watchdog.print_backtraces ? " Backtrace of the platform thread:" : ""
+    );
+
+    if (watchdog.print_backtraces) {
+        // Note this interrupts whatever syscall the platform thread is blocked in.
+        // Most syscalls are restarted (SA_RESTART), but sleeps return early.
+        pthread_kill(watchdog.watched_thread, WATCHDOG_BACKTRACE_SIGNAL);
+    }
+
+    pthread_mutex_lock(&watchdog.stats_mutex);
+    watchdog.n_stalls++;
+    watchdog.last_stall_kind = frame->kind;
+    watchdog.last_stall_function = frame->function;
+    memcpy(watchdog.last_stall_name, frame->name, sizeof(watchdog.last_stall_name));
+    watchdog.last_stall_duration_ns = duration;
+    pthread_mutex_unlock(&watchdog.stats_mutex);
+}
+
+static void *watchdog_thread_entry(void *userdata) {
+    struct watchdog_frame frame;
+    struct timespec interval;
+    unsigned int seq, reported_seq;
+    uint64_t now;
+
+    (void) userdata;
+
+    // check four times per budget, so a stall is reported at most 1.25 budgets after it started.
+    interval.tv_sec = (watchdog.budget_ns / 4) / 1000000000ull;
+    interval.tv_nsec = (watchdog.budget_ns / 4) % 1000000000ull;
+
+    // every callback entry & exit changes the sequence number, so this
+    // makes sure we report every stalled callback only once.
+    reported_seq = 1;
+
+    while (!atomic_load(&watchdog.should_stop)) {
+        while ((clock_nanosleep(CLOCK_MONOTONIC, 0, &interval, &interval) == EINTR));
+
+        interval.tv_sec = (watchdog.budget_ns / 4) / 1000000000ull;
+        interval.tv_nsec = (watchdog.budget_ns / 4) % 1000000000ull;
+
+        seq = read_frame(&frame);
+        if (!frame.is_active || (seq == reported_seq)) {
+            continue;
+        }
+
+        now = get_monotonic_time();
+        if (now - frame.start > watchdog.budget_ns) {
+            report_stall(&frame, now - frame.start);
+            reported_seq = seq;
+        }
+    }
+
+    return NULL;
+}
+
+int watchdog_init(unsigned int budget_ms, bool print_backtraces) {
+    struct sigaction action;
+    void *dummy[1];
+    int ok;
+
+    if (budget_ms == 0) {
+        return 0;
+    }
+
+    if (print_backtraces) {
+        // backtrace() loads libgcc lazily on first use, which isn't safe inside a signal handler.
+        backtrace(dummy, 1);
+
+        memset(&action, 0, sizeof action);
+        action.sa_handler = on_backtrace_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+
+        ok = sigaction(WATCHDOG_BACKTRACE_SIGNAL, &action, NULL);
+        if (ok < 0) {
+            perror("[watchdog] Could not install backtrace signal handler. sigaction");
+            return errno;
+        }
+    }
+
+    watchdog.print_backtraces = print_backtraces;
+    watchdog.budget_ns = budget_ms * 1000000ull;
+    watchdog.watched_thread = pthread_self();
+    watchdog.depth = 0;
+    watchdog.current = (struct watchdog_frame) {.is_active = false};
+    atomic_store(&watchdog.seq, 0);
+    atomic_store(&watchdog.should_stop, false);
+    atomic_store_explicit(&watchdog.enabled, true, memory_order_release);
+
+    ok = pthread_create(&watchdog.thread, NULL, watchdog_thread_entry, NULL);
+    if (ok != 0) {
+        LOG_ERROR("Could not create watchdog thread. pthread_create: %s\n", strerror(ok));
+        atomic_store_explicit(&watchdog.enabled, false, memory_order_release);
+        return ok;
+    }
+
+    pthread_setname_np(watchdog.thread, "flutter-pi.wdog");
+
+    return 0;
+}
+
+void watchdog_deinit(void) {
+    if (!atomic_load_explicit(&watchdog.enabled, memory_order_acquire)) {
+        return;
+    }
+
+    atomic_store(&watchdog.should_stop, true);
+    pthread_join(watchdog.thread, NULL);
+
+    atomic_store_explicit(&watchdog.enabled, false, memory_order_release);
+}
+
+void watchdog_enter(enum watchdog_callback_kind kind, const void *function, const char *name) {
+    struct watchdog_frame *frame;
+
+    // callbacks on other threads can't stall the main loop.
+    if (!atomic_load_explicit(&watchdog.enabled, memory_order_acquire) || !pthread_equal(pthread_self(), watchdog.watched_thread)) {
+        return;
+    }
+
+    // nested callbacks are part of the outermost one and are attributed to it.
+    if (watchdog.depth++ > 0) {
+        return;
+    }
+
+    frame = &watchdog.outermost;
+    frame->is_active = true;
+    frame->kind = kind;
+    frame->function = function;
+    if (name != NULL) {
+        snprintf(frame->name, sizeof(frame->name), "%s", name);
+    } else {
+        frame->name[0] = '\0';
+    }
+    frame->start = get_monotonic_time();
+
+    publish_frame(frame);
+}
+
+void watchdog_leave(void) {
+    static const struct watchdog_frame inactive = {.is_active = false};
+    uint64_t duration;
+
+    if (!atomic_load_explicit(&watchdog.enabled, memory_order_acquire) || !pthread_equal(pthread_self(), watchdog.watched_thread)) {
+        return;
+    }
+
+    DEBUG_ASSERT(watchdog.depth > 0);
+
+    if (--watchdog.depth > 0) {
+        return;
+    }
+
+    duration = get_monotonic_time() - watchdog.outermost.start;
+
+    // we're the only writer, so no need for a CAS loop.
+    atomic_fetch_add_explicit(&watchdog.n_callbacks, 1, memory_order_relaxed);
+    if (duration > atomic_load_explicit(&watchdog.max_duration_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&watchdog.max_duration_ns, duration, memory_order_relaxed);
+    }
+
+    publish_frame(&inactive);
+}
+
+void watchdog_get_stats(struct watchdog_stats *stats_out) {
+    stats_out->n_callbacks = atomic_load_explicit(&watchdog.n_callbacks, memory_order_relaxed);
+    stats_out->max_duration_ns = atomic_load_explicit(&watchdog.max_duration_ns, memory_order_relaxed);
+
+    pthread_mutex_lock(&watchdog.stats_mutex);
+    stats_out->n_stalls = watchdog.n_stalls;
+    stats_out->last_stall_kind = watchdog.last_stall_kind;
+    stats_out->last_stall_function = watchdog.last_stall_function;
+    memcpy(stats_out->last_stall_name, watchdog.last_stall_name, sizeof(stats_out->last_stall_name));
+    stats_out->last_stall_duration_ns = watchdog.last_stall_duration_ns;
+    pthread_mutex_unlock(&watchdog.stats_mutex);
+}
+
+void watchdog_dump_stats(void) {
+    struct watchdog_stats stats;
+
+    if (!atomic_load_explicit(&watchdog.enabled, memory_order_acquire)) {
+        return;
+    }
+
+    watchdog_get_stats(&stats);
+
+    LOG_DEBUG(
+        "%llu callbacks, longest took %.1f ms, %llu exceeded the budget of %llu ms\n",
+        (unsigned long long) stats.n_callbacks,
+        stats.max_duration_ns / 1000000.0,
+        (unsigned long long) stats.n_stalls,
+        (unsigned long long) (watchdog.budget_ns / 1000000)
+    );
+
+    if (stats.n_stalls > 0) {
+        LOG_DEBUG(
+            "last stall: %s \"%s\" (%p), %.1f ms\n",
+            callback_kind_names[stats.last_stall_kind],
+            stats.last_stall_name,
+            stats.last_stall_function,
+            stats.last_stall_duration_ns / 1000000.0
+        );
+    }
+}
@@ -0,0 +1,198 @@
+/**
+ * Measures how long building an atomic request with the plane properties the compositor
+ * sets on every frame takes:
+ *  - setting the properties by name,
+ *  - using the property ID tables, looking up the plane by its ID first,
+ *  - using the property ID tables with a plane that was already looked up, like the compositor does.
+ *
+ * Needs a DRM device that supports atomic modesetting, but doesn't need to be DRM master:
+ * the requests are only built, never committed.
+ *
+ * usage: atomic_request_benchmark [drm device] [n_iterations]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <collection.h>
+#include <modesetting.h>
+
+FILE_DESCR("atomic request benchmark")
+
+#define DRM_DEVICE_DEFAULT "/dev/dri/card0"
+#define N_ITERATIONS_DEFAULT 10000
+
+/**
+ * @brief Select the first connected connector and a CRTC it can be driven by.
+ * Atomic requests can only be created once a CRTC is selected.
+ */
+static int select_crtc(struct drmdev *drmdev) {
+    struct drm_connector *connector;
+    struct drm_encoder *encoder;
+    struct drm_crtc *crtc;
+
+    for_each_connector_in_drmdev(drmdev, connector) {
+        if ((connector->connector->connection == DRM_MODE_CONNECTED) && (connector->connector->count_modes > 0)) {
+            break;
+        }
+    }
+
+    if (connector == NULL) {
+        LOG_ERROR("No connected display found.\n");
+        return EINVAL;
+    }
+
+    for (int i = 0; i < connector->connector->count_encoders; i++) {
+        for_each_encoder_in_drmdev(drmdev, encoder) {
+            if (encoder->encoder->encoder_id == connector->connector->encoders[i]) {
+                break;
+            }
+        }
+
+        if (encoder == NULL) {
+            continue;
+        }
+
+        for_each_crtc_in_drmdev(drmdev, crtc) {
+            if (encoder->encoder->possible_crtcs & crtc->bitmask) {
+                return drmdev_configure(
+                    drmdev,
+                    connector->connector->connector_id,
+                    encoder->encoder->encoder_id,
+                    crtc->crtc->crtc_id,
+                    connector->connector->modes
+                );
+            }
+        }
+    }
+
+    LOG_ERROR("No CRTC found for the connected display.\n");
+    return EINVAL;
+}
+
+static int benchmark_by_name(struct drmdev *drmdev, uint32_t plane_id, int n_iterations, uint64_t *duration_ns_out) {
+    struct drmdev_atomic_req *req;
+    uint64_t start;
+    int ok;
+
+    start = get_monotonic_time();
+    for (int i = 0; i < n_iterations; i++) {
+        ok = drmdev_new_atomic_req(drmdev, &req);
+        if (ok != 0) {
+            return ok;
+        }
+
+        drmdev_atomic_req_put_plane_property(req, plane_id, "FB_ID", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "CRTC_ID", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "SRC_X", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "SRC_Y", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "SRC_W", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "SRC_H", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "CRTC_X", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "CRTC_Y", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "CRTC_W", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "CRTC_H", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "rotation", 0);
+        drmdev_atomic_req_put_plane_property(req, plane_id, "zpos", 0);
+
+        drmdev_destroy_atomic_req(req);
+    }
+
+    *duration_ns_out = get_monotonic_time() - start;
+    return 0;
+}
+
+static int benchmark_by_table(struct drmdev *drmdev, uint32_t plane_id, struct drm_plane *resolved_plane, int n_iterations, uint64_t *duration_ns_out) {
+    struct drmdev_atomic_req *req;
+    struct drm_plane *plane;
+    uint64_t start;
+    int ok;
+
+    start = get_monotonic_time();
+    for (int i = 0; i < n_iterations; i++) {
+        ok = drmdev_new_atomic_req(drmdev, &req);
+        if (ok != 0) {
+            return ok;
+        }
+
+        plane = resolved_plane != NULL ? resolved_plane : drmdev_get_plane(drmdev, plane_id);
+        for (int prop = 0; prop <= kDrmPlanePropZpos; prop++) {
+            drmdev_atomic_req_put_plane_prop(req, plane, prop, 0);
+        }
+
+        drmdev_destroy_atomic_req(req);
+    }
+
+    *duration_ns_out = get_monotonic_time() - start;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct drmdev *drmdev;
+    struct drm_plane *plane;
+    uint64_t by_name_ns, by_table_lookup_ns, by_table_ns;
+    const char *path;
+    int n_iterations;
+    int ok;
+
+    path = argc > 1 ? argv[1] : DRM_DEVICE_DEFAULT;
+    n_iterations = argc > 2 ? atoi(argv[2]) : N_ITERATIONS_DEFAULT;
+    if (n_iterations <= 0) {
+        fprintf(stderr, "usage: %s [drm device] [n_iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ok = drmdev_new_from_path(&drmdev, path);
+    if (ok != 0) {
+        LOG_ERROR("Could not open DRM device \"%s\". drmdev_new_from_path: %s\n", path, strerror(ok));
+        return EXIT_FAILURE;
+    }
+
+    if (!drmdev->supports_atomic_modesetting) {
+        LOG_ERROR("DRM device \"%s\" doesn't support atomic modesetting.\n", path);
+        return EXIT_FAILURE;
+    }
+
+    ok = select_crtc(drmdev);
+    if (ok != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // the last plane is the worst case for looking it up by ID.
+    plane = NULL;
+    for (size_t i = 0; i < drmdev->n_planes; i++) {
+        if (drmdev->planes[i].plane->possible_crtcs & drmdev->selected_crtc->bitmask) {
+            plane = drmdev->planes + i;
+        }
+    }
+
+    if (plane == NULL) {
+        LOG_ERROR("No plane found for the selected CRTC.\n");
+        return EXIT_FAILURE;
+    }
+
+    ok = benchmark_by_name(drmdev, plane->plane->plane_id, n_iterations, &by_name_ns);
+    if (ok == 0) {
+        ok = benchmark_by_table(drmdev, plane->plane->plane_id, NULL, n_iterations, &by_table_lookup_ns);
+    }
+    if (ok == 0) {
+        ok = benchmark_by_table(drmdev, plane->plane->plane_id, plane, n_iterations, &by_table_ns);
+    }
+    if (ok != 0) {
+        LOG_ERROR("Could not build atomic request: %s\n", strerror(ok));
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "Building an atomic request with %d plane properties (%zu planes): "
+        "%.2fus by name, %.2fus using the property tables, %.2fus using the property tables and a resolved plane\n",
+        kDrmPlanePropZpos + 1,
+        drmdev->n_planes,
+        by_name_ns / 1000.0 / n_iterations,
+        by_table_lookup_ns / 1000.0 / n_iterations,
+        by_table_ns / 1000.0 / n_iterations
+    );
+
+    return EXIT_SUCCESS;
+}
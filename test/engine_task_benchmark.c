@@ -0,0 +1,330 @@
+/**
+ * Compares the two ways flutter-pi has scheduled engine tasks:
+ *
+ *  - heap: the engine task heap, dispatched by a single timerfd that's only
+ *    re-armed when a task is due earlier than the current deadline. (current)
+ *  - sources: one malloc'd task copy and one sd_event time source per task,
+ *    which is what flutter-pi did before the engine task heap.
+ *
+ * The workload mimics the engine during an animation: tasks are posted in bursts
+ * that share one target time. Both variants run on a sd_event loop and report
+ * throughput (tasks per second of CPU time, including posting) and wakeup jitter
+ * (how late tasks ran compared to their target time).
+ *
+ * usage: engine_task_benchmark [n_tasks]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/timerfd.h>
+#include <systemd/sd-event.h>
+
+#include <collection.h>
+#include <engine_task_heap.h>
+
+FILE_DESCR("engine task benchmark")
+
+#define N_TASKS_DEFAULT 100000
+#define BURST_SIZE 8
+#define BURST_INTERVAL_NS 250000ull
+#define START_DELAY_NS 2000000ull
+
+struct benchmark_result {
+    uint64_t n_executed;
+    uint64_t n_wakeups;
+    uint64_t total_lateness_ns;
+    uint64_t max_lateness_ns;
+    uint64_t cpu_ns;
+};
+
+static uint64_t get_cpu_time(void) {
+    struct timespec time;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+
+    return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+static uint64_t get_target_time(uint64_t start, size_t index) {
+    return start + START_DELAY_NS + (index / BURST_SIZE) * BURST_INTERVAL_NS;
+}
+
+static void record_execution(struct benchmark_result *result, uint64_t target_time) {
+    uint64_t now, lateness;
+
+    now = get_monotonic_time();
+    lateness = now > target_time ? now - target_time : 0;
+
+    result->n_executed++;
+    result->total_lateness_ns += lateness;
+    result->max_lateness_ns = max(result->max_lateness_ns, lateness);
+}
+
+static int run_loop(sd_event *loop, struct benchmark_result *result) {
+    int ok;
+
+    do {
+        ok = sd_event_run(loop, (uint64_t) -1);
+        if (ok < 0) {
+            LOG_ERROR("sd_event_run: %s\n", strerror(-ok));
+            return -ok;
+        }
+
+        result->n_wakeups++;
+    } while (sd_event_get_state(loop) != SD_EVENT_FINISHED);
+
+    return 0;
+}
+
+/// heap variant
+struct heap_benchmark {
+    sd_event *loop;
+    struct engine_task_heap heap;
+    int timerfd;
+    uint64_t armed_time;
+    size_t n_remaining;
+    struct benchmark_result *result;
+};
+
+static int heap_benchmark_arm(struct heap_benchmark *bench, uint64_t target_time) {
+    return engine_task_timer_arm(bench->timerfd, target_time, &bench->armed_time);
+}
+
+static int heap_benchmark_post(struct heap_benchmark *bench, uint64_t target_time) {
+    int ok;
+
+    ok = engine_task_heap_push(&bench->heap, (FlutterTask) {0}, target_time);
+    if (ok != 0) {
+        return ok;
+    }
+
+    if (target_time < bench->armed_time) {
+        return heap_benchmark_arm(bench, target_time);
+    }
+
+    return 0;
+}
+
+static int on_heap_timer_expired(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    const struct engine_task *next;
+    struct heap_benchmark *bench;
+    struct engine_task task;
+    uint64_t expirations, now;
+    int ok;
+
+    (void) s;
+    (void) revents;
+
+    bench = userdata;
+
+    ok = read(fd, &expirations, sizeof expirations);
+    if ((ok < 0) && (errno != EAGAIN)) {
+        return -errno;
+    }
+
+    now = get_monotonic_time();
+
+    while ((next = engine_task_heap_peek(&bench->heap)) && (next->target_time <= now)) {
+        engine_task_heap_pop(&bench->heap, &task);
+        record_execution(bench->result, task.target_time);
+        bench->n_remaining--;
+    }
+
+    if (bench->armed_time <= now) {
+        bench->armed_time = UINT64_MAX;
+    }
+
+    next = engine_task_heap_peek(&bench->heap);
+    heap_benchmark_arm(bench, next != NULL ? next->target_time : UINT64_MAX);
+
+    if (bench->n_remaining == 0) {
+        sd_event_exit(bench->loop, 0);
+    }
+
+    return 0;
+}
+
+static int run_heap_benchmark(size_t n_tasks, struct benchmark_result *result) {
+    struct heap_benchmark bench = {0};
+    uint64_t cpu_start, start;
+    int ok;
+
+    ok = sd_event_new(&bench.loop);
+    if (ok < 0) {
+        return -ok;
+    }
+
+    bench.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (bench.timerfd < 0) {
+        ok = errno;
+        goto out_unref_loop;
+    }
+
+    ok = sd_event_add_io(bench.loop, NULL, bench.timerfd, EPOLLIN, on_heap_timer_expired, &bench);
+    if (ok < 0) {
+        ok = -ok;
+        goto out_close_timerfd;
+    }
+
+    bench.armed_time = UINT64_MAX;
+    bench.n_remaining = n_tasks;
+    bench.result = result;
+
+    cpu_start = get_cpu_time();
+    start = get_monotonic_time();
+
+    for (size_t i = 0; i < n_tasks; i++) {
+        ok = heap_benchmark_post(&bench, get_target_time(start, i));
+        if (ok != 0) {
+            goto out_close_timerfd;
+        }
+    }
+
+    ok = run_loop(bench.loop, result);
+
+    result->cpu_ns = get_cpu_time() - cpu_start;
+
+    out_close_timerfd:
+    close(bench.timerfd);
+
+    out_unref_loop:
+    engine_task_heap_deinit(&bench.heap);
+    sd_event_unref(bench.loop);
+    return ok;
+}
+
+/// per-source variant
+struct source_benchmark {
+    sd_event *loop;
+    size_t n_remaining;
+    struct benchmark_result *result;
+};
+
+struct source_task {
+    struct source_benchmark *bench;
+    uint64_t target_time;
+    FlutterTask task;
+};
+
+static int on_source_task_expired(sd_event_source *s, uint64_t usec, void *userdata) {
+    struct source_task *task;
+
+    (void) usec;
+
+    task = userdata;
+
+    record_execution(task->bench->result, task->target_time);
+
+    task->bench->n_remaining--;
+    if (task->bench->n_remaining == 0) {
+        sd_event_exit(task->bench->loop, 0);
+    }
+
+    free(task);
+
+    sd_event_source_set_enabled(s, SD_EVENT_OFF);
+    sd_event_source_unref(s);
+
+    return 0;
+}
+
+static int source_benchmark_post(struct source_benchmark *bench, uint64_t target_time) {
+    struct source_task *task;
+    sd_event_source *source;
+    int ok;
+
+    task = malloc(sizeof *task);
+    if (task == NULL) {
+        return ENOMEM;
+    }
+
+    task->bench = bench;
+    task->target_time = target_time;
+    task->task = (FlutterTask) {0};
+
+    ok = sd_event_add_time(bench->loop, &source, CLOCK_MONOTONIC, target_time / 1000, 1, on_source_task_expired, task);
+    if (ok < 0) {
+        free(task);
+        return -ok;
+    }
+
+    return 0;
+}
+
+static int run_source_benchmark(size_t n_tasks, struct benchmark_result *result) {
+    struct source_benchmark bench = {0};
+    uint64_t cpu_start, start;
+    int ok;
+
+    ok = sd_event_new(&bench.loop);
+    if (ok < 0) {
+        return -ok;
+    }
+
+    bench.n_remaining = n_tasks;
+    bench.result = result;
+
+    cpu_start = get_cpu_time();
+    start = get_monotonic_time();
+
+    for (size_t i = 0; i < n_tasks; i++) {
+        ok = source_benchmark_post(&bench, get_target_time(start, i));
+        if (ok != 0) {
+            goto out_unref_loop;
+        }
+    }
+
+    ok = run_loop(bench.loop, result);
+
+    result->cpu_ns = get_cpu_time() - cpu_start;
+
+    out_unref_loop:
+    sd_event_unref(bench.loop);
+    return ok;
+}
+
+static void print_result(const char *name, const struct benchmark_result *result) {
+    printf(
+        "%-8s %8" PRIu64 " tasks, %7" PRIu64 " wakeups, %10.0f tasks/s CPU time, lateness avg %6.1fus, max %7.1fus\n",
+        name,
+        result->n_executed,
+        result->n_wakeups,
+        result->cpu_ns ? result->n_executed / (result->cpu_ns / 1000000000.0) : 0.0,
+        result->n_executed ? result->total_lateness_ns / 1000.0 / result->n_executed : 0.0,
+        result->max_lateness_ns / 1000.0
+    );
+}
+
+int main(int argc, char **argv) {
+    struct benchmark_result heap_result = {0}, source_result = {0};
+    size_t n_tasks;
+    int ok;
+
+    n_tasks = argc > 1 ? strtoul(argv[1], NULL, 10) : N_TASKS_DEFAULT;
+    if (n_tasks == 0) {
+        fprintf(stderr, "usage: %s [n_tasks]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ok = run_source_benchmark(n_tasks, &source_result);
+    if (ok != 0) {
+        LOG_ERROR("per-source benchmark failed: %s\n", strerror(ok));
+        return EXIT_FAILURE;
+    }
+
+    ok = run_heap_benchmark(n_tasks, &heap_result);
+    if (ok != 0) {
+        LOG_ERROR("heap benchmark failed: %s\n", strerror(ok));
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu tasks in bursts of %d, one burst every %lluus\n", n_tasks, BURST_SIZE, BURST_INTERVAL_NS / 1000);
+    print_result("sources", &source_result);
+    print_result("heap", &heap_result);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,276 @@
+/**
+ * Unit tests for the frame scheduler, driven by a fake clock.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <collection.h>
+#include <frame_scheduler.h>
+
+FILE_DESCR("frame scheduler test")
+
+#define NOMINAL_REFRESH_RATE 60.0
+#define NOMINAL_PERIOD_NS (1000000000.0 / NOMINAL_REFRESH_RATE)
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            LOG_ERROR("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return false; \
+        } \
+    } while (0)
+
+struct fake_display {
+    struct frame_scheduler scheduler;
+
+    uint64_t now;
+    uint64_t last_vblank;
+
+    unsigned int n_replies;
+    intptr_t baton;
+    uint64_t frame_start;
+    uint64_t frame_target;
+
+    uint32_t rand_state;
+};
+
+static uint64_t get_time(void *userdata) {
+    return ((struct fake_display *) userdata)->now;
+}
+
+static uint64_t get_last_vblank(void *userdata) {
+    return ((struct fake_display *) userdata)->last_vblank;
+}
+
+static void on_reply(void *userdata, intptr_t baton, uint64_t frame_start_ns, uint64_t frame_target_ns) {
+    struct fake_display *display = userdata;
+
+    display->n_replies++;
+    display->baton = baton;
+    display->frame_start = frame_start_ns;
+    display->frame_target = frame_target_ns;
+}
+
+static void fake_display_init(struct fake_display *display) {
+    *display = (struct fake_display) {
+        .now = 1000000000ull,
+        .rand_state = 1
+    };
+
+    frame_scheduler_init(&display->scheduler, NOMINAL_REFRESH_RATE, get_time, get_last_vblank, on_reply, display);
+}
+
+/// Deliver a page flip event for a vblank at @ref vblank_ns, which is also the new current time.
+static void fake_display_vblank(struct fake_display *display, uint64_t vblank_ns) {
+    display->now = vblank_ns;
+    display->last_vblank = vblank_ns;
+    frame_scheduler_on_vblank(&display->scheduler, vblank_ns);
+}
+
+/// A random number in [-range, range]. Deterministic, so failures can be reproduced.
+static double fake_display_jitter(struct fake_display *display, double range) {
+    display->rand_state = display->rand_state * 1103515245u + 12345u;
+    return (((display->rand_state >> 8) & 0xFFFF) / (double) 0xFFFF * 2 - 1) * range;
+}
+
+static double get_estimated_period(struct fake_display *display) {
+    struct frame_scheduler_stats stats;
+
+    frame_scheduler_get_stats(&display->scheduler, &stats);
+    return stats.estimated_period_ns;
+}
+
+static bool test_replies_immediately_when_idle(void) {
+    struct fake_display display;
+
+    fake_display_init(&display);
+
+    frame_scheduler_request_frame(&display.scheduler, 1);
+
+    // no vblank is known yet, so the frame starts now.
+    CHECK(display.n_replies == 1);
+    CHECK(display.baton == 1);
+    CHECK(display.frame_start == display.now);
+    CHECK(display.frame_target == display.now + (uint64_t) NOMINAL_PERIOD_NS);
+
+    frame_scheduler_deinit(&display.scheduler);
+    return true;
+}
+
+static bool test_defers_request_until_vblank(void) {
+    struct fake_display display;
+    uint64_t vblank;
+
+    fake_display_init(&display);
+
+    vblank = display.now;
+    fake_display_vblank(&display, vblank);
+
+    frame_scheduler_on_frame_submitted(&display.scheduler);
+
+    display.now += 2000000;
+    frame_scheduler_request_frame(&display.scheduler, 2);
+    CHECK(display.n_replies == 0);
+
+    // the frame in flight is scanned out one period later.
+    vblank += (uint64_t) NOMINAL_PERIOD_NS;
+    fake_display_vblank(&display, vblank);
+
+    CHECK(display.n_replies == 1);
+    CHECK(display.baton == 2);
+    CHECK(display.frame_start == vblank);
+    CHECK(display.frame_target == vblank + (uint64_t) NOMINAL_PERIOD_NS);
+
+    frame_scheduler_deinit(&display.scheduler);
+    return true;
+}
+
+static bool test_defers_request_until_drop(void) {
+    struct fake_display display;
+    uint64_t vblank, expected_start;
+
+    fake_display_init(&display);
+
+    vblank = display.now;
+    fake_display_vblank(&display, vblank);
+
+    frame_scheduler_on_frame_submitted(&display.scheduler);
+    frame_scheduler_request_frame(&display.scheduler, 3);
+    CHECK(display.n_replies == 0);
+
+    // a few periods pass before the commit fails. The frame should start
+    // at the last vblank predicted from the one we know of.
+    display.now = vblank + (uint64_t) (2.5 * NOMINAL_PERIOD_NS);
+    frame_scheduler_on_frame_dropped(&display.scheduler);
+
+    expected_start = vblank + (uint64_t) (2 * NOMINAL_PERIOD_NS);
+
+    CHECK(display.n_replies == 1);
+    CHECK(display.baton == 3);
+    CHECK(llabs((long long) display.frame_start - (long long) expected_start) <= 1);
+    CHECK(display.frame_target == display.frame_start + (uint64_t) NOMINAL_PERIOD_NS);
+
+    frame_scheduler_deinit(&display.scheduler);
+    return true;
+}
+
+static bool test_period_converges(void) {
+    struct fake_display display;
+    double actual_period, vblank, period, min_period, max_period;
+
+    // a display that's a bit slower than its mode timings say, with noisy timestamps
+    // and frames that sometimes skip a few vblanks.
+    actual_period = NOMINAL_PERIOD_NS * 1.006;
+    min_period = NOMINAL_PERIOD_NS * (1 - FRAME_SCHEDULER_MAX_PERIOD_DEVIATION);
+    max_period = NOMINAL_PERIOD_NS * (1 + FRAME_SCHEDULER_MAX_PERIOD_DEVIATION);
+
+    fake_display_init(&display);
+
+    vblank = display.now;
+    for (int i = 0; i < 2000; i++) {
+        vblank += actual_period * (i % 7 == 0 ? 3 : 1);
+        fake_display_vblank(&display, (uint64_t) (vblank + fake_display_jitter(&display, 200000)));
+
+        period = get_estimated_period(&display);
+        CHECK(period >= min_period);
+        CHECK(period <= max_period);
+    }
+
+    CHECK(fabs(get_estimated_period(&display) - actual_period) < 20000);
+
+    frame_scheduler_deinit(&display.scheduler);
+    return true;
+}
+
+static bool test_period_stays_within_deviation(void) {
+    struct fake_display display;
+    double vblank, max_period;
+
+    max_period = NOMINAL_PERIOD_NS * (1 + FRAME_SCHEDULER_MAX_PERIOD_DEVIATION);
+
+    fake_display_init(&display);
+
+    // way slower than the mode timings, so the estimate has to be clamped.
+    vblank = display.now;
+    for (int i = 0; i < 1000; i++) {
+        vblank += NOMINAL_PERIOD_NS * 1.05;
+        fake_display_vblank(&display, (uint64_t) vblank);
+
+        CHECK(get_estimated_period(&display) <= max_period);
+    }
+
+    CHECK(fabs(get_estimated_period(&display) - max_period) < 1);
+
+    frame_scheduler_deinit(&display.scheduler);
+    return true;
+}
+
+static bool test_rejects_long_intervals_and_outliers(void) {
+    struct frame_scheduler_stats stats;
+    struct fake_display display;
+    double vblank, period;
+
+    fake_display_init(&display);
+
+    vblank = display.now;
+    fake_display_vblank(&display, (uint64_t) vblank);
+
+    period = get_estimated_period(&display);
+
+    // spans more periods than can be told apart reliably.
+    vblank += NOMINAL_PERIOD_NS * (FRAME_SCHEDULER_MAX_INTERVAL_PERIODS + 4);
+    fake_display_vblank(&display, (uint64_t) vblank);
+
+    // half-way between two vblanks.
+    vblank += NOMINAL_PERIOD_NS * 1.5;
+    fake_display_vblank(&display, (uint64_t) vblank);
+
+    // shorter than a period.
+    vblank += NOMINAL_PERIOD_NS * 0.4;
+    fake_display_vblank(&display, (uint64_t) vblank);
+
+    frame_scheduler_get_stats(&display.scheduler, &stats);
+
+    CHECK(stats.n_rejected_intervals == 3);
+    CHECK(stats.n_drift_samples == 0);
+    CHECK(stats.estimated_period_ns == period);
+
+    // a regular interval afterwards is used again.
+    vblank += NOMINAL_PERIOD_NS;
+    fake_display_vblank(&display, (uint64_t) vblank);
+
+    frame_scheduler_get_stats(&display.scheduler, &stats);
+    CHECK(stats.n_rejected_intervals == 3);
+    CHECK(stats.n_drift_samples == 1);
+
+    frame_scheduler_deinit(&display.scheduler);
+    return true;
+}
+
+int main(void) {
+    static const struct {
+        const char *name;
+        bool (*run)(void);
+    } tests[] = {
+        {"replies immediately when idle", test_replies_immediately_when_idle},
+        {"defers request until vblank", test_defers_request_until_vblank},
+        {"defers request until drop", test_defers_request_until_drop},
+        {"period converges", test_period_converges},
+        {"period stays within deviation", test_period_stays_within_deviation},
+        {"rejects long intervals and outliers", test_rejects_long_intervals_and_outliers},
+    };
+    int n_failed = 0;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+        if (tests[i].run()) {
+            printf("PASS %s\n", tests[i].name);
+        } else {
+            printf("FAIL %s\n", tests[i].name);
+            n_failed++;
+        }
+    }
+
+    return n_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+/**
+ * Simulates how long the raster thread stalls per frame with 2, 3 and 4 buffers
+ * per no-GBM overlay rendertarget (--overlay-buffers), using the same buffer
+ * selection as the compositor (see scanout_buffers.h).
+ *
+ * The display is simulated: it refreshes every REFRESH_PERIOD_NS, a commit is
+ * scanned out at the first vblank after it, and only one commit can be pending at a time.
+ * The raster thread renders frames back-to-back, each taking a random time between
+ * min_render_ms and max_render_ms. After each commit it needs a free buffer for the next frame.
+ *
+ * Two kinds of stalls are reported per frame:
+ *  - buffer: waiting for the page flip because every buffer is still queued for scanout.
+ *    This is what more buffers avoid.
+ *  - commit: waiting for the last page flip before the next commit. This is a kernel limitation
+ *    that more buffers can't avoid, but rendering overlaps with it.
+ *
+ * usage: overlay_buffer_benchmark [min_render_ms] [max_render_ms] [n_frames]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <collection.h>
+#include <scanout_buffers.h>
+
+FILE_DESCR("overlay buffer benchmark")
+
+#define REFRESH_PERIOD_NS 16666667ull
+#define MIN_RENDER_MS_DEFAULT 12.0
+#define MAX_RENDER_MS_DEFAULT 20.0
+#define N_FRAMES_DEFAULT 100000
+
+struct simulation_result {
+    uint64_t n_frames;
+    uint64_t n_buffer_stalls;
+    uint64_t total_buffer_stall_ns;
+    uint64_t total_commit_stall_ns;
+    uint64_t duration_ns;
+};
+
+static uint64_t get_next_vblank(uint64_t time) {
+    return (time / REFRESH_PERIOD_NS + 1) * REFRESH_PERIOD_NS;
+}
+
+static uint64_t get_render_time(uint32_t *rand_state, uint64_t min_ns, uint64_t max_ns) {
+    *rand_state = *rand_state * 1103515245u + 12345u;
+    return min_ns + (uint64_t) (((*rand_state >> 8) & 0xFFFF) / (double) 0xFFFF * (max_ns - min_ns));
+}
+
+static int simulate(int n_buffers, uint64_t min_render_ns, uint64_t max_render_ns, uint64_t n_frames, struct simulation_result *result) {
+    struct scanout_buffers buffers;
+    uint64_t now, flip_time;
+    uint32_t rand_state;
+
+    scanout_buffers_init(&buffers, n_buffers);
+
+    // every depth renders the same sequence of frames.
+    rand_state = 1;
+    now = 0;
+    flip_time = 0;
+
+    *result = (struct simulation_result) {.n_frames = n_frames};
+
+    for (uint64_t i = 0; i < n_frames; i++) {
+        now += get_render_time(&rand_state, min_render_ns, max_render_ns);
+
+        if (flip_time > now) {
+            result->total_commit_stall_ns += flip_time - now;
+            now = flip_time;
+        }
+
+        scanout_buffers_present_front(&buffers);
+        flip_time = get_next_vblank(now);
+
+        if (scanout_buffers_select_next(&buffers, flip_time > now) == -1) {
+            result->n_buffer_stalls++;
+            result->total_buffer_stall_ns += flip_time - now;
+            now = flip_time;
+
+            if (scanout_buffers_select_next(&buffers, false) == -1) {
+                LOG_ERROR("No free buffer even though the page flip completed.\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    result->duration_ns = now;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct simulation_result result;
+    double min_render_ms, max_render_ms;
+    uint64_t n_frames;
+    int ok;
+
+    min_render_ms = argc > 1 ? strtod(argv[1], NULL) : MIN_RENDER_MS_DEFAULT;
+    max_render_ms = argc > 2 ? strtod(argv[2], NULL) : MAX_RENDER_MS_DEFAULT;
+    n_frames = argc > 3 ? strtoull(argv[3], NULL, 10) : N_FRAMES_DEFAULT;
+    if (!(min_render_ms > 0) || !(max_render_ms >= min_render_ms) || (n_frames == 0)) {
+        fprintf(stderr, "usage: %s [min_render_ms] [max_render_ms] [n_frames]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf(
+        "%" PRIu64 " frames, rendering takes %.1f-%.1fms, refresh period %.2fms\n",
+        n_frames,
+        min_render_ms,
+        max_render_ms,
+        REFRESH_PERIOD_NS / 1000000.0
+    );
+
+    for (int n_buffers = 2; n_buffers <= SCANOUT_BUFFERS_MAX; n_buffers++) {
+        ok = simulate(n_buffers, (uint64_t) (min_render_ms * 1000000), (uint64_t) (max_render_ms * 1000000), n_frames, &result);
+        if (ok != 0) {
+            return EXIT_FAILURE;
+        }
+
+        printf(
+            "%d buffers: stall per frame: buffer %5.2fms (%5.1f%% of frames), commit %5.2fms. %5.1f frames/s\n",
+            n_buffers,
+            result.total_buffer_stall_ns / 1000000.0 / result.n_frames,
+            100.0 * result.n_buffer_stalls / result.n_frames,
+            result.total_commit_stall_ns / 1000000.0 / result.n_frames,
+            result.n_frames / (result.duration_ns / 1000000000.0)
+        );
+    }
+
+    return EXIT_SUCCESS;
+}
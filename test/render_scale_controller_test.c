@@ -0,0 +1,195 @@
+/**
+ * Unit tests for the render scale controller, driven by a fake GPU
+ * whose raster time grows with the number of pixels.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <collection.h>
+#include <render_scale_controller.h>
+
+FILE_DESCR("render scale controller test")
+
+#define REFRESH_RATE 60.0
+#define PERIOD_NS (1000000000.0 / REFRESH_RATE)
+#define BUDGET_NS (PERIOD_NS * RENDER_SCALE_CONTROLLER_TARGET_LOAD)
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            LOG_ERROR("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return false; \
+        } \
+    } while (0)
+
+/**
+ * @brief Render @ref n_frames frames, each taking @ref full_scale_ns scaled by the number of pixels.
+ * New scales take effect after @ref latency frames, like frames that are already in flight.
+ * Returns how often the requested scale changed.
+ */
+static unsigned int render(
+    struct render_scale_controller *controller,
+    double *frame_scale,
+    double full_scale_ns,
+    unsigned int latency,
+    unsigned int n_frames
+) {
+    double requested = *frame_scale, result;
+    unsigned int n_changes = 0, frames_until_applied = 0;
+
+    for (unsigned int i = 0; i < n_frames; i++) {
+        result = render_scale_controller_on_frame(controller, *frame_scale, (uint64_t) (full_scale_ns * *frame_scale * *frame_scale));
+        if (result != requested) {
+            requested = result;
+            frames_until_applied = latency;
+            n_changes++;
+        }
+
+        if (frames_until_applied > 0) {
+            frames_until_applied--;
+        } else {
+            *frame_scale = requested;
+        }
+    }
+
+    return n_changes;
+}
+
+static bool test_keeps_max_scale_when_fast(void) {
+    struct render_scale_controller controller;
+    double scale = 1.0;
+
+    render_scale_controller_init(&controller, 0.5, 1.0, REFRESH_RATE);
+
+    CHECK(render(&controller, &scale, BUDGET_NS * 0.9, 0, 1000) == 0);
+    CHECK(scale == 1.0);
+    return true;
+}
+
+static bool test_lowers_scale_until_frames_fit(void) {
+    struct render_scale_controller controller;
+    double scale = 1.0;
+
+    render_scale_controller_init(&controller, 0.25, 1.0, REFRESH_RATE);
+
+    // 4K at twice the budget. Needs a scale of about 0.7.
+    render(&controller, &scale, BUDGET_NS * 2, 2, 1000);
+    CHECK(scale < 1.0);
+    CHECK(BUDGET_NS * 2 * scale * scale <= BUDGET_NS);
+    CHECK(scale >= 0.6);
+    return true;
+}
+
+static bool test_stays_at_min_scale(void) {
+    struct render_scale_controller controller;
+    double scale = 1.0;
+
+    render_scale_controller_init(&controller, 0.5, 1.0, REFRESH_RATE);
+
+    // even the minimum scale is too slow.
+    render(&controller, &scale, BUDGET_NS * 10, 2, 1000);
+    CHECK(scale == 0.5);
+    return true;
+}
+
+static bool test_raises_scale_when_load_drops(void) {
+    struct render_scale_controller controller;
+    double scale = 1.0;
+
+    render_scale_controller_init(&controller, 0.25, 1.0, REFRESH_RATE);
+
+    render(&controller, &scale, BUDGET_NS * 4, 2, 1000);
+    CHECK(scale <= 0.5);
+
+    render(&controller, &scale, BUDGET_NS * 0.5, 2, 1000);
+    CHECK(fabs(scale - 1.0) < 1e-9);
+    return true;
+}
+
+static bool test_settles_without_oscillating(void) {
+    struct render_scale_controller controller;
+    double scale = 1.0;
+
+    render_scale_controller_init(&controller, 0.25, 1.0, REFRESH_RATE);
+
+    render(&controller, &scale, BUDGET_NS * 1.5, 2, 2000);
+    CHECK(render(&controller, &scale, BUDGET_NS * 1.5, 2, 2000) == 0);
+    return true;
+}
+
+static bool test_ignores_frames_in_flight(void) {
+    struct render_scale_controller controller;
+    double scale = 1.0, requested;
+
+    render_scale_controller_init(&controller, 0.25, 1.0, REFRESH_RATE);
+
+    // slow frames until the controller asks for a lower scale.
+    for (int i = 0; i < RENDER_SCALE_CONTROLLER_HOLD_FRAMES - 1; i++) {
+        CHECK(render_scale_controller_on_frame(&controller, 1.0, (uint64_t) (BUDGET_NS * 2)) == 1.0);
+    }
+    requested = render_scale_controller_on_frame(&controller, 1.0, (uint64_t) (BUDGET_NS * 2));
+    CHECK(requested < 1.0);
+
+    // frames that are still rendered at the old scale don't count towards the new one.
+    for (int i = 0; i < 3; i++) {
+        CHECK(render_scale_controller_on_frame(&controller, 1.0, (uint64_t) (BUDGET_NS * 2)) == requested);
+    }
+    CHECK(controller.n_frames == 0);
+
+    scale = requested;
+    CHECK(render_scale_controller_on_frame(&controller, scale, (uint64_t) (BUDGET_NS * 0.5)) == requested);
+    CHECK(controller.n_frames == 1);
+    return true;
+}
+
+static bool test_gives_up_on_scale_that_is_not_applied(void) {
+    struct render_scale_controller controller;
+    double result;
+
+    render_scale_controller_init(&controller, 0.25, 1.0, REFRESH_RATE);
+
+    // fast frames at a lower scale than the controller started at, e.g. because
+    // the scale was changed without asking the controller.
+    result = 1.0;
+    for (int i = 0; i < RENDER_SCALE_CONTROLLER_HOLD_FRAMES; i++) {
+        result = render_scale_controller_on_frame(&controller, 0.5, (uint64_t) (BUDGET_NS * 0.1));
+    }
+    CHECK(result == 0.5);
+    CHECK(controller.target_scale == 0.5);
+
+    // it continues from the scale the frames actually have.
+    for (int i = 0; i < RENDER_SCALE_CONTROLLER_HOLD_FRAMES; i++) {
+        result = render_scale_controller_on_frame(&controller, 0.5, (uint64_t) (BUDGET_NS * 0.1));
+    }
+    CHECK(fabs(result - 0.55) < 1e-9);
+    return true;
+}
+
+int main(void) {
+    static const struct {
+        const char *name;
+        bool (*run)(void);
+    } tests[] = {
+        {"keeps max scale when fast", test_keeps_max_scale_when_fast},
+        {"lowers scale until frames fit", test_lowers_scale_until_frames_fit},
+        {"stays at min scale", test_stays_at_min_scale},
+        {"raises scale when load drops", test_raises_scale_when_load_drops},
+        {"settles without oscillating", test_settles_without_oscillating},
+        {"ignores frames in flight", test_ignores_frames_in_flight},
+        {"gives up on scale that is not applied", test_gives_up_on_scale_that_is_not_applied},
+    };
+    int n_failed = 0;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+        if (tests[i].run()) {
+            printf("PASS %s\n", tests[i].name);
+        } else {
+            printf("FAIL %s\n", tests[i].name);
+            n_failed++;
+        }
+    }
+
+    return n_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
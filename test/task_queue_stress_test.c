@@ -0,0 +1,263 @@
+/**
+ * Stress test for the platform task queue.
+ *
+ * Several producer threads post tasks as fast as they can, while a single consumer
+ * thread (standing in for the platform thread) runs them. Some of the tasks are slow.
+ *
+ * Checks that:
+ *  - every task that was posted is executed exactly once,
+ *  - tasks posted by the same thread are executed in the order they were posted,
+ *  - posting never waits for the consumer, i.e. producers keep posting while
+ *    the consumer is stuck in a slow task.
+ *
+ * Also prints how long posting took on average and at most. Those numbers include
+ * the producers being preempted, so they're not checked.
+ *
+ * usage: task_queue_stress_test [n_producers] [n_tasks_per_producer]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+
+#include <collection.h>
+#include <task_queue.h>
+
+FILE_DESCR("task queue stress test")
+
+#define N_PRODUCERS_DEFAULT 8
+#define N_TASKS_PER_PRODUCER_DEFAULT 100000
+#define SLOW_TASK_INTERVAL 20000
+#define SLOW_TASK_DURATION_NS 20000000ull
+
+struct test_task {
+    struct producer *producer;
+    size_t seq;
+};
+
+struct producer {
+    pthread_t thread;
+    struct task_queue *queue;
+    struct test_task *tasks;
+    size_t n_tasks;
+
+    /// only touched by the producer
+    uint64_t total_post_ns;
+    uint64_t max_post_ns;
+    size_t n_failed_posts;
+
+    /// only touched by the consumer
+    size_t next_seq;
+    size_t n_executed;
+    size_t n_out_of_order;
+};
+
+static atomic_size_t n_remaining;
+static atomic_size_t n_posted;
+static size_t n_total;
+static size_t n_blocked_slow_tasks;
+static atomic_bool consumer_failed;
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec time = {
+        .tv_sec = ns / 1000000000ull,
+        .tv_nsec = ns % 1000000000ull
+    };
+
+    while ((nanosleep(&time, &time) < 0) && (errno == EINTR));
+}
+
+static int on_execute_task(void *userdata) {
+    struct test_task *task = userdata;
+
+    if (task->seq != task->producer->next_seq) {
+        task->producer->n_out_of_order++;
+    }
+
+    task->producer->next_seq = task->seq + 1;
+    task->producer->n_executed++;
+
+    // stands in for a plugin doing something expensive on the platform thread.
+    if ((task->seq % SLOW_TASK_INTERVAL) == SLOW_TASK_INTERVAL - 1) {
+        size_t n_posted_before = atomic_load(&n_posted);
+
+        sleep_ns(SLOW_TASK_DURATION_NS);
+
+        // If the producers still had work to do, some of it should've been posted by now.
+        size_t n_posted_after = atomic_load(&n_posted);
+        if ((n_posted_after == n_posted_before) && (n_posted_after < n_total)) {
+            n_blocked_slow_tasks++;
+        }
+    }
+
+    atomic_fetch_sub(&n_remaining, 1);
+    return 0;
+}
+
+static void *producer_entry(void *userdata) {
+    struct producer *producer = userdata;
+    uint64_t start, duration;
+    int ok;
+
+    for (size_t i = 0; i < producer->n_tasks; i++) {
+        producer->tasks[i].producer = producer;
+        producer->tasks[i].seq = i;
+
+        start = get_monotonic_time();
+        ok = task_queue_post(producer->queue, on_execute_task, producer->tasks + i);
+        duration = get_monotonic_time() - start;
+
+        atomic_fetch_add(&n_posted, 1);
+
+        if (ok != 0) {
+            producer->n_failed_posts++;
+            atomic_fetch_sub(&n_remaining, 1);
+            continue;
+        }
+
+        producer->total_post_ns += duration;
+        producer->max_post_ns = max(producer->max_post_ns, duration);
+    }
+
+    return NULL;
+}
+
+static void *consumer_entry(void *userdata) {
+    struct task_queue *queue = userdata;
+    struct pollfd fd = {.fd = queue->wakeup_fd, .events = POLLIN};
+    int ok;
+
+    while (atomic_load(&n_remaining) > 0) {
+        ok = poll(&fd, 1, 1000);
+        if ((ok < 0) && (errno == EINTR)) {
+            continue;
+        } else if (ok < 0) {
+            LOG_ERROR("poll: %s\n", strerror(errno));
+            atomic_store(&consumer_failed, true);
+            return NULL;
+        } else if (ok == 0) {
+            LOG_ERROR("Consumer wasn't woken up for a second, even though %zu tasks are left.\n", atomic_load(&n_remaining));
+            atomic_store(&consumer_failed, true);
+            return NULL;
+        }
+
+        ok = task_queue_run(queue);
+        if (ok != 0) {
+            atomic_store(&consumer_failed, true);
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct producer *producers;
+    struct task_queue queue;
+    pthread_t consumer;
+    uint64_t total_post_ns, max_post_ns;
+    size_t n_producers, n_tasks, n_succeeded;
+    bool failed;
+    int ok;
+
+    n_producers = argc > 1 ? strtoul(argv[1], NULL, 10) : N_PRODUCERS_DEFAULT;
+    n_tasks = argc > 2 ? strtoul(argv[2], NULL, 10) : N_TASKS_PER_PRODUCER_DEFAULT;
+    if ((n_producers == 0) || (n_tasks == 0)) {
+        fprintf(stderr, "usage: %s [n_producers] [n_tasks_per_producer]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ok = task_queue_init(&queue);
+    if (ok != 0) {
+        return EXIT_FAILURE;
+    }
+
+    producers = calloc(n_producers, sizeof *producers);
+    if (producers == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < n_producers; i++) {
+        producers[i].queue = &queue;
+        producers[i].n_tasks = n_tasks;
+        producers[i].tasks = calloc(n_tasks, sizeof *producers[i].tasks);
+        if (producers[i].tasks == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    n_total = n_producers * n_tasks;
+    atomic_store(&n_remaining, n_total);
+
+    ok = pthread_create(&consumer, NULL, consumer_entry, &queue);
+    if (ok != 0) {
+        LOG_ERROR("Could not start consumer thread. pthread_create: %s\n", strerror(ok));
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < n_producers; i++) {
+        ok = pthread_create(&producers[i].thread, NULL, producer_entry, producers + i);
+        if (ok != 0) {
+            LOG_ERROR("Could not start producer thread. pthread_create: %s\n", strerror(ok));
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (size_t i = 0; i < n_producers; i++) {
+        pthread_join(producers[i].thread, NULL);
+    }
+
+    pthread_join(consumer, NULL);
+
+    failed = atomic_load(&consumer_failed);
+    total_post_ns = 0;
+    max_post_ns = 0;
+    n_succeeded = 0;
+
+    for (size_t i = 0; i < n_producers; i++) {
+        struct producer *p = producers + i;
+
+        if (p->n_failed_posts != 0) {
+            LOG_ERROR("producer %zu: %zu posts failed\n", i, p->n_failed_posts);
+            failed = true;
+        }
+        if (p->n_executed != p->n_tasks - p->n_failed_posts) {
+            LOG_ERROR("producer %zu: %zu of %zu tasks were executed\n", i, p->n_executed, p->n_tasks - p->n_failed_posts);
+            failed = true;
+        }
+        if (p->n_out_of_order != 0) {
+            LOG_ERROR("producer %zu: %zu tasks were executed out of order\n", i, p->n_out_of_order);
+            failed = true;
+        }
+
+        total_post_ns += p->total_post_ns;
+        max_post_ns = max(max_post_ns, p->max_post_ns);
+        n_succeeded += p->n_tasks - p->n_failed_posts;
+    }
+
+    if (n_blocked_slow_tasks != 0) {
+        LOG_ERROR("No tasks were posted during %zu slow tasks, posting must not wait for the consumer.\n", n_blocked_slow_tasks);
+        failed = true;
+    }
+
+    printf(
+        "%zu producers, %zu tasks each: post duration avg %" PRIu64 "ns, max %" PRIu64 "us\n",
+        n_producers,
+        n_tasks,
+        n_succeeded ? total_post_ns / n_succeeded : 0,
+        max_post_ns / 1000
+    );
+
+    for (size_t i = 0; i < n_producers; i++) {
+        free(producers[i].tasks);
+    }
+    free(producers);
+    task_queue_deinit(&queue);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}